@@ -0,0 +1,40 @@
+# Measures the throughput of IMF::Image#convert.
+#
+#   $ rake compile
+#   $ ruby -Ilib benchmark/convert.rb [iterations]
+#
+# Every conversion from and into RGB is measured with the SIMD kernels
+# and with the scalar ones.  Only the matrix conversions of GRAY and YCbCr
+# have SIMD kernels, so the others show the same speed for both.
+
+require 'benchmark'
+require 'IMF'
+
+fixtures_dir = File.expand_path('../../spec/fixtures', __FILE__)
+iterations = Integer(ARGV[0] || 20)
+
+image = IMF::Image.open(File.join(fixtures_dir, 'momosan.jpg'))
+pixels = image.width * image.height
+simd = IMF.simd
+
+puts "source: #{image.width}x#{image.height}, simd: #{simd.inspect}, threads: #{IMF.max_threads}"
+puts "%-14s %-7s %10s %12s" % %w[conversion kernel ms/image Mpixel/s]
+%i[GRAY YCbCr HSV HSL Lab].each do |color_space|
+  converted = image.convert(color_space)
+  [[image, color_space, "RGB->#{color_space}"], [converted, :RGB, "#{color_space}->RGB"]].each do |source, into, label|
+    [true, false].each do |enabled|
+      next if enabled && simd.nil?
+      IMF.simd = enabled
+      elapsed = Benchmark.realtime do
+        iterations.times { source.convert(into) }
+      end
+      puts "%-14s %-7s %10.3f %12.2f" % [
+        label,
+        enabled ? simd : :scalar,
+        1000.0 * elapsed / iterations,
+        pixels * iterations / elapsed / 1e6
+      ]
+    end
+  end
+end
+IMF.simd = true
@@ -0,0 +1,47 @@
+# Measures the throughput of IMF::Image#convolve and #gaussian_blur.
+#
+#   $ rake compile
+#   $ ruby -Ilib benchmark/convolve.rb [iterations]
+#
+# The Gaussian blurs of sigma 3 and more run as box blurs, so their time
+# should stay flat as sigma grows.  Each operation is measured with the
+# SIMD kernels and with the scalar ones (IMF.simd = false).
+
+require 'benchmark'
+require 'IMF'
+
+fixtures_dir = File.expand_path('../../spec/fixtures', __FILE__)
+iterations = Integer(ARGV[0] || 10)
+
+image = IMF::Image.open(File.join(fixtures_dir, 'momosan.jpg'))
+simd = IMF.simd
+
+random = Random.new(42)
+operations = {
+  'sharpen 3x3' => ->(img) { img.convolve([[0, -1, 0], [-1, 5, -1], [0, -1, 0]]) },
+  'separable 9x9' => ->(img) { img.convolve(Array.new(9) { |i| Array.new(9) { |j| (i + 1) * (j + 1) / 2025.0 } }) },
+  'general 9x9' => ->(img) { img.convolve(Array.new(9) { Array.new(9) { random.rand / 40.0 } }) },
+}
+[1, 2, 3, 10, 30, 100].each do |sigma|
+  operations["gaussian #{sigma}"] = ->(img) { img.gaussian_blur(sigma) }
+end
+
+puts "source: #{image.width}x#{image.height}, simd: #{simd.inspect}, threads: #{IMF.max_threads}"
+puts "%-15s %-7s %10s %12s" % %w[operation kernel ms/image Mpixel/s]
+operations.each do |name, operation|
+  [true, false].each do |enabled|
+    next if enabled && simd.nil?
+    IMF.simd = enabled
+    operation.(image)
+    elapsed = Benchmark.realtime do
+      iterations.times { operation.(image) }
+    end
+    puts "%-15s %-7s %10.3f %12.2f" % [
+      name,
+      enabled ? simd : :scalar,
+      1000.0 * elapsed / iterations,
+      image.width * image.height * iterations / elapsed / 1e6
+    ]
+  end
+end
+IMF.simd = true
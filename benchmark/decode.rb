@@ -0,0 +1,70 @@
+# Measures decoding throughput of the built-in decoders.
+#
+#   $ rake compile
+#   $ ruby -Ilib benchmark/decode.rb [iterations]
+#
+# For each fixture this reports the decoded pixels per second, and the
+# bytes moved by the output stage of the PNG and JPEG decoders per image.
+# They write the rows straight into the image buffer, so "direct" is the
+# height times the packed row size.  "bounce" is what the same rows cost
+# through a scanline buffer, as these decoders did before: the decoder
+# writes the buffer, and memcpy reads it and writes a whole row into the
+# image buffer on each row call.  libpng is called for every row once per
+# pass of an interlaced image.
+
+require 'benchmark'
+require 'IMF'
+
+fixtures_dir = File.expand_path('../../spec/fixtures', __FILE__)
+iterations = Integer(ARGV[0] || 50)
+
+files = %w[
+  momosan.jpg
+  momosan_gray.jpg
+  momosan_cmyk.jpg
+  momosan.webp
+  vimlogo-141x141.png
+  colorbar.png
+  colorbar_interlaced.png
+  vimlogo-141x141.gif
+]
+
+# The number of row calls of the decoder for the image, or nil if it has
+# never decoded through a scanline buffer
+def row_calls(path, image)
+  case IMF::Image.probe(path).format
+  when :jpeg
+    image.height
+  when :png
+    # the interlace method is the last byte of IHDR
+    interlaced = File.binread(path, 1, 28).ord == 1
+    interlaced ? image.height * 7 : image.height
+  end
+end
+
+puts "%-24s %10s %10s %12s %12s" % %w[file ms/image Mpixel/s direct(KB) bounce(KB)]
+files.each do |filename|
+  path = File.join(fixtures_dir, filename)
+  source = IMF::ImageSource.new(path)
+
+  image = IMF::Image.open(source)
+  pixels = image.width * image.height
+  row_size = image.width * image.pixel_channels * image.component_size
+  calls = row_calls(path, image)
+  direct = image.height * row_size
+
+  elapsed = Benchmark.realtime do
+    iterations.times do
+      source.rewind
+      IMF::Image.open(source)
+    end
+  end
+
+  puts "%-24s %10.3f %10.2f %12s %12s" % [
+    filename,
+    1000.0 * elapsed / iterations,
+    pixels * iterations / elapsed / 1e6,
+    calls ? '%.1f' % (direct / 1024.0) : '-',
+    calls ? '%.1f' % ((direct + 2 * calls * row_size) / 1024.0) : '-'
+  ]
+end
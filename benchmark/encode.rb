@@ -0,0 +1,49 @@
+# Measures encoding throughput of the built-in encoders.
+#
+#   $ rake compile
+#   $ ruby -Ilib benchmark/encode.rb [iterations]
+#
+# Each fixture is encoded into memory with several option sets, and the
+# encoded pixels per second and the size of the output are reported.
+
+require 'benchmark'
+require 'IMF'
+
+fixtures_dir = File.expand_path('../../spec/fixtures', __FILE__)
+iterations = Integer(ARGV[0] || 20)
+
+files = %w[
+  momosan.jpg
+  momosan_gray.jpg
+  vimlogo-141x141.png
+]
+
+settings = [
+  [:jpeg, {}],
+  [:jpeg, { quality: 90, subsampling: "4:4:4" }],
+  [:jpeg, { optimize_coding: true }],
+  [:jpeg, { progressive: true }],
+  [:png, {}],
+  [:png, { compression: 1 }],
+]
+
+puts "%-22s %-40s %10s %12s %10s" % %w[file options ms/image Mpixel/s bytes]
+files.each do |filename|
+  image = IMF::Image.open(File.join(fixtures_dir, filename))
+  pixels = image.width * image.height
+
+  settings.each do |format, options|
+    size = image.encode(format: format, **options).bytesize
+    elapsed = Benchmark.realtime do
+      iterations.times { image.encode(format: format, **options) }
+    end
+
+    puts "%-22s %-40s %10.3f %12.2f %10d" % [
+      filename,
+      "#{format} #{options.map {|k, v| "#{k}: #{v}" }.join(', ')}",
+      1000.0 * elapsed / iterations,
+      pixels * iterations / elapsed / 1e6,
+      size
+    ]
+  end
+end
@@ -0,0 +1,48 @@
+# Measures IMF::Image#fft, IMF::Spectrum#ifft, and IMF::Image#convolve by
+# the FFT against the direct convolution.
+#
+#   $ rake compile
+#   $ ruby -Ilib benchmark/fft.rb [iterations]
+#
+# The transforms are measured on sizes of powers of two, of the factors 2,
+# 3, and 5, and of a large prime factor that needs Bluestein's algorithm.
+# The plans are made before the measurement, as they are cached by size.
+# The direct convolution takes time in proportion to the kernel area, and
+# the FFT does not.
+
+require 'benchmark'
+require 'IMF'
+
+fixtures_dir = File.expand_path('../../spec/fixtures', __FILE__)
+iterations = Integer(ARGV[0] || 5)
+
+image = IMF::Image.open(File.join(fixtures_dir, 'momosan.jpg'))
+
+def measure(iterations)
+  yield
+  Benchmark.realtime { iterations.times { yield } } / iterations
+end
+
+puts "source: #{image.width}x#{image.height}, threads: #{IMF.max_threads}"
+puts "%-22s %10s %10s" % %w[size fft(ms) ifft(ms)]
+[[1024, 768], [960, 720], [image.width, image.height]].each do |width, height|
+  resized = width == image.width && height == image.height ? image : image.resize(width, height)
+  spectrum = resized.fft
+  puts "%-22s %10.3f %10.3f" % [
+    "#{width}x#{height}",
+    1000.0 * measure(iterations) { resized.fft },
+    1000.0 * measure(iterations) { spectrum.ifft }
+  ]
+end
+
+random = Random.new(42)
+puts
+puts "%-22s %10s %10s" % %w[kernel direct(ms) fft(ms)]
+[9, 15, 25, 41].each do |size|
+  kernel = Array.new(size) { Array.new(size) { random.rand / (size * size / 2.0) } }
+  puts "%-22s %10.3f %10.3f" % [
+    "#{size}x#{size}",
+    1000.0 * measure(iterations) { image.convolve(kernel, method: :direct) },
+    1000.0 * measure(iterations) { image.convolve(kernel, method: :fft) }
+  ]
+end
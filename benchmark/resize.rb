@@ -0,0 +1,43 @@
+# Measures the throughput of IMF::Image#resize.
+#
+#   $ rake compile
+#   $ ruby -Ilib benchmark/resize.rb [iterations]
+#
+# Each filter is measured with the SIMD kernels and with the scalar ones
+# (IMF.simd = false), on IMF.max_threads threads.  Both give the same
+# pixels, so the ratio of the two is the speedup of the SIMD kernels.
+
+require 'benchmark'
+require 'IMF'
+
+fixtures_dir = File.expand_path('../../spec/fixtures', __FILE__)
+iterations = Integer(ARGV[0] || 10)
+
+image = IMF::Image.open(File.join(fixtures_dir, 'momosan.jpg'))
+sizes = [
+  [image.width / 4, image.height / 4],
+  [image.width * 2, image.height * 2],
+]
+simd = IMF.simd
+
+puts "source: #{image.width}x#{image.height}, simd: #{simd.inspect}, threads: #{IMF.max_threads}"
+puts "%-10s %-10s %-7s %10s %12s" % %w[filter size kernel ms/image Mpixel/s]
+%i[nearest bilinear bicubic lanczos].each do |filter|
+  sizes.each do |width, height|
+    [true, false].each do |enabled|
+      next if enabled && simd.nil?
+      IMF.simd = enabled
+      elapsed = Benchmark.realtime do
+        iterations.times { image.resize(width, height, filter: filter) }
+      end
+      puts "%-10s %-10s %-7s %10.3f %12.2f" % [
+        filter,
+        "#{width}x#{height}",
+        enabled ? simd : :scalar,
+        1000.0 * elapsed / iterations,
+        width * height * iterations / elapsed / 1e6
+      ]
+    end
+  end
+end
+IMF.simd = true
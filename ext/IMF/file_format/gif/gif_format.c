@@ -7,23 +7,117 @@ static ID id_detect;
 static ID id_read;
 static ID id_rewind;
 
+enum imf_gif_format_constants {
+  GIF_HEADER_LENGTH = 13,
+  GIF_IMAGE_DESCRIPTOR_LENGTH = 9,
+  GIF_EXTENSION_INTRODUCER = 0x21,
+  GIF_IMAGE_SEPARATOR = 0x2C,
+  GIF_TRAILER = 0x3B,
+  GIF_GRAPHIC_CONTROL_LABEL = 0xF9,
+  GIF_MAX_PALETTE_SIZE = 256,
+  GIF_LZW_MAX_BITS = 12,
+  GIF_LZW_TABLE_SIZE = 1 << GIF_LZW_MAX_BITS,
+  GIF_ERROR_MESSAGE_SIZE = 128,
+};
+
+enum imf_gif_disposal {
+  GIF_DISPOSAL_NONE = 0,
+  GIF_DISPOSAL_KEEP = 1,
+  GIF_DISPOSAL_BACKGROUND = 2,
+  GIF_DISPOSAL_PREVIOUS = 3,
+};
+
+/* The LZW decoder keeps every string in the table as its last byte, the
+ * code of the rest, its first byte, and its length.  A string is written
+ * backward from its end directly into the index buffer, so decoding never
+ * needs a stack.  The state is kept across data sub-blocks. */
+typedef struct imf_gif_lzw imf_gif_lzw_t;
+struct imf_gif_lzw {
+  uint16_t prefix[GIF_LZW_TABLE_SIZE];
+  uint16_t length[GIF_LZW_TABLE_SIZE];
+  uint8_t suffix[GIF_LZW_TABLE_SIZE];
+  uint8_t first[GIF_LZW_TABLE_SIZE];
+  unsigned int min_code_size;
+  unsigned int code_size;
+  unsigned int clear_code;
+  unsigned int next_code;
+  int prev_code;
+  uint32_t bits;
+  unsigned int bit_count;
+  uint8_t *out;
+  size_t out_pos;
+  size_t out_size;
+  bool finished;
+};
+
+/* The parameters of the current frame */
+typedef struct imf_gif_frame imf_gif_frame_t;
+struct imf_gif_frame {
+  size_t left;
+  size_t top;
+  size_t width;
+  size_t height;
+  bool interlaced;
+  int disposal;
+  int transparent_index;
+  unsigned int delay;
+  unsigned int palette_size;
+  uint8_t palette[3 * GIF_MAX_PALETTE_SIZE];
+};
+
 typedef struct imf_gif_format imf_gif_format_t;
 struct imf_gif_format {
   imf_file_format_t base;
   imf_image_t *img;
   VALUE image_source;
   VALUE buffer;
+
+  imf_byte_source_t *src;
+  imf_gif_lzw_t *lzw;
+  imf_gif_frame_t frame;
+  imf_gif_frame_t prev_frame;
+  size_t frame_count;
+
+  /* the logical screen */
+  size_t width;
+  size_t height;
+  unsigned int global_palette_size;
+  uint8_t global_palette[3 * GIF_MAX_PALETTE_SIZE];
+  uint8_t background[4];
+
+  /* the color indexes of the current frame */
+  uint8_t *indexes;
+  size_t indexes_capa;
+
+  /* the region of the canvas under the frame with GIF_DISPOSAL_PREVIOUS */
+  uint8_t *saved;
+  size_t saved_capa;
+
+  bool done;
+  volatile bool interrupted;
+  char error_message[GIF_ERROR_MESSAGE_SIZE];
 };
 
 static char const *const gif_format_extnames[] = {
   ".gif", NULL
 };
 
+static imf_file_format_magic_t const gif_format_magics[] = {
+  { GIF_MAGIC_BYTES, NULL, sizeof(GIF_MAGIC_BYTES) - 1 },
+  { NULL, NULL, 0 }
+};
+
 static int detect_gif(imf_file_format_t *fmt, VALUE image_source);
+static void load_gif(imf_file_format_t *fmt, imf_image_t *img, VALUE image_source, imf_load_options_t const *opts);
+static void probe_gif(imf_file_format_t *fmt, VALUE image_source, imf_image_t *img);
+static bool decode_gif(imf_byte_source_t *src, imf_image_t *img, imf_load_options_t const *opts, imf_load_error_t *error);
 
 static imf_file_format_interface_t const gif_format_interface = {
   detect_gif,
-  NULL
+  load_gif,
+  NULL,
+  probe_gif,
+  decode_gif
 };
 
 static void
@@ -35,17 +129,36 @@ gif_format_mark(void *ptr)
   imf_file_format_mark(ptr);
 }
 
+static void
+gif_format_release_buffers(imf_gif_format_t *fmt)
+{
+  free(fmt->lzw);
+  fmt->lzw = NULL;
+  free(fmt->indexes);
+  fmt->indexes = NULL;
+  fmt->indexes_capa = 0;
+  free(fmt->saved);
+  fmt->saved = NULL;
+  fmt->saved_capa = 0;
+}
+
 static void
 gif_format_free(void *ptr)
 {
   imf_gif_format_t *fmt = (imf_gif_format_t *) ptr;
+  gif_format_release_buffers(fmt);
   imf_file_format_free(ptr);
 }
 
 static size_t
 gif_format_memsize(void const *ptr)
 {
-  return imf_file_format_memsize(ptr);
+  imf_gif_format_t const *fmt = (imf_gif_format_t const *) ptr;
+  size_t size = imf_file_format_memsize(ptr);
+
+  if (fmt->lzw != NULL)
+    size += sizeof(imf_gif_lzw_t);
+  return size + fmt->indexes_capa + fmt->saved_capa;
 }
 
 static rb_data_type_t const gif_format_data_type = {
@@ -71,24 +184,751 @@ gif_format_alloc(VALUE klass)
       imf_gif_format_t,
       &gif_format_data_type,
       fmt);
+  fmt->image_source = Qnil;
+  fmt->buffer = Qnil;
   return obj;
 }
 
 static int
 detect_gif(imf_file_format_t *fmt, VALUE image_source)
 {
-  VALUE magic_value;
-  char const *magic;
-
-  magic_value = rb_funcall(image_source, id_read, 1, INT2FIX(GIF_MAGIC_LENGTH));
+  imf_byte_source_t *src = imf_image_source_get_byte_source(image_source);
+  uint8_t const *magic;
 
-  magic = StringValuePtr(magic_value);
-  if (RSTRING_LEN(magic_value) == GIF_MAGIC_LENGTH &&
+  if (imf_byte_source_peek(src, GIF_MAGIC_LENGTH, &magic) == GIF_MAGIC_LENGTH &&
       memcmp(GIF_MAGIC_BYTES, magic, GIF_MAGIC_LENGTH) == 0)
     return 1;
   return 0;
 }
 
+static int
+gif_read_byte(imf_byte_source_t *src)
+{
+  uint8_t byte;
+
+  if (imf_byte_source_read_into(src, &byte, 1) < 1)
+    return -1;
+  return byte;
+}
+
+static inline size_t
+gif_get_le16(uint8_t const *p)
+{
+  return (size_t) p[0] | ((size_t) p[1] << 8);
+}
+
+/* Skips the data sub-blocks up to the block terminator */
+static void
+gif_skip_sub_blocks(imf_byte_source_t *src)
+{
+  int size;
+
+  while ((size = gif_read_byte(src)) > 0)
+    imf_byte_source_skip(src, (size_t) size);
+}
+
+/* Reads the logical screen descriptor, and then the blocks up to the
+ * first image descriptor to find whether the first frame has the
+ * transparent color. */
+static void
+probe_gif(imf_file_format_t *RB_UNUSED_VAR(fmt), VALUE image_source, imf_image_t *img)
+{
+  imf_byte_source_t *src = imf_image_source_get_byte_source(image_source);
+  uint8_t header[GIF_HEADER_LENGTH];
+  int introducer;
+
+  if (imf_byte_source_read_into(src, header, GIF_HEADER_LENGTH) < GIF_HEADER_LENGTH ||
+      memcmp(header, GIF_MAGIC_BYTES, GIF_MAGIC_LENGTH) != 0)
+    rb_raise(rb_eRuntimeError, "GIF ERROR: invalid header");
+
+  img->color_space = IMF_COLOR_SPACE_RGB;
+  IMF_IMAGE_UNSET_ALPHA(img);
+  img->component_size = 1;
+  img->pixel_channels = 3;
+  img->width = gif_get_le16(header + 6);
+  img->height = gif_get_le16(header + 8);
+
+  /* global color table */
+  if (header[10] & 0x80)
+    imf_byte_source_skip(src, (size_t) 3 << ((header[10] & 0x07) + 1));
+
+  while ((introducer = gif_read_byte(src)) == GIF_EXTENSION_INTRODUCER) {
+    int const label = gif_read_byte(src);
+    uint8_t gce[6];
+
+    if (label != GIF_GRAPHIC_CONTROL_LABEL) {
+      gif_skip_sub_blocks(src);
+      continue;
+    }
+
+    /* block size (4), packed fields, delay time, and transparent color index */
+    if (imf_byte_source_read_into(src, gce, 6) < 6 || gce[0] != 4)
+      rb_raise(rb_eRuntimeError, "GIF ERROR: invalid graphic control extension");
+    if (gce[1] & 0x01) {
+      IMF_IMAGE_SET_ALPHA(img);
+      img->pixel_channels = 4;
+    }
+    break;
+  }
+}
+
+/* LZW decoder */
+
+static void
+gif_lzw_reset_table(imf_gif_lzw_t *lzw)
+{
+  lzw->code_size = lzw->min_code_size + 1;
+  lzw->next_code = lzw->clear_code + 2;
+  lzw->prev_code = -1;
+}
+
+static void
+gif_lzw_init(imf_gif_lzw_t *lzw, unsigned int min_code_size, uint8_t *out, size_t out_size)
+{
+  unsigned int code;
+
+  lzw->min_code_size = min_code_size;
+  lzw->clear_code = 1U << min_code_size;
+  for (code = 0; code < lzw->clear_code; ++code) {
+    lzw->prefix[code] = 0;
+    lzw->length[code] = 1;
+    lzw->suffix[code] = (uint8_t) code;
+    lzw->first[code] = (uint8_t) code;
+  }
+  gif_lzw_reset_table(lzw);
+
+  lzw->bits = 0;
+  lzw->bit_count = 0;
+  lzw->out = out;
+  lzw->out_pos = 0;
+  lzw->out_size = out_size;
+  lzw->finished = false;
+}
+
+/* Writes the string of the code at the current position.  The strings
+ * that run over the end of the frame are truncated. */
+static inline void
+gif_lzw_emit(imf_gif_lzw_t *lzw, unsigned int code)
+{
+  size_t const length = lzw->length[code];
+  size_t const room = lzw->out_size - lzw->out_pos;
+  uint8_t *const start = lzw->out + lzw->out_pos;
+  size_t i = length;
+
+  for (; i > room; --i)
+    code = lzw->prefix[code];
+  while (i > 0) {
+    start[--i] = lzw->suffix[code];
+    code = lzw->prefix[code];
+  }
+
+  lzw->out_pos += length < room ? length : room;
+}
+
+static void
+gif_lzw_decode(imf_gif_lzw_t *lzw, uint8_t const *data, size_t length)
+{
+  uint32_t bits = lzw->bits;
+  unsigned int bit_count = lzw->bit_count;
+  unsigned int code_size = lzw->code_size;
+  unsigned int const clear_code = lzw->clear_code;
+
+  while (!lzw->finished) {
+    unsigned int code;
+
+    while (bit_count < code_size && length > 0) {
+      bits |= (uint32_t) *data++ << bit_count;
+      bit_count += 8;
+      --length;
+    }
+    if (bit_count < code_size)
+      break;
+
+    code = bits & ((1U << code_size) - 1);
+    bits >>= code_size;
+    bit_count -= code_size;
+
+    if (code == clear_code) {
+      gif_lzw_reset_table(lzw);
+      code_size = lzw->code_size;
+      continue;
+    }
+    if (code == clear_code + 1) {
+      lzw->finished = true;
+      break;
+    }
+
+    if (lzw->prev_code < 0) {
+      if (code > clear_code) {
+        lzw->finished = true;
+        break;
+      }
+    }
+    else {
+      unsigned int const prev = (unsigned int) lzw->prev_code;
+      unsigned int const next = lzw->next_code;
+      uint8_t c;
+
+      if (code < next)
+        c = lzw->first[code];
+      else if (code == next && next < GIF_LZW_TABLE_SIZE)
+        c = lzw->first[prev];  /* the string is prev + its first byte */
+      else {
+        /* broken data */
+        lzw->finished = true;
+        break;
+      }
+
+      if (next < GIF_LZW_TABLE_SIZE) {
+        lzw->prefix[next] = (uint16_t) prev;
+        lzw->length[next] = lzw->length[prev] + 1;
+        lzw->suffix[next] = c;
+        lzw->first[next] = lzw->first[prev];
+        lzw->next_code = next + 1;
+        if (lzw->next_code == (1U << code_size) && code_size < GIF_LZW_MAX_BITS)
+          lzw->code_size = ++code_size;
+      }
+    }
+
+    gif_lzw_emit(lzw, code);
+    lzw->prev_code = (int) code;
+  }
+
+  lzw->bits = bits;
+  lzw->bit_count = bit_count;
+}
+
+/* Compositing */
+
+static void
+gif_fill_rect(imf_gif_format_t *fmt, imf_gif_frame_t const *frame, uint8_t const *color)
+{
+  imf_image_t *img = fmt->img;
+  size_t const pixel_size = img->pixel_channels;
+  size_t x, y;
+
+  for (y = frame->top; y < frame->top + frame->height && y < img->height; ++y) {
+    uint8_t *row = img->data + y * img->row_stride;
+    for (x = frame->left; x < frame->left + frame->width && x < img->width; ++x)
+      memcpy(row + x * pixel_size, color, pixel_size);
+  }
+}
+
+/* Copies the part of the canvas under the frame from or to the saved buffer */
+static void
+gif_copy_saved_rect(imf_gif_format_t *fmt, imf_gif_frame_t const *frame, bool restore)
+{
+  imf_image_t *img = fmt->img;
+  size_t const pixel_size = img->pixel_channels;
+  size_t y;
+
+  if (frame->left >= img->width || frame->top >= img->height)
+    return;
+
+  size_t const width = frame->left + frame->width > img->width ? img->width - frame->left : frame->width;
+  size_t const height = frame->top + frame->height > img->height ? img->height - frame->top : frame->height;
+  size_t const row_size = width * pixel_size;
+
+  for (y = 0; y < height; ++y) {
+    uint8_t *row = img->data + (frame->top + y) * img->row_stride + frame->left * pixel_size;
+    if (restore)
+      memcpy(row, fmt->saved + y * row_size, row_size);
+    else
+      memcpy(fmt->saved + y * row_size, row, row_size);
+  }
+}
+
+/* Returns the row of the frame stored at the i-th position of the data */
+static size_t
+gif_interlaced_row(size_t i, size_t height)
+{
+  size_t const pass1 = (height + 7) / 8;
+  size_t const pass2 = (height + 3) / 8;
+  size_t const pass3 = (height + 1) / 4;
+
+  if (i < pass1)
+    return i * 8;
+  i -= pass1;
+  if (i < pass2)
+    return i * 8 + 4;
+  i -= pass2;
+  if (i < pass3)
+    return i * 4 + 2;
+  i -= pass3;
+  return i * 2 + 1;
+}
+
+static void
+gif_draw_frame(imf_gif_format_t *fmt)
+{
+  imf_gif_frame_t const *frame = &fmt->frame;
+  imf_image_t *img = fmt->img;
+  size_t const pixel_size = img->pixel_channels;
+  bool const has_alpha = IMF_IMAGE_HAS_ALPHA(img) != 0;
+  size_t i, x;
+
+  if (frame->left >= img->width)
+    return;
+  size_t const width = frame->left + frame->width > img->width ? img->width - frame->left : frame->width;
+
+  for (i = 0; i < frame->height; ++i) {
+    size_t const y = frame->top + (frame->interlaced ? gif_interlaced_row(i, frame->height) : i);
+    uint8_t const *src = fmt->indexes + i * frame->width;
+    uint8_t *dst;
+
+    if (y >= img->height)
+      continue;
+    dst = img->data + y * img->row_stride + frame->left * pixel_size;
+
+    for (x = 0; x < width; ++x, dst += pixel_size) {
+      unsigned int const index = src[x];
+      if ((int) index == frame->transparent_index)
+        continue;
+      if (index < frame->palette_size)
+        memcpy(dst, frame->palette + 3 * index, 3);
+      else
+        memset(dst, 0, 3);
+      if (has_alpha)
+        dst[3] = 0xFF;
+    }
+  }
+}
+
+/* Frame decoding */
+
+/* Reads the LZW data of the current frame and draws it on the canvas.
+ * This is resumed after interrupts until fmt->done is set. */
+static void *
+gif_decode_frame_without_gvl(void *arg)
+{
+  imf_gif_format_t *fmt = (imf_gif_format_t *) arg;
+  imf_byte_source_t *src = fmt->src;
+
+  while (!fmt->done) {
+    uint8_t const *data;
+    int size;
+
+    if (fmt->interrupted)
+      return NULL;
+
+    /* The data ends at the block terminator or at the end of the source */
+    size = gif_read_byte(src);
+    if (size <= 0)
+      break;
+
+    size_t const length = imf_byte_source_peek(src, (size_t) size, &data);
+    gif_lzw_decode(fmt->lzw, data, length);
+    imf_byte_source_skip(src, length);
+    if (length < (size_t) size)
+      break;
+  }
+
+  if (!fmt->done) {
+    imf_gif_lzw_t *lzw = fmt->lzw;
+
+    /* The pixels missing from broken data are left as index 0 */
+    if (lzw->out_pos < lzw->out_size)
+      memset(lzw->out + lzw->out_pos, 0, lzw->out_size - lzw->out_pos);
+    gif_draw_frame(fmt);
+    fmt->done = true;
+  }
+
+  return NULL;
+}
+
+static void
+gif_decode_frame_unblock(void *arg)
+{
+  imf_gif_format_t *fmt = (imf_gif_format_t *) arg;
+  fmt->interrupted = true;
+}
+
+/* The functions below that take imf_load_error_t can be called without
+ * the GVL.  They return false with the error set on failure. */
+
+static bool
+gif_read_palette(imf_gif_format_t *fmt, uint8_t packed, uint8_t *palette, unsigned int *palette_size, imf_load_error_t *error)
+{
+  unsigned int const size = 1U << ((packed & 0x07) + 1);
+
+  if (imf_byte_source_read_into(fmt->src, palette, 3 * size) < 3 * size)
+    return imf_load_error_set(error, rb_eRuntimeError, "GIF ERROR: truncated color table");
+  *palette_size = size;
+  return true;
+}
+
+static bool
+gif_read_screen(imf_gif_format_t *fmt, imf_load_error_t *error)
+{
+  uint8_t header[GIF_HEADER_LENGTH];
+
+  if (imf_byte_source_read_into(fmt->src, header, GIF_HEADER_LENGTH) < GIF_HEADER_LENGTH ||
+      memcmp(header, GIF_MAGIC_BYTES, GIF_MAGIC_LENGTH) != 0)
+    return imf_load_error_set(error, rb_eRuntimeError, "GIF ERROR: invalid header");
+
+  fmt->width = gif_get_le16(header + 6);
+  fmt->height = gif_get_le16(header + 8);
+  if (fmt->width == 0 || fmt->height == 0)
+    return imf_load_error_set(error, rb_eRuntimeError, "GIF ERROR: empty logical screen");
+
+  fmt->global_palette_size = 0;
+  if ((header[10] & 0x80) &&
+      !gif_read_palette(fmt, header[10], fmt->global_palette, &fmt->global_palette_size, error))
+    return false;
+
+  /* The background color is used only when the canvas has no alpha */
+  memset(fmt->background, 0, sizeof(fmt->background));
+  if (header[11] < fmt->global_palette_size)
+    memcpy(fmt->background, fmt->global_palette + 3 * header[11], 3);
+
+  fmt->frame_count = 0;
+  return true;
+}
+
+/* Reads the blocks up to the next image descriptor.  Sets *found to false
+ * at the trailer or at the end of the source. */
+static bool
+gif_read_frame_header(imf_gif_format_t *fmt, bool *found, imf_load_error_t *error)
+{
+  imf_byte_source_t *src = fmt->src;
+  imf_gif_frame_t *frame = &fmt->frame;
+  uint8_t desc[GIF_IMAGE_DESCRIPTOR_LENGTH];
+
+  frame->disposal = GIF_DISPOSAL_NONE;
+  frame->transparent_index = -1;
+  frame->delay = 0;
+
+  for (;;) {
+    int const introducer = gif_read_byte(src);
+
+    if (introducer == GIF_EXTENSION_INTRODUCER) {
+      int const label = gif_read_byte(src);
+      uint8_t gce[5];
+
+      if (label == GIF_GRAPHIC_CONTROL_LABEL &&
+          imf_byte_source_read_into(src, gce, 5) == 5 && gce[0] == 4) {
+        frame->disposal = (gce[1] >> 2) & 0x07;
+        frame->delay = (unsigned int) gif_get_le16(gce + 2);
+        if (gce[1] & 0x01)
+          frame->transparent_index = gce[4];
+      }
+      gif_skip_sub_blocks(src);
+      continue;
+    }
+
+    if (introducer != GIF_IMAGE_SEPARATOR) {
+      *found = false;
+      return true;
+    }
+    break;
+  }
+
+  if (imf_byte_source_read_into(src, desc, GIF_IMAGE_DESCRIPTOR_LENGTH) < GIF_IMAGE_DESCRIPTOR_LENGTH)
+    return imf_load_error_set(error, rb_eRuntimeError, "GIF ERROR: truncated image descriptor");
+
+  frame->left = gif_get_le16(desc + 0);
+  frame->top = gif_get_le16(desc + 2);
+  frame->width = gif_get_le16(desc + 4);
+  frame->height = gif_get_le16(desc + 6);
+  frame->interlaced = (desc[8] & 0x40) != 0;
+
+  if (desc[8] & 0x80) {
+    if (!gif_read_palette(fmt, desc[8], frame->palette, &frame->palette_size, error))
+      return false;
+  }
+  else {
+    frame->palette_size = fmt->global_palette_size;
+    memcpy(frame->palette, fmt->global_palette, 3 * fmt->global_palette_size);
+  }
+
+  *found = true;
+  return true;
+}
+
+/* Sets up the layout of the canvas for the first frame */
+static void
+gif_setup_canvas(imf_gif_format_t *fmt)
+{
+  imf_image_t *img = fmt->img;
+
+  /* The canvas has alpha when the first frame has the transparent color,
+   * as reported by probe_gif. */
+  img->color_space = IMF_COLOR_SPACE_RGB;
+  img->component_size = 1;
+  img->width = fmt->width;
+  img->height = fmt->height;
+  if (fmt->frame.transparent_index >= 0) {
+    IMF_IMAGE_SET_ALPHA(img);
+    img->pixel_channels = 4;
+  }
+  else {
+    IMF_IMAGE_UNSET_ALPHA(img);
+    img->pixel_channels = 3;
+  }
+}
+
+/* Fills the allocated canvas with the background color */
+static void
+gif_clear_canvas(imf_gif_format_t *fmt)
+{
+  imf_image_t *img = fmt->img;
+  size_t const pixel_size = img->pixel_channels;
+  size_t y, x;
+
+  for (y = 0; y < img->height; ++y) {
+    uint8_t *row = img->data + y * img->row_stride;
+    for (x = 0; x < img->width; ++x)
+      memcpy(row + x * pixel_size, fmt->background, pixel_size);
+  }
+}
+
+static bool
+gif_reserve_buffer(uint8_t **ptr, size_t *capa, size_t size)
+{
+  if (size > *capa) {
+    uint8_t *new_ptr = realloc(*ptr, size);
+    if (new_ptr == NULL)
+      return false;
+    *ptr = new_ptr;
+    *capa = size;
+  }
+  return true;
+}
+
+/* Disposes the previous frame, and sets up the LZW decoder for the frame
+ * whose header is read */
+static bool
+gif_start_frame(imf_gif_format_t *fmt, imf_load_error_t *error)
+{
+  imf_gif_frame_t *frame = &fmt->frame;
+  int min_code_size;
+
+  if (fmt->frame_count > 0) {
+    imf_gif_frame_t const *prev = &fmt->prev_frame;
+    if (prev->disposal == GIF_DISPOSAL_BACKGROUND)
+      gif_fill_rect(fmt, prev, fmt->background);
+    else if (prev->disposal == GIF_DISPOSAL_PREVIOUS)
+      gif_copy_saved_rect(fmt, prev, true);
+  }
+
+  if (frame->disposal == GIF_DISPOSAL_PREVIOUS) {
+    if (!gif_reserve_buffer(&fmt->saved, &fmt->saved_capa, frame->width * frame->height * fmt->img->pixel_channels))
+      return imf_load_error_set(error, rb_eNoMemError, "failed to allocate memory");
+    gif_copy_saved_rect(fmt, frame, false);
+  }
+
+  min_code_size = gif_read_byte(fmt->src);
+  if (min_code_size < 1 || GIF_LZW_MAX_BITS - 1 < min_code_size)
+    return imf_load_error_set(error, rb_eRuntimeError, "GIF ERROR: invalid LZW minimum code size");
+
+  if (fmt->lzw == NULL) {
+    fmt->lzw = malloc(sizeof(imf_gif_lzw_t));
+    if (fmt->lzw == NULL)
+      return imf_load_error_set(error, rb_eNoMemError, "failed to allocate memory");
+  }
+  if (!gif_reserve_buffer(&fmt->indexes, &fmt->indexes_capa, frame->width * frame->height))
+    return imf_load_error_set(error, rb_eNoMemError, "failed to allocate memory");
+  gif_lzw_init(fmt->lzw, (unsigned int) min_code_size, fmt->indexes, frame->width * frame->height);
+
+  return true;
+}
+
+/* Decodes the next frame onto the canvas.  Returns false if there are no
+ * more frames. */
+static bool
+gif_next_frame(imf_gif_format_t *fmt)
+{
+  imf_load_error_t error;
+  bool found;
+
+  if (!gif_read_frame_header(fmt, &found, &error))
+    imf_load_error_raise(&error);
+  if (!found)
+    return false;
+
+  if (fmt->frame_count == 0) {
+    gif_setup_canvas(fmt);
+    imf_image_allocate_image_buffer(fmt->img);
+    gif_clear_canvas(fmt);
+  }
+  else {
+    /* the yielded canvas may have been cropped */
+    imf_image_make_writable(fmt->img);
+  }
+
+  if (!gif_start_frame(fmt, &error))
+    imf_load_error_raise(&error);
+
+  /* decode without the GVL */
+  fmt->done = false;
+  while (!fmt->done) {
+    fmt->interrupted = false;
+    imf_call_without_gvl(gif_decode_frame_without_gvl, fmt, gif_decode_frame_unblock, fmt);
+    rb_thread_check_ints();
+  }
+
+  fmt->prev_frame = fmt->frame;
+  ++fmt->frame_count;
+
+  return true;
+}
+
+static void
+gif_format_setup(imf_gif_format_t *fmt, imf_image_t *img, VALUE image_source)
+{
+  imf_load_error_t error;
+
+  if (!rb_obj_is_kind_of(image_source, imf_cIMF_ImageSource)) {
+    rb_raise(rb_eTypeError, "image_source must be an IMF::ImageSource object");
+  }
+
+  fmt->img = img;
+  fmt->image_source = image_source;
+  fmt->src = imf_image_source_get_byte_source(image_source);
+
+  /* Sources that need Ruby to produce bytes read the whole data up front,
+   * so that the LZW data can be read without the GVL. */
+  imf_byte_source_prepare_without_gvl(fmt->src);
+
+  if (!gif_read_screen(fmt, &error))
+    imf_load_error_raise(&error);
+}
+
+static VALUE
+load_gif_body(VALUE arg)
+{
+  imf_gif_format_t *fmt = (imf_gif_format_t *) arg;
+
+  if (!gif_next_frame(fmt))
+    rb_raise(rb_eRuntimeError, "GIF ERROR: no image");
+
+  return Qnil;
+}
+
+static VALUE
+gif_format_ensure(VALUE arg)
+{
+  imf_gif_format_t *fmt = (imf_gif_format_t *) arg;
+
+  gif_format_release_buffers(fmt);
+  fmt->img = NULL;
+  fmt->image_source = Qnil;
+  fmt->src = NULL;
+
+  return Qnil;
+}
+
+/* Loads the first frame */
+static void
+load_gif(imf_file_format_t *base_fmt, imf_image_t *img, VALUE image_source, imf_load_options_t const *RB_UNUSED_VAR(opts))
+{
+  imf_gif_format_t *fmt = (imf_gif_format_t *) base_fmt;
+
+  assert(img != NULL);
+
+  gif_format_setup(fmt, img, image_source);
+  rb_ensure(load_gif_body, (VALUE)fmt, gif_format_ensure, (VALUE)fmt);
+}
+
+static bool
+decode_gif_body(imf_gif_format_t *fmt, imf_load_error_t *error)
+{
+  bool found;
+
+  if (!gif_read_screen(fmt, error) || !gif_read_frame_header(fmt, &found, error))
+    return false;
+  if (!found)
+    return imf_load_error_set(error, rb_eRuntimeError, "GIF ERROR: no image");
+
+  gif_setup_canvas(fmt);
+  if (!imf_image_try_allocate_image_buffer(fmt->img))
+    return imf_load_error_set(error, rb_eNoMemError, "failed to allocate memory for the image");
+  gif_clear_canvas(fmt);
+
+  if (!gif_start_frame(fmt, error))
+    return false;
+  gif_decode_frame_without_gvl(fmt);
+
+  return true;
+}
+
+/* Decodes the first frame of the source on a thread of
+ * IMF::Image.open_all */
+static bool
+decode_gif(imf_byte_source_t *src, imf_image_t *img, imf_load_options_t const *RB_UNUSED_VAR(opts), imf_load_error_t *error)
+{
+  imf_gif_format_t fmt;
+  bool success;
+
+  memset(&fmt, 0, sizeof(fmt));
+  fmt.img = img;
+  fmt.image_source = Qnil;
+  fmt.buffer = Qnil;
+  fmt.src = src;
+
+  success = decode_gif_body(&fmt, error);
+  gif_format_release_buffers(&fmt);
+
+  return success;
+}
+
+typedef struct gif_each_frame_args gif_each_frame_args_t;
+struct gif_each_frame_args {
+  imf_gif_format_t *fmt;
+  VALUE image_obj;
+  VALUE image_source;
+};
+
+static VALUE
+gif_each_frame_body(VALUE arg)
+{
+  gif_each_frame_args_t *args = (gif_each_frame_args_t *) arg;
+  imf_gif_format_t *fmt = args->fmt;
+
+  while (gif_next_frame(fmt)) {
+    /* the delay time is given in 1/100 seconds */
+    rb_yield_values(2, args->image_obj, rb_float_new(fmt->prev_frame.delay / 100.0));
+  }
+
+  return Qnil;
+}
+
+static VALUE
+gif_each_frame_protected(VALUE arg)
+{
+  gif_each_frame_args_t *args = (gif_each_frame_args_t *) arg;
+  gif_format_setup(args->fmt, imf_get_image_data(args->image_obj), args->image_source);
+  return rb_ensure(gif_each_frame_body, arg, gif_format_ensure, (VALUE) args->fmt);
+}
+
+/*
+ * call-seq:
+ *   gif.each_frame(image_source) { |image, delay| ... } -> gif
+ *
+ * Decodes the frames one by one, and yields the canvas on which the
+ * frames so far are composited, with the delay time of the frame in
+ * seconds.  The same image is yielded for every frame and overwritten by
+ * the next frame.
+ */
+static VALUE
+gif_format_each_frame(VALUE obj, VALUE image_source)
+{
+  imf_gif_format_t *fmt;
+  gif_each_frame_args_t args;
+
+  RETURN_ENUMERATOR(obj, 1, &image_source);
+
+  TypedData_Get_Struct(obj, imf_gif_format_t, &gif_format_data_type, fmt);
+
+  args.fmt = fmt;
+  args.image_obj = rb_obj_alloc(imf_cIMF_Image);
+  args.image_source = image_source;
+  imf_image_source_protect(image_source, gif_each_frame_protected, (VALUE) &args);
+
+  RB_GC_GUARD(args.image_obj);
+  return obj;
+}
+
 void
 Init_gif(void)
 {
@@ -99,10 +939,11 @@ Init_gif(void)
   c = rb_define_class_under(m, "GIF", base);
 
   rb_define_alloc_func(c, gif_format_alloc);
+  rb_define_method(c, "each_frame", gif_format_each_frame, 1);
 
   id_detect = rb_intern("detect");
   id_read = rb_intern("read");
   id_rewind = rb_intern("rewind");
 
-  imf_register_file_format(c, gif_format_extnames);
+  imf_register_file_format(c, gif_format_extnames, gif_format_magics);
 }
@@ -9,4 +9,8 @@ unless have_header('jpeglib.h') && have_library('jpeg')
   abort
 end
 
+# libjpeg-turbo 1.5 or later can decode a part of the image
+have_func('jpeg_crop_scanline', %w[stdio.h jpeglib.h])
+have_func('jpeg_skip_scanlines', %w[stdio.h jpeglib.h])
+
 create_makefile('IMF/file_format/jpeg')
@@ -1,5 +1,7 @@
 #include "IMF.h"
 
+#include <setjmp.h>
+
 #undef EXTERN
 #include <jpeglib.h>
 #include <jerror.h>
@@ -7,67 +9,33 @@
 static char const JPEG_MAGIC_BYTES[] = "\xff\xd8";
 static size_t const JPEG_MAGIC_LENGTH = sizeof(JPEG_MAGIC_BYTES) - 1;
 
-static VALUE cSourceManager;
 static ID id_detect;
 static ID id_read;
 static ID id_rewind;
+static ID id_quality;
+static ID id_subsampling;
+static ID id_optimize_coding;
+static ID id_progressive;
+
+static JOCTET const JPEG_FAKE_EOI[] = { 0xFF, JPEG_EOI };
 
 enum imf_jpeg_src_mgr_constants {
   IMF_JPEG_BUFFER_SIZE = 8192,
 };
 
+/* A source manager that reads the compressed data from an imf_byte_source.
+ * It never calls back into Ruby once the byte source is prepared for
+ * reading without the GVL. */
 typedef struct imf_jpeg_src_mgr imf_jpeg_src_mgr_t;
 struct imf_jpeg_src_mgr {
   struct jpeg_source_mgr pub;
 
-  VALUE image_source;
-  VALUE buffer;
+  imf_byte_source_t *src;
   bool start_of_source;
 };
 
 #define IMF_JPEG_SRC_MGR(ptr) ((imf_jpeg_src_mgr_t *)(ptr))
 
-imf_jpeg_src_mgr_t *get_imf_jpeg_src_mgr(VALUE obj);
-
-static void
-imf_jpeg_src_mgr_mark(void *ptr)
-{
-  rb_gc_mark(IMF_JPEG_SRC_MGR(ptr)->image_source);
-}
-
-static void
-imf_jpeg_src_mgr_free(void *ptr)
-{
-  xfree(ptr);
-}
-
-static size_t
-imf_jpeg_src_mgr_memsize(void const *ptr)
-{
-  return sizeof(imf_jpeg_src_mgr_t);
-}
-
-static rb_data_type_t imf_jpeg_src_mgr_data_type = {
-  "imf_jpeg_src_mgr",
-  {
-    imf_jpeg_src_mgr_mark,
-    imf_jpeg_src_mgr_free,
-    imf_jpeg_src_mgr_memsize,
-  },
-#ifdef RUBY_TYPED_FREE_IMMEDIATELY
-  0, 0,
-  RUBY_TYPED_FREE_IMMEDIATELY
-#endif
-};
-
-imf_jpeg_src_mgr_t *
-get_imf_jpeg_src_mgr(VALUE obj)
-{
-  imf_jpeg_src_mgr_t *srcmgr;
-  TypedData_Get_Struct(obj, imf_jpeg_src_mgr_t, &imf_jpeg_src_mgr_data_type, srcmgr);
-  return srcmgr;
-}
-
 static void
 imf_jpeg_src_mgr_init_source(j_decompress_ptr cinfo)
 {
@@ -79,21 +47,25 @@ static boolean
 imf_jpeg_src_mgr_fill_input_buffer(j_decompress_ptr cinfo)
 {
   imf_jpeg_src_mgr_t *srcmgr = IMF_JPEG_SRC_MGR(cinfo->src);
-  srcmgr->buffer = rb_funcall(srcmgr->image_source, id_read, 1, INT2FIX(IMF_JPEG_BUFFER_SIZE));
-  if (NIL_P(srcmgr->buffer))
-    srcmgr->buffer = rb_str_tmp_new(2);
-  if (NIL_P(srcmgr->buffer) || RSTRING_LEN(srcmgr->buffer) == 0) {
+  uint8_t const *ptr;
+  size_t length;
+
+  /* Borrow the next chunk from the byte source.  It stays valid until
+   * the next peek, that is the next call of this function. */
+  length = imf_byte_source_peek(srcmgr->src, IMF_JPEG_BUFFER_SIZE, &ptr);
+  imf_byte_source_skip(srcmgr->src, length);
+
+  if (length == 0) {
     if (srcmgr->start_of_source)
       ERREXIT(cinfo, JERR_INPUT_EMPTY);
     WARNMS(cinfo, JWRN_JPEG_EOF);
-    /* Insert a face EOI marker */
-    rb_str_resize(srcmgr->buffer, 2);
-    RSTRING_PTR(srcmgr)[0] = '\xFF';
-    RSTRING_PTR(srcmgr)[1] = JPEG_EOI;
+    /* Insert a fake EOI marker */
+    ptr = JPEG_FAKE_EOI;
+    length = sizeof(JPEG_FAKE_EOI);
   }
 
-  srcmgr->pub.next_input_byte = (JOCTET const *) RSTRING_PTR(srcmgr->buffer);
-  srcmgr->pub.bytes_in_buffer = RSTRING_LEN(srcmgr->buffer);
+  srcmgr->pub.next_input_byte = (JOCTET const *) ptr;
+  srcmgr->pub.bytes_in_buffer = length;
   srcmgr->start_of_source = false;
 
   return TRUE;
@@ -102,22 +74,22 @@ imf_jpeg_src_mgr_fill_input_buffer(j_decompress_ptr cinfo)
 static void
 imf_jpeg_src_mgr_skip_input_data(j_decompress_ptr cinfo, long num_bytes)
 {
+  imf_jpeg_src_mgr_t *srcmgr = IMF_JPEG_SRC_MGR(cinfo->src);
   struct jpeg_source_mgr *src = cinfo->src;
 
-  /* Just a dumb implementation for now.  Could use fseek() except
-   * it doesn't work on pipes.  Not clear that being smart is worth
-   * any trouble anyway --- large skips are infrequent.  */
-  if (num_bytes > 0) {
-    while (num_bytes > (long) src->bytes_in_buffer) {
-      num_bytes -= (long) src->bytes_in_buffer;
+  if (num_bytes <= 0)
+    return;
 
-      /* note we assume that fill_input_buffer will never return FALSE,
-       * so suspension need not be handled.  */
-      (void) (*src->fill_input_buffer) (cinfo);
-    }
-    src->next_input_byte += (size_t) num_bytes;
-    src->bytes_in_buffer -= (size_t) num_bytes;
+  if (num_bytes > (long) src->bytes_in_buffer) {
+    /* skip the rest in the byte source without reading it */
+    imf_byte_source_skip(srcmgr->src, (size_t) num_bytes - src->bytes_in_buffer);
+    src->next_input_byte += src->bytes_in_buffer;
+    src->bytes_in_buffer = 0;
+    return;
   }
+
+  src->next_input_byte += (size_t) num_bytes;
+  src->bytes_in_buffer -= (size_t) num_bytes;
 }
 
 static void
@@ -126,18 +98,10 @@ imf_jpeg_src_mgr_term_source(j_decompress_ptr cinfo)
   /* nothing to do */
 }
 
-static VALUE
-imf_jpeg_src_mgr_new(VALUE image_source)
+static void
+init_source_manager(j_decompress_ptr cinfo, imf_jpeg_src_mgr_t *srcmgr, imf_byte_source_t *src)
 {
-  imf_jpeg_src_mgr_t *srcmgr;
-  VALUE obj = TypedData_Make_Struct(
-      cSourceManager,
-      imf_jpeg_src_mgr_t,
-      &imf_jpeg_src_mgr_data_type,
-      srcmgr);
-
-  srcmgr->image_source = image_source;
-  srcmgr->buffer = rb_str_tmp_new(IMF_JPEG_BUFFER_SIZE);
+  srcmgr->src = src;
   srcmgr->pub.init_source = imf_jpeg_src_mgr_init_source;
   srcmgr->pub.fill_input_buffer = imf_jpeg_src_mgr_fill_input_buffer;
   srcmgr->pub.skip_input_data = imf_jpeg_src_mgr_skip_input_data;
@@ -146,44 +110,84 @@ imf_jpeg_src_mgr_new(VALUE image_source)
   srcmgr->pub.bytes_in_buffer = 0;
   srcmgr->pub.next_input_byte = NULL;
 
-  return obj;
+  cinfo->src = &srcmgr->pub;
 }
 
-static VALUE
-init_source_manager(j_decompress_ptr cinfo, VALUE image_source)
-{
-  VALUE srcmgr = imf_jpeg_src_mgr_new(image_source);
-  cinfo->src = (struct jpeg_source_mgr *) get_imf_jpeg_src_mgr(srcmgr);
-  return srcmgr;
-}
+/* An error manager that unwinds to the decoder instead of raising,
+ * because libjpeg may report errors while we do not hold the GVL. */
+typedef struct imf_jpeg_error_mgr imf_jpeg_error_mgr_t;
+struct imf_jpeg_error_mgr {
+  struct jpeg_error_mgr pub;
+
+  jmp_buf setjmp_buffer;
+  char message[JMSG_LENGTH_MAX];
+};
+
+#define IMF_JPEG_ERROR_MGR(ptr) ((imf_jpeg_error_mgr_t *)(ptr))
+
+enum imf_jpeg_format_constants {
+  /* The number of rows requested by one jpeg_read_scanlines call.  This
+   * covers an entire iMCU row even for 2x2 chroma subsampling, so that
+   * libjpeg can upsample and color convert a whole row group at once. */
+  IMF_JPEG_SCANLINES_PER_CALL = 16,
+  /* The maximum number of rows of a component in an iMCU row, which is
+   * MAX_SAMP_FACTOR * DCTSIZE. */
+  IMF_JPEG_MAX_RAW_ROWS = 32,
+};
 
 typedef struct imf_jpeg_format imf_jpeg_format_t;
 struct imf_jpeg_format {
   imf_file_format_t base;
   struct jpeg_decompress_struct cinfo;
-  VALUE srcmgr;
-  VALUE buffer;
+  imf_jpeg_src_mgr_t srcmgr;
+  imf_jpeg_error_mgr_t jerr;
+  imf_image_t *img;
+  VALUE image_source;
+  imf_load_options_t const *opts;
+  /* the region of the output image to be stored into img */
+  JDIMENSION region_x;
+  JDIMENSION region_y;
+  JDIMENSION region_width;
+  JDIMENSION region_height;
+  /* rows wider than the region are decoded here and then copied */
+  uint8_t *scratch;
+  size_t scratch_stride;
+  size_t scratch_offset;
   int running;
+  bool started;
+  bool done;
+  bool failed;
+  volatile bool interrupted;
 };
 
 static char const *const jpeg_format_extnames[] = {
   ".jpg", ".jpeg", ".jpe", ".jfif", NULL
 };
 
+static imf_file_format_magic_t const jpeg_format_magics[] = {
+  { JPEG_MAGIC_BYTES, NULL, sizeof(JPEG_MAGIC_BYTES) - 1 },
+  { NULL, NULL, 0 }
+};
+
 static int detect_jpeg(imf_file_format_t *fmt, VALUE image_source);
-static void load_jpeg(imf_file_format_t *fmt, imf_image_t *img, VALUE image_source);
+static void load_jpeg(imf_file_format_t *fmt, imf_image_t *img, VALUE image_source, imf_load_options_t const *opts);
+static void save_jpeg(imf_file_format_t *fmt, imf_image_t const *img, imf_byte_sink_t *sink, VALUE opts);
+static void probe_jpeg(imf_file_format_t *fmt, VALUE image_source, imf_image_t *img);
+static bool decode_jpeg(imf_byte_source_t *src, imf_image_t *img, imf_load_options_t const *opts, imf_load_error_t *error);
 
 static imf_file_format_interface_t const jpeg_format_interface = {
   detect_jpeg,
-  load_jpeg
+  load_jpeg,
+  save_jpeg,
+  probe_jpeg,
+  decode_jpeg
 };
 
 static void
 jpeg_format_mark(void *ptr)
 {
   imf_jpeg_format_t *fmt = (imf_jpeg_format_t *) ptr;
-  rb_gc_mark(fmt->srcmgr);
-  rb_gc_mark(fmt->buffer);
+  rb_gc_mark(fmt->image_source);
   imf_file_format_mark(ptr);
 }
 
@@ -229,13 +233,10 @@ jpeg_format_alloc(VALUE klass)
 static int
 detect_jpeg(imf_file_format_t *fmt, VALUE image_source)
 {
-  VALUE magic_value;
-  char const *magic;
-
-  magic_value = rb_funcall(image_source, id_read, 1, INT2FIX(JPEG_MAGIC_LENGTH));
+  imf_byte_source_t *src = imf_image_source_get_byte_source(image_source);
+  uint8_t const *magic;
 
-  magic = StringValuePtr(magic_value);
-  if (RSTRING_LEN(magic_value) == JPEG_MAGIC_LENGTH &&
+  if (imf_byte_source_peek(src, JPEG_MAGIC_LENGTH, &magic) == JPEG_MAGIC_LENGTH &&
       memcmp(JPEG_MAGIC_BYTES, magic, JPEG_MAGIC_LENGTH) == 0)
     return 1;
   return 0;
@@ -244,20 +245,422 @@ detect_jpeg(imf_file_format_t *fmt, VALUE image_source)
 static void
 jpeg_error_exit(j_common_ptr cinfo)
 {
-  char buffer[JMSG_LENGTH_MAX] = { '\0', };
+  imf_jpeg_error_mgr_t *err = IMF_JPEG_ERROR_MGR(cinfo->err);
 
-  (*cinfo->err->format_message)(cinfo, buffer);
+  (*cinfo->err->format_message)(cinfo, err->message);
 
-  rb_raise(rb_eRuntimeError, "JPEG ERROR: %s", buffer);
+  longjmp(err->setjmp_buffer, 1);
 }
 
+/* Narrows the decoding to the columns of the region.  libjpeg-turbo can
+ * skip the iMCU columns out of the region, but the decoded rows can still
+ * be wider than the region, because the left edge is aligned to an iMCU
+ * boundary.  Such rows are decoded into the scratch buffer.  This is
+ * called without the GVL right after jpeg_start_decompress. */
 static void
-load_jpeg(imf_file_format_t *base_fmt, imf_image_t *img, VALUE image_source)
+load_jpeg_start_region(imf_jpeg_format_t *fmt)
+{
+  struct jpeg_decompress_struct *cinfo = &fmt->cinfo;
+  JDIMENSION x = fmt->region_x, width = fmt->region_width;
+  size_t const pixel_size = (size_t) cinfo->output_components * sizeof(JSAMPLE);
+
+  if (x == 0 && width == cinfo->output_width)
+    return;
+
+#ifdef HAVE_JPEG_CROP_SCANLINE
+  jpeg_crop_scanline(cinfo, &x, &width);
+#else
+  x = 0;
+  width = cinfo->output_width;
+#endif
+
+  fmt->scratch_stride = (size_t) width * pixel_size;
+  fmt->scratch_offset = (size_t) (fmt->region_x - x) * pixel_size;
+  fmt->scratch = malloc(fmt->scratch_stride * IMF_JPEG_SCANLINES_PER_CALL);
+  if (fmt->scratch == NULL)
+    ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 0);
+}
+
+/* Discards the rows above the region. */
+static void
+load_jpeg_skip_scanlines(imf_jpeg_format_t *fmt)
+{
+  struct jpeg_decompress_struct *cinfo = &fmt->cinfo;
+
+#ifdef HAVE_JPEG_SKIP_SCANLINES
+  jpeg_skip_scanlines(cinfo, fmt->region_y - cinfo->output_scanline);
+#else
+  /* decode the rows into the first row of the destination, which is
+   * overwritten later */
+  JSAMPROW rows[IMF_JPEG_SCANLINES_PER_CALL];
+  JDIMENSION n = fmt->region_y - cinfo->output_scanline;
+  JDIMENSION i;
+
+  if (n > IMF_JPEG_SCANLINES_PER_CALL)
+    n = IMF_JPEG_SCANLINES_PER_CALL;
+  for (i = 0; i < n; ++i)
+    rows[i] = (JSAMPROW) (fmt->scratch != NULL ? fmt->scratch : fmt->img->data);
+  jpeg_read_scanlines(cinfo, rows, n);
+#endif
+}
+
+static void *
+load_jpeg_scanlines_without_gvl(void *arg)
+{
+  imf_jpeg_format_t *fmt = (imf_jpeg_format_t *) arg;
+  struct jpeg_decompress_struct *cinfo = &fmt->cinfo;
+  imf_image_t *img = fmt->img;
+  JSAMPROW rows[IMF_JPEG_SCANLINES_PER_CALL];
+  JDIMENSION const region_end = fmt->region_y + fmt->region_height;
+
+  if (setjmp(fmt->jerr.setjmp_buffer)) {
+    fmt->failed = true;
+    return NULL;
+  }
+
+  if (!fmt->started) {
+    jpeg_start_decompress(cinfo);
+    fmt->started = true;
+    load_jpeg_start_region(fmt);
+  }
+
+  while (cinfo->output_scanline < fmt->region_y) {
+    if (fmt->interrupted)
+      return NULL;
+    load_jpeg_skip_scanlines(fmt);
+  }
+
+  /* libjpeg writes the scanlines straight into the image buffer unless
+   * they need to be cropped */
+  while (cinfo->output_scanline < region_end) {
+    if (fmt->interrupted)
+      return NULL;
+
+    JDIMENSION const y = cinfo->output_scanline - fmt->region_y;
+    JDIMENSION n = region_end - cinfo->output_scanline;
+    if (n > IMF_JPEG_SCANLINES_PER_CALL)
+      n = IMF_JPEG_SCANLINES_PER_CALL;
+
+    JDIMENSION i;
+    for (i = 0; i < n; ++i) {
+      if (fmt->scratch != NULL)
+        rows[i] = (JSAMPROW) (fmt->scratch + i * fmt->scratch_stride);
+      else
+        rows[i] = (JSAMPROW) (img->data + (y + i) * img->row_stride);
+    }
+
+    n = jpeg_read_scanlines(cinfo, rows, n);
+
+    if (fmt->scratch != NULL) {
+      size_t const row_size = img->width * img->pixel_channels * sizeof(JSAMPLE);
+      for (i = 0; i < n; ++i)
+        memcpy(img->data + (y + i) * img->row_stride, rows[i] + fmt->scratch_offset, row_size);
+    }
+  }
+
+  /* The rows below the region are not decoded at all */
+  if (cinfo->output_scanline < cinfo->output_height)
+    jpeg_abort_decompress(cinfo);
+  else
+    jpeg_finish_decompress(cinfo);
+  fmt->done = true;
+
+  return NULL;
+}
+
+/* Decodes the components into the planes of img without upsampling or
+ * color conversion.  libjpeg produces an iMCU row at a time, which is
+ * max_v_samp_factor * DCTSIZE rows of the image, so the planes are padded
+ * to whole iMCU rows. */
+static void *
+load_jpeg_raw_data_without_gvl(void *arg)
+{
+  imf_jpeg_format_t *fmt = (imf_jpeg_format_t *) arg;
+  struct jpeg_decompress_struct *cinfo = &fmt->cinfo;
+  imf_image_t *img = fmt->img;
+  JSAMPROW rows[IMF_IMAGE_MAX_PLANES][IMF_JPEG_MAX_RAW_ROWS];
+  JSAMPARRAY planes[IMF_IMAGE_MAX_PLANES];
+
+  if (setjmp(fmt->jerr.setjmp_buffer)) {
+    fmt->failed = true;
+    return NULL;
+  }
+
+  if (!fmt->started) {
+    jpeg_start_decompress(cinfo);
+    fmt->started = true;
+  }
+
+  JDIMENSION const imcu_rows = cinfo->max_v_samp_factor * DCTSIZE;
+  while (cinfo->output_scanline < cinfo->output_height) {
+    if (fmt->interrupted)
+      return NULL;
+
+    JDIMENSION const imcu_row = cinfo->output_scanline / imcu_rows;
+    int c;
+    for (c = 0; c < cinfo->num_components; ++c) {
+      imf_image_plane_t const *plane = &img->planes[c];
+      JDIMENSION const n = cinfo->comp_info[c].v_samp_factor * DCTSIZE;
+      JDIMENSION i;
+      for (i = 0; i < n; ++i)
+        rows[c][i] = (JSAMPROW) (plane->data + (imcu_row * n + i) * plane->row_stride);
+      planes[c] = rows[c];
+    }
+
+    jpeg_read_raw_data(cinfo, planes, imcu_rows);
+  }
+
+  jpeg_finish_decompress(cinfo);
+  fmt->done = true;
+
+  return NULL;
+}
+
+static void
+load_jpeg_scanlines_unblock(void *arg)
+{
+  imf_jpeg_format_t *fmt = (imf_jpeg_format_t *) arg;
+  fmt->interrupted = true;
+}
+
+/* The name of a J_COLOR_SPACE for error messages */
+static char const *
+jpeg_color_space_name(J_COLOR_SPACE color_space)
+{
+  switch (color_space) {
+    case JCS_UNKNOWN:
+      return "unknown";
+    case JCS_GRAYSCALE:
+      return "grayscale";
+    case JCS_RGB:
+      return "RGB";
+    case JCS_YCbCr:
+      return "YCbCr";
+    case JCS_CMYK:
+      return "CMYK";
+    case JCS_YCCK:
+      return "YCCK";
+    default:
+      return NULL;
+  }
+}
+
+/* Lets libjpeg leave the components in the color space of the file,
+ * except that YCCK is still converted into CMYK as it has no use. */
+static void
+jpeg_keep_color_space(struct jpeg_decompress_struct *cinfo)
+{
+  switch (cinfo->jpeg_color_space) {
+    case JCS_YCbCr:
+      cinfo->out_color_space = JCS_YCbCr;
+      break;
+    case JCS_YCCK:
+      cinfo->out_color_space = JCS_CMYK;
+      break;
+    default:
+      break;
+  }
+}
+
+static void
+jpeg_set_image_layout(struct jpeg_decompress_struct const *cinfo, imf_image_t *img)
+{
+  switch (cinfo->out_color_space) {
+    case JCS_GRAYSCALE:
+      img->color_space = IMF_COLOR_SPACE_GRAY;
+      break;
+    case JCS_YCbCr:
+      img->color_space = IMF_COLOR_SPACE_YCBCR;
+      break;
+    case JCS_CMYK:
+      img->color_space = IMF_COLOR_SPACE_CMYK;
+      break;
+    default:
+      img->color_space = IMF_COLOR_SPACE_RGB;
+      break;
+  }
+  IMF_IMAGE_UNSET_ALPHA(img);
+  img->component_size = sizeof(JSAMPLE);
+  img->pixel_channels = cinfo->output_components;
+}
+
+/* Sets up the planes of img for the components of the file as they are
+ * stored, e.g. YCbCr with the chroma planes subsampled, and computes the
+ * padded sizes of the planes to be allocated.  This can be called without
+ * the GVL. */
+static bool
+load_jpeg_setup_planes(imf_jpeg_format_t *fmt, size_t *padded_widths, size_t *padded_heights, imf_load_error_t *error)
+{
+  struct jpeg_decompress_struct *cinfo = &fmt->cinfo;
+  imf_load_options_t const *opts = fmt->opts;
+  imf_image_t *img = fmt->img;
+  int c;
+
+  if (opts->scale_num != opts->scale_denom || opts->max_width > 0 || opts->max_height > 0 || opts->region_width > 0)
+    return imf_load_error_set(error, rb_eArgError, "planar cannot be combined with scale, max_size, or region");
+
+  switch (cinfo->jpeg_color_space) {
+    case JCS_GRAYSCALE:
+      img->color_space = IMF_COLOR_SPACE_GRAY;
+      break;
+    case JCS_YCbCr:
+      img->color_space = IMF_COLOR_SPACE_YCBCR;
+      break;
+    case JCS_RGB:
+      img->color_space = IMF_COLOR_SPACE_RGB;
+      break;
+    case JCS_CMYK:
+      img->color_space = IMF_COLOR_SPACE_CMYK;
+      break;
+    default:
+      if (jpeg_color_space_name(cinfo->jpeg_color_space) != NULL)
+        return imf_load_error_set(error, rb_eNotImpError, "unable to load the components of %s JPEG as planes",
+                                  jpeg_color_space_name(cinfo->jpeg_color_space));
+      return imf_load_error_set(error, rb_eNotImpError, "unable to load the components of JPEG color space %d as planes",
+                                (int) cinfo->jpeg_color_space);
+  }
+  if (cinfo->num_components > IMF_IMAGE_MAX_PLANES || cinfo->max_v_samp_factor * DCTSIZE > IMF_JPEG_MAX_RAW_ROWS)
+    return imf_load_error_set(error, rb_eNotImpError, "unsupported JPEG component layout");
+
+  cinfo->raw_data_out = TRUE;
+  cinfo->out_color_space = cinfo->jpeg_color_space;
+
+  IMF_IMAGE_UNSET_ALPHA(img);
+  img->component_size = sizeof(JSAMPLE);
+  img->pixel_channels = cinfo->num_components;
+  img->width = cinfo->image_width;
+  img->height = cinfo->image_height;
+  for (c = 0; c < cinfo->num_components; ++c) {
+    jpeg_component_info const *comp = &cinfo->comp_info[c];
+    size_t const h = (size_t) comp->h_samp_factor, v = (size_t) comp->v_samp_factor;
+    img->planes[c].width = comp->downsampled_width;
+    img->planes[c].height = comp->downsampled_height;
+    padded_widths[c] = (comp->width_in_blocks + h - 1) / h * h * DCTSIZE;
+    padded_heights[c] = (size_t) cinfo->total_iMCU_rows * v * DCTSIZE;
+  }
+
+  return true;
+}
+
+/* Sets up the scale, the color space, and the region of the output, and
+ * img for the region to be allocated.  This can be called without the
+ * GVL. */
+static bool
+load_jpeg_setup_output(imf_jpeg_format_t *fmt, imf_load_error_t *error)
+{
+  struct jpeg_decompress_struct *cinfo = &fmt->cinfo;
+  imf_image_t *img = fmt->img;
+  size_t scale_num, scale_denom;
+  size_t region_x, region_y, region_width, region_height;
+
+  if (fmt->opts->keep_color_space)
+    jpeg_keep_color_space(cinfo);
+
+  /* Let the IDCT produce the reduced image directly.  libjpeg rounds the
+   * factor up to the nearest one it supports, so the image is never
+   * smaller than requested. */
+  imf_load_options_get_scale(fmt->opts, cinfo->image_width, cinfo->image_height, &scale_num, &scale_denom);
+  cinfo->scale_num = (unsigned int) scale_num;
+  cinfo->scale_denom = (unsigned int) scale_denom;
+
+  jpeg_calc_output_dimensions(cinfo);
+
+  if (!imf_load_options_try_get_region(fmt->opts, cinfo->output_width, cinfo->output_height,
+                                       &region_x, &region_y, &region_width, &region_height, error))
+    return false;
+  fmt->region_x = (JDIMENSION) region_x;
+  fmt->region_y = (JDIMENSION) region_y;
+  fmt->region_width = (JDIMENSION) region_width;
+  fmt->region_height = (JDIMENSION) region_height;
+
+  /* the image buffer is only for the region */
+  jpeg_set_image_layout(cinfo, img);
+  img->width = region_width;
+  img->height = region_height;
+
+  return true;
+}
+
+static VALUE
+load_jpeg_body(VALUE arg)
+{
+  imf_jpeg_format_t *fmt = (imf_jpeg_format_t *) arg;
+  struct jpeg_decompress_struct *cinfo = &fmt->cinfo;
+  imf_image_t *img = fmt->img;
+  imf_load_error_t error;
+
+  if (setjmp(fmt->jerr.setjmp_buffer))
+    rb_raise(rb_eRuntimeError, "JPEG ERROR: %s", fmt->jerr.message);
+
+  /* setup source manager */
+  init_source_manager(cinfo, &fmt->srcmgr, imf_image_source_get_byte_source(fmt->image_source));
+
+  /* Sources that need Ruby to produce bytes read the whole compressed data
+   * up front.  This has to be done before libjpeg borrows any chunk. */
+  imf_byte_source_prepare_without_gvl(fmt->srcmgr.src);
+
+  jpeg_read_header(cinfo, TRUE);
+
+  if (fmt->opts->planar) {
+    size_t padded_widths[IMF_IMAGE_MAX_PLANES], padded_heights[IMF_IMAGE_MAX_PLANES];
+
+    if (!load_jpeg_setup_planes(fmt, padded_widths, padded_heights, &error))
+      imf_load_error_raise(&error);
+    imf_image_allocate_planes(img, padded_widths, padded_heights);
+
+    fmt->started = false;
+    fmt->done = false;
+    while (!fmt->done && !fmt->failed) {
+      fmt->interrupted = false;
+      imf_call_without_gvl(load_jpeg_raw_data_without_gvl, fmt, load_jpeg_scanlines_unblock, fmt);
+      rb_thread_check_ints();
+    }
+
+    if (fmt->failed)
+      rb_raise(rb_eRuntimeError, "JPEG ERROR: %s", fmt->jerr.message);
+
+    return Qnil;
+  }
+
+  if (!load_jpeg_setup_output(fmt, &error))
+    imf_load_error_raise(&error);
+  imf_image_allocate_image_buffer(img);
+
+  /* decompress without the GVL */
+  fmt->started = false;
+  fmt->done = false;
+  while (!fmt->done && !fmt->failed) {
+    fmt->interrupted = false;
+    imf_call_without_gvl(load_jpeg_scanlines_without_gvl, fmt, load_jpeg_scanlines_unblock, fmt);
+    rb_thread_check_ints();
+  }
+
+  if (fmt->failed)
+    rb_raise(rb_eRuntimeError, "JPEG ERROR: %s", fmt->jerr.message);
+
+  return Qnil;
+}
+
+static VALUE
+load_jpeg_ensure(VALUE arg)
+{
+  imf_jpeg_format_t *fmt = (imf_jpeg_format_t *) arg;
+
+  if (fmt->running) {
+    jpeg_destroy_decompress(&fmt->cinfo);
+    fmt->running = 0;
+  }
+
+  free(fmt->scratch);
+  fmt->scratch = NULL;
+
+  return Qnil;
+}
+
+static void
+jpeg_format_setup(imf_jpeg_format_t *fmt, imf_image_t *img, VALUE image_source, imf_load_options_t const *opts)
 {
-  imf_jpeg_format_t *fmt = (imf_jpeg_format_t *) base_fmt;
   struct jpeg_decompress_struct *cinfo;
-  struct jpeg_error_mgr jerr;
-  JOCTET *buffer_ptr;
 
   assert(img != NULL);
 
@@ -265,53 +668,450 @@ load_jpeg(imf_file_format_t *base_fmt, imf_image_t *img, VALUE image_source)
     rb_raise(rb_eTypeError, "image_source must be an IMF::ImageSource object");
   }
 
+  fmt->img = img;
+  fmt->image_source = image_source;
+  fmt->opts = opts;
+  fmt->scratch = NULL;
+  fmt->failed = false;
+  fmt->jerr.message[0] = '\0';
+
   cinfo = &fmt->cinfo;
-  cinfo->err = jpeg_std_error(&jerr);
+  cinfo->err = jpeg_std_error(&fmt->jerr.pub);
   cinfo->err->error_exit = jpeg_error_exit;
 
   jpeg_create_decompress(cinfo);
   fmt->running = 1;
+}
 
-  /* setup source manager */
-  fmt->srcmgr = init_source_manager(cinfo, image_source);
+static void
+load_jpeg(imf_file_format_t *base_fmt, imf_image_t *img, VALUE image_source, imf_load_options_t const *opts)
+{
+  imf_jpeg_format_t *fmt = (imf_jpeg_format_t *) base_fmt;
+
+  jpeg_format_setup(fmt, img, image_source, opts);
+  rb_ensure(load_jpeg_body, (VALUE)fmt, load_jpeg_ensure, (VALUE)fmt);
+}
+
+static VALUE
+probe_jpeg_body(VALUE arg)
+{
+  imf_jpeg_format_t *fmt = (imf_jpeg_format_t *) arg;
+  struct jpeg_decompress_struct *cinfo = &fmt->cinfo;
+  imf_image_t *img = fmt->img;
+
+  if (setjmp(fmt->jerr.setjmp_buffer))
+    rb_raise(rb_eRuntimeError, "JPEG ERROR: %s", fmt->jerr.message);
 
+  /* libjpeg reads only up to the first SOS marker here */
+  init_source_manager(cinfo, &fmt->srcmgr, imf_image_source_get_byte_source(fmt->image_source));
   jpeg_read_header(cinfo, TRUE);
-  jpeg_start_decompress(cinfo);
+  jpeg_calc_output_dimensions(cinfo);
 
-  /* allocate image buffer */
-  img->color_space = IMF_COLOR_SPACE_RGB;
-  IMF_IMAGE_UNSET_ALPHA(img);
-  img->component_size = sizeof(JSAMPLE);
-  img->pixel_channels = cinfo->output_components;
+  jpeg_set_image_layout(cinfo, img);
   img->width = cinfo->output_width;
   img->height = cinfo->output_height;
 
-  imf_image_allocate_image_buffer(img);
+  return Qnil;
+}
+
+static void
+probe_jpeg(imf_file_format_t *base_fmt, VALUE image_source, imf_image_t *img)
+{
+  imf_jpeg_format_t *fmt = (imf_jpeg_format_t *) base_fmt;
+  imf_load_options_t const opts = IMF_LOAD_OPTIONS_INITIALIZER;
 
-  /* allocate temporary scanline buffer */
-  fmt->buffer = rb_str_tmp_new(sizeof(JSAMPLE) * cinfo->output_width * cinfo->output_components);
-  buffer_ptr = (JOCTET *) RSTRING_PTR(fmt->buffer);
+  jpeg_format_setup(fmt, img, image_source, &opts);
+  rb_ensure(probe_jpeg_body, (VALUE)fmt, load_jpeg_ensure, (VALUE)fmt);
+}
 
-  size_t const pixel_size = img->pixel_channels * img->component_size;
-  size_t const row_size = pixel_size * img->width;
-  uint8_t *row_base_ptr = img->data;
-  size_t y = 0;
-  while (cinfo->output_scanline < cinfo->output_height) {
-    jpeg_read_scanlines(cinfo, &buffer_ptr, 1);
+static bool
+decode_jpeg_body(imf_jpeg_format_t *fmt, imf_byte_source_t *src, imf_load_error_t *error)
+{
+  struct jpeg_decompress_struct *cinfo = &fmt->cinfo;
+  imf_image_t *img = fmt->img;
 
-    memcpy(row_base_ptr, buffer_ptr, row_size);
+  if (setjmp(fmt->jerr.setjmp_buffer))
+    return imf_load_error_set(error, rb_eRuntimeError, "JPEG ERROR: %s", fmt->jerr.message);
 
-    row_base_ptr += img->row_stride;
-    ++y;
+  jpeg_create_decompress(cinfo);
+  init_source_manager(cinfo, &fmt->srcmgr, src);
+  jpeg_read_header(cinfo, TRUE);
+
+  if (fmt->opts->planar) {
+    size_t padded_widths[IMF_IMAGE_MAX_PLANES], padded_heights[IMF_IMAGE_MAX_PLANES];
+
+    if (!load_jpeg_setup_planes(fmt, padded_widths, padded_heights, error))
+      return false;
+    if (!imf_image_try_allocate_planes(img, padded_widths, padded_heights))
+      return imf_load_error_set(error, rb_eNoMemError, "failed to allocate memory for the image");
+    load_jpeg_raw_data_without_gvl(fmt);
+  }
+  else {
+    if (!load_jpeg_setup_output(fmt, error))
+      return false;
+    if (!imf_image_try_allocate_image_buffer(img))
+      return imf_load_error_set(error, rb_eNoMemError, "failed to allocate memory for the image");
+    load_jpeg_scanlines_without_gvl(fmt);
   }
 
-  /* release temporary buffer memory */
-  buffer_ptr = NULL;
-  rb_str_resize(fmt->buffer, 0L);
+  if (fmt->failed)
+    return imf_load_error_set(error, rb_eRuntimeError, "JPEG ERROR: %s", fmt->jerr.message);
 
-  jpeg_finish_decompress(cinfo);
-  jpeg_destroy_decompress(cinfo);
-  fmt->running = 0;
+  return true;
+}
+
+/* Decodes the source on a thread of IMF::Image.open_all */
+static bool
+decode_jpeg(imf_byte_source_t *src, imf_image_t *img, imf_load_options_t const *opts, imf_load_error_t *error)
+{
+  imf_jpeg_format_t fmt;
+  bool success;
+
+  memset(&fmt, 0, sizeof(fmt));
+  fmt.img = img;
+  fmt.image_source = Qnil;
+  fmt.opts = opts;
+  fmt.cinfo.err = jpeg_std_error(&fmt.jerr.pub);
+  fmt.cinfo.err->error_exit = jpeg_error_exit;
+
+  success = decode_jpeg_body(&fmt, src, error);
+
+  /* this does nothing if jpeg_create_decompress has failed */
+  jpeg_destroy_decompress(&fmt.cinfo);
+  free(fmt.scratch);
+
+  return success;
+}
+
+/* JPEG encoder */
+
+/* A destination manager that lets libjpeg write the compressed data
+ * straight into the buffer of an imf_byte_sink. */
+typedef struct imf_jpeg_dest_mgr imf_jpeg_dest_mgr_t;
+struct imf_jpeg_dest_mgr {
+  struct jpeg_destination_mgr pub;
+
+  imf_byte_sink_t *sink;
+  size_t buffer_size;
+};
+
+#define IMF_JPEG_DEST_MGR(ptr) ((imf_jpeg_dest_mgr_t *)(ptr))
+
+static void
+imf_jpeg_dest_mgr_reserve(j_compress_ptr cinfo)
+{
+  imf_jpeg_dest_mgr_t *destmgr = IMF_JPEG_DEST_MGR(cinfo->dest);
+  uint8_t *ptr;
+
+  destmgr->buffer_size = imf_byte_sink_reserve(destmgr->sink, &ptr);
+  if (destmgr->buffer_size == 0)
+    ERREXIT(cinfo, JERR_FILE_WRITE);
+
+  destmgr->pub.next_output_byte = (JOCTET *) ptr;
+  destmgr->pub.free_in_buffer = destmgr->buffer_size;
+}
+
+static void
+imf_jpeg_dest_mgr_init_destination(j_compress_ptr cinfo)
+{
+  imf_jpeg_dest_mgr_reserve(cinfo);
+}
+
+static boolean
+imf_jpeg_dest_mgr_empty_output_buffer(j_compress_ptr cinfo)
+{
+  imf_jpeg_dest_mgr_t *destmgr = IMF_JPEG_DEST_MGR(cinfo->dest);
+
+  /* libjpeg calls this when the buffer is full regardless of free_in_buffer */
+  imf_byte_sink_commit(destmgr->sink, destmgr->buffer_size);
+  imf_jpeg_dest_mgr_reserve(cinfo);
+
+  return TRUE;
+}
+
+static void
+imf_jpeg_dest_mgr_term_destination(j_compress_ptr cinfo)
+{
+  imf_jpeg_dest_mgr_t *destmgr = IMF_JPEG_DEST_MGR(cinfo->dest);
+
+  imf_byte_sink_commit(destmgr->sink, destmgr->buffer_size - destmgr->pub.free_in_buffer);
+  destmgr->buffer_size = destmgr->pub.free_in_buffer = 0;
+}
+
+static void
+init_destination_manager(j_compress_ptr cinfo, imf_jpeg_dest_mgr_t *destmgr, imf_byte_sink_t *sink)
+{
+  destmgr->sink = sink;
+  destmgr->buffer_size = 0;
+  destmgr->pub.init_destination = imf_jpeg_dest_mgr_init_destination;
+  destmgr->pub.empty_output_buffer = imf_jpeg_dest_mgr_empty_output_buffer;
+  destmgr->pub.term_destination = imf_jpeg_dest_mgr_term_destination;
+  destmgr->pub.next_output_byte = NULL;
+  destmgr->pub.free_in_buffer = 0;
+
+  cinfo->dest = &destmgr->pub;
+}
+
+typedef struct imf_jpeg_writer imf_jpeg_writer_t;
+struct imf_jpeg_writer {
+  struct jpeg_compress_struct cinfo;
+  imf_jpeg_dest_mgr_t destmgr;
+  imf_jpeg_error_mgr_t jerr;
+  imf_image_t const *img;
+  /* the true color image of an indexed one */
+  imf_image_t expanded;
+  imf_byte_sink_t *sink;
+  int quality;
+  int h_samp_factor;
+  int v_samp_factor;
+  bool optimize_coding;
+  bool progressive;
+  bool running;
+  bool started;
+  bool done;
+  bool failed;
+  volatile bool interrupted;
+};
+
+typedef struct imf_jpeg_subsampling imf_jpeg_subsampling_t;
+struct imf_jpeg_subsampling {
+  char const *name;
+  int h_samp_factor;
+  int v_samp_factor;
+};
+
+static imf_jpeg_subsampling_t const jpeg_subsamplings[] = {
+  { "4:2:0", 2, 2 },
+  { "4:2:2", 2, 1 },
+  { "4:4:0", 1, 2 },
+  { "4:4:4", 1, 1 },
+  { NULL, 0, 0 }
+};
+
+static void
+imf_jpeg_parse_save_options(imf_jpeg_writer_t *writer, VALUE opts)
+{
+  ID keys[4];
+  VALUE values[4];
+
+  writer->quality = 75;
+  writer->h_samp_factor = 2;
+  writer->v_samp_factor = 2;
+  writer->optimize_coding = false;
+  writer->progressive = false;
+
+  if (NIL_P(opts))
+    return;
+
+  keys[0] = id_quality;
+  keys[1] = id_subsampling;
+  keys[2] = id_optimize_coding;
+  keys[3] = id_progressive;
+  rb_get_kwargs(opts, keys, 0, 4, values);
+
+  if (values[0] != Qundef && !NIL_P(values[0])) {
+    int quality = NUM2INT(values[0]);
+    if (quality < 1 || 100 < quality)
+      rb_raise(rb_eArgError, "quality must be in 1..100 (%d given)", quality);
+    writer->quality = quality;
+  }
+  if (values[1] != Qundef && !NIL_P(values[1])) {
+    VALUE name = SYMBOL_P(values[1]) ? rb_sym2str(values[1]) : rb_check_string_type(values[1]);
+    imf_jpeg_subsampling_t const *ss = jpeg_subsamplings;
+    if (!NIL_P(name)) {
+      for (; ss->name != NULL; ++ss) {
+        if (strlen(ss->name) == (size_t) RSTRING_LEN(name) &&
+            memcmp(ss->name, RSTRING_PTR(name), RSTRING_LEN(name)) == 0)
+          break;
+      }
+    }
+    if (NIL_P(name) || ss->name == NULL)
+      rb_raise(rb_eArgError, "unknown subsampling: %"PRIsVALUE, rb_inspect(values[1]));
+    writer->h_samp_factor = ss->h_samp_factor;
+    writer->v_samp_factor = ss->v_samp_factor;
+  }
+  if (values[2] != Qundef)
+    writer->optimize_coding = RTEST(values[2]);
+  if (values[3] != Qundef)
+    writer->progressive = RTEST(values[3]);
+}
+
+static void *
+save_jpeg_scanlines_without_gvl(void *arg)
+{
+  imf_jpeg_writer_t *writer = (imf_jpeg_writer_t *) arg;
+  struct jpeg_compress_struct *cinfo = &writer->cinfo;
+  imf_image_t const *img = writer->img;
+  JSAMPROW rows[IMF_JPEG_SCANLINES_PER_CALL];
+
+  if (setjmp(writer->jerr.setjmp_buffer)) {
+    writer->failed = true;
+    return NULL;
+  }
+
+  if (!writer->started) {
+    jpeg_start_compress(cinfo, TRUE);
+    writer->started = true;
+  }
+
+  /* libjpeg reads the scanlines straight from the image buffer */
+  while (cinfo->next_scanline < cinfo->image_height) {
+    if (writer->interrupted)
+      return NULL;
+
+    JDIMENSION const y = cinfo->next_scanline;
+    JDIMENSION n = cinfo->image_height - y;
+    if (n > IMF_JPEG_SCANLINES_PER_CALL)
+      n = IMF_JPEG_SCANLINES_PER_CALL;
+
+    JDIMENSION i;
+    for (i = 0; i < n; ++i)
+      rows[i] = (JSAMPROW) (img->data + (y + i) * img->row_stride);
+
+    jpeg_write_scanlines(cinfo, rows, n);
+  }
+
+  jpeg_finish_compress(cinfo);
+  writer->done = true;
+
+  return NULL;
+}
+
+static void
+save_jpeg_scanlines_unblock(void *arg)
+{
+  imf_jpeg_writer_t *writer = (imf_jpeg_writer_t *) arg;
+  writer->interrupted = true;
+}
+
+static VALUE
+save_jpeg_body(VALUE arg)
+{
+  imf_jpeg_writer_t *writer = (imf_jpeg_writer_t *) arg;
+  struct jpeg_compress_struct *cinfo = &writer->cinfo;
+  imf_image_t const *img = writer->img;
+  J_COLOR_SPACE in_color_space;
+
+  if (img->color_space == IMF_COLOR_SPACE_INDEXED) {
+    imf_image_expand_palette(img, &writer->expanded);
+    img = writer->img = &writer->expanded;
+  }
+
+  if (img->component_size != sizeof(JSAMPLE))
+    rb_raise(rb_eArgError, "JPEG cannot store %d-bit components", 8 * (int) img->component_size);
+
+  switch (img->color_space) {
+    case IMF_COLOR_SPACE_GRAY:
+      if (IMF_IMAGE_HAS_ALPHA(img))
+        rb_raise(rb_eArgError, "JPEG cannot store the alpha channel of a grayscale image");
+      in_color_space = JCS_GRAYSCALE;
+      break;
+    case IMF_COLOR_SPACE_RGB:
+      if (!IMF_IMAGE_HAS_ALPHA(img)) {
+        in_color_space = JCS_RGB;
+        break;
+      }
+#ifdef JCS_EXTENSIONS
+      /* libjpeg-turbo skips the alpha channel by itself */
+      in_color_space = JCS_EXT_RGBA;
+      break;
+#else
+      rb_raise(rb_eArgError, "JPEG cannot store the alpha channel of an image");
+#endif
+    case IMF_COLOR_SPACE_YCBCR:
+      if (IMF_IMAGE_HAS_ALPHA(img))
+        rb_raise(rb_eArgError, "JPEG cannot store the alpha channel of a YCbCr image");
+      in_color_space = JCS_YCbCr;
+      break;
+    case IMF_COLOR_SPACE_CMYK:
+      in_color_space = JCS_CMYK;
+      break;
+    default:
+      rb_raise(rb_eArgError, "JPEG cannot store the color space of the image");
+  }
+
+  if (setjmp(writer->jerr.setjmp_buffer))
+    rb_raise(rb_eRuntimeError, "JPEG ERROR: %s", writer->jerr.message);
+
+  init_destination_manager(cinfo, &writer->destmgr, writer->sink);
+
+  /* img may be clobbered by longjmp */
+  cinfo->image_width = (JDIMENSION) writer->img->width;
+  cinfo->image_height = (JDIMENSION) writer->img->height;
+  cinfo->input_components = writer->img->pixel_channels;
+  cinfo->in_color_space = in_color_space;
+
+  jpeg_set_defaults(cinfo);
+  /* store CMYK as it is instead of the default YCCK */
+  if (in_color_space == JCS_CMYK)
+    jpeg_set_colorspace(cinfo, JCS_CMYK);
+  jpeg_set_quality(cinfo, writer->quality, TRUE);
+  if (cinfo->jpeg_color_space == JCS_YCbCr) {
+    cinfo->comp_info[0].h_samp_factor = writer->h_samp_factor;
+    cinfo->comp_info[0].v_samp_factor = writer->v_samp_factor;
+  }
+  cinfo->optimize_coding = writer->optimize_coding ? TRUE : FALSE;
+  if (writer->progressive)
+    jpeg_simple_progression(cinfo);
+
+  /* compress without the GVL */
+  writer->started = false;
+  writer->done = false;
+  writer->sink->without_gvl = true;
+  while (!writer->done && !writer->failed) {
+    writer->interrupted = false;
+    imf_call_without_gvl(save_jpeg_scanlines_without_gvl, writer, save_jpeg_scanlines_unblock, writer);
+    writer->sink->without_gvl = false;
+    rb_thread_check_ints();
+    writer->sink->without_gvl = true;
+  }
+  writer->sink->without_gvl = false;
+
+  if (writer->failed)
+    rb_raise(rb_eRuntimeError, "JPEG ERROR: %s", writer->jerr.message);
+
+  return Qnil;
+}
+
+static VALUE
+save_jpeg_ensure(VALUE arg)
+{
+  imf_jpeg_writer_t *writer = (imf_jpeg_writer_t *) arg;
+
+  writer->sink->without_gvl = false;
+  if (writer->running) {
+    jpeg_destroy_compress(&writer->cinfo);
+    writer->running = false;
+  }
+
+  if (writer->expanded.data != NULL)
+    imf_image_release(&writer->expanded);
+
+  return Qnil;
+}
+
+static void
+save_jpeg(imf_file_format_t *RB_UNUSED_VAR(base_fmt), imf_image_t const *img, imf_byte_sink_t *sink, VALUE opts)
+{
+  imf_jpeg_writer_t writer;
+  struct jpeg_compress_struct *cinfo;
+
+  assert(img != NULL);
+  assert(sink != NULL);
+
+  memset(&writer, 0, sizeof(writer));
+  writer.img = img;
+  writer.sink = sink;
+  imf_jpeg_parse_save_options(&writer, opts);
+
+  cinfo = &writer.cinfo;
+  cinfo->err = jpeg_std_error(&writer.jerr.pub);
+  cinfo->err->error_exit = jpeg_error_exit;
+
+  jpeg_create_compress(cinfo);
+  writer.running = true;
+
+  rb_ensure(save_jpeg_body, (VALUE) &writer, save_jpeg_ensure, (VALUE) &writer);
 }
 
 void
@@ -322,13 +1122,16 @@ Init_jpeg(void)
   mFileFormat = rb_const_get(imf_mIMF, rb_intern_const("FileFormat"));
   cBase = rb_const_get(mFileFormat, rb_intern_const("Base"));
   cJPEG = rb_define_class_under(mFileFormat, "JPEG", cBase);
-  cSourceManager = rb_define_class_under(cJPEG, "SourceManager", rb_cData);
 
   rb_define_alloc_func(cJPEG, jpeg_format_alloc);
 
   id_detect = rb_intern("detect");
   id_read = rb_intern("read");
   id_rewind = rb_intern("rewind");
+  id_quality = rb_intern("quality");
+  id_subsampling = rb_intern("subsampling");
+  id_optimize_coding = rb_intern("optimize_coding");
+  id_progressive = rb_intern("progressive");
 
-  imf_register_file_format(cJPEG, jpeg_format_extnames);
+  imf_register_file_format(cJPEG, jpeg_format_extnames, jpeg_format_magics);
 }
@@ -1,6 +1,8 @@
 #include "IMF.h"
 
 #include <png.h>
+#include <setjmp.h>
+#include <zlib.h>
 
 #ifndef HAVE_TYPE_PNG_ALLOC_SIZE_T
 typedef png_size_t png_alloc_size_t;
@@ -12,28 +14,56 @@ static size_t const PNG_MAGIC_LENGTH = sizeof(PNG_MAGIC_BYTES) - 1;
 static ID id_detect;
 static ID id_read;
 static ID id_rewind;
+static ID id_compression;
+static ID id_filter;
+static ID id_strategy;
+
+enum imf_png_format_constants {
+  IMF_PNG_ERROR_MESSAGE_SIZE = 256,
+};
 
 typedef struct imf_png_format imf_png_format_t;
 struct imf_png_format {
   imf_file_format_t base;
   imf_image_t *img;
   VALUE image_source;
-  VALUE buffer;
+  imf_byte_source_t *src;
   png_structp png_ptr;
   png_infop info_ptr;
   png_infop end_ptr;
+  size_t y;
+  size_t rows;
+  bool without_gvl;
+  /* running on a thread of IMF::Image.open_all, which cannot take the GVL
+   * for the warnings */
+  bool native_thread;
+  bool done;
+  bool failed;
+  volatile bool interrupted;
+  char error_message[IMF_PNG_ERROR_MESSAGE_SIZE];
 };
 
 static char const *const png_format_extnames[] = {
   ".png", NULL
 };
 
+static imf_file_format_magic_t const png_format_magics[] = {
+  { PNG_MAGIC_BYTES, NULL, sizeof(PNG_MAGIC_BYTES) - 1 },
+  { NULL, NULL, 0 }
+};
+
 static int detect_png(imf_file_format_t *fmt, VALUE image_source);
-static void load_png(imf_file_format_t *fmt, imf_image_t *img, VALUE image_source);
+static void load_png(imf_file_format_t *fmt, imf_image_t *img, VALUE image_source, imf_load_options_t const *opts);
+static void save_png(imf_file_format_t *fmt, imf_image_t const *img, imf_byte_sink_t *sink, VALUE opts);
+static void probe_png(imf_file_format_t *fmt, VALUE image_source, imf_image_t *img);
+static bool decode_png(imf_byte_source_t *src, imf_image_t *img, imf_load_options_t const *opts, imf_load_error_t *error);
 
 static imf_file_format_interface_t const png_format_interface = {
   detect_png,
-  load_png
+  load_png,
+  save_png,
+  probe_png,
+  decode_png
 };
 
 static void
@@ -41,7 +71,6 @@ png_format_mark(void *ptr)
 {
   imf_png_format_t *fmt = (imf_png_format_t *) ptr;
   rb_gc_mark(fmt->image_source);
-  rb_gc_mark(fmt->buffer);
   imf_file_format_mark(ptr);
 }
 
@@ -87,13 +116,10 @@ png_format_alloc(VALUE klass)
 static int
 detect_png(imf_file_format_t *fmt, VALUE image_source)
 {
-  VALUE magic_value;
-  char const *magic;
+  imf_byte_source_t *src = imf_image_source_get_byte_source(image_source);
+  uint8_t const *magic;
 
-  magic_value = rb_funcall(image_source, id_read, 1, INT2FIX(PNG_MAGIC_LENGTH));
-
-  magic = StringValuePtr(magic_value);
-  if (RSTRING_LEN(magic_value) == PNG_MAGIC_LENGTH &&
+  if (imf_byte_source_peek(src, PNG_MAGIC_LENGTH, &magic) == PNG_MAGIC_LENGTH &&
       memcmp(PNG_MAGIC_BYTES, magic, PNG_MAGIC_LENGTH) == 0)
     return 1;
   return 0;
@@ -102,25 +128,49 @@ detect_png(imf_file_format_t *fmt, VALUE image_source)
 static void
 imf_png_error(png_structp png_ptr, png_const_charp msg)
 {
-  rb_raise(rb_eRuntimeError, "PNG ERROR: %s", msg);
+  imf_png_format_t *fmt = (imf_png_format_t *) png_get_error_ptr(png_ptr);
+
+  /* We may be running without the GVL here, so we cannot raise directly.
+   * Save the message and unwind to the setjmp point in the caller. */
+  strncpy(fmt->error_message, msg, IMF_PNG_ERROR_MESSAGE_SIZE - 1);
+  fmt->error_message[IMF_PNG_ERROR_MESSAGE_SIZE - 1] = '\0';
+  fmt->failed = true;
+
+  png_longjmp(png_ptr, 1);
+}
+
+static void *
+imf_png_warning_with_gvl(void *msg)
+{
+  rb_warn("PNG WARNING: %s", (char const *) msg);
+  return NULL;
 }
 
 static void
 imf_png_warning(png_structp png_ptr, png_const_charp msg)
 {
-  rb_warn("PNG WARNING: %s", msg);
+  imf_png_format_t *fmt = (imf_png_format_t *) png_get_error_ptr(png_ptr);
+
+  if (fmt->native_thread)
+    return;
+  if (fmt->without_gvl)
+    imf_call_with_gvl(imf_png_warning_with_gvl, (void *) msg);
+  else
+    imf_png_warning_with_gvl((void *) msg);
 }
 
+/* libpng allocates zlib's inflate state while reading rows, and that happens
+ * without the GVL, so we cannot use xmalloc here. */
 static png_voidp
 imf_png_malloc(png_structp RB_UNUSED_VAR(png_ptr), png_alloc_size_t size)
 {
-  return xmalloc(size);
+  return malloc(size);
 }
 
 static void
 imf_png_free(png_structp RB_UNUSED_VAR(png_ptr), png_voidp ptr)
 {
-  xfree(ptr);
+  free(ptr);
 }
 
 #ifdef PNG_USER_MEM_SUPPORTED
@@ -139,20 +189,27 @@ imf_png_free(png_structp RB_UNUSED_VAR(png_ptr), png_voidp ptr)
   }
 #endif
 
+/* Returns NULL if out of memory.  This can be called without the GVL. */
 static inline png_structp
-imf_png_create_read_struct(imf_png_format_t *fmt)
+imf_png_try_create_read_struct(imf_png_format_t *fmt)
 {
-  png_structp png_ptr;
-
 #ifdef PNG_USER_MEM_SUPPORTED
-  png_ptr = png_create_read_struct_2(
+  return png_create_read_struct_2(
     PNG_LIBPNG_VER_STRING,
     (png_voidp) fmt, imf_png_error, imf_png_warning,
     NULL, imf_png_malloc, imf_png_free
   );
 #else
-  IMF_PNG_TRY_WITH_GC(png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, fmt, imf_png_error, imf_png_warning));
+  return png_create_read_struct(PNG_LIBPNG_VER_STRING, fmt, imf_png_error, imf_png_warning);
 #endif
+}
+
+static inline png_structp
+imf_png_create_read_struct(imf_png_format_t *fmt)
+{
+  png_structp png_ptr;
+
+  IMF_PNG_TRY_WITH_GC(png_ptr = imf_png_try_create_read_struct(fmt));
 
   return png_ptr;
 }
@@ -173,31 +230,53 @@ imf_png_read_data(png_structp png_ptr, png_bytep data, png_size_t length)
   png_voidp read_io_ptr = png_get_io_ptr(png_ptr);
   imf_png_format_t *fmt = (imf_png_format_t *) read_io_ptr;
 
-  VALUE read_data = rb_funcall(fmt->image_source, id_read, 1, SIZET2NUM(length));
-  memcpy(data, RSTRING_PTR(read_data), length);
+  if (imf_byte_source_read_into(fmt->src, data, length) < length)
+    png_error(png_ptr, "unexpected end of data");
 }
 
-
-static VALUE
-load_png_body(VALUE arg)
+static void *
+load_png_rows_without_gvl(void *arg)
 {
   imf_png_format_t *fmt = (imf_png_format_t *) arg;
-  imf_image_t *img;
-  volatile VALUE buffer;
-  png_bytep buffer_ptr;
+  imf_image_t *img = fmt->img;
 
-  assert(fmt != NULL);
-  assert(fmt->img != NULL);
-  assert(!NIL_P(fmt->image_source));
-  assert(rb_obj_is_kind_of(fmt->image_source, imf_cIMF_ImageSource));
+  if (setjmp(png_jmpbuf(fmt->png_ptr)))
+    return NULL;
 
-  img = fmt->img;
+  /* libpng writes each row straight into the image buffer.  For interlaced
+   * images every pass revisits all rows, merging its pixels in place. */
+  while (fmt->y < fmt->rows) {
+    if (fmt->interrupted)
+      return NULL;
 
-  fmt->png_ptr = imf_png_create_read_struct(fmt);
-  IMF_PNG_TRY_WITH_GC(fmt->info_ptr = png_create_info_struct(fmt->png_ptr));
-  IMF_PNG_TRY_WITH_GC(fmt->end_ptr = png_create_info_struct(fmt->png_ptr));
+    png_bytep row_ptr = (png_bytep) img->data + (fmt->y % img->height) * img->row_stride;
+    png_read_row(fmt->png_ptr, row_ptr, NULL);
 
-  png_set_read_fn(fmt->png_ptr, (png_voidp) fmt, imf_png_read_data);
+    ++fmt->y;
+  }
+
+  png_read_end(fmt->png_ptr, fmt->end_ptr);
+  fmt->done = true;
+
+  return NULL;
+}
+
+static void
+load_png_rows_unblock(void *arg)
+{
+  imf_png_format_t *fmt = (imf_png_format_t *) arg;
+  fmt->interrupted = true;
+}
+
+
+/* Reads the chunks up to the first IDAT, and sets up the image and the
+ * transformations of libpng for its layout.  Returns the number of the
+ * interlace passes.  The errors are raised by png_error, so that this can
+ * be called without the GVL. */
+static int
+load_png_read_header(imf_png_format_t *fmt)
+{
+  imf_image_t *img = fmt->img;
 
   png_read_info(fmt->png_ptr, fmt->info_ptr);
 
@@ -221,14 +300,12 @@ load_png_body(VALUE arg)
   if (bit_depth <= 8)
     img->component_size = 1;
   else {
-    /* assume bit_depth == 16 here */
-#if PNG_LIBPNG_VER >= 10504
-    png_set_scale_16(fmt->png_ptr);
-#else
-    png_set_strip_16(fmt->png_ptr);
+    /* 16-bit components are kept in the native byte order.  libpng swaps
+     * the bytes of each row as it is decoded. */
+    img->component_size = 2;
+#ifndef WORDS_BIGENDIAN
+    png_set_swap(fmt->png_ptr);
 #endif
-    /* TODO: Support bit_depth == 16 */
-    /* img->component_size = 2; */
   }
 
   int png_channels;
@@ -248,9 +325,17 @@ load_png_body(VALUE arg)
       png_channels = 2;
       break;
     case PNG_COLOR_TYPE_PALETTE:
-      /* TODO: Support palette directly. */
-      png_set_palette_to_rgb(fmt->png_ptr);
-      /* pass through */
+      /* keep the indices, unpacked into a byte for each */
+      img->color_space = IMF_COLOR_SPACE_INDEXED;
+      if (png_get_valid(fmt->png_ptr, fmt->info_ptr, PNG_INFO_tRNS))
+        IMF_IMAGE_SET_ALPHA(img);
+      else
+        IMF_IMAGE_UNSET_ALPHA(img);
+      img->pixel_channels = 1;
+      if (bit_depth < 8)
+        png_set_packing(fmt->png_ptr);
+      png_channels = 1;
+      break;
     case PNG_COLOR_TYPE_RGB:
       img->color_space = IMF_COLOR_SPACE_RGB;
       IMF_IMAGE_UNSET_ALPHA(img);
@@ -263,41 +348,107 @@ load_png_body(VALUE arg)
       img->pixel_channels = 4;
       png_channels = 4;
       break;
-    default:
-      rb_raise(rb_eRuntimeError, "libpng: unknown color_type is given (%d)", color_type);
+    default: {
+      char message[64];
+      snprintf(message, sizeof(message), "unknown color_type is given (%d)", color_type);
+      png_error(fmt->png_ptr, message);
+    }
   }
 
+  int const passes = png_set_interlace_handling(fmt->png_ptr);
+
   png_read_update_info(fmt->png_ptr, fmt->info_ptr);
 
+  return passes;
+}
+
+/* Copies PLTE and tRNS chunks into the palette of the image */
+static void
+load_png_read_palette(imf_png_format_t *fmt)
+{
+  imf_image_t *img = fmt->img;
+  png_colorp colors;
+  int num_colors, i;
+
+  if (!png_get_PLTE(fmt->png_ptr, fmt->info_ptr, &colors, &num_colors) || num_colors <= 0)
+    png_error(fmt->png_ptr, "missing PLTE chunk");
+  if (num_colors > IMF_IMAGE_PALETTE_CAPACITY)
+    num_colors = IMF_IMAGE_PALETTE_CAPACITY;
+
+  if (!imf_image_try_allocate_palette(img, (size_t) num_colors))
+    png_error(fmt->png_ptr, "failed to allocate the palette");
+  for (i = 0; i < num_colors; ++i) {
+    img->palette[i][0] = colors[i].red;
+    img->palette[i][1] = colors[i].green;
+    img->palette[i][2] = colors[i].blue;
+  }
+
+  if (IMF_IMAGE_HAS_ALPHA(img)) {
+    png_bytep trans_alpha;
+    int num_trans;
+    png_color_16p RB_UNUSED_VAR(trans_color);
+
+    if (png_get_tRNS(fmt->png_ptr, fmt->info_ptr, &trans_alpha, &num_trans, &trans_color)) {
+      for (i = 0; i < num_trans && i < num_colors; ++i)
+        img->palette[i][3] = trans_alpha[i];
+    }
+  }
+}
+
+static VALUE
+load_png_body(VALUE arg)
+{
+  imf_png_format_t *fmt = (imf_png_format_t *) arg;
+  imf_image_t *img;
+
+  assert(fmt != NULL);
+  assert(fmt->img != NULL);
+  assert(!NIL_P(fmt->image_source));
+  assert(rb_obj_is_kind_of(fmt->image_source, imf_cIMF_ImageSource));
+
+  img = fmt->img;
+
+  fmt->src = imf_image_source_get_byte_source(fmt->image_source);
+
+  /* Sources that need Ruby to produce bytes read the whole compressed data
+   * up front, so that we can decode it without calling back into Ruby. */
+  imf_byte_source_prepare_without_gvl(fmt->src);
+
+  fmt->png_ptr = imf_png_create_read_struct(fmt);
+  IMF_PNG_TRY_WITH_GC(fmt->info_ptr = png_create_info_struct(fmt->png_ptr));
+  IMF_PNG_TRY_WITH_GC(fmt->end_ptr = png_create_info_struct(fmt->png_ptr));
+
+  if (setjmp(png_jmpbuf(fmt->png_ptr)))
+    rb_raise(rb_eRuntimeError, "PNG ERROR: %s", fmt->error_message);
+
+  png_set_read_fn(fmt->png_ptr, (png_voidp) fmt, imf_png_read_data);
+
+  int const passes = load_png_read_header(fmt);
+
+  if (img->color_space == IMF_COLOR_SPACE_INDEXED)
+    load_png_read_palette(fmt);
+
   imf_image_allocate_image_buffer(img);
+  assert(png_get_rowbytes(fmt->png_ptr, fmt->info_ptr) <= (size_t) img->row_stride);
 
 #ifdef PNG_SEQUENTIAL_READ_SUPPORTED
-  /* allocate temporary scanline buffer */
-  size_t const rowbytes = png_get_rowbytes(fmt->png_ptr, fmt->info_ptr);
-  fmt->buffer = rb_str_tmp_new(rowbytes);
-  buffer_ptr = (png_bytep) RSTRING_PTR(fmt->buffer);
-
-  size_t const pixel_size = img->pixel_channels * img->component_size;
-  size_t const row_size = pixel_size * img->width;
-  uint8_t *row_base_ptr = img->data;
-  size_t y = 0;
-  while (y < height) {
-    png_read_row(fmt->png_ptr, buffer_ptr, NULL);
-
-    memcpy(row_base_ptr, buffer_ptr, row_size);
-
-    row_base_ptr += img->row_stride;
-    ++y;
+  /* decode rows without the GVL */
+  fmt->y = 0;
+  fmt->rows = (size_t) passes * img->height;
+  fmt->done = false;
+  fmt->without_gvl = true;
+  while (!fmt->done && !fmt->failed) {
+    fmt->interrupted = false;
+    imf_call_without_gvl(load_png_rows_without_gvl, fmt, load_png_rows_unblock, fmt);
+    rb_thread_check_ints();
   }
+  fmt->without_gvl = false;
 #else
 # error === PNG_SEQUENTIAL_READ_SUPPORTED is undefined ===
 #endif
 
-  /* release temporary buffer memory */
-  buffer_ptr = NULL;
-  rb_str_resize(fmt->buffer, 0L);
-
-  png_read_end(fmt->png_ptr, fmt->end_ptr);
+  if (fmt->failed)
+    rb_raise(rb_eRuntimeError, "PNG ERROR: %s", fmt->error_message);
 
   return Qnil;
 }
@@ -317,10 +468,8 @@ load_png_ensure(VALUE arg)
 }
 
 static void
-load_png(imf_file_format_t *base_fmt, imf_image_t *img, VALUE image_source)
+png_format_setup(imf_png_format_t *fmt, imf_image_t *img, VALUE image_source)
 {
-  imf_png_format_t *fmt = (imf_png_format_t *) base_fmt;
-
   assert(fmt != NULL);
   assert(img != NULL);
 
@@ -330,13 +479,404 @@ load_png(imf_file_format_t *base_fmt, imf_image_t *img, VALUE image_source)
 
   fmt->img = img;
   fmt->image_source = image_source;
+  fmt->src = NULL;
   fmt->png_ptr = NULL;
   fmt->info_ptr = NULL;
   fmt->end_ptr = NULL;
+  fmt->without_gvl = false;
+  fmt->native_thread = false;
+  fmt->failed = false;
+  fmt->error_message[0] = '\0';
+}
+
+static void
+load_png(imf_file_format_t *base_fmt, imf_image_t *img, VALUE image_source, imf_load_options_t const *RB_UNUSED_VAR(opts))
+{
+  imf_png_format_t *fmt = (imf_png_format_t *) base_fmt;
 
+  png_format_setup(fmt, img, image_source);
   rb_ensure(load_png_body, (VALUE)fmt, load_png_ensure, (VALUE)fmt);
 }
 
+static VALUE
+probe_png_body(VALUE arg)
+{
+  imf_png_format_t *fmt = (imf_png_format_t *) arg;
+
+  /* Read the header through the byte source as it is, because reading
+   * the whole data up front is what probing should avoid. */
+  fmt->src = imf_image_source_get_byte_source(fmt->image_source);
+
+  fmt->png_ptr = imf_png_create_read_struct(fmt);
+  IMF_PNG_TRY_WITH_GC(fmt->info_ptr = png_create_info_struct(fmt->png_ptr));
+  IMF_PNG_TRY_WITH_GC(fmt->end_ptr = png_create_info_struct(fmt->png_ptr));
+
+  if (setjmp(png_jmpbuf(fmt->png_ptr)))
+    rb_raise(rb_eRuntimeError, "PNG ERROR: %s", fmt->error_message);
+
+  png_set_read_fn(fmt->png_ptr, (png_voidp) fmt, imf_png_read_data);
+
+  load_png_read_header(fmt);
+
+  return Qnil;
+}
+
+static void
+probe_png(imf_file_format_t *base_fmt, VALUE image_source, imf_image_t *img)
+{
+  imf_png_format_t *fmt = (imf_png_format_t *) base_fmt;
+
+  png_format_setup(fmt, img, image_source);
+  rb_ensure(probe_png_body, (VALUE)fmt, load_png_ensure, (VALUE)fmt);
+}
+
+static bool
+decode_png_body(imf_png_format_t *fmt, imf_load_error_t *error)
+{
+  imf_image_t *img = fmt->img;
+  int passes;
+
+  if (setjmp(png_jmpbuf(fmt->png_ptr)))
+    return imf_load_error_set(error, rb_eRuntimeError, "PNG ERROR: %s", fmt->error_message);
+
+  png_set_read_fn(fmt->png_ptr, (png_voidp) fmt, imf_png_read_data);
+
+  passes = load_png_read_header(fmt);
+
+  if (img->color_space == IMF_COLOR_SPACE_INDEXED)
+    load_png_read_palette(fmt);
+
+  if (!imf_image_try_allocate_image_buffer(img))
+    return imf_load_error_set(error, rb_eNoMemError, "failed to allocate memory for the image");
+
+  fmt->y = 0;
+  fmt->rows = (size_t) passes * img->height;
+  load_png_rows_without_gvl(fmt);
+
+  if (fmt->failed)
+    return imf_load_error_set(error, rb_eRuntimeError, "PNG ERROR: %s", fmt->error_message);
+
+  return true;
+}
+
+/* Decodes the source on a thread of IMF::Image.open_all */
+static bool
+decode_png(imf_byte_source_t *src, imf_image_t *img, imf_load_options_t const *RB_UNUSED_VAR(opts), imf_load_error_t *error)
+{
+  imf_png_format_t fmt;
+  bool success;
+
+  memset(&fmt, 0, sizeof(fmt));
+  fmt.img = img;
+  fmt.image_source = Qnil;
+  fmt.src = src;
+  fmt.native_thread = true;
+
+  fmt.png_ptr = imf_png_try_create_read_struct(&fmt);
+  if (fmt.png_ptr == NULL ||
+      (fmt.info_ptr = png_create_info_struct(fmt.png_ptr)) == NULL ||
+      (fmt.end_ptr = png_create_info_struct(fmt.png_ptr)) == NULL)
+    success = imf_load_error_set(error, rb_eNoMemError, "failed to allocate memory for libpng");
+  else
+    success = decode_png_body(&fmt, error);
+
+  png_destroy_read_struct(&fmt.png_ptr, &fmt.info_ptr, &fmt.end_ptr);
+
+  return success;
+}
+
+/* PNG encoder */
+
+typedef struct imf_png_writer imf_png_writer_t;
+struct imf_png_writer {
+  imf_image_t const *img;
+  imf_byte_sink_t *sink;
+  png_structp png_ptr;
+  png_infop info_ptr;
+  int compression_level;
+  int filters;
+  int strategy;
+  size_t y;
+  bool done;
+  bool failed;
+  volatile bool interrupted;
+  char error_message[IMF_PNG_ERROR_MESSAGE_SIZE];
+};
+
+static void
+imf_png_write_error(png_structp png_ptr, png_const_charp msg)
+{
+  imf_png_writer_t *writer = (imf_png_writer_t *) png_get_error_ptr(png_ptr);
+
+  strncpy(writer->error_message, msg, IMF_PNG_ERROR_MESSAGE_SIZE - 1);
+  writer->error_message[IMF_PNG_ERROR_MESSAGE_SIZE - 1] = '\0';
+  writer->failed = true;
+
+  png_longjmp(png_ptr, 1);
+}
+
+static void
+imf_png_write_warning(png_structp png_ptr, png_const_charp msg)
+{
+  imf_png_writer_t *writer = (imf_png_writer_t *) png_get_error_ptr(png_ptr);
+
+  if (writer->sink->without_gvl)
+    imf_call_with_gvl(imf_png_warning_with_gvl, (void *) msg);
+  else
+    imf_png_warning_with_gvl((void *) msg);
+}
+
+static void
+imf_png_write_data(png_structp png_ptr, png_bytep data, png_size_t length)
+{
+  imf_png_writer_t *writer = (imf_png_writer_t *) png_get_io_ptr(png_ptr);
+
+  if (!imf_byte_sink_write(writer->sink, data, length))
+    png_error(png_ptr, "failed to write data");
+}
+
+static void
+imf_png_flush_data(png_structp png_ptr)
+{
+  /* The sink is flushed when the encoding finishes */
+}
+
+typedef struct imf_png_option imf_png_option_t;
+struct imf_png_option {
+  char const *name;
+  ID id;
+  int value;
+};
+
+static imf_png_option_t png_filters[] = {
+  { "adaptive", 0, PNG_ALL_FILTERS },
+  { "none",     0, PNG_FILTER_NONE },
+  { "sub",      0, PNG_FILTER_SUB },
+  { "up",       0, PNG_FILTER_UP },
+  { "average",  0, PNG_FILTER_AVG },
+  { "paeth",    0, PNG_FILTER_PAETH },
+  { NULL, 0, 0 }
+};
+
+static imf_png_option_t png_strategies[] = {
+  { "default",      0, Z_DEFAULT_STRATEGY },
+  { "filtered",     0, Z_FILTERED },
+  { "huffman_only", 0, Z_HUFFMAN_ONLY },
+  { "rle",          0, Z_RLE },
+  { "fixed",        0, Z_FIXED },
+  { NULL, 0, 0 }
+};
+
+static int
+imf_png_lookup_option(VALUE value, char const *option, imf_png_option_t const *table)
+{
+  ID id = SYMBOL_P(value) ? SYM2ID(value) : 0;
+
+  for (; table->name != NULL; ++table) {
+    if (table->id == id)
+      return table->value;
+  }
+  rb_raise(rb_eArgError, "unknown %s: %"PRIsVALUE, option, rb_inspect(value));
+}
+
+static void
+imf_png_parse_save_options(imf_png_writer_t *writer, VALUE opts)
+{
+  ID keys[3];
+  VALUE values[3];
+
+  writer->compression_level = Z_DEFAULT_COMPRESSION;
+  writer->filters = -1;
+  writer->strategy = -1;
+
+  if (NIL_P(opts))
+    return;
+
+  keys[0] = id_compression;
+  keys[1] = id_filter;
+  keys[2] = id_strategy;
+  rb_get_kwargs(opts, keys, 0, 3, values);
+
+  if (values[0] != Qundef && !NIL_P(values[0])) {
+    int level = NUM2INT(values[0]);
+    if (level < 0 || 9 < level)
+      rb_raise(rb_eArgError, "compression must be in 0..9 (%d given)", level);
+    writer->compression_level = level;
+  }
+  if (values[1] != Qundef && !NIL_P(values[1]))
+    writer->filters = imf_png_lookup_option(values[1], "filter", png_filters);
+  if (values[2] != Qundef && !NIL_P(values[2]))
+    writer->strategy = imf_png_lookup_option(values[2], "strategy", png_strategies);
+}
+
+static void *
+save_png_rows_without_gvl(void *arg)
+{
+  imf_png_writer_t *writer = (imf_png_writer_t *) arg;
+  imf_image_t const *img = writer->img;
+
+  if (setjmp(png_jmpbuf(writer->png_ptr)))
+    return NULL;
+
+  /* libpng reads each row straight from the image buffer */
+  while (writer->y < img->height) {
+    if (writer->interrupted)
+      return NULL;
+
+    png_write_row(writer->png_ptr, (png_const_bytep) (img->data + writer->y * img->row_stride));
+    ++writer->y;
+  }
+
+  png_write_end(writer->png_ptr, NULL);
+  writer->done = true;
+
+  return NULL;
+}
+
+static void
+save_png_rows_unblock(void *arg)
+{
+  imf_png_writer_t *writer = (imf_png_writer_t *) arg;
+  writer->interrupted = true;
+}
+
+/* Sets PLTE, and tRNS up to the last translucent entry */
+static void
+save_png_set_palette(imf_png_writer_t *writer)
+{
+  imf_image_t const *img = writer->img;
+  png_color colors[IMF_IMAGE_PALETTE_CAPACITY] = { { 0, 0, 0 } };
+  png_byte trans_alpha[IMF_IMAGE_PALETTE_CAPACITY];
+  int const num_colors = (int) img->palette_size;
+  int num_trans = 0, i;
+
+  for (i = 0; i < num_colors; ++i) {
+    colors[i].red = img->palette[i][0];
+    colors[i].green = img->palette[i][1];
+    colors[i].blue = img->palette[i][2];
+    trans_alpha[i] = img->palette[i][3];
+    if (trans_alpha[i] != 0xFF)
+      num_trans = i + 1;
+  }
+
+  png_set_PLTE(writer->png_ptr, writer->info_ptr, colors, num_colors);
+  if (IMF_IMAGE_HAS_ALPHA(img) && num_trans > 0)
+    png_set_tRNS(writer->png_ptr, writer->info_ptr, trans_alpha, num_trans, NULL);
+}
+
+static VALUE
+save_png_body(VALUE arg)
+{
+  imf_png_writer_t *writer = (imf_png_writer_t *) arg;
+  imf_image_t const *img = writer->img;
+  int color_type;
+
+  switch (img->color_space) {
+    case IMF_COLOR_SPACE_GRAY:
+      color_type = IMF_IMAGE_HAS_ALPHA(img) ? PNG_COLOR_TYPE_GRAY_ALPHA : PNG_COLOR_TYPE_GRAY;
+      break;
+    case IMF_COLOR_SPACE_RGB:
+      color_type = IMF_IMAGE_HAS_ALPHA(img) ? PNG_COLOR_TYPE_RGB_ALPHA : PNG_COLOR_TYPE_RGB;
+      break;
+    case IMF_COLOR_SPACE_INDEXED:
+      color_type = PNG_COLOR_TYPE_PALETTE;
+      break;
+    default:
+      rb_raise(rb_eArgError, "PNG cannot store the color space of the image");
+  }
+
+#ifdef PNG_USER_MEM_SUPPORTED
+  writer->png_ptr = png_create_write_struct_2(
+    PNG_LIBPNG_VER_STRING,
+    (png_voidp) writer, imf_png_write_error, imf_png_write_warning,
+    NULL, imf_png_malloc, imf_png_free
+  );
+#else
+  IMF_PNG_TRY_WITH_GC(writer->png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, writer, imf_png_write_error, imf_png_write_warning));
+#endif
+  if (writer->png_ptr == NULL)
+    rb_memerror();
+  IMF_PNG_TRY_WITH_GC(writer->info_ptr = png_create_info_struct(writer->png_ptr));
+
+  if (setjmp(png_jmpbuf(writer->png_ptr)))
+    rb_raise(rb_eRuntimeError, "PNG ERROR: %s", writer->error_message);
+
+  png_set_write_fn(writer->png_ptr, (png_voidp) writer, imf_png_write_data, imf_png_flush_data);
+
+  /* deflate into larger chunks to reduce the number of writes */
+  png_set_compression_buffer_size(writer->png_ptr, 65536);
+  png_set_compression_level(writer->png_ptr, writer->compression_level);
+  if (writer->strategy >= 0)
+    png_set_compression_strategy(writer->png_ptr, writer->strategy);
+  if (writer->filters >= 0)
+    png_set_filter(writer->png_ptr, PNG_FILTER_TYPE_BASE, writer->filters);
+
+  png_set_IHDR(
+    writer->png_ptr, writer->info_ptr,
+    (png_uint_32) img->width, (png_uint_32) img->height,
+    8 * img->component_size, color_type,
+    PNG_INTERLACE_NONE,
+    PNG_COMPRESSION_TYPE_BASE,
+    PNG_FILTER_TYPE_BASE);
+
+  if (color_type == PNG_COLOR_TYPE_PALETTE)
+    save_png_set_palette(writer);
+
+  png_write_info(writer->png_ptr, writer->info_ptr);
+
+#ifndef WORDS_BIGENDIAN
+  /* 16-bit components are stored in the native byte order */
+  if (img->component_size == 2)
+    png_set_swap(writer->png_ptr);
+#endif
+
+  /* encode rows without the GVL */
+  writer->y = 0;
+  writer->done = false;
+  writer->sink->without_gvl = true;
+  while (!writer->done && !writer->failed) {
+    writer->interrupted = false;
+    imf_call_without_gvl(save_png_rows_without_gvl, writer, save_png_rows_unblock, writer);
+    writer->sink->without_gvl = false;
+    rb_thread_check_ints();
+    writer->sink->without_gvl = true;
+  }
+  writer->sink->without_gvl = false;
+
+  if (writer->failed)
+    rb_raise(rb_eRuntimeError, "PNG ERROR: %s", writer->error_message);
+
+  return Qnil;
+}
+
+static VALUE
+save_png_ensure(VALUE arg)
+{
+  imf_png_writer_t *writer = (imf_png_writer_t *) arg;
+
+  writer->sink->without_gvl = false;
+  if (writer->png_ptr != NULL)
+    png_destroy_write_struct(&writer->png_ptr, &writer->info_ptr);
+
+  return Qnil;
+}
+
+static void
+save_png(imf_file_format_t *RB_UNUSED_VAR(base_fmt), imf_image_t const *img, imf_byte_sink_t *sink, VALUE opts)
+{
+  imf_png_writer_t writer;
+
+  assert(img != NULL);
+  assert(sink != NULL);
+
+  memset(&writer, 0, sizeof(writer));
+  writer.img = img;
+  writer.sink = sink;
+  imf_png_parse_save_options(&writer, opts);
+
+  rb_ensure(save_png_body, (VALUE) &writer, save_png_ensure, (VALUE) &writer);
+}
+
 void
 Init_png(void)
 {
@@ -351,6 +891,17 @@ Init_png(void)
   id_detect = rb_intern("detect");
   id_read = rb_intern("read");
   id_rewind = rb_intern("rewind");
+  id_compression = rb_intern("compression");
+  id_filter = rb_intern("filter");
+  id_strategy = rb_intern("strategy");
+
+  {
+    size_t i;
+    for (i = 0; png_filters[i].name != NULL; ++i)
+      png_filters[i].id = rb_intern(png_filters[i].name);
+    for (i = 0; png_strategies[i].name != NULL; ++i)
+      png_strategies[i].id = rb_intern(png_strategies[i].name);
+  }
 
-  imf_register_file_format(cPNG, png_format_extnames);
+  imf_register_file_format(cPNG, png_format_extnames, png_format_magics);
 }
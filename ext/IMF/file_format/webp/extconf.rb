@@ -2,4 +2,11 @@ require 'mkmf'
 
 $CFLAGS += " -I#{File.expand_path('../../../include', __FILE__)}"
 
-create_makefile('IMF/fileformat/webp')
+dir_config('webp')
+
+unless have_header('webp/decode.h') && have_library('webp', 'WebPGetDecoderVersion', 'webp/decode.h')
+  $stderr.puts 'libwebp is required'
+  abort
+end
+
+create_makefile('IMF/file_format/webp')
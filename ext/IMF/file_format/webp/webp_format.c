@@ -1,5 +1,7 @@
 #include "IMF.h"
 
+#include <webp/decode.h>
+
 static size_t const WEBP_PREFIX_LENGTH = 16;
 
 static char const WEBP_MAGIC1_BYTES[] = "RIFF";
@@ -26,17 +28,58 @@ struct imf_webp_format {
   imf_image_t *img;
   VALUE image_source;
   VALUE buffer;
+  imf_load_options_t const *opts;
+
+  imf_byte_source_t *src;
+  WebPDecoderConfig config;
+  WebPIDecoder *idec;
+  VP8StatusCode status;
+  /* the region of the image, and the box around it decoded into the
+   * scratch buffer (box_width is 0 if the rows are decoded straight into
+   * the image buffer) */
+  size_t region_x;
+  size_t region_y;
+  size_t box_x;
+  size_t box_y;
+  size_t box_width;
+  size_t box_height;
+  uint8_t *scratch;
+  bool done;
+  volatile bool interrupted;
 };
 
+/* The compressed data is fed to the incremental decoder by this size, so
+ * that reading the file and decoding the rows are interleaved. */
+static size_t const IMF_WEBP_CHUNK_SIZE = 64 * 1024;
+
 static char const *const webp_format_extnames[] = {
   ".webp", NULL
 };
 
+/* "RIFF" <size> "WEBP" "VP8" followed by ' ', 'X', or 'L' */
+#define WEBP_MAGIC_MASK "\xFF\xFF\xFF\xFF\x00\x00\x00\x00\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF"
+
+static imf_file_format_magic_t const webp_format_magics[] = {
+  { "RIFF\0\0\0\0WEBPVP8 ", WEBP_MAGIC_MASK, 16 },
+  { "RIFF\0\0\0\0WEBPVP8X", WEBP_MAGIC_MASK, 16 },
+  { "RIFF\0\0\0\0WEBPVP8L", WEBP_MAGIC_MASK, 16 },
+  { NULL, NULL, 0 }
+};
+
+/* The RIFF header, the first chunk header, and the bitstream header in it */
+static size_t const WEBP_HEADER_LENGTH = 30;
+
 static int detect_webp(imf_file_format_t *fmt, VALUE image_source);
+static void load_webp(imf_file_format_t *fmt, imf_image_t *img, VALUE image_source, imf_load_options_t const *opts);
+static void probe_webp(imf_file_format_t *fmt, VALUE image_source, imf_image_t *img);
+static bool decode_webp(imf_byte_source_t *src, imf_image_t *img, imf_load_options_t const *opts, imf_load_error_t *error);
 
 static imf_file_format_interface_t const webp_format_interface = {
   detect_webp,
-  NULL
+  load_webp,
+  NULL,
+  probe_webp,
+  decode_webp
 };
 
 static void
@@ -90,13 +133,10 @@ webp_format_alloc(VALUE klass)
 static int
 detect_webp(imf_file_format_t *fmt, VALUE image_source)
 {
-  VALUE magic_value;
-  char const *magic;
+  imf_byte_source_t *src = imf_image_source_get_byte_source(image_source);
+  uint8_t const *magic;
 
-  magic_value = rb_funcall(image_source, id_read, 1, INT2FIX(WEBP_PREFIX_LENGTH));
-
-  magic = StringValuePtr(magic_value);
-  if (RSTRING_LEN(magic_value) < WEBP_PREFIX_LENGTH)
+  if (imf_byte_source_peek(src, WEBP_PREFIX_LENGTH, &magic) < WEBP_PREFIX_LENGTH)
     return 0;
 
   if (memcmp(WEBP_MAGIC1_BYTES, magic + WEBP_MAGIC1_START, WEBP_MAGIC1_LENGTH) != 0)
@@ -114,6 +154,395 @@ detect_webp(imf_file_format_t *fmt, VALUE image_source)
   return 1;
 }
 
+static inline uint32_t
+webp_get_le16(uint8_t const *p)
+{
+  return (uint32_t) p[0] | ((uint32_t) p[1] << 8);
+}
+
+static inline uint32_t
+webp_get_le24(uint8_t const *p)
+{
+  return webp_get_le16(p) | ((uint32_t) p[2] << 16);
+}
+
+static inline uint32_t
+webp_get_le32(uint8_t const *p)
+{
+  return webp_get_le24(p) | ((uint32_t) p[3] << 24);
+}
+
+/* Parses the header of the first chunk, which is one of the lossy
+ * bitstream (VP8), the lossless bitstream (VP8L), and the extended
+ * format header (VP8X).  This can be called without the GVL. */
+static bool
+webp_read_header(imf_byte_source_t *src, imf_image_t *img, imf_load_error_t *error)
+{
+  uint8_t const *header;
+  uint8_t const *data;
+  uint32_t width, height;
+  bool has_alpha;
+
+  if (imf_byte_source_peek(src, WEBP_HEADER_LENGTH, &header) < WEBP_HEADER_LENGTH)
+    return imf_load_error_set(error, rb_eRuntimeError, "WEBP ERROR: truncated header");
+
+  data = header + 20;
+  switch (header[15]) {
+    case ' ':
+      /* frame tag (3 bytes), start code, and 14-bit dimensions */
+      if (data[3] != 0x9D || data[4] != 0x01 || data[5] != 0x2A)
+        return imf_load_error_set(error, rb_eRuntimeError, "WEBP ERROR: invalid VP8 start code");
+      width = webp_get_le16(data + 6) & 0x3FFF;
+      height = webp_get_le16(data + 8) & 0x3FFF;
+      has_alpha = false;
+      break;
+
+    case 'L': {
+      /* signature, and then (width - 1), (height - 1), and alpha_is_used
+       * packed into 14, 14, and 1 bits */
+      uint32_t bits;
+      if (data[0] != 0x2F)
+        return imf_load_error_set(error, rb_eRuntimeError, "WEBP ERROR: invalid VP8L signature");
+      bits = webp_get_le32(data + 1);
+      width = (bits & 0x3FFF) + 1;
+      height = ((bits >> 14) & 0x3FFF) + 1;
+      has_alpha = ((bits >> 28) & 1) != 0;
+      break;
+    }
+
+    case 'X':
+      /* flags, reserved (3 bytes), and 24-bit (width - 1) and (height - 1) */
+      has_alpha = (data[0] & 0x10) != 0;
+      width = webp_get_le24(data + 4) + 1;
+      height = webp_get_le24(data + 7) + 1;
+      break;
+
+    default:
+      return imf_load_error_set(error, rb_eRuntimeError, "WEBP ERROR: unknown chunk");
+  }
+
+  img->color_space = IMF_COLOR_SPACE_RGB;
+  img->component_size = 1;
+  img->width = width;
+  img->height = height;
+  if (has_alpha) {
+    IMF_IMAGE_SET_ALPHA(img);
+    img->pixel_channels = 4;
+  }
+  else {
+    IMF_IMAGE_UNSET_ALPHA(img);
+    img->pixel_channels = 3;
+  }
+
+  return true;
+}
+
+static void
+probe_webp(imf_file_format_t *RB_UNUSED_VAR(fmt), VALUE image_source, imf_image_t *img)
+{
+  imf_load_error_t error;
+
+  if (!webp_read_header(imf_image_source_get_byte_source(image_source), img, &error))
+    imf_load_error_raise(&error);
+}
+
+static char const *
+webp_status_message(VP8StatusCode status)
+{
+  switch (status) {
+    case VP8_STATUS_OUT_OF_MEMORY:
+      return "out of memory";
+    case VP8_STATUS_INVALID_PARAM:
+      return "invalid parameter";
+    case VP8_STATUS_BITSTREAM_ERROR:
+      return "bitstream error";
+    case VP8_STATUS_UNSUPPORTED_FEATURE:
+      return "unsupported feature";
+    case VP8_STATUS_SUSPENDED:
+    case VP8_STATUS_NOT_ENOUGH_DATA:
+      return "premature end of data";
+    case VP8_STATUS_USER_ABORT:
+      return "aborted";
+    default:
+      return "unknown error";
+  }
+}
+
+/* Feeds the decoder with the compressed data chunk by chunk until the
+ * whole image is decoded.  libwebp emits the decoded rows into the image
+ * buffer as soon as each chunk completes them. */
+static void *
+load_webp_without_gvl(void *arg)
+{
+  imf_webp_format_t *fmt = (imf_webp_format_t *) arg;
+  uint8_t const *chunk;
+  size_t length;
+
+  while (!fmt->interrupted) {
+    length = imf_byte_source_peek(fmt->src, IMF_WEBP_CHUNK_SIZE, &chunk);
+    if (length == 0) {
+      fmt->status = VP8_STATUS_NOT_ENOUGH_DATA;
+      fmt->done = true;
+      break;
+    }
+
+    fmt->status = WebPIAppend(fmt->idec, chunk, length);
+    imf_byte_source_skip(fmt->src, length);
+
+    if (fmt->status != VP8_STATUS_SUSPENDED) {
+      fmt->done = true;
+      break;
+    }
+  }
+
+  return NULL;
+}
+
+static void
+load_webp_unblock(void *arg)
+{
+  imf_webp_format_t *fmt = (imf_webp_format_t *) arg;
+  fmt->interrupted = true;
+}
+
+/* Reads the header, and sets up the scaling or the cropping of the
+ * decoder and img for the image buffer to be allocated.  This can be
+ * called without the GVL. */
+static bool
+load_webp_setup(imf_webp_format_t *fmt, imf_load_error_t *error)
+{
+  WebPDecoderConfig *config = &fmt->config;
+  imf_image_t *img = fmt->img;
+  uint8_t const *header;
+  size_t width, height, scale_num, scale_denom;
+  size_t region_width, region_height;
+
+  /* the image layout comes from the header parsed natively */
+  if (!webp_read_header(fmt->src, img, error))
+    return false;
+
+  if (imf_byte_source_peek(fmt->src, WEBP_HEADER_LENGTH, &header) == WEBP_HEADER_LENGTH &&
+      header[15] == 'X' && (header[20] & 0x02) != 0)
+    return imf_load_error_set(error, rb_eNotImpError, "animated WEBP images are not supported");
+
+  width = img->width;
+  height = img->height;
+  imf_load_options_get_scale(fmt->opts, width, height, &scale_num, &scale_denom);
+
+  if (scale_num < scale_denom) {
+    /* libwebp scales the rows by itself while emitting them.  The size is
+     * rounded up, so the image is never smaller than requested.  The
+     * region in the scaled image is cropped afterwards. */
+    config->options.use_scaling = 1;
+    config->options.scaled_width = (int) ((width * scale_num + scale_denom - 1) / scale_denom);
+    config->options.scaled_height = (int) ((height * scale_num + scale_denom - 1) / scale_denom);
+    img->width = (size_t) config->options.scaled_width;
+    img->height = (size_t) config->options.scaled_height;
+  }
+  else if (fmt->opts->region_width != 0) {
+    if (!imf_load_options_try_get_region(fmt->opts, width, height,
+                                         &fmt->region_x, &fmt->region_y, &region_width, &region_height, error))
+      return false;
+    /* The chroma upsampling of libwebp differs from the one of the whole
+     * image near the edges of the cropped area, so the region padded by
+     * a macroblock on each side is decoded into the scratch buffer and
+     * the region is copied from there. */
+    fmt->box_x = fmt->region_x > 16 ? (fmt->region_x - 16) & ~(size_t) 15 : 0;
+    fmt->box_y = fmt->region_y > 16 ? (fmt->region_y - 16) & ~(size_t) 15 : 0;
+    fmt->box_width = ((fmt->region_x + region_width + 31) & ~(size_t) 15) - fmt->box_x;
+    fmt->box_height = ((fmt->region_y + region_height + 31) & ~(size_t) 15) - fmt->box_y;
+    if (fmt->box_x + fmt->box_width > width)
+      fmt->box_width = width - fmt->box_x;
+    if (fmt->box_y + fmt->box_height > height)
+      fmt->box_height = height - fmt->box_y;
+
+    config->options.use_cropping = 1;
+    config->options.crop_left = (int) fmt->box_x;
+    config->options.crop_top = (int) fmt->box_y;
+    config->options.crop_width = (int) fmt->box_width;
+    config->options.crop_height = (int) fmt->box_height;
+    img->width = region_width;
+    img->height = region_height;
+  }
+
+  return true;
+}
+
+/* Creates the incremental decoder that writes into the allocated image
+ * buffer or the scratch buffer.  This can be called without the GVL. */
+static bool
+load_webp_start(imf_webp_format_t *fmt, imf_load_error_t *error)
+{
+  WebPDecoderConfig *config = &fmt->config;
+  imf_image_t *img = fmt->img;
+
+  config->output.colorspace = IMF_IMAGE_HAS_ALPHA(img) ? MODE_RGBA : MODE_RGB;
+  config->output.is_external_memory = 1;
+  if (fmt->box_width != 0) {
+    size_t const box_stride = fmt->box_width * img->pixel_channels;
+    fmt->scratch = malloc(box_stride * fmt->box_height);
+    if (fmt->scratch == NULL)
+      return imf_load_error_set(error, rb_eNoMemError, "failed to allocate memory");
+    config->output.u.RGBA.rgba = fmt->scratch;
+    config->output.u.RGBA.stride = (int) box_stride;
+    config->output.u.RGBA.size = box_stride * fmt->box_height;
+  }
+  else {
+    /* let libwebp write the rows straight into the image buffer */
+    config->output.u.RGBA.rgba = img->data;
+    config->output.u.RGBA.stride = (int) img->row_stride;
+    config->output.u.RGBA.size = img->row_stride * img->height;
+  }
+
+  fmt->idec = WebPIDecode(NULL, 0, config);
+  if (fmt->idec == NULL)
+    return imf_load_error_set(error, rb_eRuntimeError, "WEBP ERROR: failed to create a decoder");
+
+  return true;
+}
+
+/* Copies the region from the scratch buffer if it is decoded there */
+static void
+load_webp_copy_region(imf_webp_format_t *fmt)
+{
+  imf_image_t *img = fmt->img;
+  size_t const pixel_size = img->pixel_channels;
+  size_t const box_stride = fmt->box_width * pixel_size;
+  uint8_t const *src;
+  size_t j;
+
+  if (fmt->scratch == NULL)
+    return;
+
+  src = fmt->scratch + (fmt->region_y - fmt->box_y) * box_stride + (fmt->region_x - fmt->box_x) * pixel_size;
+  for (j = 0; j < img->height; ++j, src += box_stride)
+    memcpy(img->data + j * img->row_stride, src, img->width * pixel_size);
+}
+
+static VALUE
+load_webp_body(VALUE arg)
+{
+  imf_webp_format_t *fmt = (imf_webp_format_t *) arg;
+  imf_load_error_t error;
+
+  if (!load_webp_setup(fmt, &error))
+    imf_load_error_raise(&error);
+
+  imf_image_allocate_image_buffer(fmt->img);
+
+  if (!load_webp_start(fmt, &error))
+    imf_load_error_raise(&error);
+
+  imf_byte_source_prepare_without_gvl(fmt->src);
+
+  /* decompress without the GVL */
+  fmt->done = false;
+  while (!fmt->done) {
+    fmt->interrupted = false;
+    imf_call_without_gvl(load_webp_without_gvl, fmt, load_webp_unblock, fmt);
+    rb_thread_check_ints();
+  }
+
+  if (fmt->status != VP8_STATUS_OK)
+    rb_raise(rb_eRuntimeError, "WEBP ERROR: %s", webp_status_message(fmt->status));
+
+  load_webp_copy_region(fmt);
+
+  return Qnil;
+}
+
+static void
+webp_format_release_decoder(imf_webp_format_t *fmt)
+{
+  if (fmt->idec != NULL) {
+    WebPIDelete(fmt->idec);
+    fmt->idec = NULL;
+  }
+  WebPFreeDecBuffer(&fmt->config.output);
+
+  free(fmt->scratch);
+  fmt->scratch = NULL;
+}
+
+static VALUE
+load_webp_ensure(VALUE arg)
+{
+  webp_format_release_decoder((imf_webp_format_t *) arg);
+  return Qnil;
+}
+
+static void
+load_webp(imf_file_format_t *base_fmt, imf_image_t *img, VALUE image_source, imf_load_options_t const *opts)
+{
+  imf_webp_format_t *fmt = (imf_webp_format_t *) base_fmt;
+
+  assert(img != NULL);
+
+  if (!rb_obj_is_kind_of(image_source, imf_cIMF_ImageSource)) {
+    rb_raise(rb_eTypeError, "image_source must be an IMF::ImageSource object");
+  }
+
+  if (!WebPInitDecoderConfig(&fmt->config))
+    rb_raise(rb_eRuntimeError, "WEBP ERROR: libwebp version mismatch");
+
+  fmt->img = img;
+  fmt->image_source = image_source;
+  fmt->opts = opts;
+  fmt->src = imf_image_source_get_byte_source(image_source);
+  fmt->idec = NULL;
+  fmt->status = VP8_STATUS_OK;
+  fmt->region_x = fmt->region_y = 0;
+  fmt->box_x = fmt->box_y = fmt->box_width = fmt->box_height = 0;
+  fmt->scratch = NULL;
+
+  rb_ensure(load_webp_body, (VALUE)fmt, load_webp_ensure, (VALUE)fmt);
+}
+
+static bool
+decode_webp_body(imf_webp_format_t *fmt, imf_load_error_t *error)
+{
+  if (!load_webp_setup(fmt, error))
+    return false;
+
+  if (!imf_image_try_allocate_image_buffer(fmt->img))
+    return imf_load_error_set(error, rb_eNoMemError, "failed to allocate memory for the image");
+
+  if (!load_webp_start(fmt, error))
+    return false;
+
+  load_webp_without_gvl(fmt);
+  if (fmt->status != VP8_STATUS_OK)
+    return imf_load_error_set(error, rb_eRuntimeError, "WEBP ERROR: %s", webp_status_message(fmt->status));
+
+  load_webp_copy_region(fmt);
+
+  return true;
+}
+
+/* Decodes the source on a thread of IMF::Image.open_all */
+static bool
+decode_webp(imf_byte_source_t *src, imf_image_t *img, imf_load_options_t const *opts, imf_load_error_t *error)
+{
+  imf_webp_format_t fmt;
+  bool success;
+
+  memset(&fmt, 0, sizeof(fmt));
+  if (!WebPInitDecoderConfig(&fmt.config))
+    return imf_load_error_set(error, rb_eRuntimeError, "WEBP ERROR: libwebp version mismatch");
+
+  fmt.img = img;
+  fmt.image_source = Qnil;
+  fmt.buffer = Qnil;
+  fmt.opts = opts;
+  fmt.src = src;
+  fmt.status = VP8_STATUS_OK;
+
+  success = decode_webp_body(&fmt, error);
+  webp_format_release_decoder(&fmt);
+
+  return success;
+}
+
 void
 Init_webp(void)
 {
@@ -129,5 +558,5 @@ Init_webp(void)
   id_read = rb_intern("read");
   id_rewind = rb_intern("rewind");
 
-  imf_register_file_format(c, webp_format_extnames);
+  imf_register_file_format(c, webp_format_extnames, webp_format_magics);
 }
@@ -26,20 +26,169 @@ typedef _Bool bool;
 # define false 0
 #endif
 
+/* GVL */
+
+typedef void *imf_gvl_func_t(void *);
+typedef void imf_unblock_func_t(void *);
+
+void *imf_call_without_gvl(imf_gvl_func_t *func, void *data1, imf_unblock_func_t *ubf, void *data2);
+void *imf_call_with_gvl(imf_gvl_func_t *func, void *data1);
+
 /* IMF */
 
 VALUE imf_find_file_format_by_filename(VALUE path_value);
 VALUE imf_detect_file_format(VALUE imgsrc_obj);
 
+/* ByteSource */
+
+typedef struct imf_byte_source imf_byte_source_t;
+
+typedef size_t imf_byte_source_peek_func(imf_byte_source_t *src, size_t length, uint8_t const **ptr);
+typedef size_t imf_byte_source_read_into_func(imf_byte_source_t *src, void *buf, size_t length);
+typedef size_t imf_byte_source_skip_func(imf_byte_source_t *src, size_t length);
+typedef void imf_byte_source_rewind_func(imf_byte_source_t *src);
+typedef void imf_byte_source_prepare_without_gvl_func(imf_byte_source_t *src);
+
+typedef struct imf_byte_source_interface imf_byte_source_interface_t;
+struct imf_byte_source_interface {
+  imf_byte_source_peek_func *peek;
+  imf_byte_source_read_into_func *read_into;
+  imf_byte_source_skip_func *skip;
+  imf_byte_source_rewind_func *rewind;
+  imf_byte_source_prepare_without_gvl_func *prepare_without_gvl;
+};
+
+struct imf_byte_source {
+  imf_byte_source_interface_t const *iface;
+  size_t pos;
+};
+
+/* Makes up to `length` bytes from the current position available at `*ptr`
+ * without consuming them, and returns the number of available bytes.
+ * The returned memory is valid until the next peek, read_into, or
+ * prepare_without_gvl call. */
+static inline size_t
+imf_byte_source_peek(imf_byte_source_t *src, size_t length, uint8_t const **ptr)
+{
+  return src->iface->peek(src, length, ptr);
+}
+
+/* Copies up to `length` bytes into `buf`, and returns the number of copied bytes.
+ * A short count means the end of the source. */
+static inline size_t
+imf_byte_source_read_into(imf_byte_source_t *src, void *buf, size_t length)
+{
+  return src->iface->read_into(src, buf, length);
+}
+
+static inline size_t
+imf_byte_source_skip(imf_byte_source_t *src, size_t length)
+{
+  return src->iface->skip(src, length);
+}
+
+static inline void
+imf_byte_source_rewind(imf_byte_source_t *src)
+{
+  src->iface->rewind(src);
+}
+
+static inline size_t
+imf_byte_source_tell(imf_byte_source_t const *src)
+{
+  return src->pos;
+}
+
+/* Must be called with the GVL before reading the source without the GVL.
+ * Sources that need Ruby to produce bytes read everything up front. */
+static inline void
+imf_byte_source_prepare_without_gvl(imf_byte_source_t *src)
+{
+  if (src->iface->prepare_without_gvl != NULL)
+    src->iface->prepare_without_gvl(src);
+}
+
+/* ByteSink
+ *
+ * The destination of encoders.  An encoder that writes without the GVL
+ * must set without_gvl meanwhile, so that the sink can reacquire it to
+ * call back into Ruby. */
+
+typedef struct imf_byte_sink imf_byte_sink_t;
+struct imf_byte_sink {
+  size_t pos;
+  bool without_gvl;
+  bool failed;
+};
+
+bool imf_byte_sink_write(imf_byte_sink_t *sink, void const *data, size_t length);
+bool imf_byte_sink_flush(imf_byte_sink_t *sink);
+
+/* Lends the free space of the sink's buffer to an encoder that produces
+ * bytes in place.  Returns the size of the space, or 0 if the sink failed.
+ * The first `length` bytes of it are appended by imf_byte_sink_commit. */
+size_t imf_byte_sink_reserve(imf_byte_sink_t *sink, uint8_t **ptr);
+void imf_byte_sink_commit(imf_byte_sink_t *sink, size_t length);
+
+static inline size_t
+imf_byte_sink_tell(imf_byte_sink_t const *sink)
+{
+  return sink->pos;
+}
+
+/* ImageSource */
+
+imf_byte_source_t *imf_image_source_get_byte_source(VALUE imgsrc_obj);
+/* Calls func(arg) that reads the image source, and raises SystemCallError
+ * if a read failed meanwhile. */
+VALUE imf_image_source_protect(VALUE imgsrc_obj, VALUE (*func)(VALUE), VALUE arg);
+
 /* Image */
 
 enum imf_color_space {
-  IMF_COLOR_SPACE_GRAY = 0,
-  IMF_COLOR_SPACE_RGB  = 1,
+  IMF_COLOR_SPACE_GRAY    = 0,
+  IMF_COLOR_SPACE_RGB     = 1,
+  /* 1-byte indices into the palette of the image */
+  IMF_COLOR_SPACE_INDEXED = 2,
+  /* The color spaces made by IMF::Image#convert, with 8-bit components.
+   * YCbCr is the full range one of JFIF.  H of HSV and HSL spans 0 to 255
+   * for the full circle.  L* of Lab is scaled by 255/100, and 128 is
+   * added to a* and b*. */
+  IMF_COLOR_SPACE_YCBCR   = 3,
+  IMF_COLOR_SPACE_HSV     = 4,
+  IMF_COLOR_SPACE_HSL     = 5,
+  IMF_COLOR_SPACE_LAB     = 6,
+  /* The ink components of a CMYK JPEG as stored in the file.  Adobe
+   * applications store them inverted, i.e. 255 is no ink. */
+  IMF_COLOR_SPACE_CMYK    = 7,
 };
 
 enum imf_image_flags {
   IMF_IMAGE_FLAG_HAS_ALPHA = (1<<0),
+  /* The components are stored in separate planes */
+  IMF_IMAGE_FLAG_PLANAR = (1<<1),
+};
+
+/* The pixel buffer of every image starts at a multiple of
+ * IMF_IMAGE_BUFFER_ALIGNMENT, and each row starts at a multiple of
+ * row_alignment, which is a power of two not greater than that. */
+enum imf_image_constants {
+  IMF_IMAGE_BUFFER_ALIGNMENT = 64,
+  IMF_IMAGE_DEFAULT_ROW_ALIGNMENT = 16,
+  IMF_IMAGE_PALETTE_CAPACITY = 256,
+  IMF_IMAGE_MAX_PLANES = 4,
+};
+
+/* A plane of a planar image.  The plane may be smaller than the image,
+ * e.g. a subsampled chroma plane, and its buffer may have more rows than
+ * the height, e.g. for the padding of a JPEG decoder. */
+typedef struct imf_image_plane imf_image_plane_t;
+struct imf_image_plane {
+  uint8_t *data;
+  size_t width;
+  size_t height;
+  size_t row_stride;
+  size_t allocated_height;
 };
 
 typedef struct imf_image imf_image_t;
@@ -50,8 +199,20 @@ struct imf_image {
   uint8_t pixel_channels;
   size_t width;
   size_t row_stride;
+  size_t row_alignment;
   size_t height;
   uint8_t *data;
+  /* RGBA entries of an IMF_COLOR_SPACE_INDEXED image.  The alpha
+   * components are meaningful only if the image has alpha. */
+  uint8_t (*palette)[4];
+  size_t palette_size;
+  /* The planes of an image with IMF_IMAGE_FLAG_PLANAR, one for each of
+   * pixel_channels components of 8 bits.  The planes share one buffer
+   * pointed by data, and row_stride of the image is 0. */
+  imf_image_plane_t planes[IMF_IMAGE_MAX_PLANES];
+  /* The hidden object that owns the pixel buffer shared by the views made
+   * by IMF::Image#crop, or 0 if the image owns its buffer. */
+  VALUE base;
 };
 
 #define IMF_IMAGE(ptr) ((imf_image_t *)(ptr))
@@ -64,11 +225,141 @@ struct imf_image {
 #define IMF_IMAGE_FLAG_TOGGLE(img, f) (void)(IMF_IMAGE(img)->flags ^= (f))
 
 #define IMF_IMAGE_HAS_ALPHA(img) IMF_IMAGE_FLAG_TEST(img, IMF_IMAGE_FLAG_HAS_ALPHA)
+#define IMF_IMAGE_IS_PLANAR(img) IMF_IMAGE_FLAG_TEST(img, IMF_IMAGE_FLAG_PLANAR)
 #define IMF_IMAGE_SET_ALPHA(img) IMF_IMAGE_FLAG_SET(img, IMF_IMAGE_FLAG_HAS_ALPHA)
 #define IMF_IMAGE_UNSET_ALPHA(img) IMF_IMAGE_FLAG_UNSET(img, IMF_IMAGE_FLAG_HAS_ALPHA)
 
 bool imf_is_image(VALUE obj);
+imf_image_t *imf_get_image_data(VALUE obj);
 void imf_image_allocate_image_buffer(imf_image_t *img);
+/* Allocates the buffer of a planar image for the planes of pixel_channels
+ * components, whose width and height are already set.  Each plane gets
+ * room for padded_widths[i] x padded_heights[i] components. */
+void imf_image_allocate_planes(imf_image_t *img, size_t const *padded_widths, size_t const *padded_heights);
+/* The same as imf_image_allocate_image_buffer and
+ * imf_image_allocate_planes, but return false instead of raising if out
+ * of memory.  These can be called without the GVL. */
+bool imf_image_try_allocate_image_buffer(imf_image_t *img);
+bool imf_image_try_allocate_planes(imf_image_t *img, size_t const *padded_widths, size_t const *padded_heights);
+/* Raises ArgumentError if the image is planar, for the operations on
+ * interleaved pixels */
+void imf_image_check_interleaved(imf_image_t const *img);
+/* Releases the pixel buffer and the palette of an image that is not
+ * wrapped by an IMF::Image object */
+void imf_image_release(imf_image_t *img);
+/* Moves the pixel buffer of the image to a hidden base object, if not
+ * yet, and returns the base.  Anything that points into the buffer keeps
+ * it alive by marking the base. */
+VALUE imf_image_share_buffer(imf_image_t *img);
+/* Gives the image its own copy of the pixels if they are shared with
+ * other images.  Must be called before writing pixels into an image that
+ * may have been seen by Ruby code. */
+void imf_image_make_writable(imf_image_t *img);
+/* Allocates the palette of `size` entries, which must be up to 256 */
+void imf_image_allocate_palette(imf_image_t *img, size_t size);
+bool imf_image_try_allocate_palette(imf_image_t *img, size_t size);
+/* Makes `dst` the RGB or RGBA image of the colors of the indexed image
+ * `src`.  The fields of `dst` other than row_alignment are overwritten. */
+void imf_image_expand_palette(imf_image_t const *src, imf_image_t *dst);
+
+/* Loading errors
+ *
+ * The decoders that run without the GVL cannot raise, so they report the
+ * error in imf_load_error_t, and it is raised by imf_load_error_raise
+ * once the GVL is acquired again. */
+
+enum imf_load_error_constants {
+  IMF_LOAD_ERROR_MESSAGE_SIZE = 256,
+};
+
+typedef struct imf_load_error imf_load_error_t;
+struct imf_load_error {
+  /* the class of the exception, or 0 for the SystemCallError of
+   * errno_value */
+  VALUE klass;
+  int errno_value;
+  char message[IMF_LOAD_ERROR_MESSAGE_SIZE];
+};
+
+/* Sets the exception class and the message formatted by printf.  Returns
+ * false, so that a decoder can return the result. */
+PRINTF_ARGS(bool imf_load_error_set(imf_load_error_t *error, VALUE klass, char const *format, ...), 3, 4);
+/* Sets the SystemCallError of errno_value.  Returns false. */
+bool imf_load_error_set_errno(imf_load_error_t *error, int errno_value, char const *message);
+NORETURN(void imf_load_error_raise(imf_load_error_t const *error));
+/* Returns the exception of the error without raising it */
+VALUE imf_load_error_to_exception(imf_load_error_t const *error);
+
+/* Loading options
+ *
+ * These are given by the keyword arguments of IMF::Image.open.  The scale
+ * options are hints for the decoders that can produce a reduced image
+ * more cheaply than the full size one, and other decoders ignore them.
+ * The region is honored by every decoder; the ones that cannot decode a
+ * part of the image leave the whole image to be cropped afterwards. */
+
+typedef struct imf_load_options imf_load_options_t;
+struct imf_load_options {
+  /* Requested scale factor as scale_num/scale_denom (1/1 by default) */
+  unsigned int scale_num;
+  unsigned int scale_denom;
+  /* The box the caller is going to fit the image into (0 if unlimited) */
+  size_t max_width;
+  size_t max_height;
+  /* Alignment of the rows of the loaded image (0 for the default) */
+  size_t row_alignment;
+  /* The region to be loaded in the coordinates of the scaled image
+   * (region_width is 0 if the whole image is loaded) */
+  size_t region_x;
+  size_t region_y;
+  size_t region_width;
+  size_t region_height;
+  /* Whether the decoders keep the color space of the file, e.g. YCbCr of
+   * JPEG, instead of converting it into RGB */
+  bool keep_color_space;
+  /* Whether the decoders that can produce planar images do so */
+  bool planar;
+};
+
+#define IMF_LOAD_OPTIONS_INITIALIZER { 1, 1, 0, 0, 0, 0, 0, 0, 0, false, false }
+
+/* Computes the reduction factor for the image of the given size from the
+ * options.  The result is the smaller one of the requested scale and the
+ * scale that fits the image into max_width x max_height, and is never
+ * greater than 1. */
+static inline void
+imf_load_options_get_scale(imf_load_options_t const *opts, size_t width, size_t height,
+                           size_t *scale_num, size_t *scale_denom)
+{
+  size_t num = opts->scale_num, denom = opts->scale_denom;
+
+  if (num >= denom)
+    num = denom = 1;
+
+  /* compare num/denom with max_width/width by cross multiplication */
+  if (opts->max_width > 0 && opts->max_width < width && opts->max_width * denom < num * width) {
+    num = opts->max_width;
+    denom = width;
+  }
+  if (opts->max_height > 0 && opts->max_height < height && opts->max_height * denom < num * height) {
+    num = opts->max_height;
+    denom = height;
+  }
+
+  *scale_num = num;
+  *scale_denom = denom;
+}
+
+/* Gets the region to be loaded from the image of the given size, which is
+ * the whole image unless the region is given.  Raises ArgumentError if the
+ * region sticks out of the image. */
+void imf_load_options_get_region(imf_load_options_t const *opts, size_t width, size_t height,
+                                 size_t *x, size_t *y, size_t *region_width, size_t *region_height);
+/* The same as imf_load_options_get_region, but sets ArgumentError in
+ * `error` and returns false instead of raising */
+bool imf_load_options_try_get_region(imf_load_options_t const *opts, size_t width, size_t height,
+                                     size_t *x, size_t *y, size_t *region_width, size_t *region_height,
+                                     imf_load_error_t *error);
 
 /* FileFormat */
 
@@ -77,12 +368,28 @@ struct imf_file_format {
 };
 
 typedef int imf_file_format_detect_func(imf_file_format_t *fmt, VALUE detect);
-typedef void imf_file_format_load_func(imf_file_format_t *fmt, imf_image_t *img, VALUE src);
+typedef void imf_file_format_load_func(imf_file_format_t *fmt, imf_image_t *img, VALUE src, imf_load_options_t const *opts);
+/* `opts` is the Hash of the format specific saving options, or nil */
+typedef void imf_file_format_save_func(imf_file_format_t *fmt, imf_image_t const *img, imf_byte_sink_t *sink, VALUE opts);
+/* Sets the fields of `img` to the ones of the image to be loaded, reading
+ * only the header.  `img->data` is left NULL. */
+typedef void imf_file_format_probe_func(imf_file_format_t *fmt, VALUE src, imf_image_t *img);
+/* Loads the image like imf_file_format_load_func, but on a native thread
+ * of IMF::Image.open_all, so it must not call any Ruby API.  `src` is
+ * already prepared for reading without the GVL.  Returns false with the
+ * error set instead of raising, leaving the buffers allocated so far in
+ * `img` to be released by the caller.  This is optional, and the formats
+ * without it are loaded by `load` after the native threads finish. */
+typedef bool imf_file_format_decode_func(imf_byte_source_t *src, imf_image_t *img, imf_load_options_t const *opts,
+                                         imf_load_error_t *error);
 
 typedef struct imf_file_format_interface imf_file_format_interface_t;
 struct imf_file_format_interface {
   imf_file_format_detect_func *detect;
   imf_file_format_load_func *load;
+  imf_file_format_save_func *save;
+  imf_file_format_probe_func *probe;
+  imf_file_format_decode_func *decode;
 };
 
 #define imf_file_format_interface(obj) ( \
@@ -101,7 +408,23 @@ imf_is_file_format(VALUE obj)
   return rb_typeddata_is_kind_of(obj, &imf_file_format_data_type);
 }
 
-void imf_register_file_format(VALUE file_format, char const *const *extnames);
+/* Magic number patterns for format detection.  A pattern matches when
+ * every byte of the header masked by `mask` equals the pattern.  A NULL
+ * mask means exact match.  A pattern list is terminated by the entry
+ * whose length is 0. */
+enum imf_file_format_magic_constants {
+  IMF_FILE_FORMAT_MAGIC_MAX_LENGTH = 32,
+};
+
+typedef struct imf_file_format_magic imf_file_format_magic_t;
+struct imf_file_format_magic {
+  char const *pattern;
+  char const *mask;
+  size_t length;
+};
+
+void imf_register_file_format(VALUE file_format, char const *const *extnames, imf_file_format_magic_t const *magics);
+VALUE imf_detect_file_format_class_by_magic(imf_byte_source_t *src);
 
 /* Classes and Modules */
 
@@ -0,0 +1,421 @@
+#include "IMF.h"
+
+#ifdef HAVE_RUBY_THREAD_NATIVE_H
+# include <ruby/thread_native.h>
+#endif
+
+#include <stdlib.h>
+
+#include "internal.h"
+
+/* Buffer pool
+ *
+ * Pixel buffers are recycled through free lists bucketed by size class,
+ * so that decoding many images of the same size does not churn malloc.
+ * There are eight size classes between every two consecutive powers of
+ * two, so that at most 1/8 of a buffer is wasted, and every buffer in a
+ * bucket has exactly the size of its class.
+ *
+ * Only the memory newly taken from the system is reported to Ruby's GC,
+ * so reusing a pooled buffer does not move the GC toward the next run.
+ * The memory taken or released without the GVL is reported by the next
+ * allocation with the GVL.
+ *
+ * The free lists are linked through the first word of each free buffer. */
+
+enum imf_buffer_pool_constants {
+  IMF_BUFFER_POOL_ALIGNMENT = IMF_IMAGE_BUFFER_ALIGNMENT,
+  IMF_BUFFER_POOL_MIN_SHIFT = 6,
+  IMF_BUFFER_POOL_MIN_SIZE = (1 << IMF_BUFFER_POOL_MIN_SHIFT),
+  IMF_BUFFER_POOL_CLASS_SHIFT = 3,
+  IMF_BUFFER_POOL_CLASSES_PER_DOUBLING = (1 << IMF_BUFFER_POOL_CLASS_SHIFT),
+  IMF_BUFFER_POOL_NUM_CLASSES =
+    1 + (sizeof(size_t) * CHAR_BIT - IMF_BUFFER_POOL_MIN_SHIFT) * IMF_BUFFER_POOL_CLASSES_PER_DOUBLING,
+};
+
+#define IMF_BUFFER_POOL_DEFAULT_LIMIT ((size_t) 64 * 1024 * 1024)
+
+typedef struct imf_buffer_pool_entry imf_buffer_pool_entry_t;
+struct imf_buffer_pool_entry {
+  imf_buffer_pool_entry_t *next;
+};
+
+static struct {
+#ifdef HAVE_RUBY_THREAD_NATIVE_H
+  rb_nativethread_lock_t lock;
+#endif
+  imf_buffer_pool_entry_t *free_lists[IMF_BUFFER_POOL_NUM_CLASSES];
+  size_t limit;
+  size_t pooled_bytes;
+  size_t pooled_buffers;
+  size_t hits;
+  size_t misses;
+  /* the bytes taken from the system minus the ones released to it, which
+   * are not reported to Ruby's GC yet */
+  ssize_t unreported_bytes;
+} buffer_pool;
+
+static inline void
+buffer_pool_lock(void)
+{
+#ifdef HAVE_RUBY_THREAD_NATIVE_H
+  rb_nativethread_lock_lock(&buffer_pool.lock);
+#endif
+}
+
+static inline void
+buffer_pool_unlock(void)
+{
+#ifdef HAVE_RUBY_THREAD_NATIVE_H
+  rb_nativethread_lock_unlock(&buffer_pool.lock);
+#endif
+}
+
+static inline unsigned int
+bit_length(size_t x)
+{
+#if defined(__GNUC__) || defined(__clang__)
+  return x == 0 ? 0 : (unsigned int) (sizeof(unsigned long long) * CHAR_BIT - __builtin_clzll(x));
+#else
+  unsigned int n = 0;
+  while (x != 0) {
+    x >>= 1;
+    ++n;
+  }
+  return n;
+#endif
+}
+
+/* Returns the index of the size class of the given size,
+ * and stores the size of the class into *class_size. */
+static size_t
+buffer_pool_size_class(size_t size, size_t *class_size)
+{
+  if (size <= IMF_BUFFER_POOL_MIN_SIZE) {
+    *class_size = IMF_BUFFER_POOL_MIN_SIZE;
+    return 0;
+  }
+
+  /* 2^(bits-1) < size <= 2^bits, and the classes in this range are
+   * 2^(bits-1) + k * 2^(bits-1) / CLASSES_PER_DOUBLING for k = 1..CLASSES_PER_DOUBLING */
+  unsigned int const bits = bit_length(size - 1);
+  unsigned int const shift = bits - 1 - IMF_BUFFER_POOL_CLASS_SHIFT;
+  size_t const rounded = ((size - 1) >> shift) + 1;
+  size_t const k = rounded - IMF_BUFFER_POOL_CLASSES_PER_DOUBLING;
+
+  *class_size = rounded << shift;
+  return 1 + (bits - 1 - IMF_BUFFER_POOL_MIN_SHIFT) * IMF_BUFFER_POOL_CLASSES_PER_DOUBLING + (k - 1);
+}
+
+/* The inverse of buffer_pool_size_class */
+static size_t
+buffer_pool_class_size(size_t index)
+{
+  if (index == 0)
+    return IMF_BUFFER_POOL_MIN_SIZE;
+
+  size_t const group = (index - 1) / IMF_BUFFER_POOL_CLASSES_PER_DOUBLING;
+  size_t const k = (index - 1) % IMF_BUFFER_POOL_CLASSES_PER_DOUBLING + 1;
+  unsigned int const shift = (unsigned int) group + IMF_BUFFER_POOL_MIN_SHIFT - IMF_BUFFER_POOL_CLASS_SHIFT;
+
+  return (IMF_BUFFER_POOL_CLASSES_PER_DOUBLING + k) << shift;
+}
+
+static void *
+buffer_pool_system_alloc(size_t size)
+{
+  void *ptr = NULL;
+#if defined(HAVE_POSIX_MEMALIGN)
+  if (posix_memalign(&ptr, IMF_BUFFER_POOL_ALIGNMENT, size) != 0)
+    ptr = NULL;
+#elif defined(_WIN32)
+  ptr = _aligned_malloc(size, IMF_BUFFER_POOL_ALIGNMENT);
+#else
+  /* Over-allocate and keep the pointer given by malloc just before
+   * the aligned block. */
+  void *raw = malloc(size + IMF_BUFFER_POOL_ALIGNMENT);
+  if (raw != NULL) {
+    uintptr_t const aligned = ((uintptr_t) raw + IMF_BUFFER_POOL_ALIGNMENT) & ~(uintptr_t) (IMF_BUFFER_POOL_ALIGNMENT - 1);
+    ptr = (void *) aligned;
+    ((void **) ptr)[-1] = raw;
+  }
+#endif
+  return ptr;
+}
+
+static void
+buffer_pool_system_free(void *ptr)
+{
+#if defined(HAVE_POSIX_MEMALIGN)
+  free(ptr);
+#elif defined(_WIN32)
+  _aligned_free(ptr);
+#else
+  free(((void **) ptr)[-1]);
+#endif
+}
+
+static void
+buffer_pool_adjust_memory_usage(ssize_t diff)
+{
+#ifdef HAVE_RB_GC_ADJUST_MEMORY_USAGE
+  rb_gc_adjust_memory_usage(diff);
+#endif
+}
+
+/* Adds the bytes taken from the system, or subtracts the released ones,
+ * to be reported by the next buffer_pool_report_memory_usage */
+static void
+buffer_pool_add_unreported_bytes(ssize_t diff)
+{
+  buffer_pool_lock();
+  buffer_pool.unreported_bytes += diff;
+  buffer_pool_unlock();
+}
+
+/* Reports the memory usage changed by `diff` bytes and the unreported
+ * bytes to Ruby's GC.  Must be called with the GVL. */
+static void
+buffer_pool_report_memory_usage(ssize_t diff)
+{
+  buffer_pool_lock();
+  diff += buffer_pool.unreported_bytes;
+  buffer_pool.unreported_bytes = 0;
+  buffer_pool_unlock();
+
+  if (diff != 0)
+    buffer_pool_adjust_memory_usage(diff);
+}
+
+/* Takes a free buffer of the size class from the pool, or returns NULL */
+static imf_buffer_pool_entry_t *
+buffer_pool_take(size_t index, size_t class_size)
+{
+  imf_buffer_pool_entry_t *entry;
+
+  buffer_pool_lock();
+  entry = buffer_pool.free_lists[index];
+  if (entry != NULL) {
+    buffer_pool.free_lists[index] = entry->next;
+    buffer_pool.pooled_bytes -= class_size;
+    --buffer_pool.pooled_buffers;
+    ++buffer_pool.hits;
+  }
+  else {
+    ++buffer_pool.misses;
+  }
+  buffer_pool_unlock();
+
+  return entry;
+}
+
+/* Takes a buffer of at least `size` bytes from the pool, or from the
+ * system when the pool has none.  The buffer is aligned to
+ * IMF_IMAGE_BUFFER_ALIGNMENT.  Must be called with the GVL. */
+void *
+imf_buffer_pool_alloc(size_t size)
+{
+  size_t class_size;
+  size_t const index = buffer_pool_size_class(size, &class_size);
+  imf_buffer_pool_entry_t *entry = buffer_pool_take(index, class_size);
+
+  if (entry != NULL)
+    return entry;
+
+  void *ptr = buffer_pool_system_alloc(class_size);
+  if (ptr == NULL) {
+    rb_gc();
+    ptr = buffer_pool_system_alloc(class_size);
+    if (ptr == NULL)
+      rb_memerror();
+  }
+  buffer_pool_report_memory_usage((ssize_t) class_size);
+
+  return ptr;
+}
+
+/* Takes a buffer like imf_buffer_pool_alloc, but returns NULL instead of
+ * raising if out of memory.  This can be called without the GVL. */
+void *
+imf_buffer_pool_try_alloc(size_t size)
+{
+  size_t class_size;
+  size_t const index = buffer_pool_size_class(size, &class_size);
+  imf_buffer_pool_entry_t *entry = buffer_pool_take(index, class_size);
+
+  if (entry != NULL)
+    return entry;
+
+  void *ptr = buffer_pool_system_alloc(class_size);
+  if (ptr != NULL)
+    buffer_pool_add_unreported_bytes((ssize_t) class_size);
+
+  return ptr;
+}
+
+/* Reports the memory taken or released without the GVL to Ruby's GC.
+ * Must be called with the GVL. */
+void
+imf_buffer_pool_report_unreported_memory(void)
+{
+  buffer_pool_report_memory_usage(0);
+}
+
+/* Returns the buffer taken by imf_buffer_pool_alloc with the same size.
+ * The buffer is released to the system if the pool is full.  This can be
+ * called without the GVL. */
+void
+imf_buffer_pool_free(void *ptr, size_t size)
+{
+  size_t class_size;
+  size_t const index = buffer_pool_size_class(size, &class_size);
+  bool pooled = false;
+
+  if (ptr == NULL)
+    return;
+
+  buffer_pool_lock();
+  if (buffer_pool.pooled_bytes + class_size <= buffer_pool.limit) {
+    imf_buffer_pool_entry_t *entry = (imf_buffer_pool_entry_t *) ptr;
+    entry->next = buffer_pool.free_lists[index];
+    buffer_pool.free_lists[index] = entry;
+    buffer_pool.pooled_bytes += class_size;
+    ++buffer_pool.pooled_buffers;
+    pooled = true;
+  }
+  buffer_pool_unlock();
+
+  if (!pooled) {
+    buffer_pool_system_free(ptr);
+    buffer_pool_add_unreported_bytes(-(ssize_t) class_size);
+  }
+}
+
+/* Releases pooled buffers, the largest first, until the pooled bytes
+ * fit in the limit. */
+static void
+buffer_pool_trim(void)
+{
+  size_t index = IMF_BUFFER_POOL_NUM_CLASSES;
+  size_t released = 0;
+
+  buffer_pool_lock();
+  while (buffer_pool.pooled_bytes > buffer_pool.limit && index > 0) {
+    imf_buffer_pool_entry_t *entry;
+    size_t class_size;
+
+    --index;
+    entry = buffer_pool.free_lists[index];
+    if (entry == NULL)
+      continue;
+
+    class_size = buffer_pool_class_size(index);
+
+    while (entry != NULL && buffer_pool.pooled_bytes > buffer_pool.limit) {
+      imf_buffer_pool_entry_t *next = entry->next;
+      buffer_pool_system_free(entry);
+      buffer_pool.pooled_bytes -= class_size;
+      --buffer_pool.pooled_buffers;
+      released += class_size;
+      entry = next;
+    }
+    buffer_pool.free_lists[index] = entry;
+  }
+  buffer_pool_unlock();
+
+  buffer_pool_report_memory_usage(-(ssize_t) released);
+}
+
+/*
+ * call-seq:
+ *   IMF.buffer_pool_stats -> hash
+ *
+ * Returns the statistics of the pixel buffer pool.
+ *
+ * - :hits, :misses - the numbers of allocations served from the pool and
+ *   from the system
+ * - :hit_rate - hits / (hits + misses)
+ * - :pooled_buffers, :pooled_bytes - the buffers kept in the pool now
+ * - :limit - the maximum number of bytes kept in the pool
+ */
+static VALUE
+imf_s_buffer_pool_stats(VALUE mod)
+{
+  size_t hits, misses, pooled_bytes, pooled_buffers, limit;
+  VALUE stats;
+
+  buffer_pool_lock();
+  hits = buffer_pool.hits;
+  misses = buffer_pool.misses;
+  pooled_bytes = buffer_pool.pooled_bytes;
+  pooled_buffers = buffer_pool.pooled_buffers;
+  limit = buffer_pool.limit;
+  buffer_pool_unlock();
+
+  stats = rb_hash_new();
+  rb_hash_aset(stats, ID2SYM(rb_intern("hits")), SIZET2NUM(hits));
+  rb_hash_aset(stats, ID2SYM(rb_intern("misses")), SIZET2NUM(misses));
+  rb_hash_aset(stats, ID2SYM(rb_intern("hit_rate")),
+               DBL2NUM(hits + misses == 0 ? 0.0 : (double) hits / (double) (hits + misses)));
+  rb_hash_aset(stats, ID2SYM(rb_intern("pooled_buffers")), SIZET2NUM(pooled_buffers));
+  rb_hash_aset(stats, ID2SYM(rb_intern("pooled_bytes")), SIZET2NUM(pooled_bytes));
+  rb_hash_aset(stats, ID2SYM(rb_intern("limit")), SIZET2NUM(limit));
+
+  return stats;
+}
+
+/*
+ * call-seq:
+ *   IMF.buffer_pool_limit -> integer
+ *
+ * Returns the maximum number of bytes kept in the pixel buffer pool.
+ */
+static VALUE
+imf_s_get_buffer_pool_limit(VALUE mod)
+{
+  size_t limit;
+
+  buffer_pool_lock();
+  limit = buffer_pool.limit;
+  buffer_pool_unlock();
+
+  return SIZET2NUM(limit);
+}
+
+/*
+ * call-seq:
+ *   IMF.buffer_pool_limit = bytes
+ *
+ * Sets the maximum number of bytes kept in the pixel buffer pool.
+ * The buffers exceeding the new limit are released immediately.
+ * Setting 0 disables pooling.
+ */
+static VALUE
+imf_s_set_buffer_pool_limit(VALUE mod, VALUE limit_v)
+{
+  ssize_t const limit = NUM2SSIZET(limit_v);
+
+  if (limit < 0)
+    rb_raise(rb_eArgError, "negative buffer pool limit");
+
+  buffer_pool_lock();
+  buffer_pool.limit = (size_t) limit;
+  buffer_pool_unlock();
+
+  buffer_pool_trim();
+
+  return limit_v;
+}
+
+void
+Init_imf_buffer_pool(void)
+{
+#ifdef HAVE_RUBY_THREAD_NATIVE_H
+  rb_nativethread_lock_initialize(&buffer_pool.lock);
+#endif
+  buffer_pool.limit = IMF_BUFFER_POOL_DEFAULT_LIMIT;
+
+  rb_define_singleton_method(imf_mIMF, "buffer_pool_stats", imf_s_buffer_pool_stats, 0);
+  rb_define_singleton_method(imf_mIMF, "buffer_pool_limit", imf_s_get_buffer_pool_limit, 0);
+  rb_define_singleton_method(imf_mIMF, "buffer_pool_limit=", imf_s_set_buffer_pool_limit, 1);
+}
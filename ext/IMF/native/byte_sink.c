@@ -0,0 +1,454 @@
+#include "IMF.h"
+
+#include <ruby/io.h>
+
+#ifdef HAVE_SYS_TYPES_H
+# include <sys/types.h>
+#endif
+
+#ifdef HAVE_SYS_STAT_H
+# include <sys/stat.h>
+#endif
+
+#ifdef HAVE_FCNTL_H
+# include <fcntl.h>
+#endif
+
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+
+#include <errno.h>
+
+#include "internal.h"
+
+/* ByteSink
+ *
+ * Encoders write through an imf_byte_sink_t, which is owned by a hidden
+ * Ruby object so that it is released even if the encoder raises.  The
+ * bytes are buffered by malloc'ed memory, and then
+ *
+ * - PATH, FD: written to the file descriptor by write(2),
+ * - MEMORY: kept in the growing buffer to be returned as a String,
+ * - WRITER: passed to the #write method of a Ruby object with the GVL.
+ *
+ * Only the IOs of regular files are written as FD.  Ruby makes pipes and
+ * sockets non-blocking, so they are written by IO#write as WRITER, which
+ * waits for them to be writable.
+ *
+ * Errors while flushing are stored in the sink and raised by
+ * imf_byte_sink_close, because they can happen without the GVL. */
+
+enum imf_byte_sink_constants {
+  IMF_BYTE_SINK_BUFFER_SIZE = 65536,
+};
+
+enum imf_byte_sink_kind {
+  IMF_BYTE_SINK_PATH,
+  IMF_BYTE_SINK_FD,
+  IMF_BYTE_SINK_MEMORY,
+  IMF_BYTE_SINK_WRITER,
+};
+
+typedef struct imf_byte_sink_data imf_byte_sink_data_t;
+struct imf_byte_sink_data {
+  imf_byte_sink_t base;
+  enum imf_byte_sink_kind kind;
+
+  uint8_t *buffer;
+  size_t buffer_capa;
+  size_t buffer_length;
+
+  /* PATH, FD */
+  int fd;
+  VALUE path;
+
+  /* WRITER */
+  VALUE writer;
+
+  /* the error raised by imf_byte_sink_close */
+  int error_errno;
+  VALUE error;
+};
+
+#define IMF_BYTE_SINK_DATA(ptr) ((imf_byte_sink_data_t *)(ptr))
+
+static ID id_fileno;
+static ID id_flush;
+static ID id_to_path;
+static ID id_write;
+
+static void
+imf_byte_sink_mark(void *ptr)
+{
+  imf_byte_sink_data_t *sink = IMF_BYTE_SINK_DATA(ptr);
+  rb_gc_mark(sink->path);
+  rb_gc_mark(sink->writer);
+  rb_gc_mark(sink->error);
+}
+
+static void
+imf_byte_sink_release(imf_byte_sink_data_t *sink)
+{
+  if (sink->fd >= 0) {
+    close(sink->fd);
+    sink->fd = -1;
+  }
+  free(sink->buffer);
+  sink->buffer = NULL;
+  sink->buffer_capa = 0;
+  sink->buffer_length = 0;
+}
+
+static void
+imf_byte_sink_free(void *ptr)
+{
+  imf_byte_sink_release(IMF_BYTE_SINK_DATA(ptr));
+  xfree(ptr);
+}
+
+static size_t
+imf_byte_sink_memsize(void const *ptr)
+{
+  return sizeof(imf_byte_sink_data_t) + IMF_BYTE_SINK_DATA(ptr)->buffer_capa;
+}
+
+static rb_data_type_t const imf_byte_sink_data_type = {
+  "imf_byte_sink",
+  {
+    imf_byte_sink_mark,
+    imf_byte_sink_free,
+    imf_byte_sink_memsize,
+  },
+#ifdef RUBY_TYPED_FREE_IMMEDIATELY
+  0, 0,
+  RUBY_TYPED_FREE_IMMEDIATELY
+#endif
+};
+
+static inline imf_byte_sink_data_t *
+imf_get_byte_sink_data(VALUE obj)
+{
+  imf_byte_sink_data_t *ptr;
+  TypedData_Get_Struct(obj, imf_byte_sink_data_t, &imf_byte_sink_data_type, ptr);
+  return ptr;
+}
+
+static void
+imf_byte_sink_fail_errno(imf_byte_sink_data_t *sink, int e)
+{
+  sink->base.failed = true;
+  sink->error_errno = e;
+}
+
+static bool
+imf_byte_sink_write_fd(imf_byte_sink_data_t *sink, uint8_t const *data, size_t length)
+{
+  while (length > 0) {
+    ssize_t n = write(sink->fd, data, length);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      imf_byte_sink_fail_errno(sink, errno);
+      return false;
+    }
+    data += n;
+    length -= (size_t) n;
+  }
+  return true;
+}
+
+static VALUE
+imf_byte_sink_call_writer(VALUE arg)
+{
+  imf_byte_sink_data_t *sink = IMF_BYTE_SINK_DATA(arg);
+  VALUE chunk = rb_str_new((char const *) sink->buffer, (long) sink->buffer_length);
+  return rb_funcall(sink->writer, id_write, 1, chunk);
+}
+
+static void *
+imf_byte_sink_flush_writer_with_gvl(void *arg)
+{
+  imf_byte_sink_data_t *sink = IMF_BYTE_SINK_DATA(arg);
+  int state = 0;
+
+  rb_protect(imf_byte_sink_call_writer, (VALUE) sink, &state);
+  if (state) {
+    sink->base.failed = true;
+    sink->error = rb_errinfo();
+    rb_set_errinfo(Qnil);
+  }
+
+  return NULL;
+}
+
+static bool
+imf_byte_sink_flush_buffer(imf_byte_sink_data_t *sink)
+{
+  if (sink->buffer_length == 0)
+    return true;
+
+  switch (sink->kind) {
+    case IMF_BYTE_SINK_PATH:
+    case IMF_BYTE_SINK_FD:
+      if (!imf_byte_sink_write_fd(sink, sink->buffer, sink->buffer_length))
+        return false;
+      break;
+
+    case IMF_BYTE_SINK_WRITER:
+      if (sink->base.without_gvl)
+        imf_call_with_gvl(imf_byte_sink_flush_writer_with_gvl, sink);
+      else
+        imf_byte_sink_flush_writer_with_gvl(sink);
+      if (sink->base.failed)
+        return false;
+      break;
+
+    case IMF_BYTE_SINK_MEMORY:
+      return true;
+  }
+
+  sink->buffer_length = 0;
+  return true;
+}
+
+static bool
+imf_byte_sink_grow_buffer(imf_byte_sink_data_t *sink, size_t required)
+{
+  size_t capa = sink->buffer_capa;
+  uint8_t *ptr;
+
+  while (capa < required) {
+    if (capa > SIZE_MAX / 2) {
+      capa = required;
+      break;
+    }
+    capa *= 2;
+  }
+
+  ptr = realloc(sink->buffer, capa);
+  if (ptr == NULL) {
+    imf_byte_sink_fail_errno(sink, ENOMEM);
+    return false;
+  }
+  sink->buffer = ptr;
+  sink->buffer_capa = capa;
+  return true;
+}
+
+/* Appends `length` bytes to the sink.  This can be called without the
+ * GVL if sink->without_gvl is set.  Returns false if the sink failed. */
+bool
+imf_byte_sink_write(imf_byte_sink_t *base, void const *data, size_t length)
+{
+  imf_byte_sink_data_t *sink = IMF_BYTE_SINK_DATA(base);
+  uint8_t const *ptr = (uint8_t const *) data;
+
+  if (base->failed)
+    return false;
+
+  base->pos += length;
+
+  if (sink->kind == IMF_BYTE_SINK_MEMORY) {
+    if (sink->buffer_length + length > sink->buffer_capa &&
+        !imf_byte_sink_grow_buffer(sink, sink->buffer_length + length))
+      return false;
+    memcpy(sink->buffer + sink->buffer_length, ptr, length);
+    sink->buffer_length += length;
+    return true;
+  }
+
+  while (length > 0) {
+    size_t room = sink->buffer_capa - sink->buffer_length;
+
+    /* write large chunks directly to the file */
+    if (sink->buffer_length == 0 && length >= sink->buffer_capa && sink->fd >= 0)
+      return imf_byte_sink_write_fd(sink, ptr, length);
+
+    if (room == 0) {
+      if (!imf_byte_sink_flush_buffer(sink))
+        return false;
+      continue;
+    }
+
+    if (room > length)
+      room = length;
+    memcpy(sink->buffer + sink->buffer_length, ptr, room);
+    sink->buffer_length += room;
+    ptr += room;
+    length -= room;
+  }
+
+  return true;
+}
+
+/* Writes the buffered bytes out.  Returns false if the sink failed. */
+bool
+imf_byte_sink_flush(imf_byte_sink_t *base)
+{
+  imf_byte_sink_data_t *sink = IMF_BYTE_SINK_DATA(base);
+
+  if (base->failed)
+    return false;
+  return imf_byte_sink_flush_buffer(sink);
+}
+
+size_t
+imf_byte_sink_reserve(imf_byte_sink_t *base, uint8_t **ptr)
+{
+  imf_byte_sink_data_t *sink = IMF_BYTE_SINK_DATA(base);
+
+  if (base->failed)
+    return 0;
+
+  if (sink->buffer_length == sink->buffer_capa) {
+    if (sink->kind == IMF_BYTE_SINK_MEMORY) {
+      if (!imf_byte_sink_grow_buffer(sink, sink->buffer_capa + 1))
+        return 0;
+    }
+    else if (!imf_byte_sink_flush_buffer(sink)) {
+      return 0;
+    }
+  }
+
+  *ptr = sink->buffer + sink->buffer_length;
+  return sink->buffer_capa - sink->buffer_length;
+}
+
+void
+imf_byte_sink_commit(imf_byte_sink_t *base, size_t length)
+{
+  imf_byte_sink_data_t *sink = IMF_BYTE_SINK_DATA(base);
+
+  assert(length <= sink->buffer_capa - sink->buffer_length);
+  sink->buffer_length += length;
+  base->pos += length;
+}
+
+static VALUE
+imf_byte_sink_alloc(enum imf_byte_sink_kind kind, imf_byte_sink_data_t **sink_ptr)
+{
+  imf_byte_sink_data_t *sink;
+  VALUE obj = TypedData_Make_Struct(0, imf_byte_sink_data_t, &imf_byte_sink_data_type, sink);
+
+  sink->kind = kind;
+  sink->fd = -1;
+  sink->path = Qnil;
+  sink->writer = Qnil;
+  sink->error = Qnil;
+
+  sink->buffer = malloc(IMF_BYTE_SINK_BUFFER_SIZE);
+  if (sink->buffer == NULL)
+    rb_memerror();
+  sink->buffer_capa = IMF_BYTE_SINK_BUFFER_SIZE;
+
+  *sink_ptr = sink;
+  return obj;
+}
+
+/* Returns true if the IO is of a regular file */
+static bool
+imf_byte_sink_io_is_regular_file(VALUE io)
+{
+  struct stat st;
+  int fd = NUM2INT(rb_funcall(io, id_fileno, 0));
+
+  return fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+/* Creates the sink that writes to `dest`, which is a path name, an IO,
+ * or an object that responds to #write.  If `dest` is nil, the bytes
+ * are kept in memory, and returned by imf_byte_sink_close as a String. */
+VALUE
+imf_byte_sink_open(VALUE dest, imf_byte_sink_t **sink_ptr)
+{
+  imf_byte_sink_data_t *sink;
+  VALUE obj;
+
+  if (NIL_P(dest)) {
+    obj = imf_byte_sink_alloc(IMF_BYTE_SINK_MEMORY, &sink);
+  }
+  else if (RB_TYPE_P(dest, T_FILE) && !imf_byte_sink_io_is_regular_file(dest)) {
+    obj = imf_byte_sink_alloc(IMF_BYTE_SINK_WRITER, &sink);
+    sink->writer = dest;
+  }
+  else if (RB_TYPE_P(dest, T_FILE)) {
+    /* Write to the descriptor after flushing the IO's own buffer.
+     * The duplicated descriptor shares the file offset with the IO. */
+    rb_funcall(dest, id_flush, 0);
+    obj = imf_byte_sink_alloc(IMF_BYTE_SINK_FD, &sink);
+    sink->fd = rb_cloexec_dup(NUM2INT(rb_funcall(dest, id_fileno, 0)));
+    if (sink->fd < 0)
+      rb_sys_fail("dup");
+    rb_update_max_fd(sink->fd);
+  }
+  else if (RB_TYPE_P(dest, T_STRING) || rb_respond_to(dest, id_to_path)) {
+    VALUE path = rb_get_path(dest);
+    obj = imf_byte_sink_alloc(IMF_BYTE_SINK_PATH, &sink);
+    sink->path = path;
+    sink->fd = rb_cloexec_open(RSTRING_PTR(path), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (sink->fd < 0)
+      rb_sys_fail_str(path);
+    rb_update_max_fd(sink->fd);
+  }
+  else if (rb_respond_to(dest, id_write)) {
+    obj = imf_byte_sink_alloc(IMF_BYTE_SINK_WRITER, &sink);
+    sink->writer = dest;
+  }
+  else {
+    rb_raise(rb_eTypeError, "destination must be a path name, an IO, or an object that responds to #write");
+  }
+
+  *sink_ptr = &sink->base;
+  return obj;
+}
+
+/* Flushes and closes the sink, and raises the error that occurred while
+ * writing.  When `success` is false, the file created for a path name is
+ * removed.  Returns the written String for a memory sink, otherwise nil. */
+VALUE
+imf_byte_sink_close(VALUE obj, bool success)
+{
+  imf_byte_sink_data_t *sink = imf_get_byte_sink_data(obj);
+  VALUE result = Qnil;
+
+  sink->base.without_gvl = false;
+  if (success)
+    success = imf_byte_sink_flush(&sink->base);
+
+  if (success && sink->kind == IMF_BYTE_SINK_MEMORY)
+    result = rb_str_new((char const *) sink->buffer, (long) sink->buffer_length);
+
+  if (sink->fd >= 0) {
+    if (close(sink->fd) < 0 && success) {
+      imf_byte_sink_fail_errno(sink, errno);
+      success = false;
+    }
+    sink->fd = -1;
+  }
+
+  if (!success && sink->kind == IMF_BYTE_SINK_PATH)
+    unlink(RSTRING_PTR(sink->path));
+
+  imf_byte_sink_release(sink);
+
+  if (!NIL_P(sink->error))
+    rb_exc_raise(sink->error);
+  if (sink->error_errno != 0) {
+    errno = sink->error_errno;
+    if (!NIL_P(sink->path))
+      rb_sys_fail_str(sink->path);
+    rb_sys_fail("write");
+  }
+
+  return result;
+}
+
+void
+Init_imf_byte_sink(void)
+{
+  id_fileno = rb_intern("fileno");
+  id_flush = rb_intern("flush");
+  id_to_path = rb_intern("to_path");
+  id_write = rb_intern("write");
+}
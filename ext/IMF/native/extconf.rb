@@ -5,6 +5,20 @@ $CFLAGS += " -I#{imf_include_dir}"
 
 have_func('rb_ary_new_capa')
 
+have_header('ruby/thread.h')
+have_func('rb_thread_call_without_gvl', 'ruby/thread.h')
+have_func('rb_thread_call_with_gvl', 'ruby/thread.h')
+
+have_header('ruby/thread_native.h')
+have_header('pthread.h') && have_library('pthread', 'pthread_create')
+have_func('rb_gc_adjust_memory_usage')
+have_func('posix_memalign', 'stdlib.h')
+
+have_header('fcntl.h')
+have_header('sys/mman.h')
+have_func('mmap', 'sys/mman.h')
+have_func('madvise', 'sys/mman.h')
+
 dir_config('jpeg')
 
 unless have_header('jpeglib.h') && have_library('jpeg')
@@ -0,0 +1,774 @@
+#include "IMF.h"
+
+#include <math.h>
+#include <ruby/st.h>
+
+#include "internal.h"
+
+/* Fast Fourier transform
+ *
+ * A plan of size n factors n into radices of 4, 2, 3, 5, and other primes,
+ * and holds the twiddle factors exp(-2 pi i k / n).  The transform is the
+ * mixed radix decimation in time, which recursively transforms the m = n / p
+ * interleaved subsequences and combines them by butterflies of radix p.
+ * A size with a prime factor larger than IMF_FFT_MAX_RADIX is transformed
+ * by Bluestein's algorithm, as a convolution of a power of two size.
+ *
+ * The real transforms of even size n pack the samples into n / 2 complex
+ * numbers, and split the result into the spectra of the even and odd
+ * samples.  Those of odd size are the complex transforms of the samples.
+ *
+ * Plans are made with the GVL held, cached by size for the lifetime of the
+ * process, and never modified afterwards, so that the transforms can use
+ * them on any thread without the GVL.  The transforms are unnormalized in
+ * both directions. */
+
+enum imf_fft_constants {
+  /* the largest radix of the butterflies.  Larger prime factors make the
+   * generic butterfly slower than Bluestein's algorithm. */
+  IMF_FFT_MAX_RADIX = 13,
+  /* columns transformed together in the 2D transforms, so that a pass over
+   * the rows reads whole cache lines */
+  IMF_FFT_COLUMN_GROUP = 8,
+  /* samples in a band of rows or columns processed by a thread */
+  IMF_FFT_MIN_BAND_SAMPLES = 64 * 1024,
+};
+
+struct imf_fft_plan {
+  size_t n;
+  /* pairs of the radix p and the size m = n / p at each stage */
+  size_t factors[2 * sizeof(size_t) * CHAR_BIT];
+  imf_complex_t *twiddles;
+  /* Bluestein's algorithm: the chirp exp(-pi i k^2 / n), and the spectrum
+   * of its conjugate of size inner->n */
+  imf_fft_plan_t const *inner;
+  imf_complex_t *chirp;
+  imf_complex_t *chirp_spectrum;
+};
+
+struct imf_fft_real_plan {
+  size_t n;
+  /* the plan of n / 2 for an even n, or of n for an odd n */
+  imf_fft_plan_t const *plan;
+  /* exp(-2 pi i k / n) for k < n / 2 for an even n */
+  imf_complex_t *twiddles;
+};
+
+static st_table *fft_plans;
+static st_table *fft_real_plans;
+
+static inline imf_complex_t
+imf_complex_mul(imf_complex_t a, imf_complex_t b)
+{
+  imf_complex_t c;
+  c.re = a.re * b.re - a.im * b.im;
+  c.im = a.re * b.im + a.im * b.re;
+  return c;
+}
+
+static inline imf_complex_t
+imf_complex_add(imf_complex_t a, imf_complex_t b)
+{
+  imf_complex_t c;
+  c.re = a.re + b.re;
+  c.im = a.im + b.im;
+  return c;
+}
+
+static inline imf_complex_t
+imf_complex_sub(imf_complex_t a, imf_complex_t b)
+{
+  imf_complex_t c;
+  c.re = a.re - b.re;
+  c.im = a.im - b.im;
+  return c;
+}
+
+static inline imf_complex_t
+imf_complex_conj(imf_complex_t a)
+{
+  a.im = -a.im;
+  return a;
+}
+
+/* exp(-2 pi i k / n) */
+static inline imf_complex_t
+imf_fft_twiddle(size_t k, size_t n)
+{
+  double const phase = -2.0 * M_PI * (double) k / (double) n;
+  imf_complex_t w;
+  w.re = cos(phase);
+  w.im = sin(phase);
+  return w;
+}
+
+/* Butterflies
+ *
+ * Each combines p transforms of size m at out, out + m, ..., which are the
+ * transforms of the subsequences, into a transform of size p * m.  The
+ * twiddle factors of the stage are every stride-th one of the plan. */
+
+static void
+imf_fft_butterfly2(imf_complex_t *out, imf_complex_t const *tw, size_t stride, size_t m)
+{
+  imf_complex_t *out2 = out + m;
+  size_t k;
+
+  for (k = 0; k < m; ++k) {
+    imf_complex_t const t = imf_complex_mul(out2[k], tw[k * stride]);
+    out2[k] = imf_complex_sub(out[k], t);
+    out[k] = imf_complex_add(out[k], t);
+  }
+}
+
+static void
+imf_fft_butterfly3(imf_complex_t *out, imf_complex_t const *tw, size_t stride, size_t m)
+{
+  /* the imaginary part of exp(-2 pi i / 3) */
+  double const epi3 = tw[stride * m].im;
+  size_t k;
+
+  for (k = 0; k < m; ++k) {
+    imf_complex_t const s1 = imf_complex_mul(out[k + m], tw[k * stride]);
+    imf_complex_t const s2 = imf_complex_mul(out[k + 2 * m], tw[2 * k * stride]);
+    imf_complex_t const s3 = imf_complex_add(s1, s2);
+    imf_complex_t s0 = imf_complex_sub(s1, s2);
+    imf_complex_t a;
+
+    a.re = out[k].re - 0.5 * s3.re;
+    a.im = out[k].im - 0.5 * s3.im;
+    s0.re *= epi3;
+    s0.im *= epi3;
+    out[k] = imf_complex_add(out[k], s3);
+    out[k + 2 * m].re = a.re + s0.im;
+    out[k + 2 * m].im = a.im - s0.re;
+    out[k + m].re = a.re - s0.im;
+    out[k + m].im = a.im + s0.re;
+  }
+}
+
+static void
+imf_fft_butterfly4(imf_complex_t *out, imf_complex_t const *tw, size_t stride, size_t m)
+{
+  size_t k;
+
+  for (k = 0; k < m; ++k) {
+    imf_complex_t const s0 = imf_complex_mul(out[k + m], tw[k * stride]);
+    imf_complex_t const s1 = imf_complex_mul(out[k + 2 * m], tw[2 * k * stride]);
+    imf_complex_t const s2 = imf_complex_mul(out[k + 3 * m], tw[3 * k * stride]);
+    imf_complex_t const s5 = imf_complex_sub(out[k], s1);
+    imf_complex_t const a = imf_complex_add(out[k], s1);
+    imf_complex_t const s3 = imf_complex_add(s0, s2);
+    imf_complex_t const s4 = imf_complex_sub(s0, s2);
+
+    out[k] = imf_complex_add(a, s3);
+    out[k + 2 * m] = imf_complex_sub(a, s3);
+    out[k + m].re = s5.re + s4.im;
+    out[k + m].im = s5.im - s4.re;
+    out[k + 3 * m].re = s5.re - s4.im;
+    out[k + 3 * m].im = s5.im + s4.re;
+  }
+}
+
+static void
+imf_fft_butterfly5(imf_complex_t *out, imf_complex_t const *tw, size_t stride, size_t m)
+{
+  /* exp(-2 pi i / 5) and exp(-4 pi i / 5) */
+  imf_complex_t const ya = tw[stride * m], yb = tw[2 * stride * m];
+  size_t k;
+
+  for (k = 0; k < m; ++k) {
+    imf_complex_t const s0 = out[k];
+    imf_complex_t const s1 = imf_complex_mul(out[k + m], tw[k * stride]);
+    imf_complex_t const s2 = imf_complex_mul(out[k + 2 * m], tw[2 * k * stride]);
+    imf_complex_t const s3 = imf_complex_mul(out[k + 3 * m], tw[3 * k * stride]);
+    imf_complex_t const s4 = imf_complex_mul(out[k + 4 * m], tw[4 * k * stride]);
+    imf_complex_t const s7 = imf_complex_add(s1, s4), s10 = imf_complex_sub(s1, s4);
+    imf_complex_t const s8 = imf_complex_add(s2, s3), s9 = imf_complex_sub(s2, s3);
+    imf_complex_t s5, s6, s11, s12;
+
+    out[k].re = s0.re + s7.re + s8.re;
+    out[k].im = s0.im + s7.im + s8.im;
+
+    s5.re = s0.re + s7.re * ya.re + s8.re * yb.re;
+    s5.im = s0.im + s7.im * ya.re + s8.im * yb.re;
+    s6.re = s10.im * ya.im + s9.im * yb.im;
+    s6.im = -s10.re * ya.im - s9.re * yb.im;
+    out[k + m] = imf_complex_sub(s5, s6);
+    out[k + 4 * m] = imf_complex_add(s5, s6);
+
+    s11.re = s0.re + s7.re * yb.re + s8.re * ya.re;
+    s11.im = s0.im + s7.im * yb.re + s8.im * ya.re;
+    s12.re = -s10.im * yb.im + s9.im * ya.im;
+    s12.im = s10.re * yb.im - s9.re * ya.im;
+    out[k + 2 * m] = imf_complex_add(s11, s12);
+    out[k + 3 * m] = imf_complex_sub(s11, s12);
+  }
+}
+
+/* A direct DFT of size p for any radix up to IMF_FFT_MAX_RADIX */
+static void
+imf_fft_butterfly_generic(imf_complex_t *out, imf_complex_t const *tw, size_t stride, size_t m,
+                          size_t p, size_t n)
+{
+  imf_complex_t scratch[IMF_FFT_MAX_RADIX];
+  size_t u, q, q1;
+
+  for (u = 0; u < m; ++u) {
+    for (q = 0; q < p; ++q)
+      scratch[q] = out[u + q * m];
+
+    for (q1 = 0; q1 < p; ++q1) {
+      size_t const k = u + q1 * m;
+      size_t index = 0;
+      imf_complex_t sum = scratch[0];
+      for (q = 1; q < p; ++q) {
+        /* stride * k < n */
+        index += stride * k;
+        if (index >= n)
+          index -= n;
+        sum = imf_complex_add(sum, imf_complex_mul(scratch[q], tw[index]));
+      }
+      out[k] = sum;
+    }
+  }
+}
+
+/* Transforms the n samples in, which are stride elements apart, into out */
+static void
+imf_fft_work(imf_fft_plan_t const *plan, imf_complex_t *out, imf_complex_t const *in,
+             size_t stride, size_t const *factors)
+{
+  size_t const p = factors[0], m = factors[1];
+  size_t q;
+
+  if (m == 1) {
+    for (q = 0; q < p; ++q)
+      out[q] = in[q * stride];
+  }
+  else {
+    for (q = 0; q < p; ++q)
+      imf_fft_work(plan, out + q * m, in + q * stride, stride * p, factors + 2);
+  }
+
+  switch (p) {
+    case 2:
+      imf_fft_butterfly2(out, plan->twiddles, stride, m);
+      break;
+    case 3:
+      imf_fft_butterfly3(out, plan->twiddles, stride, m);
+      break;
+    case 4:
+      imf_fft_butterfly4(out, plan->twiddles, stride, m);
+      break;
+    case 5:
+      imf_fft_butterfly5(out, plan->twiddles, stride, m);
+      break;
+    default:
+      imf_fft_butterfly_generic(out, plan->twiddles, stride, m, p, plan->n);
+      break;
+  }
+}
+
+size_t
+imf_fft_scratch_size(imf_fft_plan_t const *plan)
+{
+  return plan->inner != NULL ? 2 * plan->inner->n : plan->n;
+}
+
+void
+imf_fft_forward(imf_fft_plan_t const *plan, imf_complex_t *data, imf_complex_t *scratch)
+{
+  size_t const n = plan->n;
+  size_t k;
+
+  if (n == 1)
+    return;
+
+  if (plan->inner == NULL) {
+    memcpy(scratch, data, n * sizeof(imf_complex_t));
+    imf_fft_work(plan, data, scratch, 1, plan->factors);
+    return;
+  }
+
+  /* Bluestein's algorithm: X = chirp * (chirp^-1 conv (chirp * x)) */
+  size_t const m = plan->inner->n;
+  imf_complex_t *a = scratch, *b = scratch + m;
+  double const scale = 1.0 / (double) m;
+
+  for (k = 0; k < n; ++k)
+    a[k] = imf_complex_mul(data[k], plan->chirp[k]);
+  memset(a + n, 0, (m - n) * sizeof(imf_complex_t));
+  imf_fft_work(plan->inner, b, a, 1, plan->inner->factors);
+
+  /* the inverse transform by conjugating the input and the output */
+  for (k = 0; k < m; ++k)
+    b[k] = imf_complex_conj(imf_complex_mul(b[k], plan->chirp_spectrum[k]));
+  imf_fft_work(plan->inner, a, b, 1, plan->inner->factors);
+
+  for (k = 0; k < n; ++k) {
+    imf_complex_t const c = imf_complex_mul(imf_complex_conj(a[k]), plan->chirp[k]);
+    data[k].re = c.re * scale;
+    data[k].im = c.im * scale;
+  }
+}
+
+void
+imf_fft_inverse(imf_fft_plan_t const *plan, imf_complex_t *data, imf_complex_t *scratch)
+{
+  size_t const n = plan->n;
+  size_t k;
+
+  for (k = 0; k < n; ++k)
+    data[k].im = -data[k].im;
+  imf_fft_forward(plan, data, scratch);
+  for (k = 0; k < n; ++k)
+    data[k].im = -data[k].im;
+}
+
+/* Real transforms */
+
+size_t
+imf_fft_real_buffer_size(imf_fft_real_plan_t const *rplan)
+{
+  return rplan->n % 2 == 0 ? rplan->n / 2 + 1 : rplan->n;
+}
+
+size_t
+imf_fft_real_scratch_size(imf_fft_real_plan_t const *rplan)
+{
+  return imf_fft_scratch_size(rplan->plan);
+}
+
+void
+imf_fft_real_forward(imf_fft_real_plan_t const *rplan, double const *in, imf_complex_t *buf,
+                     imf_complex_t *scratch)
+{
+  size_t const n = rplan->n;
+  size_t k;
+
+  if (n % 2 != 0) {
+    for (k = 0; k < n; ++k) {
+      buf[k].re = in[k];
+      buf[k].im = 0.0;
+    }
+    imf_fft_forward(rplan->plan, buf, scratch);
+    return;
+  }
+
+  /* z[k] = x[2k] + i x[2k + 1], and Z is split into the spectra of the even
+   * and odd samples, E[k] = (Z[k] + conj Z[h - k]) / 2 and O[k] =
+   * (Z[k] - conj Z[h - k]) / 2i, so that X[k] = E[k] + W^k O[k] */
+  size_t const h = n / 2;
+  memcpy(buf, in, n * sizeof(double));
+  imf_fft_forward(rplan->plan, buf, scratch);
+
+  imf_complex_t const z0 = buf[0];
+  buf[0].re = z0.re + z0.im;
+  buf[0].im = 0.0;
+  buf[h].re = z0.re - z0.im;
+  buf[h].im = 0.0;
+
+  for (k = 1; k <= h / 2; ++k) {
+    size_t const j = h - k;
+    imf_complex_t const zk = buf[k], zj = buf[j];
+    imf_complex_t ek, ok, ej, oj;
+
+    ek.re = 0.5 * (zk.re + zj.re);
+    ek.im = 0.5 * (zk.im - zj.im);
+    ok.re = 0.5 * (zk.im + zj.im);
+    ok.im = -0.5 * (zk.re - zj.re);
+    ej.re = ek.re;
+    ej.im = -ek.im;
+    oj.re = ok.re;
+    oj.im = -ok.im;
+
+    buf[k] = imf_complex_add(ek, imf_complex_mul(rplan->twiddles[k], ok));
+    buf[j] = imf_complex_add(ej, imf_complex_mul(rplan->twiddles[j], oj));
+  }
+}
+
+void
+imf_fft_real_inverse(imf_fft_real_plan_t const *rplan, imf_complex_t *buf, double *out,
+                     imf_complex_t *scratch)
+{
+  size_t const n = rplan->n;
+  size_t k;
+
+  if (n % 2 != 0) {
+    for (k = n / 2 + 1; k < n; ++k)
+      buf[k] = imf_complex_conj(buf[n - k]);
+    imf_fft_inverse(rplan->plan, buf, scratch);
+    for (k = 0; k < n; ++k)
+      out[k] = buf[k].re;
+    return;
+  }
+
+  /* Z[k] = E[k] + i O[k], where E[k] = X[k] + conj X[h - k] and O[k] =
+   * (X[k] - conj X[h - k]) W^-k are twice the spectra of the even and odd
+   * samples, so that the inverse transform of size h gives n x */
+  size_t const h = n / 2;
+  imf_complex_t const x0 = buf[0], xh = buf[h];
+  buf[0].re = x0.re + xh.re - (x0.im + xh.im);
+  buf[0].im = x0.im - xh.im + (x0.re - xh.re);
+
+  for (k = 1; k <= h / 2; ++k) {
+    size_t const j = h - k;
+    imf_complex_t const xk = buf[k], xj = buf[j];
+    imf_complex_t ek, dk, ok, ej, dj, oj;
+
+    ek.re = xk.re + xj.re;
+    ek.im = xk.im - xj.im;
+    dk.re = xk.re - xj.re;
+    dk.im = xk.im + xj.im;
+    ok = imf_complex_mul(dk, imf_complex_conj(rplan->twiddles[k]));
+    ej.re = ek.re;
+    ej.im = -ek.im;
+    dj.re = -dk.re;
+    dj.im = dk.im;
+    oj = imf_complex_mul(dj, imf_complex_conj(rplan->twiddles[j]));
+
+    buf[k].re = ek.re - ok.im;
+    buf[k].im = ek.im + ok.re;
+    buf[j].re = ej.re - oj.im;
+    buf[j].im = ej.im + oj.re;
+  }
+
+  imf_fft_inverse(rplan->plan, buf, scratch);
+  memcpy(out, buf, n * sizeof(double));
+}
+
+/* 2D transforms
+ *
+ * The spectrum of a width x height real image is height rows of
+ * width / 2 + 1 complex numbers.  The rows are transformed first, and then
+ * the columns in groups, on bands of rows and columns in parallel. */
+
+typedef struct imf_fft_2d imf_fft_2d_t;
+struct imf_fft_2d {
+  imf_fft_real_plan_t const *rows;
+  imf_fft_plan_t const *columns;
+  size_t width, height, bins;
+  double *samples;
+  size_t stride;
+  imf_complex_t *spectrum;
+  bool inverse;
+  bool failed;
+};
+
+static void
+imf_fft_2d_rows_band(void *arg, size_t begin, size_t end)
+{
+  imf_fft_2d_t *t = (imf_fft_2d_t *) arg;
+  imf_complex_t *buf = malloc(imf_fft_real_buffer_size(t->rows) * sizeof(imf_complex_t));
+  imf_complex_t *scratch = malloc(imf_fft_real_scratch_size(t->rows) * sizeof(imf_complex_t));
+  size_t y;
+
+  if (buf == NULL || scratch == NULL) {
+    t->failed = true;
+    goto done;
+  }
+
+  for (y = begin; y < end; ++y) {
+    imf_complex_t *row = t->spectrum + y * t->bins;
+    double *samples = t->samples + y * t->stride;
+    if (t->inverse) {
+      memcpy(buf, row, t->bins * sizeof(imf_complex_t));
+      imf_fft_real_inverse(t->rows, buf, samples, scratch);
+    }
+    else {
+      imf_fft_real_forward(t->rows, samples, buf, scratch);
+      memcpy(row, buf, t->bins * sizeof(imf_complex_t));
+    }
+  }
+
+done:
+  free(buf);
+  free(scratch);
+}
+
+static void
+imf_fft_2d_columns_band(void *arg, size_t begin, size_t end)
+{
+  imf_fft_2d_t *t = (imf_fft_2d_t *) arg;
+  size_t const height = t->height;
+  imf_complex_t *columns = malloc(IMF_FFT_COLUMN_GROUP * height * sizeof(imf_complex_t));
+  imf_complex_t *scratch = malloc(imf_fft_scratch_size(t->columns) * sizeof(imf_complex_t));
+  size_t g, u, v;
+
+  if (columns == NULL || scratch == NULL) {
+    t->failed = true;
+    goto done;
+  }
+
+  for (g = begin; g < end; ++g) {
+    size_t const first = g * IMF_FFT_COLUMN_GROUP;
+    size_t const count = t->bins - first < IMF_FFT_COLUMN_GROUP ? t->bins - first : IMF_FFT_COLUMN_GROUP;
+
+    for (v = 0; v < height; ++v) {
+      imf_complex_t const *row = t->spectrum + v * t->bins + first;
+      for (u = 0; u < count; ++u)
+        columns[u * height + v] = row[u];
+    }
+
+    for (u = 0; u < count; ++u) {
+      if (t->inverse)
+        imf_fft_inverse(t->columns, columns + u * height, scratch);
+      else
+        imf_fft_forward(t->columns, columns + u * height, scratch);
+    }
+
+    for (v = 0; v < height; ++v) {
+      imf_complex_t *row = t->spectrum + v * t->bins + first;
+      for (u = 0; u < count; ++u)
+        row[u] = columns[u * height + v];
+    }
+  }
+
+done:
+  free(columns);
+  free(scratch);
+}
+
+static bool
+imf_fft_2d_run(imf_fft_2d_t *t)
+{
+  size_t const groups = (t->bins + IMF_FFT_COLUMN_GROUP - 1) / IMF_FFT_COLUMN_GROUP;
+  size_t const min_rows = IMF_FFT_MIN_BAND_SAMPLES / t->width + 1;
+  size_t const min_groups = IMF_FFT_MIN_BAND_SAMPLES / (IMF_FFT_COLUMN_GROUP * t->height) + 1;
+
+  t->failed = false;
+  if (t->inverse) {
+    imf_parallel_for_rows(groups, min_groups, imf_fft_2d_columns_band, t);
+    if (!t->failed)
+      imf_parallel_for_rows(t->height, min_rows, imf_fft_2d_rows_band, t);
+  }
+  else {
+    imf_parallel_for_rows(t->height, min_rows, imf_fft_2d_rows_band, t);
+    if (!t->failed)
+      imf_parallel_for_rows(groups, min_groups, imf_fft_2d_columns_band, t);
+  }
+
+  return !t->failed;
+}
+
+bool
+imf_fft_2d_forward(imf_fft_real_plan_t const *rows, imf_fft_plan_t const *columns,
+                   double const *samples, size_t stride, imf_complex_t *spectrum)
+{
+  imf_fft_2d_t t;
+
+  t.rows = rows;
+  t.columns = columns;
+  t.width = rows->n;
+  t.height = columns->n;
+  t.bins = rows->n / 2 + 1;
+  t.samples = (double *) samples;
+  t.stride = stride;
+  t.spectrum = spectrum;
+  t.inverse = false;
+  return imf_fft_2d_run(&t);
+}
+
+bool
+imf_fft_2d_inverse(imf_fft_real_plan_t const *rows, imf_fft_plan_t const *columns,
+                   imf_complex_t *spectrum, double *samples, size_t stride)
+{
+  imf_fft_2d_t t;
+
+  t.rows = rows;
+  t.columns = columns;
+  t.width = rows->n;
+  t.height = columns->n;
+  t.bins = rows->n / 2 + 1;
+  t.samples = samples;
+  t.stride = stride;
+  t.spectrum = spectrum;
+  t.inverse = true;
+  return imf_fft_2d_run(&t);
+}
+
+/* Plans */
+
+static void
+imf_fft_plan_factor(imf_fft_plan_t *plan)
+{
+  size_t n = plan->n, p = 4, i = 0;
+
+  do {
+    while (n % p != 0) {
+      switch (p) {
+        case 4:
+          p = 2;
+          break;
+        case 2:
+          p = 3;
+          break;
+        default:
+          p += 2;
+          break;
+      }
+      if (p * p > n)
+        p = n;
+    }
+    n /= p;
+    plan->factors[i++] = p;
+    plan->factors[i++] = n;
+  } while (n > 1);
+}
+
+static bool
+imf_fft_plan_has_large_factor(imf_fft_plan_t const *plan)
+{
+  size_t const *f;
+
+  for (f = plan->factors; ; f += 2) {
+    if (f[0] > IMF_FFT_MAX_RADIX)
+      return true;
+    if (f[1] == 1)
+      return false;
+  }
+}
+
+static imf_fft_plan_t const *
+imf_fft_plan_new(size_t n)
+{
+  imf_fft_plan_t *plan = ZALLOC(imf_fft_plan_t);
+  size_t k;
+
+  plan->n = n;
+  plan->twiddles = ALLOC_N(imf_complex_t, n);
+  for (k = 0; k < n; ++k)
+    plan->twiddles[k] = imf_fft_twiddle(k, n);
+  imf_fft_plan_factor(plan);
+
+  if (imf_fft_plan_has_large_factor(plan)) {
+    size_t m = 1;
+    while (m < 2 * n - 1)
+      m <<= 1;
+    plan->inner = imf_fft_plan(m);
+
+    /* exp(-pi i k^2 / n), where k^2 is reduced modulo 2n to keep the phase
+     * accurate */
+    plan->chirp = ALLOC_N(imf_complex_t, n);
+    for (k = 0; k < n; ++k) {
+      size_t const k2 = (size_t) (((unsigned long long) k * k) % (2 * n));
+      double const phase = -M_PI * (double) k2 / (double) n;
+      plan->chirp[k].re = cos(phase);
+      plan->chirp[k].im = sin(phase);
+    }
+
+    imf_complex_t *b = ZALLOC_N(imf_complex_t, m);
+    imf_complex_t *scratch = ALLOC_N(imf_complex_t, imf_fft_scratch_size(plan->inner));
+    b[0] = imf_complex_conj(plan->chirp[0]);
+    for (k = 1; k < n; ++k)
+      b[k] = b[m - k] = imf_complex_conj(plan->chirp[k]);
+    imf_fft_forward(plan->inner, b, scratch);
+    xfree(scratch);
+    plan->chirp_spectrum = b;
+  }
+
+  return plan;
+}
+
+imf_fft_plan_t const *
+imf_fft_plan(size_t n)
+{
+  st_data_t value;
+  imf_fft_plan_t const *plan;
+
+  if (st_lookup(fft_plans, (st_data_t) n, &value))
+    return (imf_fft_plan_t const *) value;
+
+  plan = imf_fft_plan_new(n);
+  st_insert(fft_plans, (st_data_t) n, (st_data_t) plan);
+  return plan;
+}
+
+imf_fft_real_plan_t const *
+imf_fft_real_plan(size_t n)
+{
+  st_data_t value;
+  imf_fft_real_plan_t *rplan;
+  size_t k;
+
+  if (st_lookup(fft_real_plans, (st_data_t) n, &value))
+    return (imf_fft_real_plan_t const *) value;
+
+  rplan = ZALLOC(imf_fft_real_plan_t);
+  rplan->n = n;
+  if (n % 2 == 0) {
+    rplan->plan = imf_fft_plan(n / 2);
+    rplan->twiddles = ALLOC_N(imf_complex_t, n / 2);
+    for (k = 0; k < n / 2; ++k)
+      rplan->twiddles[k] = imf_fft_twiddle(k, n);
+  }
+  else {
+    rplan->plan = imf_fft_plan(n);
+  }
+
+  st_insert(fft_real_plans, (st_data_t) n, (st_data_t) rplan);
+  return rplan;
+}
+
+size_t
+imf_fft_size(imf_fft_plan_t const *plan)
+{
+  return plan->n;
+}
+
+/* Returns the smallest size not less than n whose prime factors are 2, 3,
+ * and 5, which the butterflies transform fastest */
+size_t
+imf_fft_good_size(size_t n)
+{
+  size_t best = 1, p2, p3, p5;
+
+  while (best < n)
+    best <<= 1;
+
+  for (p5 = 1; p5 < best; p5 *= 5) {
+    for (p3 = p5; p3 < best; p3 *= 3) {
+      p2 = p3;
+      while (p2 < n)
+        p2 <<= 1;
+      if (p2 < best)
+        best = p2;
+    }
+  }
+
+  return best;
+}
+
+static int
+imf_fft_plan_sizes_i(st_data_t key, st_data_t value, st_data_t arg)
+{
+  rb_ary_push((VALUE) arg, SIZET2NUM((size_t) key));
+  return ST_CONTINUE;
+}
+
+/*
+ * call-seq:
+ *   IMF.fft_plan_sizes -> array of integers
+ *
+ * Returns the sorted sizes of the cached complex FFT plans.  The plans are
+ * kept for the lifetime of the process, so transforms of the same size
+ * reuse their twiddle factors.
+ */
+static VALUE
+imf_s_fft_plan_sizes(VALUE mod)
+{
+  VALUE ary = rb_ary_new_capa((long) fft_plans->num_entries);
+
+  st_foreach(fft_plans, imf_fft_plan_sizes_i, (st_data_t) ary);
+  return rb_ary_sort_bang(ary);
+}
+
+void
+Init_imf_fft(void)
+{
+  fft_plans = st_init_numtable();
+  fft_real_plans = st_init_numtable();
+
+  rb_define_singleton_method(imf_mIMF, "fft_plan_sizes", imf_s_fft_plan_sizes, 0);
+}
@@ -5,6 +5,7 @@ VALUE imf_cIMF_FileFormat_Base;
 static VALUE imf_cIMF_FileFormatRegistry;
 
 static ID id_detect;
+static ID id_detect_format;
 static ID id_extnames;
 static ID id_file_formats_for_filename;
 static ID id_register_file_format;
@@ -97,37 +98,378 @@ imf_get_file_format_data(VALUE obj)
    return ptr;
 }
 
+typedef struct imf_file_format_read_args imf_file_format_read_args_t;
+struct imf_file_format_read_args {
+  imf_file_format_interface_t *iface;
+  imf_file_format_t *fmt;
+  VALUE imgsrc_obj;
+  imf_image_t *img;
+  imf_load_options_t const *opts;
+};
+
+static VALUE
+imf_file_format_detect_body(VALUE arg)
+{
+  imf_file_format_read_args_t *args = (imf_file_format_read_args_t *) arg;
+  int const res = args->iface->detect(args->fmt, args->imgsrc_obj);
+  imf_byte_source_rewind(imf_image_source_get_byte_source(args->imgsrc_obj));
+  return res ? Qtrue : Qfalse;
+}
+
 VALUE
 imf_file_format_detect(VALUE fmt_obj, VALUE imgsrc_obj)
 {
-  int res = 0;
+  imf_file_format_read_args_t args;
 
-  imf_file_format_interface_t *iface = imf_file_format_interface(fmt_obj);
-  imf_file_format_t *fmt = imf_get_file_format_data(fmt_obj);
+  args.iface = imf_file_format_interface(fmt_obj);
+  args.fmt = imf_get_file_format_data(fmt_obj);
+  args.imgsrc_obj = imgsrc_obj;
 
-  if (iface != NULL && iface->detect != NULL) {
-    res = iface->detect(fmt, imgsrc_obj);
-    rb_funcall(imgsrc_obj, id_rewind, 0);
-  }
+  if (args.iface == NULL || args.iface->detect == NULL)
+    return Qfalse;
 
-  return res ? Qtrue : Qfalse;
+  return imf_image_source_protect(imgsrc_obj, imf_file_format_detect_body, (VALUE) &args);
+}
+
+static VALUE
+imf_file_format_load_body(VALUE arg)
+{
+  imf_file_format_read_args_t *args = (imf_file_format_read_args_t *) arg;
+  args->iface->load(args->fmt, args->img, args->imgsrc_obj, args->opts);
+  return Qnil;
 }
 
 VALUE
-imf_file_format_load(VALUE fmt_obj, VALUE image_obj, VALUE imgsrc_obj)
+imf_file_format_load(VALUE fmt_obj, VALUE image_obj, VALUE imgsrc_obj, imf_load_options_t const *opts)
+{
+  imf_file_format_read_args_t args;
+
+  args.iface = imf_file_format_interface(fmt_obj);
+  args.fmt = imf_get_file_format_data(fmt_obj);
+  args.imgsrc_obj = imgsrc_obj;
+  args.img = imf_get_image_data(image_obj);
+  args.opts = opts;
+
+  if (args.iface != NULL && args.iface->load != NULL)
+    imf_image_source_protect(imgsrc_obj, imf_file_format_load_body, (VALUE) &args);
+
+  return image_obj;
+}
+
+static VALUE
+imf_file_format_probe_body(VALUE arg)
+{
+  imf_file_format_read_args_t *args = (imf_file_format_read_args_t *) arg;
+  args->iface->probe(args->fmt, args->imgsrc_obj, args->img);
+  return Qnil;
+}
+
+/* Reads the header of the image source into img without allocating the
+ * pixel buffer. */
+void
+imf_file_format_probe(VALUE fmt_obj, VALUE imgsrc_obj, imf_image_t *img)
+{
+  imf_file_format_read_args_t args;
+
+  args.iface = imf_file_format_interface(fmt_obj);
+  args.fmt = imf_get_file_format_data(fmt_obj);
+  args.imgsrc_obj = imgsrc_obj;
+  args.img = img;
+
+  if (args.iface == NULL || args.iface->probe == NULL)
+    rb_raise(rb_eNotImpError, "%"PRIsVALUE" does not support probing", rb_obj_class(fmt_obj));
+
+  imf_image_source_protect(imgsrc_obj, imf_file_format_probe_body, (VALUE) &args);
+}
+
+typedef struct imf_file_format_save_args imf_file_format_save_args_t;
+struct imf_file_format_save_args {
+  imf_file_format_interface_t *iface;
+  imf_file_format_t *fmt;
+  imf_image_t const *img;
+  imf_byte_sink_t *sink;
+  VALUE opts;
+};
+
+static VALUE
+imf_file_format_save_body(VALUE arg)
+{
+  imf_file_format_save_args_t *args = (imf_file_format_save_args_t *) arg;
+  args->iface->save(args->fmt, args->img, args->sink, args->opts);
+  return Qnil;
+}
+
+static VALUE
+imf_file_format_save(VALUE fmt_obj, VALUE image_obj, VALUE dest, VALUE opts)
 {
   imf_file_format_interface_t *iface = imf_file_format_interface(fmt_obj);
-  imf_file_format_t *fmt = imf_get_file_format_data(fmt_obj);
-  imf_image_t *img = imf_get_image_data(image_obj);
+  imf_file_format_save_args_t args;
+  VALUE sink_obj, result;
+  int state = 0;
+
+  if (iface == NULL || iface->save == NULL)
+    rb_raise(rb_eNotImpError, "%"PRIsVALUE" does not support saving", rb_obj_class(fmt_obj));
+
+  args.iface = iface;
+  args.fmt = imf_get_file_format_data(fmt_obj);
+  args.img = imf_get_image_data(image_obj);
+  args.opts = opts;
+  imf_image_check_interleaved(args.img);
+
+  if (args.img->data == NULL)
+    rb_raise(rb_eArgError, "the image has no pixels");
+
+  sink_obj = imf_byte_sink_open(dest, &args.sink);
+  rb_protect(imf_file_format_save_body, (VALUE) &args, &state);
+
+  /* The error of the sink is the cause of the encoder's error, if any */
+  result = imf_byte_sink_close(sink_obj, state == 0);
+  if (state)
+    rb_jump_tag(state);
+
+  RB_GC_GUARD(image_obj);
+  return result;
+}
+
+/*
+ * call-seq:
+ *   file_format.save(image, dest, **options) -> image
+ *
+ * Encodes the image into dest, which is a path name, an IO, or an object
+ * that responds to #write.  The options are specific to the format.
+ */
+static VALUE
+imf_file_format_m_save(int argc, VALUE *argv, VALUE fmt_obj)
+{
+  VALUE image_obj, dest, opts;
 
-  if (iface != NULL && iface->load != NULL)
-    iface->load(fmt, img, imgsrc_obj);
+  rb_scan_args(argc, argv, "2:", &image_obj, &dest, &opts);
+  if (NIL_P(dest))
+    rb_raise(rb_eArgError, "no destination is given");
 
+  imf_file_format_save(fmt_obj, image_obj, dest, opts);
   return image_obj;
 }
 
+/*
+ * call-seq:
+ *   file_format.encode(image, **options) -> string
+ *
+ * Encodes the image into a binary String.
+ */
+static VALUE
+imf_file_format_m_encode(int argc, VALUE *argv, VALUE fmt_obj)
+{
+  VALUE image_obj, opts;
+
+  rb_scan_args(argc, argv, "1:", &image_obj, &opts);
+  return imf_file_format_save(fmt_obj, image_obj, Qnil, opts);
+}
+
+static VALUE
+imf_file_format_m_load(int argc, VALUE *argv, VALUE fmt_obj)
+{
+  VALUE image_obj, imgsrc_obj, opts_hash;
+  imf_load_options_t opts;
+
+  rb_scan_args(argc, argv, "2:", &image_obj, &imgsrc_obj, &opts_hash);
+  imf_load_options_init(&opts, opts_hash);
+
+  return imf_file_format_load(fmt_obj, image_obj, imgsrc_obj, &opts);
+}
+
+/* Magic number table
+ *
+ * Every entry is a pair of a file format class and one of its magic
+ * patterns.  The entries are kept ordered by the number of hits, so
+ * that the most frequent format is tried first.  The classes are always
+ * reachable because they are registered in the file format registry. */
+
+typedef struct imf_file_format_magic_entry imf_file_format_magic_entry_t;
+struct imf_file_format_magic_entry {
+  VALUE klass;
+  imf_file_format_magic_t const *magic;
+  imf_file_format_decode_func *decode;
+  size_t hits;
+  bool enabled;
+};
+
+static imf_file_format_magic_entry_t *magic_table;
+static size_t magic_table_length;
+static size_t magic_table_capa;
+
+/* Returns the decode function of the interface of the file format class,
+ * or NULL if it has none */
+static imf_file_format_decode_func *
+imf_file_format_class_get_decode_func(VALUE klass)
+{
+  VALUE fmt_obj = rb_obj_alloc(klass);
+  imf_file_format_interface_t const *iface;
+
+  if (!RB_TYPE_P(fmt_obj, T_DATA) || !RTYPEDDATA_P(fmt_obj))
+    return NULL;
+  iface = imf_file_format_interface(fmt_obj);
+  return iface != NULL ? iface->decode : NULL;
+}
+
+static void
+imf_file_format_add_magics(VALUE klass, imf_file_format_magic_t const *magics)
+{
+  imf_file_format_magic_t const *magic;
+  imf_file_format_decode_func *decode = imf_file_format_class_get_decode_func(klass);
+
+  for (magic = magics; magic->length > 0; ++magic) {
+    imf_file_format_magic_entry_t *entry;
+
+    if (magic->length > IMF_FILE_FORMAT_MAGIC_MAX_LENGTH)
+      rb_raise(rb_eArgError, "too long magic pattern for %"PRIsVALUE, klass);
+
+    if (magic_table_length == magic_table_capa) {
+      magic_table_capa = magic_table_capa == 0 ? 8 : 2 * magic_table_capa;
+      REALLOC_N(magic_table, imf_file_format_magic_entry_t, magic_table_capa);
+    }
+
+    entry = &magic_table[magic_table_length++];
+    entry->klass = klass;
+    entry->magic = magic;
+    entry->decode = decode;
+    entry->hits = 0;
+    entry->enabled = false;
+  }
+}
+
+static inline bool
+imf_file_format_magic_match(imf_file_format_magic_t const *magic, uint8_t const *header, size_t header_length)
+{
+  size_t i;
+
+  if (header_length < magic->length)
+    return false;
+
+  if (magic->mask == NULL)
+    return memcmp(magic->pattern, header, magic->length) == 0;
+
+  for (i = 0; i < magic->length; ++i) {
+    if ((header[i] & (uint8_t) magic->mask[i]) != (uint8_t) magic->pattern[i])
+      return false;
+  }
+  return true;
+}
+
+/* Detects the file format from the leading bytes of the given source.
+ * This peeks the header only once, and does not allocate any object.
+ * Returns the file format class, or nil if no magic pattern matches. */
+VALUE
+imf_detect_file_format_class_by_magic(imf_byte_source_t *src)
+{
+  uint8_t const *header;
+  size_t header_length, i;
+
+  header_length = imf_byte_source_peek(src, IMF_FILE_FORMAT_MAGIC_MAX_LENGTH, &header);
+
+  for (i = 0; i < magic_table_length; ++i) {
+    imf_file_format_magic_entry_t *entry = &magic_table[i];
+
+    if (!entry->enabled)
+      continue;
+
+    if (imf_file_format_magic_match(entry->magic, header, header_length)) {
+      VALUE klass = entry->klass;
+
+      /* move the entry forward while it wins more often */
+      ++entry->hits;
+      while (i > 0 && magic_table[i - 1].hits < magic_table[i].hits) {
+        imf_file_format_magic_entry_t tmp = magic_table[i - 1];
+        magic_table[i - 1] = magic_table[i];
+        magic_table[i] = tmp;
+        --i;
+      }
+
+      return klass;
+    }
+  }
+
+  return Qnil;
+}
+
+/* Copies the enabled entries of the magic number table in the current
+ * order into an array allocated by ALLOC_N, for detecting file formats
+ * without the GVL by imf_file_format_find_decoder.  The entries of the
+ * formats without the decode function are also copied, so that their
+ * sources are not taken by another format.  Returns the number of the
+ * entries. */
+size_t
+imf_file_format_get_decoders(imf_file_format_decoder_t **decoders)
+{
+  size_t i, n = 0;
+
+  *decoders = ALLOC_N(imf_file_format_decoder_t, magic_table_length > 0 ? magic_table_length : 1);
+  for (i = 0; i < magic_table_length; ++i) {
+    if (!magic_table[i].enabled)
+      continue;
+    (*decoders)[n].magic = magic_table[i].magic;
+    (*decoders)[n].decode = magic_table[i].decode;
+    ++n;
+  }
+  return n;
+}
+
+/* Detects the file format of the source by the copied entries.  This can
+ * be called without the GVL.  Returns the decoder entry, or NULL if no
+ * magic pattern matches. */
+imf_file_format_decoder_t const *
+imf_file_format_find_decoder(imf_file_format_decoder_t const *decoders, size_t length, imf_byte_source_t *src)
+{
+  uint8_t const *header;
+  size_t header_length, i;
+
+  header_length = imf_byte_source_peek(src, IMF_FILE_FORMAT_MAGIC_MAX_LENGTH, &header);
+
+  for (i = 0; i < length; ++i) {
+    if (imf_file_format_magic_match(decoders[i].magic, header, header_length))
+      return &decoders[i];
+  }
+  return NULL;
+}
+
+static VALUE
+imf_file_format_s_has_magic(VALUE klass)
+{
+  size_t i;
+
+  for (i = 0; i < magic_table_length; ++i) {
+    if (magic_table[i].klass == klass)
+      return Qtrue;
+  }
+  return Qfalse;
+}
+
+static VALUE
+imf_s_set_file_format_magic_enabled(VALUE mod, VALUE klass, VALUE enabled)
+{
+  size_t i;
+
+  for (i = 0; i < magic_table_length; ++i) {
+    if (magic_table[i].klass == klass)
+      magic_table[i].enabled = RTEST(enabled);
+  }
+  return enabled;
+}
+
+static VALUE
+imf_detect_file_format_class_by_magic_body(VALUE imgsrc_obj)
+{
+  return imf_detect_file_format_class_by_magic(imf_image_source_get_byte_source(imgsrc_obj));
+}
+
+static VALUE
+imf_s_detect_file_format_class_by_magic(VALUE mod, VALUE imgsrc_obj)
+{
+  return imf_image_source_protect(imgsrc_obj, imf_detect_file_format_class_by_magic_body, imgsrc_obj);
+}
+
 void
-imf_register_file_format(VALUE file_format, char const *const *extnames)
+imf_register_file_format(VALUE file_format, char const *const *extnames, imf_file_format_magic_t const *magics)
 {
   VALUE m, base;
   m = rb_const_get(imf_mIMF, rb_intern_const("FileFormat"));
@@ -140,6 +482,8 @@ imf_register_file_format(VALUE file_format, char const *const *extnames)
       rb_ary_push(ary, rb_str_new_cstr(*p));
     }
     imf_file_format_s_set_extnames(file_format, ary);
+    if (magics != NULL)
+      imf_file_format_add_magics(file_format, magics);
     rb_funcall(imf_mIMF, id_register_file_format, 1, file_format);
   }
 }
@@ -164,7 +508,7 @@ imf_find_file_format_by_filename(VALUE path_value)
 VALUE
 imf_detect_file_format(VALUE imgsrc_obj)
 {
-  return rb_funcall(imf_cIMF_Image, rb_intern_const("detect_format"), 1, imgsrc_obj);
+  return rb_funcall(imf_cIMF_Image, id_detect_format, 1, imgsrc_obj);
 }
 
 void
@@ -177,10 +521,17 @@ Init_imf_file_format(void)
   rb_define_singleton_method(imf_cIMF_FileFormat_Base, "format_name", imf_file_format_s_get_format_name, 0);
   rb_define_singleton_method(imf_cIMF_FileFormat_Base, "extnames", imf_file_format_s_get_extnames, 0);
   rb_define_singleton_method(imf_cIMF_FileFormat_Base, "extnames=", imf_file_format_s_set_extnames, 1);
+  rb_define_singleton_method(imf_cIMF_FileFormat_Base, "magic?", imf_file_format_s_has_magic, 0);
   rb_define_method(imf_cIMF_FileFormat_Base, "detect", imf_file_format_detect, 1);
-  rb_define_method(imf_cIMF_FileFormat_Base, "load", imf_file_format_load, 2);
+  rb_define_method(imf_cIMF_FileFormat_Base, "load", imf_file_format_m_load, -1);
+  rb_define_method(imf_cIMF_FileFormat_Base, "save", imf_file_format_m_save, -1);
+  rb_define_method(imf_cIMF_FileFormat_Base, "encode", imf_file_format_m_encode, -1);
+
+  rb_define_private_method(rb_singleton_class(imf_mIMF), "set_file_format_magic_enabled", imf_s_set_file_format_magic_enabled, 2);
+  rb_define_singleton_method(imf_mIMF, "detect_file_format_class_by_magic", imf_s_detect_file_format_class_by_magic, 1);
 
   id_detect = rb_intern("detect");
+  id_detect_format = rb_intern("detect_format");
   id_extnames = rb_intern("extnames");
   id_file_formats_for_filename = rb_intern("file_formats_for_filename");
   id_register_file_format = rb_intern("register_file_format");
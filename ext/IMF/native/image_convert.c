@@ -0,0 +1,797 @@
+#include "IMF.h"
+
+#include <math.h>
+
+#include "internal.h"
+
+#ifdef IMF_HAVE_SSSE3
+# include <tmmintrin.h>
+#endif
+#ifdef IMF_HAVE_AVX2
+# include <immintrin.h>
+#endif
+
+/* Color space conversion
+ *
+ * Image#convert converts whole rows at a time.  Every color space has a
+ * row kernel from RGB and one to RGB, and the conversion between two
+ * color spaces other than RGB goes through RGB in chunks of pixels that
+ * fit in the stack.  The alpha channel is copied as it is.
+ *
+ * The conversions between RGB, GRAY, and YCbCr are 3x3 matrices in
+ * fixed point with IMF_CONVERT_PRECISION_BITS fractional bits, which have
+ * an SSSE3 kernel.  HSV and HSL are computed in integers with tables of
+ * reciprocals, and have an AVX2 kernel from RGB.  Lab is computed in
+ * floats with a table of the linear values of sRGB components. */
+
+enum imf_convert_constants {
+  IMF_CONVERT_PRECISION_BITS = 14,
+  IMF_CONVERT_ROUNDING = 1 << (IMF_CONVERT_PRECISION_BITS - 1),
+  /* pixels converted through RGB at a time */
+  IMF_CONVERT_CHUNK_PIXELS = 256,
+  /* pixels in a band of rows processed by a thread */
+  IMF_CONVERT_MIN_BAND_PIXELS = 64 * 1024,
+  /* fractional bits of the reciprocal tables of HSV and HSL */
+  IMF_CONVERT_DIV_BITS = 12,
+};
+
+typedef void imf_convert_row_func_t(uint8_t const *src, size_t src_channels,
+                                    uint8_t *dst, size_t dst_channels, size_t width);
+
+static inline uint8_t
+imf_convert_clamp(int32_t v)
+{
+  return (uint8_t) (v < 0 ? 0 : v > 0xFF ? 0xFF : v);
+}
+
+/* Matrices
+ *
+ * out[k] = (sum of m[k][j] * (in[j] - in_offset[j]) + bias[k]) >> 14,
+ * where bias[k] includes the rounding and the offset of out[k]. */
+
+typedef struct imf_convert_matrix imf_convert_matrix_t;
+struct imf_convert_matrix {
+  size_t out_channels;
+  int16_t in_offset[3];
+  int16_t m[3][3];
+  int32_t bias[3];
+};
+
+/* the same weights as the gray8 layout of Image#export_pixels */
+static imf_convert_matrix_t const rgb_to_gray_matrix = {
+  1, { 0, 0, 0 },
+  { { 77 << 6, 150 << 6, 29 << 6 } },
+  { IMF_CONVERT_ROUNDING }
+};
+
+static imf_convert_matrix_t const rgb_to_ycbcr_matrix = {
+  3, { 0, 0, 0 },
+  { {  4899,  9617,  1868 },
+    { -2765, -5427,  8192 },
+    {  8192, -6860, -1332 } },
+  { IMF_CONVERT_ROUNDING,
+    (128 << IMF_CONVERT_PRECISION_BITS) + IMF_CONVERT_ROUNDING,
+    (128 << IMF_CONVERT_PRECISION_BITS) + IMF_CONVERT_ROUNDING }
+};
+
+static imf_convert_matrix_t const ycbcr_to_rgb_matrix = {
+  3, { 0, 128, 128 },
+  { { 16384,      0,  22970 },
+    { 16384,  -5638, -11700 },
+    { 16384,  29032,      0 } },
+  { IMF_CONVERT_ROUNDING, IMF_CONVERT_ROUNDING, IMF_CONVERT_ROUNDING }
+};
+
+static void
+imf_convert_row_matrix_scalar(imf_convert_matrix_t const *mat, uint8_t const *src, size_t src_channels,
+                              uint8_t *dst, size_t dst_channels, size_t begin, size_t width)
+{
+  size_t x, k;
+
+  src += begin * src_channels;
+  dst += begin * dst_channels;
+  for (x = begin; x < width; ++x, src += src_channels, dst += dst_channels) {
+    int32_t const c0 = src[0] - mat->in_offset[0];
+    int32_t const c1 = src[1] - mat->in_offset[1];
+    int32_t const c2 = src[2] - mat->in_offset[2];
+    for (k = 0; k < mat->out_channels; ++k) {
+      int32_t const v = mat->m[k][0] * c0 + mat->m[k][1] * c1 + mat->m[k][2] * c2 + mat->bias[k];
+      dst[k] = imf_convert_clamp(v >> IMF_CONVERT_PRECISION_BITS);
+    }
+  }
+}
+
+#ifdef IMF_HAVE_SSSE3
+/* Shuffle masks that gather the k-th components of 16 pixels from the
+ * registers of 3 or 4 channels, and that scatter them back into the
+ * registers of 1 to 4 channels.  The lanes of 0x80 become zero. */
+static uint8_t deinterleave_masks[2][3][4][16];
+static uint8_t interleave_masks[4][3][4][16];
+
+static void
+imf_convert_init_masks(void)
+{
+  size_t channels, k, r, i;
+
+  for (channels = 3; channels <= 4; ++channels) {
+    for (k = 0; k < 3; ++k) {
+      for (r = 0; r < channels; ++r) {
+        for (i = 0; i < 16; ++i) {
+          size_t const b = i * channels + k;
+          deinterleave_masks[channels - 3][k][r][i] = b / 16 == r ? (uint8_t) (b % 16) : 0x80;
+        }
+      }
+    }
+  }
+
+  for (channels = 1; channels <= 4; ++channels) {
+    for (k = 0; k < 3; ++k) {
+      for (r = 0; r < channels; ++r) {
+        for (i = 0; i < 16; ++i) {
+          size_t const b = r * 16 + i;
+          interleave_masks[channels - 1][k][r][i] = b % channels == k ? (uint8_t) (b / channels) : 0x80;
+        }
+      }
+    }
+  }
+}
+
+/* 16 pixels at a time.  The components are gathered into planes by
+ * pshufb, widened into 16-bit pairs for _mm_madd_epi16, and scattered
+ * back.  The alpha lanes of the destination are left zero. */
+IMF_TARGET_SSSE3 static size_t
+imf_convert_row_matrix_ssse3(imf_convert_matrix_t const *mat, uint8_t const *src, size_t src_channels,
+                             uint8_t *dst, size_t dst_channels, size_t width)
+{
+  __m128i const zero = _mm_setzero_si128();
+  size_t const out_channels = mat->out_channels;
+  __m128i offset[3], w01[3], w2[3], bias[3];
+  size_t x, k, r;
+
+  for (k = 0; k < 3; ++k) {
+    offset[k] = _mm_set1_epi16(mat->in_offset[k]);
+    if (k < out_channels) {
+      w01[k] = _mm_set1_epi32((int32_t) (uint16_t) mat->m[k][0] | ((int32_t) mat->m[k][1] << 16));
+      w2[k] = _mm_set1_epi32((int32_t) (uint16_t) mat->m[k][2]);
+      bias[k] = _mm_set1_epi32(mat->bias[k]);
+    }
+  }
+
+  for (x = 0; x + 16 <= width; x += 16) {
+    uint8_t const *s = src + x * src_channels;
+    uint8_t *d = dst + x * dst_channels;
+    __m128i in[4], plane[3], half[3][2];
+
+    for (r = 0; r < src_channels; ++r)
+      in[r] = _mm_loadu_si128((__m128i const *) (s + 16 * r));
+    for (k = 0; k < 3; ++k) {
+      plane[k] = zero;
+      for (r = 0; r < src_channels; ++r) {
+        __m128i const mask = _mm_loadu_si128((__m128i const *) deinterleave_masks[src_channels - 3][k][r]);
+        plane[k] = _mm_or_si128(plane[k], _mm_shuffle_epi8(in[r], mask));
+      }
+    }
+
+    for (r = 0; r < 2; ++r) {
+      __m128i c[3];
+      for (k = 0; k < 3; ++k) {
+        c[k] = r == 0 ? _mm_unpacklo_epi8(plane[k], zero) : _mm_unpackhi_epi8(plane[k], zero);
+        c[k] = _mm_sub_epi16(c[k], offset[k]);
+      }
+      __m128i const c01_lo = _mm_unpacklo_epi16(c[0], c[1]);
+      __m128i const c01_hi = _mm_unpackhi_epi16(c[0], c[1]);
+      __m128i const c2_lo = _mm_unpacklo_epi16(c[2], zero);
+      __m128i const c2_hi = _mm_unpackhi_epi16(c[2], zero);
+      for (k = 0; k < out_channels; ++k) {
+        __m128i lo = _mm_add_epi32(_mm_madd_epi16(c01_lo, w01[k]), _mm_madd_epi16(c2_lo, w2[k]));
+        __m128i hi = _mm_add_epi32(_mm_madd_epi16(c01_hi, w01[k]), _mm_madd_epi16(c2_hi, w2[k]));
+        lo = _mm_srai_epi32(_mm_add_epi32(lo, bias[k]), IMF_CONVERT_PRECISION_BITS);
+        hi = _mm_srai_epi32(_mm_add_epi32(hi, bias[k]), IMF_CONVERT_PRECISION_BITS);
+        half[k][r] = _mm_packs_epi32(lo, hi);
+      }
+    }
+
+    for (k = 0; k < out_channels; ++k)
+      plane[k] = _mm_packus_epi16(half[k][0], half[k][1]);
+    for (r = 0; r < dst_channels; ++r) {
+      __m128i out = zero;
+      for (k = 0; k < out_channels; ++k) {
+        __m128i const mask = _mm_loadu_si128((__m128i const *) interleave_masks[dst_channels - 1][k][r]);
+        out = _mm_or_si128(out, _mm_shuffle_epi8(plane[k], mask));
+      }
+      _mm_storeu_si128((__m128i *) (d + 16 * r), out);
+    }
+  }
+
+  return x;
+}
+#endif
+
+static void
+imf_convert_row_matrix(imf_convert_matrix_t const *mat, uint8_t const *src, size_t src_channels,
+                       uint8_t *dst, size_t dst_channels, size_t width)
+{
+  size_t done = 0;
+
+#ifdef IMF_HAVE_SSSE3
+  if (imf_simd_level >= IMF_SIMD_SSSE3)
+    done = imf_convert_row_matrix_ssse3(mat, src, src_channels, dst, dst_channels, width);
+#endif
+  imf_convert_row_matrix_scalar(mat, src, src_channels, dst, dst_channels, done, width);
+}
+
+/* RGB, GRAY, and YCbCr */
+
+static void
+imf_convert_row_copy_rgb(uint8_t const *src, size_t src_channels, uint8_t *dst, size_t dst_channels, size_t width)
+{
+  size_t x;
+
+  for (x = 0; x < width; ++x, src += src_channels, dst += dst_channels) {
+    dst[0] = src[0];
+    dst[1] = src[1];
+    dst[2] = src[2];
+  }
+}
+
+static void
+imf_convert_row_gray_from_rgb(uint8_t const *src, size_t src_channels, uint8_t *dst, size_t dst_channels, size_t width)
+{
+  imf_convert_row_matrix(&rgb_to_gray_matrix, src, src_channels, dst, dst_channels, width);
+}
+
+static void
+imf_convert_row_gray_to_rgb(uint8_t const *src, size_t src_channels, uint8_t *dst, size_t dst_channels, size_t width)
+{
+  size_t x;
+
+  for (x = 0; x < width; ++x, src += src_channels, dst += dst_channels)
+    dst[0] = dst[1] = dst[2] = src[0];
+}
+
+static void
+imf_convert_row_ycbcr_from_rgb(uint8_t const *src, size_t src_channels, uint8_t *dst, size_t dst_channels, size_t width)
+{
+  imf_convert_row_matrix(&rgb_to_ycbcr_matrix, src, src_channels, dst, dst_channels, width);
+}
+
+static void
+imf_convert_row_ycbcr_to_rgb(uint8_t const *src, size_t src_channels, uint8_t *dst, size_t dst_channels, size_t width)
+{
+  imf_convert_row_matrix(&ycbcr_to_rgb_matrix, src, src_channels, dst, dst_channels, width);
+}
+
+/* HSV and HSL
+ *
+ * The hue is the position on the hexagon in sixths of the circle, and
+ * the divisions by the chroma and the saturation denominators are the
+ * multiplications by the reciprocals in the tables.  The conversions from
+ * RGB have an AVX2 kernel, which reads the tables by gathers; the scalar
+ * loops are not vectorized by the compiler because of the table lookups.
+ * The conversions to RGB are scalar. */
+
+static int32_t hue_reciprocals[256];
+static int32_t saturation_reciprocals[256];
+
+static void
+imf_convert_init_reciprocals(void)
+{
+  int32_t i;
+
+  hue_reciprocals[0] = saturation_reciprocals[0] = 0;
+  for (i = 1; i < 256; ++i) {
+    hue_reciprocals[i] = ((256 << IMF_CONVERT_DIV_BITS) + 3 * i) / (6 * i);
+    saturation_reciprocals[i] = ((255 << IMF_CONVERT_DIV_BITS) + i / 2) / i;
+  }
+}
+
+static inline int32_t
+imf_convert_reciprocal_mul(int32_t v, int32_t reciprocal)
+{
+  return (v * reciprocal + (1 << (IMF_CONVERT_DIV_BITS - 1))) >> IMF_CONVERT_DIV_BITS;
+}
+
+static inline int32_t
+imf_convert_hue(int32_t r, int32_t g, int32_t b, int32_t max, int32_t chroma)
+{
+  int32_t const h6 = max == r ? g - b : max == g ? 2 * chroma + b - r : 4 * chroma + r - g;
+  return imf_convert_reciprocal_mul(h6, hue_reciprocals[chroma]) & 0xFF;
+}
+
+static void
+imf_convert_row_hsx_from_rgb_scalar(uint8_t const *src, size_t src_channels, uint8_t *dst, size_t dst_channels,
+                                    bool hsl, size_t begin, size_t width)
+{
+  size_t x;
+
+  src += begin * src_channels;
+  dst += begin * dst_channels;
+  for (x = begin; x < width; ++x, src += src_channels, dst += dst_channels) {
+    int32_t const r = src[0], g = src[1], b = src[2];
+    int32_t const max = r > g ? (r > b ? r : b) : (g > b ? g : b);
+    int32_t const min = r < g ? (r < b ? r : b) : (g < b ? g : b);
+    int32_t const chroma = max - min;
+    int32_t const sum = max + min;
+    int32_t const denom = !hsl ? max : sum <= 0xFF ? sum : 2 * 0xFF - sum;
+    int32_t const s = imf_convert_reciprocal_mul(chroma, saturation_reciprocals[denom]);
+
+    dst[0] = (uint8_t) imf_convert_hue(r, g, b, max, chroma);
+    dst[1] = (uint8_t) (s < 0xFF ? s : 0xFF);
+    dst[2] = (uint8_t) (!hsl ? max : (sum + 1) >> 1);
+  }
+}
+
+#ifdef IMF_HAVE_AVX2
+IMF_TARGET_AVX2 static inline __m256i
+imf_convert_reciprocal_mul_avx2(__m256i v, __m256i reciprocal)
+{
+  __m256i const rounding = _mm256_set1_epi32(1 << (IMF_CONVERT_DIV_BITS - 1));
+  return _mm256_srai_epi32(_mm256_add_epi32(_mm256_mullo_epi32(v, reciprocal), rounding), IMF_CONVERT_DIV_BITS);
+}
+
+/* Converts 8 pixels, whose components are in the low 8 bytes of r, g, b,
+ * max, and min, into 8 lanes of hue, saturation, and value or lightness. */
+IMF_TARGET_AVX2 static inline void
+imf_convert_hsx_from_rgb8_avx2(__m128i r8, __m128i g8, __m128i b8, __m128i max8, __m128i min8,
+                               bool hsl, __m256i out[3])
+{
+  __m256i const r = _mm256_cvtepu8_epi32(r8);
+  __m256i const g = _mm256_cvtepu8_epi32(g8);
+  __m256i const b = _mm256_cvtepu8_epi32(b8);
+  __m256i const max = _mm256_cvtepu8_epi32(max8);
+  __m256i const min = _mm256_cvtepu8_epi32(min8);
+  __m256i const chroma = _mm256_sub_epi32(max, min);
+  __m256i const chroma2 = _mm256_add_epi32(chroma, chroma);
+  __m256i const sum = _mm256_add_epi32(max, min);
+  __m256i const full = _mm256_set1_epi32(0xFF);
+  __m256i denom, h6, s;
+
+  /* the hue of the sector of the largest component, red first */
+  h6 = _mm256_add_epi32(_mm256_add_epi32(chroma2, chroma2), _mm256_sub_epi32(r, g));
+  h6 = _mm256_blendv_epi8(h6, _mm256_add_epi32(chroma2, _mm256_sub_epi32(b, r)), _mm256_cmpeq_epi32(max, g));
+  h6 = _mm256_blendv_epi8(h6, _mm256_sub_epi32(g, b), _mm256_cmpeq_epi32(max, r));
+  out[0] = _mm256_and_si256(
+    imf_convert_reciprocal_mul_avx2(h6, _mm256_i32gather_epi32(hue_reciprocals, chroma, 4)), full);
+
+  /* sum <= 255 is the same as sum <= 510 - sum */
+  denom = hsl ? _mm256_min_epi32(sum, _mm256_sub_epi32(_mm256_set1_epi32(2 * 0xFF), sum)) : max;
+  s = imf_convert_reciprocal_mul_avx2(chroma, _mm256_i32gather_epi32(saturation_reciprocals, denom, 4));
+  out[1] = _mm256_min_epi32(s, full);
+
+  out[2] = hsl ? _mm256_srli_epi32(_mm256_add_epi32(sum, _mm256_set1_epi32(1)), 1) : max;
+}
+
+/* 16 pixels at a time.  The components are gathered into planes as the
+ * matrix kernel, and converted in two halves of 32-bit lanes, where the
+ * ternaries are blends by the comparison masks and the reciprocals are
+ * gathered from the tables.  The alpha lanes of the destination are left
+ * zero. */
+IMF_TARGET_AVX2 static size_t
+imf_convert_row_hsx_from_rgb_avx2(uint8_t const *src, size_t src_channels, uint8_t *dst, size_t dst_channels,
+                                  bool hsl, size_t width)
+{
+  __m128i const zero = _mm_setzero_si128();
+  size_t x, k, r;
+
+  for (x = 0; x + 16 <= width; x += 16) {
+    uint8_t const *s = src + x * src_channels;
+    uint8_t *d = dst + x * dst_channels;
+    __m128i in[4], plane[3], max, min;
+    __m256i lo[3], hi[3];
+
+    for (r = 0; r < src_channels; ++r)
+      in[r] = _mm_loadu_si128((__m128i const *) (s + 16 * r));
+    for (k = 0; k < 3; ++k) {
+      plane[k] = zero;
+      for (r = 0; r < src_channels; ++r) {
+        __m128i const mask = _mm_loadu_si128((__m128i const *) deinterleave_masks[src_channels - 3][k][r]);
+        plane[k] = _mm_or_si128(plane[k], _mm_shuffle_epi8(in[r], mask));
+      }
+    }
+    max = _mm_max_epu8(_mm_max_epu8(plane[0], plane[1]), plane[2]);
+    min = _mm_min_epu8(_mm_min_epu8(plane[0], plane[1]), plane[2]);
+
+    imf_convert_hsx_from_rgb8_avx2(plane[0], plane[1], plane[2], max, min, hsl, lo);
+    imf_convert_hsx_from_rgb8_avx2(_mm_unpackhi_epi64(plane[0], plane[0]), _mm_unpackhi_epi64(plane[1], plane[1]),
+                                   _mm_unpackhi_epi64(plane[2], plane[2]), _mm_unpackhi_epi64(max, max),
+                                   _mm_unpackhi_epi64(min, min), hsl, hi);
+
+    for (k = 0; k < 3; ++k) {
+      /* the 16-bit lanes of lo 0-3, hi 0-3, lo 4-7, hi 4-7 put in order */
+      __m256i const packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(lo[k], hi[k]), 0xD8);
+      plane[k] = _mm_packus_epi16(_mm256_castsi256_si128(packed), _mm256_extracti128_si256(packed, 1));
+    }
+    for (r = 0; r < dst_channels; ++r) {
+      __m128i out = zero;
+      for (k = 0; k < 3; ++k) {
+        __m128i const mask = _mm_loadu_si128((__m128i const *) interleave_masks[dst_channels - 1][k][r]);
+        out = _mm_or_si128(out, _mm_shuffle_epi8(plane[k], mask));
+      }
+      _mm_storeu_si128((__m128i *) (d + 16 * r), out);
+    }
+  }
+
+  return x;
+}
+#endif
+
+static void
+imf_convert_row_hsx_from_rgb(uint8_t const *src, size_t src_channels, uint8_t *dst, size_t dst_channels,
+                             bool hsl, size_t width)
+{
+  size_t done = 0;
+
+#ifdef IMF_HAVE_AVX2
+  if (imf_simd_level >= IMF_SIMD_AVX2)
+    done = imf_convert_row_hsx_from_rgb_avx2(src, src_channels, dst, dst_channels, hsl, width);
+#endif
+  imf_convert_row_hsx_from_rgb_scalar(src, src_channels, dst, dst_channels, hsl, done, width);
+}
+
+static void
+imf_convert_row_hsv_from_rgb(uint8_t const *src, size_t src_channels, uint8_t *dst, size_t dst_channels, size_t width)
+{
+  imf_convert_row_hsx_from_rgb(src, src_channels, dst, dst_channels, false, width);
+}
+
+static void
+imf_convert_row_hsl_from_rgb(uint8_t const *src, size_t src_channels, uint8_t *dst, size_t dst_channels, size_t width)
+{
+  imf_convert_row_hsx_from_rgb(src, src_channels, dst, dst_channels, true, width);
+}
+
+/* The order of chroma + m, the second largest component, and m in RGB
+ * for each sixth of the hue circle */
+static uint8_t const hue_sector_order[6][3] = {
+  { 0, 1, 2 }, { 1, 0, 2 }, { 2, 0, 1 }, { 2, 1, 0 }, { 1, 2, 0 }, { 0, 2, 1 },
+};
+
+static inline void
+imf_convert_rgb_from_hue(int32_t h, int32_t chroma, int32_t m, uint8_t *dst)
+{
+  int32_t const h6 = h * 6;
+  int32_t const sector = h6 >> 8;
+  int32_t const f = h6 & 0xFF;
+  int32_t const x = (chroma * ((sector & 1) ? 0x100 - f : f) + 0x80) >> 8;
+  int32_t v[3];
+
+  v[0] = chroma + m;
+  v[1] = x + m;
+  v[2] = m;
+  dst[0] = imf_convert_clamp(v[hue_sector_order[sector][0]]);
+  dst[1] = imf_convert_clamp(v[hue_sector_order[sector][1]]);
+  dst[2] = imf_convert_clamp(v[hue_sector_order[sector][2]]);
+}
+
+static void
+imf_convert_row_hsv_to_rgb(uint8_t const *src, size_t src_channels, uint8_t *dst, size_t dst_channels, size_t width)
+{
+  size_t x;
+
+  for (x = 0; x < width; ++x, src += src_channels, dst += dst_channels) {
+    int32_t const v = src[2];
+    int32_t const chroma = (v * src[1] + 127) / 255;
+    imf_convert_rgb_from_hue(src[0], chroma, v - chroma, dst);
+  }
+}
+
+static void
+imf_convert_row_hsl_to_rgb(uint8_t const *src, size_t src_channels, uint8_t *dst, size_t dst_channels, size_t width)
+{
+  size_t x;
+
+  for (x = 0; x < width; ++x, src += src_channels, dst += dst_channels) {
+    int32_t const l = src[2];
+    int32_t const span = 0xFF - (2 * l > 0xFF ? 2 * l - 0xFF : 0xFF - 2 * l);
+    int32_t const chroma = (span * src[1] + 127) / 255;
+    int32_t const m = (2 * l - chroma + 1) >> 1;
+    imf_convert_rgb_from_hue(src[0], chroma, m > 0 ? m : 0, dst);
+  }
+}
+
+/* Lab
+ *
+ * sRGB components are made linear by a table, and back by the binary
+ * search of the midpoints between the linear values of the table, which
+ * gives the nearest 8-bit component.  The cube root of f(t) is linearly
+ * interpolated in a table, whose error is far below an 8-bit step.  The
+ * white point is D65. */
+
+enum {
+  IMF_CONVERT_LAB_F_STEPS = 1024,
+};
+
+static float srgb_to_linear[256];
+static float linear_midpoints[256];
+static float lab_f_table[IMF_CONVERT_LAB_F_STEPS + 2];
+
+static inline float
+imf_convert_lab_f_exact(double t)
+{
+  return (float) (t > 0.008856 ? cbrt(t) : 7.787 * t + 16.0 / 116.0);
+}
+
+static void
+imf_convert_init_srgb_tables(void)
+{
+  int i;
+
+  for (i = 0; i < 256; ++i) {
+    double const c = i / 255.0;
+    srgb_to_linear[i] = (float) (c <= 0.04045 ? c / 12.92 : pow((c + 0.055) / 1.055, 2.4));
+  }
+  linear_midpoints[0] = -INFINITY;
+  for (i = 1; i < 256; ++i)
+    linear_midpoints[i] = (srgb_to_linear[i - 1] + srgb_to_linear[i]) / 2.0f;
+
+  for (i = 0; i < IMF_CONVERT_LAB_F_STEPS + 2; ++i)
+    lab_f_table[i] = imf_convert_lab_f_exact((double) i / IMF_CONVERT_LAB_F_STEPS);
+}
+
+static inline uint8_t
+imf_convert_linear_to_srgb(float v)
+{
+  unsigned int i = 0, step;
+
+  /* i + step never exceeds 255 */
+  for (step = 128; step > 0; step >>= 1) {
+    if (v >= linear_midpoints[i + step])
+      i += step;
+  }
+  return (uint8_t) i;
+}
+
+/* t is from 0 to 1 for the colors in the sRGB gamut */
+static inline float
+imf_convert_lab_f(float t)
+{
+  float const pos = (t < 0.0f ? 0.0f : t > 1.0f ? 1.0f : t) * IMF_CONVERT_LAB_F_STEPS;
+  int const i = (int) pos;
+  float const frac = pos - (float) i;
+  return lab_f_table[i] + (lab_f_table[i + 1] - lab_f_table[i]) * frac;
+}
+
+static inline float
+imf_convert_lab_finv(float f)
+{
+  return f > 0.206893f ? f * f * f : (f - 16.0f / 116.0f) / 7.787f;
+}
+
+static void
+imf_convert_row_lab_from_rgb(uint8_t const *src, size_t src_channels, uint8_t *dst, size_t dst_channels, size_t width)
+{
+  size_t x;
+
+  for (x = 0; x < width; ++x, src += src_channels, dst += dst_channels) {
+    float const r = srgb_to_linear[src[0]], g = srgb_to_linear[src[1]], b = srgb_to_linear[src[2]];
+    float const fx = imf_convert_lab_f((0.412453f * r + 0.357580f * g + 0.180423f * b) / 0.950456f);
+    float const fy = imf_convert_lab_f(0.212671f * r + 0.715160f * g + 0.072169f * b);
+    float const fz = imf_convert_lab_f((0.019334f * r + 0.119193f * g + 0.950227f * b) / 1.088754f);
+
+    dst[0] = imf_convert_clamp((int32_t) lrintf((116.0f * fy - 16.0f) * (255.0f / 100.0f)));
+    dst[1] = imf_convert_clamp((int32_t) lrintf(500.0f * (fx - fy)) + 128);
+    dst[2] = imf_convert_clamp((int32_t) lrintf(200.0f * (fy - fz)) + 128);
+  }
+}
+
+static void
+imf_convert_row_lab_to_rgb(uint8_t const *src, size_t src_channels, uint8_t *dst, size_t dst_channels, size_t width)
+{
+  size_t x;
+
+  for (x = 0; x < width; ++x, src += src_channels, dst += dst_channels) {
+    float const fy = (src[0] * (100.0f / 255.0f) + 16.0f) / 116.0f;
+    float const fx = fy + (src[1] - 128) / 500.0f;
+    float const fz = fy - (src[2] - 128) / 200.0f;
+    float const X = 0.950456f * imf_convert_lab_finv(fx);
+    float const Y = imf_convert_lab_finv(fy);
+    float const Z = 1.088754f * imf_convert_lab_finv(fz);
+
+    dst[0] = imf_convert_linear_to_srgb( 3.240479f * X - 1.537150f * Y - 0.498535f * Z);
+    dst[1] = imf_convert_linear_to_srgb(-0.969256f * X + 1.875992f * Y + 0.041556f * Z);
+    dst[2] = imf_convert_linear_to_srgb( 0.055648f * X - 0.204043f * Y + 1.057311f * Z);
+  }
+}
+
+/* Color spaces */
+
+typedef struct imf_convert_color_space imf_convert_color_space_t;
+struct imf_convert_color_space {
+  char const *name;
+  ID id;
+  enum imf_color_space color_space;
+  size_t channels;
+  imf_convert_row_func_t *from_rgb;
+  imf_convert_row_func_t *to_rgb;
+};
+
+static imf_convert_color_space_t convert_color_spaces[] = {
+  { "GRAY",  0, IMF_COLOR_SPACE_GRAY,  1, imf_convert_row_gray_from_rgb,  imf_convert_row_gray_to_rgb },
+  { "RGB",   0, IMF_COLOR_SPACE_RGB,   3, imf_convert_row_copy_rgb,       imf_convert_row_copy_rgb },
+  { "YCbCr", 0, IMF_COLOR_SPACE_YCBCR, 3, imf_convert_row_ycbcr_from_rgb, imf_convert_row_ycbcr_to_rgb },
+  { "HSV",   0, IMF_COLOR_SPACE_HSV,   3, imf_convert_row_hsv_from_rgb,   imf_convert_row_hsv_to_rgb },
+  { "HSL",   0, IMF_COLOR_SPACE_HSL,   3, imf_convert_row_hsl_from_rgb,   imf_convert_row_hsl_to_rgb },
+  { "Lab",   0, IMF_COLOR_SPACE_LAB,   3, imf_convert_row_lab_from_rgb,   imf_convert_row_lab_to_rgb },
+  { NULL, 0, 0, 0, NULL, NULL }
+};
+
+static imf_convert_color_space_t const *
+imf_convert_find_color_space(VALUE color_space_v)
+{
+  imf_convert_color_space_t const *cs;
+  ID id = rb_check_id(&color_space_v);
+
+  if (id != 0) {
+    for (cs = convert_color_spaces; cs->name != NULL; ++cs) {
+      if (cs->id == id)
+        return cs;
+    }
+  }
+
+  rb_raise(rb_eArgError, "unknown color space to convert into: %"PRIsVALUE, rb_inspect(color_space_v));
+}
+
+static imf_convert_color_space_t const *
+imf_convert_color_space_of(imf_image_t const *img)
+{
+  imf_convert_color_space_t const *cs;
+
+  for (cs = convert_color_spaces; cs->name != NULL; ++cs) {
+    if (cs->color_space == img->color_space)
+      return cs;
+  }
+
+  rb_raise(rb_eArgError, "unable to convert the color space of the image");
+}
+
+/* Conversion */
+
+typedef struct imf_convert imf_convert_t;
+struct imf_convert {
+  imf_convert_color_space_t const *from;
+  imf_convert_color_space_t const *to;
+  imf_image_t const *src;
+  imf_image_t *dst;
+  /* the RGB(A) pixels of an indexed source */
+  imf_image_t expanded;
+};
+
+static void
+imf_convert_row(imf_convert_t const *cv, uint8_t const *src, uint8_t *dst)
+{
+  size_t const width = cv->src->width;
+  size_t const src_channels = cv->src->pixel_channels;
+  size_t const dst_channels = cv->dst->pixel_channels;
+  size_t x;
+
+  if (cv->from->color_space == IMF_COLOR_SPACE_RGB) {
+    cv->to->from_rgb(src, src_channels, dst, dst_channels, width);
+  }
+  else if (cv->to->color_space == IMF_COLOR_SPACE_RGB) {
+    cv->from->to_rgb(src, src_channels, dst, dst_channels, width);
+  }
+  else {
+    uint8_t rgb[IMF_CONVERT_CHUNK_PIXELS * 3];
+    for (x = 0; x < width; x += IMF_CONVERT_CHUNK_PIXELS) {
+      size_t const n = width - x < IMF_CONVERT_CHUNK_PIXELS ? width - x : IMF_CONVERT_CHUNK_PIXELS;
+      cv->from->to_rgb(src + x * src_channels, src_channels, rgb, 3, n);
+      cv->to->from_rgb(rgb, 3, dst + x * dst_channels, dst_channels, n);
+    }
+  }
+
+  if (IMF_IMAGE_HAS_ALPHA(cv->dst)) {
+    for (x = 0; x < width; ++x)
+      dst[x * dst_channels + dst_channels - 1] = src[x * src_channels + src_channels - 1];
+  }
+}
+
+static void
+imf_convert_band(void *arg, size_t begin, size_t end)
+{
+  imf_convert_t const *cv = (imf_convert_t const *) arg;
+  size_t y;
+
+  for (y = begin; y < end; ++y) {
+    imf_convert_row(cv, cv->src->data + y * cv->src->row_stride,
+                    cv->dst->data + y * cv->dst->row_stride);
+  }
+}
+
+static void *
+imf_convert_without_gvl(void *arg)
+{
+  imf_convert_t *cv = (imf_convert_t *) arg;
+  size_t const width = cv->src->width;
+  size_t rows = IMF_CONVERT_MIN_BAND_PIXELS / (width > 0 ? width : 1);
+
+  imf_parallel_for_rows(cv->src->height, rows > 0 ? rows : 1, imf_convert_band, cv);
+  return NULL;
+}
+
+static VALUE
+imf_convert_body(VALUE arg)
+{
+  imf_convert_t *cv = (imf_convert_t *) arg;
+  imf_image_t const *src = cv->src;
+  imf_image_t *dst = cv->dst;
+
+  if (src->color_space == IMF_COLOR_SPACE_INDEXED) {
+    cv->expanded.row_alignment = src->row_alignment;
+    imf_image_expand_palette(src, &cv->expanded);
+    cv->src = src = &cv->expanded;
+  }
+  cv->from = imf_convert_color_space_of(src);
+
+  dst->flags = src->flags;
+  dst->color_space = cv->to->color_space;
+  dst->component_size = 1;
+  dst->pixel_channels = (uint8_t) (cv->to->channels + (IMF_IMAGE_HAS_ALPHA(src) ? 1 : 0));
+  dst->width = src->width;
+  dst->height = src->height;
+  dst->row_alignment = src->row_alignment;
+  imf_image_allocate_image_buffer(dst);
+
+  imf_call_without_gvl(imf_convert_without_gvl, cv, NULL, NULL);
+
+  return Qnil;
+}
+
+static VALUE
+imf_convert_ensure(VALUE arg)
+{
+  imf_convert_t *cv = (imf_convert_t *) arg;
+
+  if (cv->expanded.data != NULL)
+    imf_image_release(&cv->expanded);
+
+  return Qnil;
+}
+
+/*
+ * call-seq:
+ *   image.convert(color_space) -> new_image
+ *
+ * Returns a new image of the pixels converted into the color space, one
+ * of :GRAY, :RGB, :YCbCr, :HSV, :HSL, and :Lab.  The alpha channel is
+ * kept.  Only the images of 8-bit components can be converted.
+ */
+static VALUE
+imf_image_convert(VALUE obj, VALUE color_space_v)
+{
+  imf_image_t *img = imf_get_image_data(obj);
+  imf_convert_t cv;
+  VALUE new_obj;
+
+  imf_image_check_interleaved(img);
+  memset(&cv, 0, sizeof(cv));
+  cv.to = imf_convert_find_color_space(color_space_v);
+
+  if (img->component_size != 1)
+    rb_raise(rb_eNotImpError, "unable to convert %d-bit components", 8 * (int) img->component_size);
+  if (img->color_space == cv.to->color_space)
+    return rb_obj_dup(obj);
+
+  new_obj = rb_obj_alloc(rb_obj_class(obj));
+  cv.src = img;
+  cv.dst = imf_get_image_data(new_obj);
+  rb_ensure(imf_convert_body, (VALUE) &cv, imf_convert_ensure, (VALUE) &cv);
+
+  return new_obj;
+}
+
+void
+Init_imf_image_convert(void)
+{
+  imf_convert_color_space_t *cs;
+
+  rb_define_method(imf_cIMF_Image, "convert", imf_image_convert, 1);
+
+  for (cs = convert_color_spaces; cs->name != NULL; ++cs)
+    cs->id = rb_intern(cs->name);
+
+#ifdef IMF_HAVE_SSSE3
+  imf_convert_init_masks();
+#endif
+  imf_convert_init_reciprocals();
+  imf_convert_init_srgb_tables();
+}
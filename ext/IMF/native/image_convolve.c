@@ -0,0 +1,1455 @@
+#include "IMF.h"
+
+#include <math.h>
+
+#include "internal.h"
+
+#ifdef IMF_HAVE_SSE2
+# include <emmintrin.h>
+#endif
+
+#ifdef IMF_HAVE_AVX2
+# include <immintrin.h>
+#endif
+
+/* Convolution
+ *
+ * Kernels are applied in single precision floating point, because their
+ * weights can be negative or large, e.g. of sharpening and edge detection.
+ * A kernel of rank 1 is split into a horizontal and a vertical kernel.
+ * Each band of rows keeps a ring of the kh source rows around the current
+ * row, already converted into floats and padded by the border pixels, or
+ * already filtered horizontally for a separable kernel, so that every
+ * source row is loaded once per band and the working set stays small.
+ *
+ * The Gaussian blur of a large sigma is approximated by three box blurs,
+ * whose running sums cost the same for any radius.  The horizontal boxes
+ * run on bands of rows, and the vertical ones on strips of columns, so
+ * that the sums of a strip stay in the L1 cache while a thread walks down
+ * the image.
+ *
+ * The SIMD kernels add the terms in the same order as the scalar ones, so
+ * the result does not depend on IMF.simd. */
+
+/* border: and method:, the latter only for #convolve */
+static ID convolve_kwargs[2];
+
+enum imf_convolve_constants {
+  /* pixels in a band of rows processed by a thread */
+  IMF_CONVOLVE_MIN_BAND_PIXELS = 64 * 1024,
+  /* components in a strip of columns of the vertical box blur */
+  IMF_CONVOLVE_STRIP_LENGTH = 256,
+  /* the number of box blurs approximating a Gaussian blur */
+  IMF_CONVOLVE_BOX_PASSES = 3,
+};
+
+/* Gaussian blurs with a smaller sigma use the exact kernel of radius
+ * ceil(3 * sigma) */
+static double const IMF_CONVOLVE_MIN_BOX_SIGMA = 3.0;
+static double const IMF_CONVOLVE_MAX_SIGMA = 10000.0;
+
+/* the cost of the forward and inverse FFT per sample and bit of the size,
+ * in the taps of the direct convolution, measured on x86-64 with AVX2 */
+static double const IMF_CONVOLVE_FFT_COST = 24.0;
+
+/* Options */
+
+enum imf_convolve_border_type {
+  IMF_CONVOLVE_BORDER_CLAMP,
+  IMF_CONVOLVE_BORDER_REFLECT,
+};
+
+enum imf_convolve_method_type {
+  IMF_CONVOLVE_METHOD_AUTO,
+  IMF_CONVOLVE_METHOD_DIRECT,
+  IMF_CONVOLVE_METHOD_FFT,
+};
+
+typedef struct imf_convolve_option imf_convolve_option_t;
+struct imf_convolve_option {
+  char const *name;
+  ID id;
+  int type;
+};
+
+static imf_convolve_option_t convolve_borders[] = {
+  { "clamp",   0, IMF_CONVOLVE_BORDER_CLAMP },
+  { "reflect", 0, IMF_CONVOLVE_BORDER_REFLECT },
+  { NULL, 0, 0 }
+};
+
+static imf_convolve_option_t convolve_methods[] = {
+  { "auto",   0, IMF_CONVOLVE_METHOD_AUTO },
+  { "direct", 0, IMF_CONVOLVE_METHOD_DIRECT },
+  { "fft",    0, IMF_CONVOLVE_METHOD_FFT },
+  { NULL, 0, 0 }
+};
+
+static int
+imf_convolve_find_option(imf_convolve_option_t const *options, char const *kind, VALUE value)
+{
+  imf_convolve_option_t const *option;
+  ID id = rb_check_id(&value);
+
+  if (id != 0) {
+    for (option = options; option->name != NULL; ++option) {
+      if (option->id == id)
+        return option->type;
+    }
+  }
+
+  rb_raise(rb_eArgError, "unknown %s: %"PRIsVALUE, kind, rb_inspect(value));
+}
+
+/* Maps the index i out of [0, n) into it.  :clamp repeats the edge pixel,
+ * i.e. aaa|abcd|ddd, and :reflect mirrors the image about the edge pixel
+ * without repeating it, i.e. dcb|abcd|cba. */
+static inline size_t
+imf_convolve_border_index(ssize_t i, size_t n, int border)
+{
+  if (i >= 0 && (size_t) i < n)
+    return (size_t) i;
+
+  if (border == IMF_CONVOLVE_BORDER_CLAMP || n == 1)
+    return i < 0 ? 0 : n - 1;
+
+  ssize_t const period = 2 * ((ssize_t) n - 1);
+  i %= period;
+  if (i < 0)
+    i += period;
+  return (size_t) (i < (ssize_t) n ? i : period - i);
+}
+
+/* floor(a / b) for b > 0 */
+static inline ssize_t
+imf_convolve_floor_div(ssize_t a, ssize_t b)
+{
+  return a >= 0 ? a / b : -((-a + b - 1) / b);
+}
+
+/* The number of the indices in [-r, r] that imf_convolve_border_index maps
+ * to i, so that a box of radius r around 0 is a weighted sum of the rows
+ * 0 ... min(r, n - 1) however large r is. */
+static inline size_t
+imf_convolve_border_count(size_t i, size_t r, size_t n, int border)
+{
+  if (n == 1)
+    return 2 * r + 1;
+
+  if (border == IMF_CONVOLVE_BORDER_CLAMP) {
+    if (i == 0)
+      return r + 1;
+    if (i == n - 1)
+      return r >= n - 1 ? r - n + 2 : 0;
+    return i <= r ? 1 : 0;
+  }
+
+  /* the indices congruent to i or -i modulo the period */
+  ssize_t const period = 2 * ((ssize_t) n - 1);
+  ssize_t const lo = -(ssize_t) r, hi = (ssize_t) r;
+  ssize_t const a = (ssize_t) i, b = period - (ssize_t) i;
+  size_t count = (size_t) (imf_convolve_floor_div(hi - a, period) - imf_convolve_floor_div(lo - 1 - a, period));
+  if (i != 0 && i != n - 1)
+    count += (size_t) (imf_convolve_floor_div(hi - b, period) - imf_convolve_floor_div(lo - 1 - b, period));
+  return count;
+}
+
+/* Row kernels
+ *
+ * A row is a sequence of `length` components regardless of the channels.
+ * The horizontal taps of a pixel are `step` components apart, which is the
+ * number of channels. */
+
+/* acc[i] += w[0] * src[i] + w[1] * src[i + step] + ... */
+static void
+imf_convolve_row_h_scalar(float *acc, float const *src, float const *w, size_t n, size_t step,
+                          size_t begin, size_t length)
+{
+  size_t i, k;
+
+  for (i = begin; i < length; ++i) {
+    float a = acc[i];
+    for (k = 0; k < n; ++k)
+      a += w[k] * src[i + k * step];
+    acc[i] = a;
+  }
+}
+
+/* acc[i] = w[0] * rows[0][i] + w[1] * rows[1][i] + ... */
+static void
+imf_convolve_row_v_scalar(float *acc, float const *const *rows, float const *w, size_t n,
+                          size_t begin, size_t length)
+{
+  size_t i, k;
+
+  for (i = begin; i < length; ++i) {
+    float a = 0.0f;
+    for (k = 0; k < n; ++k)
+      a += w[k] * rows[k][i];
+    acc[i] = a;
+  }
+}
+
+static inline float
+imf_convolve_clamp(float v, float max)
+{
+  v += 0.5f;
+  return v < 0.0f ? 0.0f : v > max ? max : v;
+}
+
+static void
+imf_convolve_store8_scalar(uint8_t *dst, float const *acc, size_t begin, size_t length)
+{
+  size_t i;
+
+  for (i = begin; i < length; ++i)
+    dst[i] = (uint8_t) imf_convolve_clamp(acc[i], 255.0f);
+}
+
+static void
+imf_convolve_store16_scalar(uint16_t *dst, float const *acc, size_t begin, size_t length)
+{
+  size_t i;
+
+  for (i = begin; i < length; ++i)
+    dst[i] = (uint16_t) imf_convolve_clamp(acc[i], 65535.0f);
+}
+
+static void
+imf_convolve_load8_scalar(float *dst, uint8_t const *src, size_t begin, size_t length)
+{
+  size_t i;
+
+  for (i = begin; i < length; ++i)
+    dst[i] = (float) src[i];
+}
+
+static void
+imf_convolve_load16_scalar(float *dst, uint16_t const *src, size_t begin, size_t length)
+{
+  size_t i;
+
+  for (i = begin; i < length; ++i)
+    dst[i] = (float) src[i];
+}
+
+#ifdef IMF_HAVE_SSE2
+static size_t
+imf_convolve_row_h_sse2(float *acc, float const *src, float const *w, size_t n, size_t step,
+                        size_t begin, size_t length)
+{
+  size_t i, k;
+
+  for (i = begin; i + 4 <= length; i += 4) {
+    __m128 a = _mm_loadu_ps(acc + i);
+    for (k = 0; k < n; ++k)
+      a = _mm_add_ps(a, _mm_mul_ps(_mm_set1_ps(w[k]), _mm_loadu_ps(src + i + k * step)));
+    _mm_storeu_ps(acc + i, a);
+  }
+
+  return i;
+}
+
+static size_t
+imf_convolve_row_v_sse2(float *acc, float const *const *rows, float const *w, size_t n,
+                        size_t begin, size_t length)
+{
+  size_t i, k;
+
+  for (i = begin; i + 4 <= length; i += 4) {
+    __m128 a = _mm_setzero_ps();
+    for (k = 0; k < n; ++k)
+      a = _mm_add_ps(a, _mm_mul_ps(_mm_set1_ps(w[k]), _mm_loadu_ps(rows[k] + i)));
+    _mm_storeu_ps(acc + i, a);
+  }
+
+  return i;
+}
+
+/* Rounds and clamps 4 floats into 32-bit integers */
+static inline __m128i
+imf_convolve_round_sse2(__m128 v, __m128 max)
+{
+  v = _mm_add_ps(v, _mm_set1_ps(0.5f));
+  v = _mm_min_ps(_mm_max_ps(v, _mm_setzero_ps()), max);
+  return _mm_cvttps_epi32(v);
+}
+
+static size_t
+imf_convolve_store8_sse2(uint8_t *dst, float const *acc, size_t begin, size_t length)
+{
+  __m128 const max = _mm_set1_ps(255.0f);
+  size_t i;
+
+  for (i = begin; i + 16 <= length; i += 16) {
+    __m128i const a = imf_convolve_round_sse2(_mm_loadu_ps(acc + i), max);
+    __m128i const b = imf_convolve_round_sse2(_mm_loadu_ps(acc + i + 4), max);
+    __m128i const c = imf_convolve_round_sse2(_mm_loadu_ps(acc + i + 8), max);
+    __m128i const d = imf_convolve_round_sse2(_mm_loadu_ps(acc + i + 12), max);
+    __m128i const out = _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d));
+    _mm_storeu_si128((__m128i *) (dst + i), out);
+  }
+
+  return i;
+}
+
+/* SSE2 has no unsigned saturating pack of 32-bit integers, so the values
+ * are biased into the signed range and back */
+static size_t
+imf_convolve_store16_sse2(uint16_t *dst, float const *acc, size_t begin, size_t length)
+{
+  __m128 const max = _mm_set1_ps(65535.0f);
+  __m128i const bias32 = _mm_set1_epi32(0x8000);
+  __m128i const bias16 = _mm_set1_epi16((short) 0x8000);
+  size_t i;
+
+  for (i = begin; i + 8 <= length; i += 8) {
+    __m128i const a = _mm_sub_epi32(imf_convolve_round_sse2(_mm_loadu_ps(acc + i), max), bias32);
+    __m128i const b = _mm_sub_epi32(imf_convolve_round_sse2(_mm_loadu_ps(acc + i + 4), max), bias32);
+    __m128i const out = _mm_xor_si128(_mm_packs_epi32(a, b), bias16);
+    _mm_storeu_si128((__m128i *) (dst + i), out);
+  }
+
+  return i;
+}
+
+static size_t
+imf_convolve_load8_sse2(float *dst, uint8_t const *src, size_t begin, size_t length)
+{
+  __m128i const zero = _mm_setzero_si128();
+  size_t i;
+
+  for (i = begin; i + 8 <= length; i += 8) {
+    __m128i const p = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i const *) (src + i)), zero);
+    _mm_storeu_ps(dst + i, _mm_cvtepi32_ps(_mm_unpacklo_epi16(p, zero)));
+    _mm_storeu_ps(dst + i + 4, _mm_cvtepi32_ps(_mm_unpackhi_epi16(p, zero)));
+  }
+
+  return i;
+}
+
+static size_t
+imf_convolve_load16_sse2(float *dst, uint16_t const *src, size_t begin, size_t length)
+{
+  __m128i const zero = _mm_setzero_si128();
+  size_t i;
+
+  for (i = begin; i + 8 <= length; i += 8) {
+    __m128i const p = _mm_loadu_si128((__m128i const *) (src + i));
+    _mm_storeu_ps(dst + i, _mm_cvtepi32_ps(_mm_unpacklo_epi16(p, zero)));
+    _mm_storeu_ps(dst + i + 4, _mm_cvtepi32_ps(_mm_unpackhi_epi16(p, zero)));
+  }
+
+  return i;
+}
+#endif
+
+#ifdef IMF_HAVE_AVX2
+IMF_TARGET_AVX2 static size_t
+imf_convolve_row_h_avx2(float *acc, float const *src, float const *w, size_t n, size_t step,
+                        size_t begin, size_t length)
+{
+  size_t i, k;
+
+  for (i = begin; i + 8 <= length; i += 8) {
+    __m256 a = _mm256_loadu_ps(acc + i);
+    for (k = 0; k < n; ++k)
+      a = _mm256_add_ps(a, _mm256_mul_ps(_mm256_set1_ps(w[k]), _mm256_loadu_ps(src + i + k * step)));
+    _mm256_storeu_ps(acc + i, a);
+  }
+
+  return i;
+}
+
+IMF_TARGET_AVX2 static size_t
+imf_convolve_row_v_avx2(float *acc, float const *const *rows, float const *w, size_t n,
+                        size_t begin, size_t length)
+{
+  size_t i, k;
+
+  for (i = begin; i + 8 <= length; i += 8) {
+    __m256 a = _mm256_setzero_ps();
+    for (k = 0; k < n; ++k)
+      a = _mm256_add_ps(a, _mm256_mul_ps(_mm256_set1_ps(w[k]), _mm256_loadu_ps(rows[k] + i)));
+    _mm256_storeu_ps(acc + i, a);
+  }
+
+  return i;
+}
+
+IMF_TARGET_AVX2 static size_t
+imf_convolve_load8_avx2(float *dst, uint8_t const *src, size_t begin, size_t length)
+{
+  size_t i;
+
+  for (i = begin; i + 8 <= length; i += 8) {
+    __m256i const p = _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i const *) (src + i)));
+    _mm256_storeu_ps(dst + i, _mm256_cvtepi32_ps(p));
+  }
+
+  return i;
+}
+
+IMF_TARGET_AVX2 static size_t
+imf_convolve_load16_avx2(float *dst, uint16_t const *src, size_t begin, size_t length)
+{
+  size_t i;
+
+  for (i = begin; i + 8 <= length; i += 8) {
+    __m256i const p = _mm256_cvtepu16_epi32(_mm_loadu_si128((__m128i const *) (src + i)));
+    _mm256_storeu_ps(dst + i, _mm256_cvtepi32_ps(p));
+  }
+
+  return i;
+}
+#endif
+
+static void
+imf_convolve_row_h(float *acc, float const *src, float const *w, size_t n, size_t step, size_t length)
+{
+  size_t done = 0;
+
+#ifdef IMF_HAVE_AVX2
+  if (imf_simd_level >= IMF_SIMD_AVX2)
+    done = imf_convolve_row_h_avx2(acc, src, w, n, step, done, length);
+#endif
+#ifdef IMF_HAVE_SSE2
+  if (imf_simd_level >= IMF_SIMD_SSE2)
+    done = imf_convolve_row_h_sse2(acc, src, w, n, step, done, length);
+#endif
+  imf_convolve_row_h_scalar(acc, src, w, n, step, done, length);
+}
+
+static void
+imf_convolve_row_v(float *acc, float const *const *rows, float const *w, size_t n, size_t length)
+{
+  size_t done = 0;
+
+#ifdef IMF_HAVE_AVX2
+  if (imf_simd_level >= IMF_SIMD_AVX2)
+    done = imf_convolve_row_v_avx2(acc, rows, w, n, done, length);
+#endif
+#ifdef IMF_HAVE_SSE2
+  if (imf_simd_level >= IMF_SIMD_SSE2)
+    done = imf_convolve_row_v_sse2(acc, rows, w, n, done, length);
+#endif
+  imf_convolve_row_v_scalar(acc, rows, w, n, done, length);
+}
+
+static void
+imf_convolve_load_row(float *dst, uint8_t const *src, size_t component_size, size_t length)
+{
+  size_t done = 0;
+
+  if (component_size == 1) {
+#ifdef IMF_HAVE_AVX2
+    if (imf_simd_level >= IMF_SIMD_AVX2)
+      done = imf_convolve_load8_avx2(dst, src, done, length);
+#endif
+#ifdef IMF_HAVE_SSE2
+    if (imf_simd_level >= IMF_SIMD_SSE2)
+      done = imf_convolve_load8_sse2(dst, src, done, length);
+#endif
+    imf_convolve_load8_scalar(dst, src, done, length);
+  }
+  else {
+#ifdef IMF_HAVE_AVX2
+    if (imf_simd_level >= IMF_SIMD_AVX2)
+      done = imf_convolve_load16_avx2(dst, (uint16_t const *) src, done, length);
+#endif
+#ifdef IMF_HAVE_SSE2
+    if (imf_simd_level >= IMF_SIMD_SSE2)
+      done = imf_convolve_load16_sse2(dst, (uint16_t const *) src, done, length);
+#endif
+    imf_convolve_load16_scalar(dst, (uint16_t const *) src, done, length);
+  }
+}
+
+static void
+imf_convolve_store_row(uint8_t *dst, float const *acc, size_t component_size, size_t length)
+{
+  size_t done = 0;
+
+  if (component_size == 1) {
+#ifdef IMF_HAVE_SSE2
+    if (imf_simd_level >= IMF_SIMD_SSE2)
+      done = imf_convolve_store8_sse2(dst, acc, done, length);
+#endif
+    imf_convolve_store8_scalar(dst, acc, done, length);
+  }
+  else {
+#ifdef IMF_HAVE_SSE2
+    if (imf_simd_level >= IMF_SIMD_SSE2)
+      done = imf_convolve_store16_sse2((uint16_t *) dst, acc, done, length);
+#endif
+    imf_convolve_store16_scalar((uint16_t *) dst, acc, done, length);
+  }
+}
+
+/* Box blur kernels
+ *
+ * out[i] = sum[i] / n, and then the sum slides down by a row:
+ * sum[i] += add[i] - sub[i].  The division is a multiplication by the
+ * reciprocal in single precision. */
+
+static inline uint32_t
+imf_convolve_box_div(uint32_t sum, float inv)
+{
+  return (uint32_t) (int32_t) ((float) (int32_t) sum * inv + 0.5f);
+}
+
+static void
+imf_convolve_box_row_v8_scalar(uint8_t *out, uint32_t *sum, uint8_t const *add, uint8_t const *sub,
+                               float inv, size_t begin, size_t length)
+{
+  size_t i;
+
+  for (i = begin; i < length; ++i) {
+    out[i] = (uint8_t) imf_convolve_box_div(sum[i], inv);
+    sum[i] += (uint32_t) add[i] - sub[i];
+  }
+}
+
+static void
+imf_convolve_box_row_v16_scalar(uint16_t *out, uint32_t *sum, uint16_t const *add, uint16_t const *sub,
+                                float inv, size_t begin, size_t length)
+{
+  size_t i;
+
+  for (i = begin; i < length; ++i) {
+    out[i] = (uint16_t) imf_convolve_box_div(sum[i], inv);
+    sum[i] += (uint32_t) add[i] - sub[i];
+  }
+}
+
+#ifdef IMF_HAVE_SSE2
+static inline __m128i
+imf_convolve_box_div_sse2(__m128i sum, __m128 inv)
+{
+  __m128 const v = _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(sum), inv), _mm_set1_ps(0.5f));
+  return _mm_cvttps_epi32(v);
+}
+
+static size_t
+imf_convolve_box_row_v8_sse2(uint8_t *out, uint32_t *sum, uint8_t const *add, uint8_t const *sub,
+                             float inv, size_t begin, size_t length)
+{
+  __m128i const zero = _mm_setzero_si128();
+  __m128 const invv = _mm_set1_ps(inv);
+  size_t i;
+
+  for (i = begin; i + 8 <= length; i += 8) {
+    __m128i s0 = _mm_loadu_si128((__m128i const *) (sum + i));
+    __m128i s1 = _mm_loadu_si128((__m128i const *) (sum + i + 4));
+    __m128i const q = _mm_packs_epi32(imf_convolve_box_div_sse2(s0, invv), imf_convolve_box_div_sse2(s1, invv));
+    _mm_storel_epi64((__m128i *) (out + i), _mm_packus_epi16(q, q));
+
+    __m128i const a = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i const *) (add + i)), zero);
+    __m128i const b = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i const *) (sub + i)), zero);
+    s0 = _mm_sub_epi32(_mm_add_epi32(s0, _mm_unpacklo_epi16(a, zero)), _mm_unpacklo_epi16(b, zero));
+    s1 = _mm_sub_epi32(_mm_add_epi32(s1, _mm_unpackhi_epi16(a, zero)), _mm_unpackhi_epi16(b, zero));
+    _mm_storeu_si128((__m128i *) (sum + i), s0);
+    _mm_storeu_si128((__m128i *) (sum + i + 4), s1);
+  }
+
+  return i;
+}
+
+static size_t
+imf_convolve_box_row_v16_sse2(uint16_t *out, uint32_t *sum, uint16_t const *add, uint16_t const *sub,
+                              float inv, size_t begin, size_t length)
+{
+  __m128i const zero = _mm_setzero_si128();
+  __m128i const bias32 = _mm_set1_epi32(0x8000);
+  __m128i const bias16 = _mm_set1_epi16((short) 0x8000);
+  __m128 const invv = _mm_set1_ps(inv);
+  size_t i;
+
+  for (i = begin; i + 8 <= length; i += 8) {
+    __m128i s0 = _mm_loadu_si128((__m128i const *) (sum + i));
+    __m128i s1 = _mm_loadu_si128((__m128i const *) (sum + i + 4));
+    __m128i const q0 = _mm_sub_epi32(imf_convolve_box_div_sse2(s0, invv), bias32);
+    __m128i const q1 = _mm_sub_epi32(imf_convolve_box_div_sse2(s1, invv), bias32);
+    _mm_storeu_si128((__m128i *) (out + i), _mm_xor_si128(_mm_packs_epi32(q0, q1), bias16));
+
+    __m128i const a = _mm_loadu_si128((__m128i const *) (add + i));
+    __m128i const b = _mm_loadu_si128((__m128i const *) (sub + i));
+    s0 = _mm_sub_epi32(_mm_add_epi32(s0, _mm_unpacklo_epi16(a, zero)), _mm_unpacklo_epi16(b, zero));
+    s1 = _mm_sub_epi32(_mm_add_epi32(s1, _mm_unpackhi_epi16(a, zero)), _mm_unpackhi_epi16(b, zero));
+    _mm_storeu_si128((__m128i *) (sum + i), s0);
+    _mm_storeu_si128((__m128i *) (sum + i + 4), s1);
+  }
+
+  return i;
+}
+#endif
+
+static void
+imf_convolve_box_row_v(uint8_t *out, uint32_t *sum, uint8_t const *add, uint8_t const *sub,
+                       float inv, size_t component_size, size_t length)
+{
+  size_t done = 0;
+
+  if (component_size == 1) {
+#ifdef IMF_HAVE_SSE2
+    if (imf_simd_level >= IMF_SIMD_SSE2)
+      done = imf_convolve_box_row_v8_sse2(out, sum, add, sub, inv, done, length);
+#endif
+    imf_convolve_box_row_v8_scalar(out, sum, add, sub, inv, done, length);
+  }
+  else {
+    uint16_t *out16 = (uint16_t *) out;
+    uint16_t const *add16 = (uint16_t const *) add, *sub16 = (uint16_t const *) sub;
+#ifdef IMF_HAVE_SSE2
+    if (imf_simd_level >= IMF_SIMD_SSE2)
+      done = imf_convolve_box_row_v16_sse2(out16, sum, add16, sub16, inv, done, length);
+#endif
+    imf_convolve_box_row_v16_scalar(out16, sum, add16, sub16, inv, done, length);
+  }
+}
+
+/* Convolution */
+
+typedef struct imf_convolve imf_convolve_t;
+struct imf_convolve {
+  VALUE kernel_v;
+  double sigma;
+  int border;
+  imf_image_t const *src;
+  imf_image_t *dst;
+  /* the RGB(A) pixels of an indexed source */
+  imf_image_t expanded;
+  /* the kernel of kh rows of kw weights, whose (ay, ax) element is on the
+   * destination pixel */
+  size_t kw, kh, ax, ay;
+  float *weights;
+  /* the horizontal and vertical kernels of a separable kernel */
+  bool separable;
+  float *horizontal;
+  float *vertical;
+  /* the radii of the box blurs and the intermediate images between them */
+  size_t box_radii[IMF_CONVOLVE_BOX_PASSES];
+  uint8_t *box_tmp[2];
+  size_t box_stride;
+  /* one of enum imf_convolve_method_type */
+  int method;
+  /* the FFT of the image padded to fft_width x fft_height, and the
+   * spectrum of the kernel already conjugated and normalized */
+  imf_fft_real_plan_t const *fft_rows;
+  imf_fft_plan_t const *fft_columns;
+  size_t fft_width, fft_height;
+  double *fft_samples;
+  imf_complex_t *fft_spectrum;
+  imf_complex_t *fft_kernel;
+  bool failed;
+};
+
+/* Loads the source row y converted into floats, with the ax pixels on the
+ * left and kw - ax - 1 pixels on the right taken by the border rule. */
+static void
+imf_convolve_load_padded_row(imf_convolve_t const *cv, ssize_t y, float *pad)
+{
+  imf_image_t const *src = cv->src;
+  size_t const channels = src->pixel_channels;
+  size_t const sy = imf_convolve_border_index(y, src->height, cv->border);
+  float *center = pad + cv->ax * channels;
+  size_t p, c;
+
+  imf_convolve_load_row(center, src->data + sy * src->row_stride, src->component_size, src->width * channels);
+
+  for (p = 0; p < cv->kw - 1; ++p) {
+    ssize_t const x = p < cv->ax ? (ssize_t) p - (ssize_t) cv->ax : (ssize_t) (src->width + p - cv->ax);
+    size_t const sx = imf_convolve_border_index(x, src->width, cv->border);
+    float *out = center + x * (ssize_t) channels;
+    for (c = 0; c < channels; ++c)
+      out[c] = center[sx * channels + c];
+  }
+}
+
+static inline size_t
+imf_convolve_ring_slot(ssize_t y, size_t n)
+{
+  /* y is never less than -n */
+  return (size_t) (y + (ssize_t) n) % n;
+}
+
+/* Each destination row is the vertical kernel applied to kh rows, which
+ * are the source rows filtered by the horizontal kernel. */
+static void
+imf_convolve_separable_band(void *arg, size_t begin, size_t end)
+{
+  imf_convolve_t *cv = (imf_convolve_t *) arg;
+  imf_image_t const *src = cv->src;
+  imf_image_t *dst = cv->dst;
+  size_t const channels = src->pixel_channels;
+  size_t const length = src->width * channels;
+  size_t const kh = cv->kh;
+  float *pad = malloc((src->width + cv->kw - 1) * channels * sizeof(float));
+  float *ring = malloc(kh * length * sizeof(float));
+  float *acc = malloc(length * sizeof(float));
+  float const **rows = malloc(kh * sizeof(float *));
+  ssize_t next = (ssize_t) begin - (ssize_t) cv->ay;
+  size_t y, k;
+
+  if (pad == NULL || ring == NULL || acc == NULL || rows == NULL) {
+    cv->failed = true;
+    goto done;
+  }
+
+  for (y = begin; y < end; ++y) {
+    ssize_t const top = (ssize_t) y - (ssize_t) cv->ay;
+
+    for (; next < top + (ssize_t) kh; ++next) {
+      float *out = ring + imf_convolve_ring_slot(next, kh) * length;
+      imf_convolve_load_padded_row(cv, next, pad);
+      memset(out, 0, length * sizeof(float));
+      imf_convolve_row_h(out, pad, cv->horizontal, cv->kw, channels, length);
+    }
+
+    for (k = 0; k < kh; ++k)
+      rows[k] = ring + imf_convolve_ring_slot(top + (ssize_t) k, kh) * length;
+    imf_convolve_row_v(acc, rows, cv->vertical, kh, length);
+    imf_convolve_store_row(dst->data + y * dst->row_stride, acc, dst->component_size, length);
+  }
+
+done:
+  free(pad);
+  free(ring);
+  free(acc);
+  free(rows);
+}
+
+/* Each destination row is the sum of the rows of the kernel applied to kh
+ * padded source rows. */
+static void
+imf_convolve_general_band(void *arg, size_t begin, size_t end)
+{
+  imf_convolve_t *cv = (imf_convolve_t *) arg;
+  imf_image_t const *src = cv->src;
+  imf_image_t *dst = cv->dst;
+  size_t const channels = src->pixel_channels;
+  size_t const length = src->width * channels;
+  size_t const pad_length = (src->width + cv->kw - 1) * channels;
+  size_t const kh = cv->kh;
+  float *ring = malloc(kh * pad_length * sizeof(float));
+  float *acc = malloc(length * sizeof(float));
+  ssize_t next = (ssize_t) begin - (ssize_t) cv->ay;
+  size_t y, k;
+
+  if (ring == NULL || acc == NULL) {
+    cv->failed = true;
+    goto done;
+  }
+
+  for (y = begin; y < end; ++y) {
+    ssize_t const top = (ssize_t) y - (ssize_t) cv->ay;
+
+    for (; next < top + (ssize_t) kh; ++next)
+      imf_convolve_load_padded_row(cv, next, ring + imf_convolve_ring_slot(next, kh) * pad_length);
+
+    memset(acc, 0, length * sizeof(float));
+    for (k = 0; k < kh; ++k) {
+      float const *row = ring + imf_convolve_ring_slot(top + (ssize_t) k, kh) * pad_length;
+      imf_convolve_row_h(acc, row, cv->weights + k * cv->kw, cv->kw, channels, length);
+    }
+    imf_convolve_store_row(dst->data + y * dst->row_stride, acc, dst->component_size, length);
+  }
+
+done:
+  free(ring);
+  free(acc);
+}
+
+/* Box blurs */
+
+static inline uint32_t
+imf_convolve_get_component(uint8_t const *p, size_t i, size_t component_size)
+{
+  return component_size == 1 ? p[i] : ((uint16_t const *) p)[i];
+}
+
+/* Fills out[j * channels + c] with the sum of the first `first + j`
+ * components of channel c of the row extended by the border rule, modulo
+ * 2^32, for j in [0, count), where prefix[x * channels + c] is the sum of
+ * the first x pixels of the row.  The indices are split into runs on which
+ * the extended sums are a slice of the prefix sums, reversed or not, plus
+ * a term that is the same or linear in j, so that every run is a simple
+ * loop whatever the radius is.  :reflect repeats the row and its mirror
+ * image, which add up to the same sum in every period. */
+static inline void
+imf_convolve_box_extended_prefix(uint32_t *out, uint32_t const *prefix, ssize_t first, size_t count,
+                                 size_t width, size_t channels, int border)
+{
+  uint32_t const *total = prefix + width * channels;
+  uint32_t const *before_last = prefix + (width - 1) * channels;
+  size_t j, c;
+
+  while (count > 0) {
+    ssize_t const i = first;
+    size_t run;
+
+    if (border == IMF_CONVOLVE_BORDER_CLAMP || width == 1) {
+      if (i < 0) {
+        /* the copies of the first pixel */
+        run = (size_t) -i < count ? (size_t) -i : count;
+        for (j = 0; j < run; ++j)
+          for (c = 0; c < channels; ++c)
+            out[j * channels + c] = (uint32_t) (i + (ssize_t) j) * prefix[channels + c];
+      }
+      else if ((size_t) i <= width) {
+        run = width - (size_t) i + 1 < count ? width - (size_t) i + 1 : count;
+        memcpy(out, prefix + (size_t) i * channels, run * channels * sizeof(uint32_t));
+      }
+      else {
+        /* the copies of the last pixel */
+        run = count;
+        for (j = 0; j < run; ++j)
+          for (c = 0; c < channels; ++c)
+            out[j * channels + c] = total[c] + (uint32_t) ((size_t) i + j - width) * (total[c] - before_last[c]);
+      }
+    }
+    else {
+      size_t const period = 2 * (width - 1);
+      ssize_t const q = imf_convolve_floor_div(i, (ssize_t) period);
+      size_t const m = (size_t) (i - q * (ssize_t) period);
+      uint32_t base[4], last[4];
+
+      for (c = 0; c < channels; ++c) {
+        last[c] = total[c] + before_last[c];
+        base[c] = (uint32_t) q * (last[c] - prefix[channels + c]);
+      }
+      if (m <= width) {
+        run = width - m + 1 < count ? width - m + 1 : count;
+        for (j = 0; j < run; ++j)
+          for (c = 0; c < channels; ++c)
+            out[j * channels + c] = base[c] + prefix[(m + j) * channels + c];
+      }
+      else {
+        /* the mirror image */
+        run = period - m < count ? period - m : count;
+        for (j = 0; j < run; ++j)
+          for (c = 0; c < channels; ++c)
+            out[j * channels + c] = base[c] + last[c] - prefix[(2 * width - 1 - m - j) * channels + c];
+      }
+    }
+
+    out += run * channels;
+    first += (ssize_t) run;
+    count -= run;
+  }
+}
+
+/* The boxes of pixels [begin, end) of a row over an edge, as the
+ * differences of the extended prefix sums taken into hi and lo.  The body
+ * is inlined for each number of channels as the resize kernels, so that
+ * the compiler can unroll the loops over the channels. */
+static inline void
+imf_convolve_box_edge_body(uint32_t *out, uint32_t const *prefix, uint32_t *hi, uint32_t *lo,
+                           size_t begin, size_t end, size_t r, float inv,
+                           size_t width, size_t channels, int border)
+{
+  size_t const length = (end - begin) * channels;
+  size_t i;
+
+  imf_convolve_box_extended_prefix(hi, prefix, (ssize_t) (begin + r + 1), end - begin, width, channels, border);
+  imf_convolve_box_extended_prefix(lo, prefix, (ssize_t) begin - (ssize_t) r, end - begin, width, channels, border);
+  out += begin * channels;
+  for (i = 0; i < length; ++i)
+    out[i] = imf_convolve_box_div(hi[i] - lo[i], inv);
+}
+
+static void
+imf_convolve_box_edge(uint32_t *out, uint32_t const *prefix, uint32_t *hi, uint32_t *lo,
+                      size_t begin, size_t end, size_t r, float inv,
+                      size_t width, size_t channels, int border)
+{
+  if (begin >= end)
+    return;
+
+  switch (channels) {
+    case 1:
+      imf_convolve_box_edge_body(out, prefix, hi, lo, begin, end, r, inv, width, 1, border);
+      break;
+    case 2:
+      imf_convolve_box_edge_body(out, prefix, hi, lo, begin, end, r, inv, width, 2, border);
+      break;
+    case 3:
+      imf_convolve_box_edge_body(out, prefix, hi, lo, begin, end, r, inv, width, 3, border);
+      break;
+    default:
+      imf_convolve_box_edge_body(out, prefix, hi, lo, begin, end, r, inv, width, 4, border);
+      break;
+  }
+}
+
+/* The horizontal box blurs of rows [begin, end) into box_tmp[0].  Every
+ * pass takes the prefix sums of the row, and each box is the difference of
+ * two of them, so that the cost does not depend on the radius.  The boxes
+ * over the edges are done by imf_convolve_box_edge. */
+static void
+imf_convolve_box_horizontal_band(void *arg, size_t begin, size_t end)
+{
+  imf_convolve_t *cv = (imf_convolve_t *) arg;
+  imf_image_t const *src = cv->src;
+  size_t const channels = src->pixel_channels;
+  size_t const cs = src->component_size;
+  size_t const width = src->width;
+  size_t const length = width * channels;
+  uint32_t *prefix = malloc((length + channels) * sizeof(uint32_t));
+  uint32_t *row = malloc(length * sizeof(uint32_t));
+  uint32_t *next = malloc(length * sizeof(uint32_t));
+  uint32_t *edge = malloc(2 * length * sizeof(uint32_t));
+  size_t y, i, c, p;
+
+  if (prefix == NULL || row == NULL || next == NULL || edge == NULL) {
+    cv->failed = true;
+    goto done;
+  }
+
+  for (y = begin; y < end; ++y) {
+    uint8_t const *in = src->data + y * src->row_stride;
+    uint8_t *out = cv->box_tmp[0] + y * cv->box_stride;
+
+    if (cs == 1) {
+      for (i = 0; i < length; ++i)
+        row[i] = in[i];
+    }
+    else {
+      for (i = 0; i < length; ++i)
+        row[i] = ((uint16_t const *) in)[i];
+    }
+
+    for (p = 0; p < IMF_CONVOLVE_BOX_PASSES; ++p) {
+      size_t const r = cv->box_radii[p];
+      float const inv = 1.0f / (float) (2 * r + 1);
+      size_t const inner_begin = r < width ? r : width;
+      size_t inner_end = width > r ? width - r : 0;
+      uint32_t *tmp;
+
+      if (inner_end < inner_begin)
+        inner_end = inner_begin;
+
+      for (c = 0; c < channels; ++c)
+        prefix[c] = 0;
+      for (i = 0; i < length; ++i)
+        prefix[i + channels] = prefix[i] + row[i];
+
+      /* the boxes within the row */
+      size_t const hi = (r + 1) * channels, lo = r * channels;
+      for (i = inner_begin * channels; i < inner_end * channels; ++i)
+        next[i] = imf_convolve_box_div(prefix[i + hi] - prefix[i - lo], inv);
+
+      imf_convolve_box_edge(next, prefix, edge, edge + length, 0, inner_begin, r, inv, width, channels, cv->border);
+      imf_convolve_box_edge(next, prefix, edge, edge + length, inner_end, width, r, inv, width, channels, cv->border);
+
+      tmp = row;
+      row = next;
+      next = tmp;
+    }
+
+    if (cs == 1) {
+      for (i = 0; i < length; ++i)
+        out[i] = (uint8_t) row[i];
+    }
+    else {
+      for (i = 0; i < length; ++i)
+        ((uint16_t *) out)[i] = (uint16_t) row[i];
+    }
+  }
+
+done:
+  free(prefix);
+  free(row);
+  free(next);
+  free(edge);
+}
+
+/* The vertical box blurs of strips [begin, end), from box_tmp[0] through
+ * box_tmp[1] and box_tmp[0] into the destination. */
+static void
+imf_convolve_box_vertical_band(void *arg, size_t begin, size_t end)
+{
+  imf_convolve_t *cv = (imf_convolve_t *) arg;
+  imf_image_t *dst = cv->dst;
+  size_t const cs = dst->component_size;
+  size_t const length = dst->width * dst->pixel_channels;
+  size_t const height = dst->height;
+  uint32_t sum[IMF_CONVOLVE_STRIP_LENGTH];
+  size_t s, p, y, i, k;
+
+  for (s = begin; s < end; ++s) {
+    size_t const offset = s * IMF_CONVOLVE_STRIP_LENGTH * cs;
+    size_t const strip_length = length - s * IMF_CONVOLVE_STRIP_LENGTH < IMF_CONVOLVE_STRIP_LENGTH
+                              ? length - s * IMF_CONVOLVE_STRIP_LENGTH : IMF_CONVOLVE_STRIP_LENGTH;
+
+    for (p = 0; p < IMF_CONVOLVE_BOX_PASSES; ++p) {
+      size_t const r = cv->box_radii[p];
+      float const inv = 1.0f / (float) (2 * r + 1);
+      uint8_t const *in = cv->box_tmp[p % 2] + offset;
+      uint8_t *out_base;
+      size_t out_stride;
+
+      if (p + 1 < IMF_CONVOLVE_BOX_PASSES) {
+        out_base = cv->box_tmp[(p + 1) % 2] + offset;
+        out_stride = cv->box_stride;
+      }
+      else {
+        out_base = dst->data + offset;
+        out_stride = dst->row_stride;
+      }
+
+      /* the box around row 0 counts each row by the times the border
+       * rule repeats it, so that it takes up to height rows */
+      memset(sum, 0, sizeof(sum));
+      for (k = 0; k <= (r < height ? r : height - 1); ++k) {
+        uint8_t const *row = in + k * cv->box_stride;
+        uint32_t const count = (uint32_t) imf_convolve_border_count(k, r, height, cv->border);
+        if (count == 1) {
+          for (i = 0; i < strip_length; ++i)
+            sum[i] += imf_convolve_get_component(row, i, cs);
+        }
+        else if (count > 1) {
+          for (i = 0; i < strip_length; ++i)
+            sum[i] += count * imf_convolve_get_component(row, i, cs);
+        }
+      }
+
+      for (y = 0; y < height; ++y) {
+        size_t const add_y = imf_convolve_border_index((ssize_t) (y + r + 1), height, cv->border);
+        size_t const sub_y = imf_convolve_border_index((ssize_t) y - (ssize_t) r, height, cv->border);
+        imf_convolve_box_row_v(out_base + y * out_stride, sum,
+                               in + add_y * cv->box_stride, in + sub_y * cv->box_stride,
+                               inv, cs, strip_length);
+      }
+    }
+  }
+}
+
+/* FFT convolution
+ *
+ * The image is padded by the border rule to (width + kw - 1) x (height +
+ * kh - 1) pixels, and by zeros further to the sizes that the FFT transforms
+ * fast.  The circular correlation with the kernel at the origin is then
+ * the same as the convolution in the width x height pixels on the upper
+ * left, because the kernel never wraps around there.  The channels are
+ * transformed one by one, each in parallel. */
+
+static void
+imf_convolve_fft_load_channel(imf_convolve_t const *cv, size_t c)
+{
+  imf_image_t const *src = cv->src;
+  size_t const channels = src->pixel_channels;
+  size_t const padded_width = src->width + cv->kw - 1;
+  size_t const padded_height = src->height + cv->kh - 1;
+  size_t x, y;
+
+  for (y = 0; y < cv->fft_height; ++y) {
+    double *samples = cv->fft_samples + y * cv->fft_width;
+    if (y >= padded_height) {
+      memset(samples, 0, cv->fft_width * sizeof(double));
+      continue;
+    }
+
+    size_t const sy = imf_convolve_border_index((ssize_t) y - (ssize_t) cv->ay, src->height, cv->border);
+    uint8_t const *row = src->data + sy * src->row_stride;
+    for (x = 0; x < padded_width; ++x) {
+      size_t const sx = imf_convolve_border_index((ssize_t) x - (ssize_t) cv->ax, src->width, cv->border);
+      samples[x] = imf_convolve_get_component(row, sx * channels + c, src->component_size);
+    }
+    for (; x < cv->fft_width; ++x)
+      samples[x] = 0.0;
+  }
+}
+
+static void
+imf_convolve_fft_store_channel(imf_convolve_t const *cv, size_t c)
+{
+  imf_image_t *dst = cv->dst;
+  size_t const channels = dst->pixel_channels;
+  double const max = dst->component_size == 1 ? 255.0 : 65535.0;
+  size_t x, y;
+
+  for (y = 0; y < dst->height; ++y) {
+    double const *samples = cv->fft_samples + y * cv->fft_width;
+    uint8_t *row = dst->data + y * dst->row_stride;
+    for (x = 0; x < dst->width; ++x) {
+      double v = samples[x] + 0.5;
+      v = v < 0.0 ? 0.0 : v > max ? max : v;
+      if (dst->component_size == 1)
+        row[x * channels + c] = (uint8_t) v;
+      else
+        ((uint16_t *) row)[x * channels + c] = (uint16_t) v;
+    }
+  }
+}
+
+static void *
+imf_convolve_fft_without_gvl(void *arg)
+{
+  imf_convolve_t *cv = (imf_convolve_t *) arg;
+  size_t const length = cv->fft_height * (cv->fft_width / 2 + 1);
+  double const scale = 1.0 / ((double) cv->fft_width * (double) cv->fft_height);
+  size_t c, i, j;
+
+  memset(cv->fft_samples, 0, cv->fft_width * cv->fft_height * sizeof(double));
+  for (i = 0; i < cv->kh; ++i) {
+    for (j = 0; j < cv->kw; ++j)
+      cv->fft_samples[i * cv->fft_width + j] = cv->weights[i * cv->kw + j];
+  }
+  if (!imf_fft_2d_forward(cv->fft_rows, cv->fft_columns, cv->fft_samples, cv->fft_width, cv->fft_kernel)) {
+    cv->failed = true;
+    return NULL;
+  }
+  for (i = 0; i < length; ++i) {
+    cv->fft_kernel[i].re *= scale;
+    cv->fft_kernel[i].im *= -scale;
+  }
+
+  for (c = 0; c < cv->dst->pixel_channels; ++c) {
+    imf_convolve_fft_load_channel(cv, c);
+    if (!imf_fft_2d_forward(cv->fft_rows, cv->fft_columns, cv->fft_samples, cv->fft_width, cv->fft_spectrum)) {
+      cv->failed = true;
+      return NULL;
+    }
+    for (i = 0; i < length; ++i) {
+      imf_complex_t const a = cv->fft_spectrum[i], b = cv->fft_kernel[i];
+      cv->fft_spectrum[i].re = a.re * b.re - a.im * b.im;
+      cv->fft_spectrum[i].im = a.re * b.im + a.im * b.re;
+    }
+    if (!imf_fft_2d_inverse(cv->fft_rows, cv->fft_columns, cv->fft_spectrum, cv->fft_samples, cv->fft_width)) {
+      cv->failed = true;
+      return NULL;
+    }
+    imf_convolve_fft_store_channel(cv, c);
+  }
+
+  return NULL;
+}
+
+/* Chooses the FFT for method: :auto if it is estimated to take less time
+ * than the taps of the kernel applied directly.  A channel takes a forward
+ * and an inverse transform, whose samples cost IMF_CONVOLVE_FFT_COST taps
+ * per bit of the size, and the kernel takes one more transform shared by
+ * the channels. */
+static bool
+imf_convolve_prefer_fft(imf_convolve_t const *cv, size_t fft_width, size_t fft_height)
+{
+  imf_image_t const *src = cv->src;
+  double const taps = cv->separable ? (double) (cv->kw + cv->kh) : (double) (cv->kw * cv->kh);
+  double const samples = (double) fft_width * (double) fft_height;
+  double const transforms = (2.0 * src->pixel_channels + 1.0) / (2.0 * src->pixel_channels);
+  double const cost = IMF_CONVOLVE_FFT_COST * transforms * log2(samples) * samples / ((double) src->width * (double) src->height);
+
+  return taps > cost;
+}
+
+static size_t
+imf_convolve_min_rows_per_band(size_t width)
+{
+  size_t const rows = IMF_CONVOLVE_MIN_BAND_PIXELS / (width > 0 ? width : 1);
+  return rows > 0 ? rows : 1;
+}
+
+static void *
+imf_convolve_without_gvl(void *arg)
+{
+  imf_convolve_t *cv = (imf_convolve_t *) arg;
+  imf_image_t *dst = cv->dst;
+  size_t const min_rows = imf_convolve_min_rows_per_band(dst->width);
+
+  if (cv->box_tmp[0] != NULL) {
+    size_t const length = dst->width * dst->pixel_channels;
+    size_t const strips = (length + IMF_CONVOLVE_STRIP_LENGTH - 1) / IMF_CONVOLVE_STRIP_LENGTH;
+    size_t const strip_pixels = IMF_CONVOLVE_STRIP_LENGTH / dst->pixel_channels * dst->height;
+
+    imf_parallel_for_rows(dst->height, min_rows, imf_convolve_box_horizontal_band, cv);
+    if (!cv->failed) {
+      imf_parallel_for_rows(strips, IMF_CONVOLVE_MIN_BAND_PIXELS / strip_pixels + 1,
+                            imf_convolve_box_vertical_band, cv);
+    }
+  }
+  else if (cv->separable)
+    imf_parallel_for_rows(dst->height, min_rows, imf_convolve_separable_band, cv);
+  else
+    imf_parallel_for_rows(dst->height, min_rows, imf_convolve_general_band, cv);
+
+  return NULL;
+}
+
+/* Reads the kernel given as an array of rows, and splits it into the
+ * horizontal and vertical kernels if it is the outer product of them. */
+static void
+imf_convolve_parse_kernel(imf_convolve_t *cv, VALUE kernel_v)
+{
+  size_t i, j, pr = 0, pc = 0;
+  double max = 0.0;
+  VALUE row_v;
+
+  kernel_v = rb_check_array_type(kernel_v);
+  if (NIL_P(kernel_v) || RARRAY_LEN(kernel_v) == 0)
+    rb_raise(rb_eArgError, "kernel must be a non-empty array of rows");
+
+  row_v = rb_check_array_type(RARRAY_AREF(kernel_v, 0));
+  if (NIL_P(row_v) || RARRAY_LEN(row_v) == 0)
+    rb_raise(rb_eArgError, "kernel must be a non-empty array of rows");
+
+  cv->kh = (size_t) RARRAY_LEN(kernel_v);
+  cv->kw = (size_t) RARRAY_LEN(row_v);
+  cv->ay = cv->kh / 2;
+  cv->ax = cv->kw / 2;
+  cv->weights = ALLOC_N(float, cv->kh * cv->kw);
+
+  for (i = 0; i < cv->kh; ++i) {
+    row_v = rb_check_array_type(RARRAY_AREF(kernel_v, i));
+    if (NIL_P(row_v) || (size_t) RARRAY_LEN(row_v) != cv->kw)
+      rb_raise(rb_eArgError, "kernel rows must be arrays of the same length");
+    for (j = 0; j < cv->kw; ++j) {
+      double const w = NUM2DBL(RARRAY_AREF(row_v, j));
+      cv->weights[i * cv->kw + j] = (float) w;
+      if (fabs(w) > max) {
+        max = fabs(w);
+        pr = i;
+        pc = j;
+      }
+    }
+  }
+
+  /* the kernel is the outer product of the column pc and the row pr
+   * divided by the pivot, if it is of rank 1 */
+  cv->vertical = ALLOC_N(float, cv->kh);
+  cv->horizontal = ALLOC_N(float, cv->kw);
+  float const *k = cv->weights;
+  float const pivot = max > 0.0 ? k[pr * cv->kw + pc] : 1.0f;
+  for (i = 0; i < cv->kh; ++i)
+    cv->vertical[i] = k[i * cv->kw + pc];
+  for (j = 0; j < cv->kw; ++j)
+    cv->horizontal[j] = k[pr * cv->kw + j] / pivot;
+
+  cv->separable = true;
+  for (i = 0; i < cv->kh && cv->separable; ++i) {
+    for (j = 0; j < cv->kw; ++j) {
+      double const d = (double) cv->vertical[i] * cv->horizontal[j] - k[i * cv->kw + j];
+      if (fabs(d) > max * 1e-6) {
+        cv->separable = false;
+        break;
+      }
+    }
+  }
+}
+
+/* The exact Gaussian kernel for a small sigma, or the radii of the box
+ * blurs whose variances add up to sigma^2 for a large one.  The box widths
+ * are the odd numbers around sqrt(12 sigma^2 / n + 1), as in "Fast Almost-
+ * Gaussian Filtering" by Peter Kovesi. */
+static void
+imf_convolve_gaussian_kernel(imf_convolve_t *cv, double sigma)
+{
+  size_t i;
+
+  if (sigma < IMF_CONVOLVE_MIN_BOX_SIGMA) {
+    size_t const radius = (size_t) ceil(3.0 * sigma);
+    size_t const n = 2 * radius + 1;
+    double total = 0.0;
+
+    cv->kw = cv->kh = n;
+    cv->ax = cv->ay = radius;
+    cv->separable = true;
+    cv->horizontal = ALLOC_N(float, n);
+    cv->vertical = ALLOC_N(float, n);
+    double *w = ALLOCA_N(double, n);
+    for (i = 0; i < n; ++i) {
+      double const x = (double) i - (double) radius;
+      w[i] = exp(-x * x / (2.0 * sigma * sigma));
+      total += w[i];
+    }
+    for (i = 0; i < n; ++i)
+      cv->horizontal[i] = cv->vertical[i] = (float) (w[i] / total);
+    return;
+  }
+
+  double const var = 12.0 * sigma * sigma;
+  double const passes = IMF_CONVOLVE_BOX_PASSES;
+  long wl = (long) floor(sqrt(var / passes + 1.0));
+  if (wl % 2 == 0)
+    --wl;
+  long const m = lround((var - passes * wl * wl - 4.0 * passes * wl - 3.0 * passes) / (-4.0 * wl - 4.0));
+  for (i = 0; i < IMF_CONVOLVE_BOX_PASSES; ++i)
+    cv->box_radii[i] = (size_t) (((long) i < m ? wl : wl + 2) - 1) / 2;
+}
+
+static VALUE
+imf_convolve_body(VALUE arg)
+{
+  imf_convolve_t *cv = (imf_convolve_t *) arg;
+  imf_image_t const *src = cv->src;
+  imf_image_t *dst = cv->dst;
+
+  if (cv->sigma > 0.0)
+    imf_convolve_gaussian_kernel(cv, cv->sigma);
+  else
+    imf_convolve_parse_kernel(cv, cv->kernel_v);
+
+  if (src->color_space == IMF_COLOR_SPACE_INDEXED) {
+    cv->expanded.row_alignment = src->row_alignment;
+    imf_image_expand_palette(src, &cv->expanded);
+    cv->src = src = &cv->expanded;
+  }
+
+  *dst = *src;
+  dst->data = NULL;
+  dst->palette = NULL;
+  imf_image_allocate_image_buffer(dst);
+
+  if (cv->sigma == 0.0 && cv->method != IMF_CONVOLVE_METHOD_DIRECT) {
+    size_t const fft_width = imf_fft_good_size(src->width + cv->kw - 1);
+    size_t const fft_height = imf_fft_good_size(src->height + cv->kh - 1);
+
+    if (cv->method == IMF_CONVOLVE_METHOD_FFT || imf_convolve_prefer_fft(cv, fft_width, fft_height)) {
+      cv->fft_width = fft_width;
+      cv->fft_height = fft_height;
+      cv->fft_rows = imf_fft_real_plan(fft_width);
+      cv->fft_columns = imf_fft_plan(fft_height);
+      cv->fft_samples = ALLOC_N(double, fft_width * fft_height);
+      cv->fft_spectrum = ALLOC_N(imf_complex_t, fft_height * (fft_width / 2 + 1));
+      cv->fft_kernel = ALLOC_N(imf_complex_t, fft_height * (fft_width / 2 + 1));
+      imf_call_without_gvl(imf_convolve_fft_without_gvl, cv, NULL, NULL);
+      if (cv->failed)
+        rb_raise(rb_eNoMemError, "failed to allocate memory for convolution");
+      return Qnil;
+    }
+  }
+
+  if (cv->sigma >= IMF_CONVOLVE_MIN_BOX_SIGMA) {
+    cv->box_stride = dst->width * dst->pixel_channels * dst->component_size;
+    cv->box_tmp[0] = ALLOC_N(uint8_t, cv->box_stride * dst->height);
+    cv->box_tmp[1] = ALLOC_N(uint8_t, cv->box_stride * dst->height);
+  }
+
+  imf_call_without_gvl(imf_convolve_without_gvl, cv, NULL, NULL);
+
+  if (cv->failed)
+    rb_raise(rb_eNoMemError, "failed to allocate memory for convolution");
+
+  return Qnil;
+}
+
+static VALUE
+imf_convolve_ensure(VALUE arg)
+{
+  imf_convolve_t *cv = (imf_convolve_t *) arg;
+
+  xfree(cv->weights);
+  xfree(cv->horizontal);
+  xfree(cv->vertical);
+  xfree(cv->box_tmp[0]);
+  xfree(cv->box_tmp[1]);
+  xfree(cv->fft_samples);
+  xfree(cv->fft_spectrum);
+  xfree(cv->fft_kernel);
+  if (cv->expanded.data != NULL)
+    imf_image_release(&cv->expanded);
+
+  return Qnil;
+}
+
+static VALUE
+imf_convolve_run(VALUE obj, imf_convolve_t *cv, VALUE opts)
+{
+  imf_image_t *img = imf_get_image_data(obj);
+  VALUE values[2] = { Qundef, Qundef }, new_obj;
+
+  imf_image_check_interleaved(img);
+  if (!NIL_P(opts)) {
+    rb_get_kwargs(opts, convolve_kwargs, 0, cv->sigma > 0.0 ? 1 : 2, values);
+    if (values[0] != Qundef && !NIL_P(values[0]))
+      cv->border = imf_convolve_find_option(convolve_borders, "border", values[0]);
+    if (values[1] != Qundef && !NIL_P(values[1]))
+      cv->method = imf_convolve_find_option(convolve_methods, "method", values[1]);
+  }
+
+  new_obj = rb_obj_alloc(rb_obj_class(obj));
+  cv->src = img;
+  cv->dst = imf_get_image_data(new_obj);
+  rb_ensure(imf_convolve_body, (VALUE) cv, imf_convolve_ensure, (VALUE) cv);
+
+  return new_obj;
+}
+
+/*
+ * call-seq:
+ *   image.convolve(kernel, border: :clamp, method: :auto) -> new_image
+ *
+ * Returns a new image convolved with the kernel, which is an array of
+ * rows of weights, e.g. [[0, -1, 0], [-1, 5, -1], [0, -1, 0]].  The
+ * element [kernel.size / 2][kernel[0].size / 2], which is the center, or
+ * the one on the lower right of the center for an even size, is on the
+ * destination pixel.  The results are rounded and clamped to the range of
+ * the components.  A kernel that is the outer product of a column and a
+ * row is applied as the two.
+ *
+ * The border is :clamp to repeat the edge pixels, or :reflect to mirror
+ * the image at them.  Every channel including alpha is convolved, and
+ * indexed images are expanded into RGB(A) ones.
+ *
+ * The method is :direct to apply the taps of the kernel to every pixel,
+ * :fft to multiply the spectra of the image and the kernel, whose time
+ * hardly depends on the kernel size, or :auto to choose the faster one,
+ * which is the FFT for a kernel of more than about 25x25 elements that
+ * is not separable.  The results of the two may differ by 1 as they are
+ * rounded from different precisions.
+ */
+static VALUE
+imf_image_convolve(int argc, VALUE *argv, VALUE obj)
+{
+  VALUE kernel_v, opts;
+  imf_convolve_t cv;
+
+  rb_scan_args(argc, argv, "1:", &kernel_v, &opts);
+
+  memset(&cv, 0, sizeof(cv));
+  cv.kernel_v = kernel_v;
+  return imf_convolve_run(obj, &cv, opts);
+}
+
+/*
+ * call-seq:
+ *   image.gaussian_blur(sigma, border: :clamp) -> new_image
+ *
+ * Returns a new image blurred by the Gaussian of the standard deviation
+ * sigma in pixels.  A sigma of 3 or more is approximated by three box
+ * blurs, which take the same time for any sigma.  The border is the same
+ * as #convolve.
+ */
+static VALUE
+imf_image_gaussian_blur(int argc, VALUE *argv, VALUE obj)
+{
+  VALUE sigma_v, opts;
+  imf_convolve_t cv;
+  double sigma;
+
+  rb_scan_args(argc, argv, "1:", &sigma_v, &opts);
+  sigma = NUM2DBL(sigma_v);
+  if (!(sigma > 0.0 && sigma <= IMF_CONVOLVE_MAX_SIGMA))
+    rb_raise(rb_eArgError, "sigma must be positive and at most %g (%g given)", IMF_CONVOLVE_MAX_SIGMA, sigma);
+
+  memset(&cv, 0, sizeof(cv));
+  cv.sigma = sigma;
+  return imf_convolve_run(obj, &cv, opts);
+}
+
+void
+Init_imf_image_convolve(void)
+{
+  imf_convolve_option_t *option;
+
+  rb_define_method(imf_cIMF_Image, "convolve", imf_image_convolve, -1);
+  rb_define_method(imf_cIMF_Image, "gaussian_blur", imf_image_gaussian_blur, -1);
+
+  for (option = convolve_borders; option->name != NULL; ++option)
+    option->id = rb_intern(option->name);
+  for (option = convolve_methods; option->name != NULL; ++option)
+    option->id = rb_intern(option->name);
+
+  convolve_kwargs[0] = rb_intern("border");
+  convolve_kwargs[1] = rb_intern("method");
+}
@@ -0,0 +1,308 @@
+#include "IMF.h"
+
+#include "internal.h"
+
+/* Bulk pixel export
+ *
+ * Image#export_pixels copies a region into a packed binary String, either
+ * in the layout of the image or converted into one of the 8-bit layouts
+ * listed below.  Image#each_row yields read-only Strings that refer to
+ * the rows in the image buffer without copying. */
+
+static ID id_layout;
+static ID id_buffer;
+
+enum imf_export_component {
+  IMF_EXPORT_R = 0,
+  IMF_EXPORT_G,
+  IMF_EXPORT_B,
+  IMF_EXPORT_A,
+  IMF_EXPORT_Y,
+  IMF_EXPORT_NUM_COMPONENTS
+};
+
+typedef struct imf_export_layout imf_export_layout_t;
+struct imf_export_layout {
+  char const *name;
+  ID id;
+  uint8_t channels;
+  uint8_t components[4];
+};
+
+static imf_export_layout_t export_layouts[] = {
+  { "gray8",  0, 1, { IMF_EXPORT_Y } },
+  { "graya8", 0, 2, { IMF_EXPORT_Y, IMF_EXPORT_A } },
+  { "rgb8",   0, 3, { IMF_EXPORT_R, IMF_EXPORT_G, IMF_EXPORT_B } },
+  { "rgba8",  0, 4, { IMF_EXPORT_R, IMF_EXPORT_G, IMF_EXPORT_B, IMF_EXPORT_A } },
+  { "bgr8",   0, 3, { IMF_EXPORT_B, IMF_EXPORT_G, IMF_EXPORT_R } },
+  { "bgra8",  0, 4, { IMF_EXPORT_B, IMF_EXPORT_G, IMF_EXPORT_R, IMF_EXPORT_A } },
+  { "argb8",  0, 4, { IMF_EXPORT_A, IMF_EXPORT_R, IMF_EXPORT_G, IMF_EXPORT_B } },
+  { "abgr8",  0, 4, { IMF_EXPORT_A, IMF_EXPORT_B, IMF_EXPORT_G, IMF_EXPORT_R } },
+  { NULL, 0, 0, { 0 } }
+};
+
+static imf_export_layout_t const *
+imf_export_find_layout(VALUE layout_v)
+{
+  imf_export_layout_t const *layout;
+  ID id = rb_check_id(&layout_v);
+
+  if (id != 0) {
+    for (layout = export_layouts; layout->name != NULL; ++layout) {
+      if (layout->id == id)
+        return layout;
+    }
+  }
+
+  rb_raise(rb_eArgError, "unknown pixel layout: %"PRIsVALUE, rb_inspect(layout_v));
+}
+
+static inline uint8_t
+imf_export_fetch(uint8_t const *ptr, size_t channel, size_t component_size)
+{
+  if (component_size == 1)
+    return ptr[channel];
+  /* scale a native-endian 16-bit component with rounding, in the same way
+   * as png_set_scale_16 of libpng */
+  return (uint8_t) ((((uint16_t const *) ptr)[channel] * 255U + 32895U) >> 16);
+}
+
+/* ITU-R BT.601 luma in 8-bit fixed point */
+static inline uint8_t
+imf_export_luma(uint8_t r, uint8_t g, uint8_t b)
+{
+  return (uint8_t) ((77 * r + 150 * g + 29 * b + 128) >> 8);
+}
+
+/* The body of the conversion is instantiated for each combination of the
+ * component size and the color space, so that the compiler can resolve
+ * the branches for every pixel. */
+static inline void
+imf_export_convert_row_body(uint8_t const *src, size_t width, size_t pixel_size,
+                            size_t component_size, bool gray, bool has_alpha, size_t alpha_channel,
+                            imf_export_layout_t const *layout, uint8_t *dst)
+{
+  size_t const out_channels = layout->channels;
+  bool const need_luma = !gray && memchr(layout->components, IMF_EXPORT_Y, out_channels) != NULL;
+  size_t x, i;
+
+  for (x = 0; x < width; ++x, src += pixel_size, dst += out_channels) {
+    uint8_t v[IMF_EXPORT_NUM_COMPONENTS];
+
+    if (gray) {
+      v[IMF_EXPORT_Y] = v[IMF_EXPORT_R] = v[IMF_EXPORT_G] = v[IMF_EXPORT_B] =
+        imf_export_fetch(src, 0, component_size);
+    }
+    else {
+      v[IMF_EXPORT_R] = imf_export_fetch(src, 0, component_size);
+      v[IMF_EXPORT_G] = imf_export_fetch(src, 1, component_size);
+      v[IMF_EXPORT_B] = imf_export_fetch(src, 2, component_size);
+      if (need_luma)
+        v[IMF_EXPORT_Y] = imf_export_luma(v[IMF_EXPORT_R], v[IMF_EXPORT_G], v[IMF_EXPORT_B]);
+    }
+    v[IMF_EXPORT_A] = has_alpha ? imf_export_fetch(src, alpha_channel, component_size) : 0xFF;
+
+    for (i = 0; i < out_channels; ++i)
+      dst[i] = v[layout->components[i]];
+  }
+}
+
+/* Looks up the palette for each index.  The entries are in the rgba8
+ * layout, so it is a plain gather for that layout. */
+static void
+imf_export_convert_indexed_row(imf_image_t const *img, uint8_t const *src, size_t width,
+                               imf_export_layout_t const *layout, uint8_t *dst)
+{
+  uint8_t const (*const palette)[4] = (uint8_t const (*)[4]) img->palette;
+  size_t const out_channels = layout->channels;
+  bool const need_luma = memchr(layout->components, IMF_EXPORT_Y, out_channels) != NULL;
+  size_t x, i;
+
+  if (layout->components[0] == IMF_EXPORT_R && out_channels == 4 &&
+      layout->components[3] == IMF_EXPORT_A) {
+    for (x = 0; x < width; ++x)
+      memcpy(dst + 4 * x, palette[src[x]], 4);
+    return;
+  }
+
+  for (x = 0; x < width; ++x, dst += out_channels) {
+    uint8_t const *entry = palette[src[x]];
+    uint8_t v[IMF_EXPORT_NUM_COMPONENTS];
+
+    v[IMF_EXPORT_R] = entry[0];
+    v[IMF_EXPORT_G] = entry[1];
+    v[IMF_EXPORT_B] = entry[2];
+    v[IMF_EXPORT_A] = entry[3];
+    if (need_luma)
+      v[IMF_EXPORT_Y] = imf_export_luma(entry[0], entry[1], entry[2]);
+
+    for (i = 0; i < out_channels; ++i)
+      dst[i] = v[layout->components[i]];
+  }
+}
+
+static void
+imf_export_convert_row(imf_image_t const *img, uint8_t const *src, size_t width,
+                       imf_export_layout_t const *layout, uint8_t *dst)
+{
+  size_t const pixel_size = img->pixel_channels * img->component_size;
+  bool const has_alpha = IMF_IMAGE_HAS_ALPHA(img) != 0;
+  size_t const alpha_channel = img->pixel_channels - 1;
+
+  if (img->color_space == IMF_COLOR_SPACE_INDEXED) {
+    imf_export_convert_indexed_row(img, src, width, layout, dst);
+    return;
+  }
+
+  if (img->color_space == IMF_COLOR_SPACE_GRAY) {
+    if (img->component_size == 1)
+      imf_export_convert_row_body(src, width, pixel_size, 1, true, has_alpha, alpha_channel, layout, dst);
+    else
+      imf_export_convert_row_body(src, width, pixel_size, 2, true, has_alpha, alpha_channel, layout, dst);
+  }
+  else {
+    if (img->component_size == 1)
+      imf_export_convert_row_body(src, width, pixel_size, 1, false, has_alpha, alpha_channel, layout, dst);
+    else
+      imf_export_convert_row_body(src, width, pixel_size, 2, false, has_alpha, alpha_channel, layout, dst);
+  }
+}
+
+static void
+imf_export_check_region(imf_image_t const *img, ssize_t x, ssize_t y, ssize_t width, ssize_t height)
+{
+  if (x < 0 || y < 0 || width < 0 || height < 0 ||
+      (size_t) x + (size_t) width > img->width ||
+      (size_t) y + (size_t) height > img->height) {
+    rb_raise(rb_eIndexError,
+             "region (%"PRIdSIZE", %"PRIdSIZE", %"PRIdSIZE", %"PRIdSIZE") is out of the image of %"PRIuSIZE"x%"PRIuSIZE,
+             x, y, width, height, img->width, img->height);
+  }
+}
+
+/*
+ * call-seq:
+ *   image.export_pixels(x, y, width, height, layout: nil) -> string
+ *
+ * Returns the pixels in the given region as a packed binary String
+ * without row padding.  If layout is nil, the pixels are copied in the
+ * layout of the image, i.e. as indices for an indexed image.  Otherwise
+ * they are converted into one of :gray8, :graya8, :rgb8, :rgba8, :bgr8,
+ * :bgra8, :argb8, and :abgr8, which is possible for GRAY, RGB, and
+ * INDEXED images.
+ */
+static VALUE
+imf_image_export_pixels(int argc, VALUE *argv, VALUE obj)
+{
+  imf_image_t *img = imf_get_image_data(obj);
+  VALUE x_v, y_v, width_v, height_v, opts, layout_v = Qnil, str;
+  imf_export_layout_t const *layout = NULL;
+  ssize_t x, y, width, height, j;
+  size_t out_pixel_size, out_row_size;
+  uint8_t *dst;
+
+  imf_image_check_interleaved(img);
+  rb_scan_args(argc, argv, "4:", &x_v, &y_v, &width_v, &height_v, &opts);
+  if (!NIL_P(opts)) {
+    rb_get_kwargs(opts, &id_layout, 0, 1, &layout_v);
+    if (layout_v == Qundef)
+      layout_v = Qnil;
+  }
+
+  x = NUM2SSIZET(x_v);
+  y = NUM2SSIZET(y_v);
+  width = NUM2SSIZET(width_v);
+  height = NUM2SSIZET(height_v);
+  imf_export_check_region(img, x, y, width, height);
+
+  if (!NIL_P(layout_v)) {
+    layout = imf_export_find_layout(layout_v);
+    if (img->color_space != IMF_COLOR_SPACE_GRAY && img->color_space != IMF_COLOR_SPACE_RGB &&
+        img->color_space != IMF_COLOR_SPACE_INDEXED) {
+      rb_raise(rb_eArgError, "unable to convert pixels of the color space into a layout; convert the image into RGB first");
+    }
+    out_pixel_size = layout->channels;
+  }
+  else {
+    out_pixel_size = img->pixel_channels * img->component_size;
+  }
+  out_row_size = out_pixel_size * (size_t) width;
+
+  str = rb_str_new(NULL, (long) (out_row_size * (size_t) height));
+  if (out_row_size == 0 || height == 0)
+    return str;
+
+  size_t const pixel_size = img->pixel_channels * img->component_size;
+  uint8_t const *src = img->data + (size_t) y * img->row_stride + (size_t) x * pixel_size;
+  dst = (uint8_t *) RSTRING_PTR(str);
+
+  for (j = 0; j < height; ++j, src += img->row_stride, dst += out_row_size) {
+    if (layout == NULL)
+      memcpy(dst, src, out_row_size);
+    else
+      imf_export_convert_row(img, src, (size_t) width, layout, dst);
+  }
+
+  return str;
+}
+
+static VALUE
+imf_image_each_row_size(VALUE obj, VALUE args, VALUE eobj)
+{
+  imf_image_t *img = imf_get_image_data(obj);
+  return SIZET2NUM(img->height);
+}
+
+/*
+ * call-seq:
+ *   image.each_row { |row| ... } -> image
+ *   image.each_row -> enumerator
+ *
+ * Yields each row as a frozen binary String without row padding.  The
+ * Strings refer to the image buffer directly and keep the buffer alive;
+ * the buffer becomes shared as by #crop, so the rows keep their pixels
+ * when the image is written later.
+ */
+static VALUE
+imf_image_each_row(VALUE obj)
+{
+  imf_image_t *img = imf_get_image_data(obj);
+  VALUE base;
+  size_t y;
+
+  RETURN_SIZED_ENUMERATOR(obj, 0, 0, imf_image_each_row_size);
+  imf_image_check_interleaved(img);
+
+  base = imf_image_share_buffer(img);
+
+  /* The rows are taken from the buffer shared now even if the image gets
+   * another buffer while the block runs, e.g. the canvas of each_frame. */
+  uint8_t const *const data = img->data;
+  size_t const row_stride = img->row_stride;
+  size_t const height = img->height;
+  size_t const row_size = img->pixel_channels * img->component_size * img->width;
+  for (y = 0; y < height; ++y) {
+    VALUE row = rb_str_new_static((char const *) (data + y * row_stride), (long) row_size);
+    rb_ivar_set(row, id_buffer, base);
+    rb_obj_freeze(row);
+    rb_yield(row);
+  }
+
+  return obj;
+}
+
+void
+Init_imf_image_export(void)
+{
+  imf_export_layout_t *layout;
+
+  rb_define_method(imf_cIMF_Image, "export_pixels", imf_image_export_pixels, -1);
+  rb_define_method(imf_cIMF_Image, "each_row", imf_image_each_row, 0);
+
+  for (layout = export_layouts; layout->name != NULL; ++layout)
+    layout->id = rb_intern(layout->name);
+
+  id_layout = rb_intern("layout");
+  /* without '@', this instance variable is invisible from Ruby */
+  id_buffer = rb_intern("buffer");
+}
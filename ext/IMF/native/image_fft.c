@@ -0,0 +1,349 @@
+#include "IMF.h"
+
+#include <math.h>
+
+#include "internal.h"
+
+/* Spectrum
+ *
+ * IMF::Image#fft transforms every channel of an image into an IMF::Spectrum,
+ * which keeps the width / 2 + 1 columns of non-negative frequencies of each
+ * row, because the spectrum of real samples is Hermitian symmetric.  The
+ * spectrum remembers the pixel format of the image, so that
+ * IMF::Spectrum#ifft returns an image of the same format. */
+
+static VALUE imf_cIMF_Spectrum;
+
+typedef struct imf_spectrum imf_spectrum_t;
+struct imf_spectrum {
+  /* the size and the pixel format of the transformed image without its
+   * pixels */
+  imf_image_t shape;
+  size_t bins;
+  /* pixel_channels planes of height rows of bins complex numbers */
+  imf_complex_t *data;
+};
+
+static void
+imf_spectrum_free(void *ptr)
+{
+  xfree(((imf_spectrum_t *) ptr)->data);
+  xfree(ptr);
+}
+
+static size_t
+imf_spectrum_memsize(void const *ptr)
+{
+  imf_spectrum_t const *spec = (imf_spectrum_t const *) ptr;
+  size_t const length = spec->shape.pixel_channels * spec->shape.height * spec->bins;
+  return sizeof(imf_spectrum_t) + (spec->data != NULL ? length * sizeof(imf_complex_t) : 0);
+}
+
+static rb_data_type_t const imf_spectrum_data_type = {
+  "imf_spectrum",
+  {
+    NULL,
+    imf_spectrum_free,
+    imf_spectrum_memsize,
+  },
+#ifdef RUBY_TYPED_FREE_IMMEDIATELY
+  0, 0,
+  RUBY_TYPED_FREE_IMMEDIATELY
+#endif
+};
+
+static imf_spectrum_t *
+imf_get_spectrum_data(VALUE obj)
+{
+  imf_spectrum_t *spec;
+  TypedData_Get_Struct(obj, imf_spectrum_t, &imf_spectrum_data_type, spec);
+  if (spec->data == NULL)
+    rb_raise(rb_eTypeError, "uninitialized spectrum");
+  return spec;
+}
+
+static VALUE
+imf_spectrum_alloc(VALUE klass)
+{
+  imf_spectrum_t *spec;
+  return TypedData_Make_Struct(klass, imf_spectrum_t, &imf_spectrum_data_type, spec);
+}
+
+/* Transforms */
+
+typedef struct imf_fft_image imf_fft_image_t;
+struct imf_fft_image {
+  imf_image_t const *img;
+  imf_spectrum_t *spec;
+  imf_fft_real_plan_t const *rows;
+  imf_fft_plan_t const *columns;
+  /* the samples of a channel, and a copy of its spectrum for the inverse
+   * transform which overwrites it */
+  double *samples;
+  imf_complex_t *spectrum;
+  /* the RGB(A) pixels of an indexed image */
+  imf_image_t expanded;
+  bool failed;
+};
+
+static void *
+imf_image_fft_without_gvl(void *arg)
+{
+  imf_fft_image_t *t = (imf_fft_image_t *) arg;
+  imf_image_t const *img = t->img;
+  size_t const channels = img->pixel_channels;
+  size_t const plane_length = img->height * t->spec->bins;
+  size_t c, x, y;
+
+  for (c = 0; c < channels && !t->failed; ++c) {
+    for (y = 0; y < img->height; ++y) {
+      uint8_t const *row = img->data + y * img->row_stride;
+      double *samples = t->samples + y * img->width;
+      if (img->component_size == 1) {
+        for (x = 0; x < img->width; ++x)
+          samples[x] = row[x * channels + c];
+      }
+      else {
+        for (x = 0; x < img->width; ++x)
+          samples[x] = ((uint16_t const *) row)[x * channels + c];
+      }
+    }
+
+    if (!imf_fft_2d_forward(t->rows, t->columns, t->samples, img->width, t->spec->data + c * plane_length))
+      t->failed = true;
+  }
+
+  return NULL;
+}
+
+static void *
+imf_spectrum_ifft_without_gvl(void *arg)
+{
+  imf_fft_image_t *t = (imf_fft_image_t *) arg;
+  imf_image_t const *img = t->img;
+  size_t const channels = img->pixel_channels;
+  size_t const plane_length = img->height * t->spec->bins;
+  double const scale = 1.0 / ((double) img->width * (double) img->height);
+  double const max = img->component_size == 1 ? 255.0 : 65535.0;
+  size_t c, x, y;
+
+  for (c = 0; c < channels && !t->failed; ++c) {
+    memcpy(t->spectrum, t->spec->data + c * plane_length, plane_length * sizeof(imf_complex_t));
+    if (!imf_fft_2d_inverse(t->rows, t->columns, t->spectrum, t->samples, img->width)) {
+      t->failed = true;
+      break;
+    }
+
+    for (y = 0; y < img->height; ++y) {
+      uint8_t *row = img->data + y * img->row_stride;
+      double const *samples = t->samples + y * img->width;
+      for (x = 0; x < img->width; ++x) {
+        double v = samples[x] * scale + 0.5;
+        v = v < 0.0 ? 0.0 : (v > max ? max : v);
+        if (img->component_size == 1)
+          row[x * channels + c] = (uint8_t) v;
+        else
+          ((uint16_t *) row)[x * channels + c] = (uint16_t) v;
+      }
+    }
+  }
+
+  return NULL;
+}
+
+static VALUE
+imf_image_fft_body(VALUE arg)
+{
+  imf_fft_image_t *t = (imf_fft_image_t *) arg;
+  imf_image_t const *img = t->img;
+  imf_spectrum_t *spec = t->spec;
+
+  if (img->color_space == IMF_COLOR_SPACE_INDEXED) {
+    t->expanded.row_alignment = img->row_alignment;
+    imf_image_expand_palette(img, &t->expanded);
+    t->img = img = &t->expanded;
+  }
+
+  spec->shape = *img;
+  spec->shape.data = NULL;
+  spec->shape.palette = NULL;
+  spec->shape.palette_size = 0;
+  spec->shape.base = 0;
+  spec->bins = img->width / 2 + 1;
+
+  t->rows = imf_fft_real_plan(img->width);
+  t->columns = imf_fft_plan(img->height);
+  t->samples = ALLOC_N(double, img->width * img->height);
+  spec->data = ALLOC_N(imf_complex_t, img->pixel_channels * img->height * spec->bins);
+
+  imf_call_without_gvl(imf_image_fft_without_gvl, t, NULL, NULL);
+
+  if (t->failed)
+    rb_raise(rb_eNoMemError, "failed to allocate memory for FFT");
+
+  return Qnil;
+}
+
+static VALUE
+imf_spectrum_ifft_body(VALUE arg)
+{
+  imf_fft_image_t *t = (imf_fft_image_t *) arg;
+  imf_image_t const *img = t->img;
+
+  t->rows = imf_fft_real_plan(img->width);
+  t->columns = imf_fft_plan(img->height);
+  t->samples = ALLOC_N(double, img->width * img->height);
+  t->spectrum = ALLOC_N(imf_complex_t, img->height * t->spec->bins);
+
+  imf_call_without_gvl(imf_spectrum_ifft_without_gvl, t, NULL, NULL);
+
+  if (t->failed)
+    rb_raise(rb_eNoMemError, "failed to allocate memory for FFT");
+
+  return Qnil;
+}
+
+static VALUE
+imf_fft_image_ensure(VALUE arg)
+{
+  imf_fft_image_t *t = (imf_fft_image_t *) arg;
+
+  xfree(t->samples);
+  xfree(t->spectrum);
+  if (t->expanded.data != NULL)
+    imf_image_release(&t->expanded);
+
+  return Qnil;
+}
+
+/*
+ * call-seq:
+ *   image.fft -> spectrum
+ *
+ * Returns the discrete Fourier transform of every channel of the image as
+ * an IMF::Spectrum.  The transform is not normalized, so the element at
+ * the origin is the sum of the components.  Indexed images are expanded
+ * into RGB(A) ones.  Any size can be transformed, but a size whose prime
+ * factors are 2, 3, and 5 is the fastest.
+ */
+static VALUE
+imf_image_fft(VALUE obj)
+{
+  imf_image_t *img = imf_get_image_data(obj);
+  imf_fft_image_t t;
+  VALUE spec_obj;
+
+  imf_image_check_interleaved(img);
+
+  spec_obj = imf_spectrum_alloc(imf_cIMF_Spectrum);
+  memset(&t, 0, sizeof(t));
+  t.img = img;
+  TypedData_Get_Struct(spec_obj, imf_spectrum_t, &imf_spectrum_data_type, t.spec);
+  rb_ensure(imf_image_fft_body, (VALUE) &t, imf_fft_image_ensure, (VALUE) &t);
+
+  return spec_obj;
+}
+
+/*
+ * call-seq:
+ *   spectrum.ifft -> image
+ *
+ * Returns the image transformed back from the spectrum, in the pixel
+ * format of the image the spectrum was made from.  The components are
+ * normalized by the number of pixels, rounded, and clamped to their range,
+ * so image.fft.ifft has the same pixels as image.
+ */
+static VALUE
+imf_spectrum_ifft(VALUE obj)
+{
+  imf_spectrum_t *spec = imf_get_spectrum_data(obj);
+  imf_fft_image_t t;
+  imf_image_t *img;
+  VALUE image_obj;
+
+  image_obj = rb_obj_alloc(imf_cIMF_Image);
+  img = imf_get_image_data(image_obj);
+  *img = spec->shape;
+  imf_image_allocate_image_buffer(img);
+
+  memset(&t, 0, sizeof(t));
+  t.img = img;
+  t.spec = spec;
+  rb_ensure(imf_spectrum_ifft_body, (VALUE) &t, imf_fft_image_ensure, (VALUE) &t);
+
+  return image_obj;
+}
+
+static VALUE
+imf_spectrum_get_width(VALUE obj)
+{
+  return SIZET2NUM(imf_get_spectrum_data(obj)->shape.width);
+}
+
+static VALUE
+imf_spectrum_get_height(VALUE obj)
+{
+  return SIZET2NUM(imf_get_spectrum_data(obj)->shape.height);
+}
+
+static VALUE
+imf_spectrum_get_pixel_channels(VALUE obj)
+{
+  return INT2FIX(imf_get_spectrum_data(obj)->shape.pixel_channels);
+}
+
+/*
+ * call-seq:
+ *   spectrum[v, u] -> array of complex numbers
+ *
+ * Returns the elements of the frequencies (v, u) of the channels, where v
+ * is vertical and u is horizontal as the row and column of IMF::Image#[].
+ * Negative indices count from the end, which are the negative
+ * frequencies.  The elements of u >= width / 2 + 1 are the conjugates of
+ * the symmetric ones.  Returns nil for the indices out of range.
+ */
+static VALUE
+imf_spectrum_aref(VALUE obj, VALUE v_v, VALUE u_v)
+{
+  imf_spectrum_t *spec = imf_get_spectrum_data(obj);
+  size_t const width = spec->shape.width, height = spec->shape.height;
+  ssize_t v = NUM2SSIZET(v_v), u = NUM2SSIZET(u_v);
+  bool conjugate = false;
+  size_t c;
+  VALUE ary;
+
+  if (v < 0)
+    v += (ssize_t) height;
+  if (u < 0)
+    u += (ssize_t) width;
+  if (v < 0 || (size_t) v >= height || u < 0 || (size_t) u >= width)
+    return Qnil;
+
+  if ((size_t) u >= spec->bins) {
+    u = (ssize_t) width - u;
+    v = v == 0 ? 0 : (ssize_t) height - v;
+    conjugate = true;
+  }
+
+  ary = rb_ary_new_capa(spec->shape.pixel_channels);
+  for (c = 0; c < spec->shape.pixel_channels; ++c) {
+    imf_complex_t const z = spec->data[(c * height + (size_t) v) * spec->bins + (size_t) u];
+    rb_ary_push(ary, rb_dbl_complex_new(z.re, conjugate ? -z.im : z.im));
+  }
+
+  return ary;
+}
+
+void
+Init_imf_image_fft(void)
+{
+  rb_define_method(imf_cIMF_Image, "fft", imf_image_fft, 0);
+
+  imf_cIMF_Spectrum = rb_define_class_under(imf_mIMF, "Spectrum", rb_cObject);
+  rb_undef_alloc_func(imf_cIMF_Spectrum);
+  rb_define_method(imf_cIMF_Spectrum, "width", imf_spectrum_get_width, 0);
+  rb_define_method(imf_cIMF_Spectrum, "height", imf_spectrum_get_height, 0);
+  rb_define_method(imf_cIMF_Spectrum, "pixel_channels", imf_spectrum_get_pixel_channels, 0);
+  rb_define_method(imf_cIMF_Spectrum, "[]", imf_spectrum_aref, 2);
+  rb_define_method(imf_cIMF_Spectrum, "ifft", imf_spectrum_ifft, 0);
+}
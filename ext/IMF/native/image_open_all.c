@@ -0,0 +1,317 @@
+#include "IMF.h"
+
+#include <ruby/util.h>
+
+#include <errno.h>
+
+#include "internal.h"
+
+/* Opening many images
+ *
+ * IMF::Image.open_all decodes the images of many sources on a work queue
+ * of native threads.  Each thread opens a path, detects the format by the
+ * magic number, and decodes the image without the GVL, and the IMF::Image
+ * objects are made after all the threads finish.  The sources other than
+ * paths are made into ImageSource objects beforehand, and the images of
+ * the formats without the decode function are loaded afterwards with the
+ * GVL as IMF::Image.open does. */
+
+static ID id_new;
+
+enum imf_open_all_state {
+  IMF_OPEN_ALL_PENDING = 0,
+  IMF_OPEN_ALL_DECODED,
+  IMF_OPEN_ALL_FAILED,
+  /* loaded by imf_image_load after the threads finish */
+  IMF_OPEN_ALL_FALLBACK,
+};
+
+typedef struct imf_open_all_item imf_open_all_item_t;
+struct imf_open_all_item {
+  enum imf_open_all_state state;
+  /* the path of a String source, or NULL */
+  char *path;
+  /* the byte source of the ImageSource of another source, or NULL */
+  imf_byte_source_t *src;
+  imf_image_t img;
+  imf_load_error_t error;
+};
+
+typedef struct imf_open_all imf_open_all_t;
+struct imf_open_all {
+  VALUE klass;
+  VALUE sources;
+  /* the ImageSource, or the exception of making it, of every source that
+   * is not a path */
+  VALUE image_sources;
+  imf_load_options_t opts;
+  size_t num_threads;
+  imf_file_format_decoder_t *decoders;
+  size_t num_decoders;
+  imf_open_all_item_t *items;
+  size_t num_items;
+  imf_work_queue_t queue;
+  bool queue_initialized;
+};
+
+static void
+imf_open_all_decode_item(void *arg, size_t index)
+{
+  imf_open_all_t *t = (imf_open_all_t *) arg;
+  imf_open_all_item_t *item = &t->items[index];
+  imf_byte_source_t *src = item->src;
+  imf_file_format_decoder_t const *decoder;
+  int read_errno;
+  bool success;
+
+  if (item->state != IMF_OPEN_ALL_PENDING)
+    return;
+
+  if (item->path != NULL) {
+    src = imf_image_source_open_path(item->path);
+    if (src == NULL && errno == ESPIPE) {
+      /* pipes and devices are read by Image.open afterwards */
+      item->state = IMF_OPEN_ALL_FALLBACK;
+      return;
+    }
+    if (src == NULL) {
+      imf_load_error_set_errno(&item->error, errno, item->path);
+      item->state = IMF_OPEN_ALL_FAILED;
+      return;
+    }
+  }
+
+  decoder = imf_file_format_find_decoder(t->decoders, t->num_decoders, src);
+  if (decoder == NULL || decoder->decode == NULL) {
+    item->state = IMF_OPEN_ALL_FALLBACK;
+  }
+  else {
+    item->img.row_alignment = t->opts.row_alignment;
+    success = decoder->decode(src, &item->img, &t->opts, &item->error) &&
+              imf_image_crop_to_region(&item->img, &t->opts, &item->error);
+
+    /* a failed read is seen as the end of the data by the decoders */
+    read_errno = imf_image_source_get_read_errno(src);
+    if (read_errno != 0)
+      success = imf_load_error_set_errno(&item->error, read_errno, "pread");
+
+    if (success) {
+      item->state = IMF_OPEN_ALL_DECODED;
+    }
+    else {
+      imf_image_release(&item->img);
+      item->state = IMF_OPEN_ALL_FAILED;
+    }
+  }
+
+  if (item->path != NULL)
+    imf_image_source_close(src);
+}
+
+static void *
+imf_open_all_without_gvl(void *arg)
+{
+  imf_open_all_t *t = (imf_open_all_t *) arg;
+  imf_work_queue_run(&t->queue, t->num_threads);
+  return NULL;
+}
+
+static void
+imf_open_all_unblock(void *arg)
+{
+  imf_open_all_t *t = (imf_open_all_t *) arg;
+  imf_work_queue_cancel(&t->queue);
+}
+
+static VALUE
+imf_open_all_prepare_body(VALUE imgsrc_obj)
+{
+  imf_byte_source_prepare_without_gvl(imf_image_source_get_byte_source(imgsrc_obj));
+  return imgsrc_obj;
+}
+
+/* Makes the item of the source, which is a path, or an ImageSource read
+ * to the end if it is not seekable */
+static VALUE
+imf_open_all_setup_item(VALUE arg)
+{
+  imf_open_all_t *t = (imf_open_all_t *) arg;
+  size_t const i = RARRAY_LEN(t->image_sources);
+  VALUE source = RARRAY_AREF(t->sources, i);
+  VALUE imgsrc_obj;
+
+  if (RB_TYPE_P(source, T_STRING)) {
+    t->items[i].path = ruby_strdup(StringValueCStr(source));
+    return Qnil;
+  }
+
+  imgsrc_obj = rb_funcall(imf_cIMF_ImageSource, id_new, 1, source);
+  imf_image_source_protect(imgsrc_obj, imf_open_all_prepare_body, imgsrc_obj);
+  t->items[i].src = imf_image_source_get_byte_source(imgsrc_obj);
+  return imgsrc_obj;
+}
+
+typedef struct imf_open_all_load_args imf_open_all_load_args_t;
+struct imf_open_all_load_args {
+  imf_open_all_t *t;
+  VALUE source;
+  VALUE imgsrc_obj;
+};
+
+static VALUE
+imf_open_all_load_body(VALUE arg)
+{
+  imf_open_all_load_args_t *args = (imf_open_all_load_args_t *) arg;
+  VALUE imgsrc_obj = args->imgsrc_obj;
+
+  if (NIL_P(imgsrc_obj))
+    imgsrc_obj = rb_funcall(imf_cIMF_ImageSource, id_new, 1, args->source);
+  return imf_image_load(args->t->klass, imgsrc_obj, &args->t->opts);
+}
+
+/* Calls func(arg), and returns the exception instead if it raises a
+ * StandardError */
+static VALUE
+imf_open_all_rescue(VALUE (*func)(VALUE), VALUE arg, bool *raised)
+{
+  int state = 0;
+  VALUE result, error;
+
+  result = rb_protect(func, arg, &state);
+  *raised = state != 0;
+  if (!state)
+    return result;
+
+  error = rb_errinfo();
+  if (!rb_obj_is_kind_of(error, rb_eStandardError))
+    rb_jump_tag(state);
+  rb_set_errinfo(Qnil);
+  return error;
+}
+
+static VALUE
+imf_open_all_collect_item(imf_open_all_t *t, size_t i)
+{
+  imf_open_all_item_t *item = &t->items[i];
+  imf_open_all_load_args_t args;
+  VALUE image_obj, error;
+  bool raised;
+
+  switch (item->state) {
+    case IMF_OPEN_ALL_DECODED:
+      image_obj = rb_obj_alloc(t->klass);
+      *imf_get_image_data(image_obj) = item->img;
+      memset(&item->img, 0, sizeof(item->img));
+      return image_obj;
+
+    case IMF_OPEN_ALL_FALLBACK:
+      args.t = t;
+      args.source = RARRAY_AREF(t->sources, i);
+      args.imgsrc_obj = RARRAY_AREF(t->image_sources, i);
+      return imf_open_all_rescue(imf_open_all_load_body, (VALUE) &args, &raised);
+
+    default:
+      if (item->src == NULL && item->path == NULL)
+        return RARRAY_AREF(t->image_sources, i);
+      error = imf_load_error_to_exception(&item->error);
+      /* only the StandardErrors are returned as Image.open would raise
+       * the others, e.g. NotImplementedError */
+      if (!rb_obj_is_kind_of(error, rb_eStandardError))
+        rb_exc_raise(error);
+      return error;
+  }
+}
+
+static VALUE
+imf_open_all_body(VALUE arg)
+{
+  imf_open_all_t *t = (imf_open_all_t *) arg;
+  VALUE results;
+  size_t i;
+  bool raised;
+
+  t->items = ZALLOC_N(imf_open_all_item_t, t->num_items);
+  for (i = 0; i < t->num_items; ++i) {
+    VALUE imgsrc_obj = imf_open_all_rescue(imf_open_all_setup_item, (VALUE) t, &raised);
+    if (raised)
+      t->items[i].state = IMF_OPEN_ALL_FAILED;
+    rb_ary_push(t->image_sources, imgsrc_obj);
+  }
+
+  /* the formats are detected by the enabled magic numbers as of now */
+  t->num_decoders = imf_file_format_get_decoders(&t->decoders);
+
+  imf_work_queue_init(&t->queue, t->num_items, imf_open_all_decode_item, t);
+  t->queue_initialized = true;
+  while (t->queue.next < t->num_items) {
+    imf_call_without_gvl(imf_open_all_without_gvl, t, imf_open_all_unblock, t);
+    rb_thread_check_ints();
+    t->queue.canceled = false;
+  }
+
+  imf_buffer_pool_report_unreported_memory();
+
+  results = rb_ary_new_capa(t->num_items);
+  for (i = 0; i < t->num_items; ++i)
+    rb_ary_push(results, imf_open_all_collect_item(t, i));
+
+  return results;
+}
+
+static VALUE
+imf_open_all_ensure(VALUE arg)
+{
+  imf_open_all_t *t = (imf_open_all_t *) arg;
+  size_t i;
+
+  if (t->queue_initialized)
+    imf_work_queue_destroy(&t->queue);
+  if (t->items != NULL) {
+    for (i = 0; i < t->num_items; ++i) {
+      if (t->items[i].state == IMF_OPEN_ALL_DECODED)
+        imf_image_release(&t->items[i].img);
+      xfree(t->items[i].path);
+    }
+  }
+  xfree(t->items);
+  xfree(t->decoders);
+
+  return Qnil;
+}
+
+/* :nodoc: */
+static VALUE
+imf_image_s_load_images(int argc, VALUE *argv, VALUE klass)
+{
+  VALUE sources, threads_v, opts_hash, results;
+  imf_open_all_t t;
+  long threads;
+
+  rb_scan_args(argc, argv, "2:", &sources, &threads_v, &opts_hash);
+
+  memset(&t, 0, sizeof(t));
+  t.klass = klass;
+  t.sources = rb_ary_dup(rb_Array(sources));
+  t.num_items = RARRAY_LEN(t.sources);
+  imf_load_options_init(&t.opts, opts_hash);
+
+  threads = NUM2LONG(threads_v);
+  if (threads < 1)
+    rb_raise(rb_eArgError, "threads must be positive");
+  t.num_threads = (size_t) threads;
+
+  t.image_sources = rb_ary_new_capa(t.num_items);
+  results = rb_ensure(imf_open_all_body, (VALUE) &t, imf_open_all_ensure, (VALUE) &t);
+
+  RB_GC_GUARD(t.sources);
+  RB_GC_GUARD(t.image_sources);
+  return results;
+}
+
+void
+Init_imf_image_open_all(void)
+{
+  rb_define_singleton_method(imf_cIMF_Image, "load_images", imf_image_s_load_images, -1);
+
+  id_new = rb_intern("new");
+}
@@ -0,0 +1,1065 @@
+#include "IMF.h"
+
+#include <math.h>
+
+#include "internal.h"
+
+#ifdef IMF_HAVE_SSE2
+# include <emmintrin.h>
+#endif
+
+#ifdef IMF_HAVE_AVX2
+# include <immintrin.h>
+#endif
+
+/* Image resizing
+ *
+ * Images are resampled by a separable filter, first horizontally into a
+ * temporary image of the destination width, and then vertically.  The
+ * filter weights are computed once for every destination column and row,
+ * and stored in fixed point with IMF_RESIZE_PRECISION_BITS fractional
+ * bits, so that both passes are integer multiply-adds.  Each pass runs on
+ * bands of rows in parallel.
+ *
+ * The SIMD kernels round and clamp in exactly the same way as the scalar
+ * ones, so the result does not depend on IMF.simd. */
+
+static ID id_filter;
+
+enum imf_resize_constants {
+  IMF_RESIZE_PRECISION_BITS = 14,
+  IMF_RESIZE_ONE = 1 << IMF_RESIZE_PRECISION_BITS,
+  IMF_RESIZE_ROUNDING = 1 << (IMF_RESIZE_PRECISION_BITS - 1),
+  /* the bias of the 16-bit components in the SIMD kernels times the sum
+   * of the weights of a pixel */
+  IMF_RESIZE_BIAS16 = 0x8000 << IMF_RESIZE_PRECISION_BITS,
+  /* pixels in a band of rows processed by a thread */
+  IMF_RESIZE_MIN_BAND_PIXELS = 64 * 1024,
+};
+
+static double
+imf_resize_bilinear(double x)
+{
+  x = fabs(x);
+  return x < 1.0 ? 1.0 - x : 0.0;
+}
+
+/* Keys' cubic convolution with a = -0.5 */
+static double
+imf_resize_bicubic(double x)
+{
+  double const a = -0.5;
+
+  x = fabs(x);
+  if (x < 1.0)
+    return ((a + 2.0) * x - (a + 3.0)) * x * x + 1.0;
+  if (x < 2.0)
+    return (((x - 5.0) * x + 8.0) * x - 4.0) * a;
+  return 0.0;
+}
+
+static double
+imf_resize_sinc(double x)
+{
+  if (x == 0.0)
+    return 1.0;
+  x *= M_PI;
+  return sin(x) / x;
+}
+
+static double
+imf_resize_lanczos3(double x)
+{
+  if (-3.0 < x && x < 3.0)
+    return imf_resize_sinc(x) * imf_resize_sinc(x / 3.0);
+  return 0.0;
+}
+
+typedef struct imf_resize_filter imf_resize_filter_t;
+struct imf_resize_filter {
+  char const *name;
+  ID id;
+  /* the radius of the filter, or 0 for the nearest neighbor */
+  double support;
+  double (*func)(double x);
+};
+
+static imf_resize_filter_t resize_filters[] = {
+  { "nearest",  0, 0.0, NULL },
+  { "bilinear", 0, 1.0, imf_resize_bilinear },
+  { "bicubic",  0, 2.0, imf_resize_bicubic },
+  { "lanczos",  0, 3.0, imf_resize_lanczos3 },
+  { NULL, 0, 0.0, NULL }
+};
+
+static imf_resize_filter_t const *
+imf_resize_find_filter(VALUE filter_v)
+{
+  imf_resize_filter_t const *filter;
+  ID id = rb_check_id(&filter_v);
+
+  if (id != 0) {
+    for (filter = resize_filters; filter->name != NULL; ++filter) {
+      if (filter->id == id)
+        return filter;
+    }
+  }
+
+  rb_raise(rb_eArgError, "unknown resize filter: %"PRIsVALUE, rb_inspect(filter_v));
+}
+
+/* The taps of the filter along an axis.  The i-th destination pixel is
+ * the sum of weights[i * taps + k] times the (start[i] + k)-th source
+ * pixel for k < count[i], and the weights of a pixel add up to
+ * IMF_RESIZE_ONE. */
+typedef struct imf_resize_axis imf_resize_axis_t;
+struct imf_resize_axis {
+  size_t taps;
+  size_t *start;
+  size_t *count;
+  int16_t *weights;
+};
+
+static void
+imf_resize_axis_init(imf_resize_axis_t *axis, size_t in_size, size_t out_size,
+                     imf_resize_filter_t const *filter)
+{
+  double const scale = (double) in_size / (double) out_size;
+  size_t i, k;
+
+  if (filter->func == NULL) {
+    axis->taps = 1;
+    axis->start = ALLOC_N(size_t, out_size);
+    axis->count = ALLOC_N(size_t, out_size);
+    axis->weights = ALLOC_N(int16_t, out_size);
+    for (i = 0; i < out_size; ++i) {
+      size_t x = (size_t) (((double) i + 0.5) * scale);
+      axis->start[i] = x < in_size ? x : in_size - 1;
+      axis->count[i] = 1;
+      axis->weights[i] = IMF_RESIZE_ONE;
+    }
+    return;
+  }
+
+  /* widen the filter when reducing, so that it covers every source pixel */
+  double const filter_scale = scale > 1.0 ? scale : 1.0;
+  double const support = filter->support * filter_scale;
+  size_t const taps = (size_t) ceil(support) * 2 + 1;
+  double *w;
+
+  axis->taps = taps;
+  axis->start = ALLOC_N(size_t, out_size);
+  axis->count = ALLOC_N(size_t, out_size);
+  axis->weights = ZALLOC_N(int16_t, out_size * taps);
+  w = ALLOCA_N(double, taps);
+
+  for (i = 0; i < out_size; ++i) {
+    double const center = ((double) i + 0.5) * scale;
+    double lo = floor(center - support + 0.5);
+    double hi = floor(center + support + 0.5);
+    double total = 0.0;
+    size_t n, peak = 0;
+    int sum = 0;
+
+    if (lo < 0.0)
+      lo = 0.0;
+    if (hi > (double) in_size)
+      hi = (double) in_size;
+    n = (size_t) (hi - lo);
+    if (n > taps)
+      n = taps;
+    if (n == 0)
+      n = 1;
+
+    for (k = 0; k < n; ++k) {
+      w[k] = filter->func(((double) k + lo - center + 0.5) / filter_scale);
+      total += w[k];
+    }
+
+    /* normalize to IMF_RESIZE_ONE, and put the rounding error on the
+     * largest weight */
+    int16_t *fixed = axis->weights + i * taps;
+    for (k = 0; k < n; ++k) {
+      double const v = total != 0.0 ? w[k] / total : (k == 0 ? 1.0 : 0.0);
+      fixed[k] = (int16_t) lround(v * IMF_RESIZE_ONE);
+      sum += fixed[k];
+      if (fixed[k] > fixed[peak])
+        peak = k;
+    }
+    fixed[peak] += (int16_t) (IMF_RESIZE_ONE - sum);
+
+    axis->start[i] = (size_t) lo;
+    axis->count[i] = n;
+  }
+}
+
+static void
+imf_resize_axis_free(imf_resize_axis_t *axis)
+{
+  xfree(axis->start);
+  xfree(axis->count);
+  xfree(axis->weights);
+  axis->start = NULL;
+  axis->count = NULL;
+  axis->weights = NULL;
+}
+
+static inline uint8_t
+imf_resize_clamp8(int32_t v)
+{
+  v >>= IMF_RESIZE_PRECISION_BITS;
+  return (uint8_t) (v < 0 ? 0 : v > 0xFF ? 0xFF : v);
+}
+
+static inline uint16_t
+imf_resize_clamp16(int64_t v)
+{
+  v >>= IMF_RESIZE_PRECISION_BITS;
+  return (uint16_t) (v < 0 ? 0 : v > 0xFFFF ? 0xFFFF : v);
+}
+
+/* Horizontal pass
+ *
+ * The bodies are instantiated for each number of channels, so that the
+ * compiler can unroll the loops over the channels. */
+
+static inline void
+imf_resize_row_h8_body(uint8_t const *src, uint8_t *dst, size_t width, size_t channels,
+                       imf_resize_axis_t const *axis)
+{
+  size_t x, k, c;
+
+  for (x = 0; x < width; ++x, dst += channels) {
+    uint8_t const *s = src + axis->start[x] * channels;
+    int16_t const *w = axis->weights + x * axis->taps;
+    size_t const n = axis->count[x];
+    int32_t acc[4] = { IMF_RESIZE_ROUNDING, IMF_RESIZE_ROUNDING, IMF_RESIZE_ROUNDING, IMF_RESIZE_ROUNDING };
+
+    for (k = 0; k < n; ++k, s += channels) {
+      for (c = 0; c < channels; ++c)
+        acc[c] += w[k] * s[c];
+    }
+    for (c = 0; c < channels; ++c)
+      dst[c] = imf_resize_clamp8(acc[c]);
+  }
+}
+
+static inline void
+imf_resize_row_h16_body(uint16_t const *src, uint16_t *dst, size_t width, size_t channels,
+                        imf_resize_axis_t const *axis)
+{
+  size_t x, k, c;
+
+  for (x = 0; x < width; ++x, dst += channels) {
+    uint16_t const *s = src + axis->start[x] * channels;
+    int16_t const *w = axis->weights + x * axis->taps;
+    size_t const n = axis->count[x];
+    int64_t acc[4] = { IMF_RESIZE_ROUNDING, IMF_RESIZE_ROUNDING, IMF_RESIZE_ROUNDING, IMF_RESIZE_ROUNDING };
+
+    for (k = 0; k < n; ++k, s += channels) {
+      for (c = 0; c < channels; ++c)
+        acc[c] += (int64_t) w[k] * s[c];
+    }
+    for (c = 0; c < channels; ++c)
+      dst[c] = imf_resize_clamp16(acc[c]);
+  }
+}
+
+#ifdef IMF_HAVE_SSE2
+/* A pixel of 2 to 4 channels is a vector of four 32-bit sums, whose
+ * lanes beyond the channels are dropped.  The taps are taken in pairs, so
+ * that _mm_madd_epi16 multiplies and adds two taps at once.  A pixel of a
+ * single channel takes its taps eight at a time instead.
+ *
+ * 16-bit components are biased by -32768 into the range of int16 for
+ * _mm_madd_epi16, and IMF_RESIZE_BIAS16 is added back.
+ * The positive weights of a pixel add up to far less than 2 *
+ * IMF_RESIZE_ONE for every filter, so the sums fit in 32 bits and are the
+ * same as the 64-bit sums of the scalar kernels. */
+
+/* The components of a pixel in the low lanes, without reading past it.
+ * The loads are no wider than the components, so that they are not
+ * stalled by the stores to a temporary. */
+static inline __m128i
+imf_resize_load_pixel8(uint8_t const *s, size_t channels)
+{
+  int32_t v;
+  uint16_t u;
+
+  if (channels == 4) {
+    memcpy(&v, s, 4);
+    return _mm_cvtsi32_si128(v);
+  }
+  memcpy(&u, s, 2);
+  v = channels == 3 ? u | (s[2] << 16) : u;
+  return _mm_cvtsi32_si128(v);
+}
+
+static inline __m128i
+imf_resize_load_pixel16(uint16_t const *s, size_t channels)
+{
+  int32_t v;
+
+  if (channels == 4)
+    return _mm_loadl_epi64((__m128i const *) s);
+  memcpy(&v, s, 4);
+  if (channels == 3)
+    return _mm_insert_epi16(_mm_cvtsi32_si128(v), s[2], 2);
+  return _mm_cvtsi32_si128(v);
+}
+
+/* The components of a pixel and the next one in the low lanes of two
+ * halves of 4 lanes.  The lanes beyond the channels may have any value. */
+static inline __m128i
+imf_resize_load_pair8(uint8_t const *s, size_t channels)
+{
+  int32_t a, b;
+
+  if (channels == 4)
+    return _mm_loadl_epi64((__m128i const *) s);
+  if (channels == 3) {
+    /* a0 a1 a2 b0 and a2 b0 b1 b2 */
+    memcpy(&a, s, 4);
+    memcpy(&b, s + 2, 4);
+    return _mm_unpacklo_epi32(_mm_cvtsi32_si128(a), _mm_cvtsi32_si128((int32_t) ((uint32_t) b >> 8)));
+  }
+  memcpy(&a, s, 4);
+  return _mm_unpacklo_epi16(_mm_cvtsi32_si128(a), _mm_setzero_si128());
+}
+
+static inline __m128i
+imf_resize_load_pair16(uint16_t const *s, size_t channels)
+{
+  if (channels == 4)
+    return _mm_loadu_si128((__m128i const *) s);
+  if (channels == 3) {
+    /* a0 a1 a2 b0, and b0 b1 b2 from it and b1 b2 */
+    __m128i const a = _mm_loadl_epi64((__m128i const *) s);
+    int32_t v;
+    memcpy(&v, s + 4, 4);
+    __m128i const b = _mm_or_si128(_mm_srli_epi64(a, 48), _mm_slli_epi64(_mm_cvtsi32_si128(v), 16));
+    return _mm_unpacklo_epi64(a, b);
+  }
+  return _mm_unpacklo_epi32(_mm_loadl_epi64((__m128i const *) s), _mm_setzero_si128());
+}
+
+/* a b c d of a pixel and e f g h of the next one in 16-bit lanes into
+ * the pairs a e b f c g d h */
+static inline __m128i
+imf_resize_pair_taps(__m128i p)
+{
+  return _mm_unpacklo_epi16(p, _mm_unpackhi_epi64(p, p));
+}
+
+static inline __m128i
+imf_resize_pair_weights(int16_t const *w)
+{
+  return _mm_set1_epi32((int32_t) (uint16_t) w[0] | ((int32_t) w[1] << 16));
+}
+
+static inline void
+imf_resize_row_h8_sse2_body(uint8_t const *src, uint8_t *dst, size_t width, size_t channels,
+                            imf_resize_axis_t const *axis)
+{
+  __m128i const zero = _mm_setzero_si128();
+  __m128i const rounding = _mm_set1_epi32(IMF_RESIZE_ROUNDING);
+  size_t x, k;
+
+  for (x = 0; x < width; ++x, dst += channels) {
+    uint8_t const *s = src + axis->start[x] * channels;
+    int16_t const *w = axis->weights + x * axis->taps;
+    size_t const n = axis->count[x];
+    __m128i acc = rounding;
+
+    for (k = 0; k + 1 < n; k += 2, s += 2 * channels) {
+      __m128i const p = imf_resize_pair_taps(_mm_unpacklo_epi8(imf_resize_load_pair8(s, channels), zero));
+      acc = _mm_add_epi32(acc, _mm_madd_epi16(p, imf_resize_pair_weights(w + k)));
+    }
+    if (k < n) {
+      __m128i const p = _mm_unpacklo_epi8(imf_resize_load_pixel8(s, channels), zero);
+      __m128i const wv = _mm_set1_epi32((int32_t) (uint16_t) w[k]);
+      acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_unpacklo_epi16(p, zero), wv));
+    }
+
+    acc = _mm_srai_epi32(acc, IMF_RESIZE_PRECISION_BITS);
+    acc = _mm_packs_epi32(acc, acc);
+    int32_t const out = _mm_cvtsi128_si32(_mm_packus_epi16(acc, acc));
+    memcpy(dst, &out, channels);
+  }
+}
+
+static void
+imf_resize_row_h8x1_sse2(uint8_t const *src, uint8_t *dst, size_t width, imf_resize_axis_t const *axis)
+{
+  __m128i const zero = _mm_setzero_si128();
+  size_t x, k;
+
+  for (x = 0; x < width; ++x) {
+    uint8_t const *s = src + axis->start[x];
+    int16_t const *w = axis->weights + x * axis->taps;
+    size_t const n = axis->count[x];
+    int32_t sum = IMF_RESIZE_ROUNDING;
+
+    k = 0;
+    if (n >= 8) {
+      __m128i acc = zero;
+      for (; k + 8 <= n; k += 8) {
+        __m128i const p = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i const *) (s + k)), zero);
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(p, _mm_loadu_si128((__m128i const *) (w + k))));
+      }
+      acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+      acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+      sum += _mm_cvtsi128_si32(acc);
+    }
+    for (; k < n; ++k)
+      sum += w[k] * s[k];
+    dst[x] = imf_resize_clamp8(sum);
+  }
+}
+
+static void
+imf_resize_row_h8_sse2(uint8_t const *src, uint8_t *dst, size_t width, size_t channels,
+                       imf_resize_axis_t const *axis)
+{
+  switch (channels) {
+    case 1:
+      imf_resize_row_h8x1_sse2(src, dst, width, axis);
+      break;
+    case 2:
+      imf_resize_row_h8_sse2_body(src, dst, width, 2, axis);
+      break;
+    case 3:
+      imf_resize_row_h8_sse2_body(src, dst, width, 3, axis);
+      break;
+    default:
+      imf_resize_row_h8_sse2_body(src, dst, width, 4, axis);
+      break;
+  }
+}
+
+/* The biased sums back into 16-bit components, clamped by the signed
+ * saturation of _mm_packs_epi32 */
+static inline __m128i
+imf_resize_pack16_sse2(__m128i lo, __m128i hi)
+{
+  __m128i const offset = _mm_set1_epi32(0x8000);
+  lo = _mm_sub_epi32(_mm_srai_epi32(lo, IMF_RESIZE_PRECISION_BITS), offset);
+  hi = _mm_sub_epi32(_mm_srai_epi32(hi, IMF_RESIZE_PRECISION_BITS), offset);
+  return _mm_xor_si128(_mm_packs_epi32(lo, hi), _mm_set1_epi16((int16_t) 0x8000));
+}
+
+static inline void
+imf_resize_store_pixel16(uint16_t *d, __m128i v, size_t channels)
+{
+  int32_t const lo = _mm_cvtsi128_si32(v);
+
+  if (channels == 4) {
+    _mm_storel_epi64((__m128i *) d, v);
+    return;
+  }
+  memcpy(d, &lo, 4);
+  if (channels == 3)
+    d[2] = (uint16_t) _mm_extract_epi16(v, 2);
+}
+
+static inline void
+imf_resize_row_h16_sse2_body(uint16_t const *src, uint16_t *dst, size_t width, size_t channels,
+                             imf_resize_axis_t const *axis)
+{
+  __m128i const zero = _mm_setzero_si128();
+  __m128i const bias = _mm_set1_epi16((int16_t) 0x8000);
+  size_t x, k;
+
+  for (x = 0; x < width; ++x, dst += channels) {
+    uint16_t const *s = src + axis->start[x] * channels;
+    int16_t const *w = axis->weights + x * axis->taps;
+    size_t const n = axis->count[x];
+    __m128i acc = _mm_set1_epi32(IMF_RESIZE_ROUNDING + IMF_RESIZE_BIAS16);
+
+    for (k = 0; k + 1 < n; k += 2, s += 2 * channels) {
+      __m128i const p = imf_resize_pair_taps(_mm_xor_si128(imf_resize_load_pair16(s, channels), bias));
+      acc = _mm_add_epi32(acc, _mm_madd_epi16(p, imf_resize_pair_weights(w + k)));
+    }
+    if (k < n) {
+      __m128i const p = _mm_xor_si128(imf_resize_load_pixel16(s, channels), bias);
+      __m128i const wv = _mm_set1_epi32((int32_t) (uint16_t) w[k]);
+      acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_unpacklo_epi16(p, zero), wv));
+    }
+
+    imf_resize_store_pixel16(dst, imf_resize_pack16_sse2(acc, acc), channels);
+  }
+}
+
+static void
+imf_resize_row_h16x1_sse2(uint16_t const *src, uint16_t *dst, size_t width, imf_resize_axis_t const *axis)
+{
+  __m128i const zero = _mm_setzero_si128();
+  __m128i const bias = _mm_set1_epi16((int16_t) 0x8000);
+  size_t x, k;
+
+  for (x = 0; x < width; ++x) {
+    uint16_t const *s = src + axis->start[x];
+    int16_t const *w = axis->weights + x * axis->taps;
+    size_t const n = axis->count[x];
+    int64_t sum = IMF_RESIZE_ROUNDING + IMF_RESIZE_BIAS16;
+
+    k = 0;
+    if (n >= 8) {
+      __m128i acc = zero;
+      for (; k + 8 <= n; k += 8) {
+        __m128i const p = _mm_xor_si128(_mm_loadu_si128((__m128i const *) (s + k)), bias);
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(p, _mm_loadu_si128((__m128i const *) (w + k))));
+      }
+      acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+      acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+      sum += _mm_cvtsi128_si32(acc);
+    }
+    for (; k < n; ++k)
+      sum += w[k] * (s[k] - 0x8000);
+    dst[x] = imf_resize_clamp16(sum);
+  }
+}
+
+static void
+imf_resize_row_h16_sse2(uint16_t const *src, uint16_t *dst, size_t width, size_t channels,
+                        imf_resize_axis_t const *axis)
+{
+  switch (channels) {
+    case 1:
+      imf_resize_row_h16x1_sse2(src, dst, width, axis);
+      break;
+    case 2:
+      imf_resize_row_h16_sse2_body(src, dst, width, 2, axis);
+      break;
+    case 3:
+      imf_resize_row_h16_sse2_body(src, dst, width, 3, axis);
+      break;
+    default:
+      imf_resize_row_h16_sse2_body(src, dst, width, 4, axis);
+      break;
+  }
+}
+#endif
+
+static void
+imf_resize_row_h8(uint8_t const *src, uint8_t *dst, size_t width, size_t channels,
+                  imf_resize_axis_t const *axis)
+{
+#ifdef IMF_HAVE_SSE2
+  if (imf_simd_level >= IMF_SIMD_SSE2) {
+    imf_resize_row_h8_sse2(src, dst, width, channels, axis);
+    return;
+  }
+#endif
+  switch (channels) {
+    case 1:
+      imf_resize_row_h8_body(src, dst, width, 1, axis);
+      break;
+    case 2:
+      imf_resize_row_h8_body(src, dst, width, 2, axis);
+      break;
+    case 3:
+      imf_resize_row_h8_body(src, dst, width, 3, axis);
+      break;
+    default:
+      imf_resize_row_h8_body(src, dst, width, 4, axis);
+      break;
+  }
+}
+
+static void
+imf_resize_row_h16(uint16_t const *src, uint16_t *dst, size_t width, size_t channels,
+                   imf_resize_axis_t const *axis)
+{
+#ifdef IMF_HAVE_SSE2
+  if (imf_simd_level >= IMF_SIMD_SSE2) {
+    imf_resize_row_h16_sse2(src, dst, width, channels, axis);
+    return;
+  }
+#endif
+  switch (channels) {
+    case 1:
+      imf_resize_row_h16_body(src, dst, width, 1, axis);
+      break;
+    case 2:
+      imf_resize_row_h16_body(src, dst, width, 2, axis);
+      break;
+    case 3:
+      imf_resize_row_h16_body(src, dst, width, 3, axis);
+      break;
+    default:
+      imf_resize_row_h16_body(src, dst, width, 4, axis);
+      break;
+  }
+}
+
+/* Vertical pass
+ *
+ * A destination row is the weighted sum of source rows, so it is computed
+ * for every component in the row at once regardless of the channels. */
+
+static void
+imf_resize_row_v8_scalar(uint8_t const *const *rows, int16_t const *w, size_t n,
+                         uint8_t *dst, size_t begin, size_t end)
+{
+  size_t i, k;
+
+  for (i = begin; i < end; ++i) {
+    int32_t acc = IMF_RESIZE_ROUNDING;
+    for (k = 0; k < n; ++k)
+      acc += w[k] * rows[k][i];
+    dst[i] = imf_resize_clamp8(acc);
+  }
+}
+
+#ifdef IMF_HAVE_SSE2
+/* 16 components at a time.  The bytes of two source rows are interleaved
+ * and widened into 16-bit pairs for _mm_madd_epi16. */
+static size_t
+imf_resize_row_v8_sse2(uint8_t const *const *rows, int16_t const *w, size_t n,
+                       uint8_t *dst, size_t begin, size_t length)
+{
+  __m128i const zero = _mm_setzero_si128();
+  __m128i const rounding = _mm_set1_epi32(IMF_RESIZE_ROUNDING);
+  size_t i, k;
+
+  for (i = begin; i + 16 <= length; i += 16) {
+    __m128i acc0 = rounding, acc1 = rounding, acc2 = rounding, acc3 = rounding;
+
+    for (k = 0; k + 1 < n; k += 2) {
+      __m128i const wv = _mm_set1_epi32((int32_t) (uint16_t) w[k] | ((int32_t) w[k + 1] << 16));
+      __m128i const a = _mm_loadu_si128((__m128i const *) (rows[k] + i));
+      __m128i const b = _mm_loadu_si128((__m128i const *) (rows[k + 1] + i));
+      __m128i const lo = _mm_unpacklo_epi8(a, b);
+      __m128i const hi = _mm_unpackhi_epi8(a, b);
+      acc0 = _mm_add_epi32(acc0, _mm_madd_epi16(_mm_unpacklo_epi8(lo, zero), wv));
+      acc1 = _mm_add_epi32(acc1, _mm_madd_epi16(_mm_unpackhi_epi8(lo, zero), wv));
+      acc2 = _mm_add_epi32(acc2, _mm_madd_epi16(_mm_unpacklo_epi8(hi, zero), wv));
+      acc3 = _mm_add_epi32(acc3, _mm_madd_epi16(_mm_unpackhi_epi8(hi, zero), wv));
+    }
+    if (k < n) {
+      __m128i const wv = _mm_set1_epi32((int32_t) (uint16_t) w[k]);
+      __m128i const a = _mm_loadu_si128((__m128i const *) (rows[k] + i));
+      __m128i const lo = _mm_unpacklo_epi8(a, zero);
+      __m128i const hi = _mm_unpackhi_epi8(a, zero);
+      acc0 = _mm_add_epi32(acc0, _mm_madd_epi16(_mm_unpacklo_epi16(lo, zero), wv));
+      acc1 = _mm_add_epi32(acc1, _mm_madd_epi16(_mm_unpackhi_epi16(lo, zero), wv));
+      acc2 = _mm_add_epi32(acc2, _mm_madd_epi16(_mm_unpacklo_epi16(hi, zero), wv));
+      acc3 = _mm_add_epi32(acc3, _mm_madd_epi16(_mm_unpackhi_epi16(hi, zero), wv));
+    }
+
+    acc0 = _mm_srai_epi32(acc0, IMF_RESIZE_PRECISION_BITS);
+    acc1 = _mm_srai_epi32(acc1, IMF_RESIZE_PRECISION_BITS);
+    acc2 = _mm_srai_epi32(acc2, IMF_RESIZE_PRECISION_BITS);
+    acc3 = _mm_srai_epi32(acc3, IMF_RESIZE_PRECISION_BITS);
+    __m128i const out = _mm_packus_epi16(_mm_packs_epi32(acc0, acc1), _mm_packs_epi32(acc2, acc3));
+    _mm_storeu_si128((__m128i *) (dst + i), out);
+  }
+
+  return i;
+}
+#endif
+
+#ifdef IMF_HAVE_AVX2
+/* The same as the SSE2 kernel for 32 components.  The unpack and pack
+ * instructions work within each 128-bit lane, so the order is kept. */
+IMF_TARGET_AVX2 static size_t
+imf_resize_row_v8_avx2(uint8_t const *const *rows, int16_t const *w, size_t n,
+                       uint8_t *dst, size_t begin, size_t length)
+{
+  __m256i const zero = _mm256_setzero_si256();
+  __m256i const rounding = _mm256_set1_epi32(IMF_RESIZE_ROUNDING);
+  size_t i, k;
+
+  for (i = begin; i + 32 <= length; i += 32) {
+    __m256i acc0 = rounding, acc1 = rounding, acc2 = rounding, acc3 = rounding;
+
+    for (k = 0; k + 1 < n; k += 2) {
+      __m256i const wv = _mm256_set1_epi32((int32_t) (uint16_t) w[k] | ((int32_t) w[k + 1] << 16));
+      __m256i const a = _mm256_loadu_si256((__m256i const *) (rows[k] + i));
+      __m256i const b = _mm256_loadu_si256((__m256i const *) (rows[k + 1] + i));
+      __m256i const lo = _mm256_unpacklo_epi8(a, b);
+      __m256i const hi = _mm256_unpackhi_epi8(a, b);
+      acc0 = _mm256_add_epi32(acc0, _mm256_madd_epi16(_mm256_unpacklo_epi8(lo, zero), wv));
+      acc1 = _mm256_add_epi32(acc1, _mm256_madd_epi16(_mm256_unpackhi_epi8(lo, zero), wv));
+      acc2 = _mm256_add_epi32(acc2, _mm256_madd_epi16(_mm256_unpacklo_epi8(hi, zero), wv));
+      acc3 = _mm256_add_epi32(acc3, _mm256_madd_epi16(_mm256_unpackhi_epi8(hi, zero), wv));
+    }
+    if (k < n) {
+      __m256i const wv = _mm256_set1_epi32((int32_t) (uint16_t) w[k]);
+      __m256i const a = _mm256_loadu_si256((__m256i const *) (rows[k] + i));
+      __m256i const lo = _mm256_unpacklo_epi8(a, zero);
+      __m256i const hi = _mm256_unpackhi_epi8(a, zero);
+      acc0 = _mm256_add_epi32(acc0, _mm256_madd_epi16(_mm256_unpacklo_epi16(lo, zero), wv));
+      acc1 = _mm256_add_epi32(acc1, _mm256_madd_epi16(_mm256_unpackhi_epi16(lo, zero), wv));
+      acc2 = _mm256_add_epi32(acc2, _mm256_madd_epi16(_mm256_unpacklo_epi16(hi, zero), wv));
+      acc3 = _mm256_add_epi32(acc3, _mm256_madd_epi16(_mm256_unpackhi_epi16(hi, zero), wv));
+    }
+
+    acc0 = _mm256_srai_epi32(acc0, IMF_RESIZE_PRECISION_BITS);
+    acc1 = _mm256_srai_epi32(acc1, IMF_RESIZE_PRECISION_BITS);
+    acc2 = _mm256_srai_epi32(acc2, IMF_RESIZE_PRECISION_BITS);
+    acc3 = _mm256_srai_epi32(acc3, IMF_RESIZE_PRECISION_BITS);
+    __m256i const out = _mm256_packus_epi16(_mm256_packs_epi32(acc0, acc1), _mm256_packs_epi32(acc2, acc3));
+    _mm256_storeu_si256((__m256i *) (dst + i), out);
+  }
+
+  return i;
+}
+#endif
+
+static void
+imf_resize_row_v8(uint8_t const *const *rows, int16_t const *w, size_t n, uint8_t *dst, size_t length)
+{
+  size_t done = 0;
+
+#ifdef IMF_HAVE_AVX2
+  if (imf_simd_level >= IMF_SIMD_AVX2)
+    done = imf_resize_row_v8_avx2(rows, w, n, dst, done, length);
+#endif
+#ifdef IMF_HAVE_SSE2
+  if (imf_simd_level >= IMF_SIMD_SSE2)
+    done = imf_resize_row_v8_sse2(rows, w, n, dst, done, length);
+#endif
+  imf_resize_row_v8_scalar(rows, w, n, dst, done, length);
+}
+
+static void
+imf_resize_row_v16_scalar(uint8_t const *const *rows, int16_t const *w, size_t n,
+                          uint16_t *dst, size_t begin, size_t end)
+{
+  size_t i, k;
+
+  for (i = begin; i < end; ++i) {
+    int64_t acc = IMF_RESIZE_ROUNDING;
+    for (k = 0; k < n; ++k)
+      acc += (int64_t) w[k] * ((uint16_t const *) rows[k])[i];
+    dst[i] = imf_resize_clamp16(acc);
+  }
+}
+
+#ifdef IMF_HAVE_SSE2
+/* 8 components at a time, biased as the horizontal kernels.  The
+ * components of two source rows are interleaved into 16-bit pairs for
+ * _mm_madd_epi16. */
+static size_t
+imf_resize_row_v16_sse2(uint8_t const *const *rows, int16_t const *w, size_t n,
+                        uint16_t *dst, size_t begin, size_t length)
+{
+  __m128i const zero = _mm_setzero_si128();
+  __m128i const bias = _mm_set1_epi16((int16_t) 0x8000);
+  __m128i const init = _mm_set1_epi32(IMF_RESIZE_ROUNDING + IMF_RESIZE_BIAS16);
+  size_t i, k;
+
+  for (i = begin; i + 8 <= length; i += 8) {
+    __m128i acc0 = init, acc1 = init;
+
+    for (k = 0; k + 1 < n; k += 2) {
+      __m128i const wv = imf_resize_pair_weights(w + k);
+      __m128i const a = _mm_xor_si128(_mm_loadu_si128((__m128i const *) ((uint16_t const *) rows[k] + i)), bias);
+      __m128i const b = _mm_xor_si128(_mm_loadu_si128((__m128i const *) ((uint16_t const *) rows[k + 1] + i)), bias);
+      acc0 = _mm_add_epi32(acc0, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), wv));
+      acc1 = _mm_add_epi32(acc1, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), wv));
+    }
+    if (k < n) {
+      __m128i const wv = _mm_set1_epi32((int32_t) (uint16_t) w[k]);
+      __m128i const a = _mm_xor_si128(_mm_loadu_si128((__m128i const *) ((uint16_t const *) rows[k] + i)), bias);
+      acc0 = _mm_add_epi32(acc0, _mm_madd_epi16(_mm_unpacklo_epi16(a, zero), wv));
+      acc1 = _mm_add_epi32(acc1, _mm_madd_epi16(_mm_unpackhi_epi16(a, zero), wv));
+    }
+
+    _mm_storeu_si128((__m128i *) (dst + i), imf_resize_pack16_sse2(acc0, acc1));
+  }
+
+  return i;
+}
+#endif
+
+#ifdef IMF_HAVE_AVX2
+/* The same as the SSE2 kernel for 16 components, in the order kept by
+ * the unpack and pack instructions within each 128-bit lane */
+IMF_TARGET_AVX2 static size_t
+imf_resize_row_v16_avx2(uint8_t const *const *rows, int16_t const *w, size_t n,
+                        uint16_t *dst, size_t begin, size_t length)
+{
+  __m256i const zero = _mm256_setzero_si256();
+  __m256i const bias = _mm256_set1_epi16((int16_t) 0x8000);
+  __m256i const offset = _mm256_set1_epi32(0x8000);
+  __m256i const init = _mm256_set1_epi32(IMF_RESIZE_ROUNDING + IMF_RESIZE_BIAS16);
+  size_t i, k;
+
+  for (i = begin; i + 16 <= length; i += 16) {
+    __m256i acc0 = init, acc1 = init;
+
+    for (k = 0; k + 1 < n; k += 2) {
+      __m256i const wv = _mm256_set1_epi32((int32_t) (uint16_t) w[k] | ((int32_t) w[k + 1] << 16));
+      __m256i const a = _mm256_xor_si256(_mm256_loadu_si256((__m256i const *) ((uint16_t const *) rows[k] + i)), bias);
+      __m256i const b = _mm256_xor_si256(_mm256_loadu_si256((__m256i const *) ((uint16_t const *) rows[k + 1] + i)), bias);
+      acc0 = _mm256_add_epi32(acc0, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), wv));
+      acc1 = _mm256_add_epi32(acc1, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), wv));
+    }
+    if (k < n) {
+      __m256i const wv = _mm256_set1_epi32((int32_t) (uint16_t) w[k]);
+      __m256i const a = _mm256_xor_si256(_mm256_loadu_si256((__m256i const *) ((uint16_t const *) rows[k] + i)), bias);
+      acc0 = _mm256_add_epi32(acc0, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, zero), wv));
+      acc1 = _mm256_add_epi32(acc1, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, zero), wv));
+    }
+
+    acc0 = _mm256_sub_epi32(_mm256_srai_epi32(acc0, IMF_RESIZE_PRECISION_BITS), offset);
+    acc1 = _mm256_sub_epi32(_mm256_srai_epi32(acc1, IMF_RESIZE_PRECISION_BITS), offset);
+    __m256i const out = _mm256_xor_si256(_mm256_packs_epi32(acc0, acc1), bias);
+    _mm256_storeu_si256((__m256i *) (dst + i), out);
+  }
+
+  return i;
+}
+#endif
+
+static void
+imf_resize_row_v16(uint8_t const *const *rows, int16_t const *w, size_t n, uint16_t *dst, size_t length)
+{
+  size_t done = 0;
+
+#ifdef IMF_HAVE_AVX2
+  if (imf_simd_level >= IMF_SIMD_AVX2)
+    done = imf_resize_row_v16_avx2(rows, w, n, dst, done, length);
+#endif
+#ifdef IMF_HAVE_SSE2
+  if (imf_simd_level >= IMF_SIMD_SSE2)
+    done = imf_resize_row_v16_sse2(rows, w, n, dst, done, length);
+#endif
+  imf_resize_row_v16_scalar(rows, w, n, dst, done, length);
+}
+
+/* Resizing */
+
+typedef struct imf_resize imf_resize_t;
+struct imf_resize {
+  imf_resize_filter_t const *filter;
+  imf_image_t const *src;
+  imf_image_t *dst;
+  /* the RGB(A) pixels of an indexed source, if filtered */
+  imf_image_t expanded;
+  imf_resize_axis_t horizontal;
+  imf_resize_axis_t vertical;
+  bool resize_horizontally;
+  bool resize_vertically;
+  /* the result of the horizontal pass, if the vertical pass follows */
+  uint8_t *tmp;
+  size_t tmp_stride;
+  /* the source rows of the vertical pass */
+  uint8_t const *rows;
+  size_t rows_stride;
+};
+
+static void
+imf_resize_horizontal_band(void *arg, size_t begin, size_t end)
+{
+  imf_resize_t *rs = (imf_resize_t *) arg;
+  imf_image_t const *src = rs->src;
+  size_t const channels = src->pixel_channels;
+  size_t const out_width = rs->dst->width;
+  uint8_t *out_base;
+  size_t out_stride, y;
+
+  if (rs->resize_vertically) {
+    out_base = rs->tmp;
+    out_stride = rs->tmp_stride;
+  }
+  else {
+    out_base = rs->dst->data;
+    out_stride = rs->dst->row_stride;
+  }
+
+  for (y = begin; y < end; ++y) {
+    uint8_t const *in = src->data + y * src->row_stride;
+    uint8_t *out = out_base + y * out_stride;
+    if (src->component_size == 1)
+      imf_resize_row_h8(in, out, out_width, channels, &rs->horizontal);
+    else
+      imf_resize_row_h16((uint16_t const *) in, (uint16_t *) out, out_width, channels, &rs->horizontal);
+  }
+}
+
+static void
+imf_resize_vertical_band(void *arg, size_t begin, size_t end)
+{
+  imf_resize_t *rs = (imf_resize_t *) arg;
+  imf_image_t *dst = rs->dst;
+  imf_resize_axis_t const *axis = &rs->vertical;
+  size_t const length = dst->width * dst->pixel_channels;
+  uint8_t const **rows = (uint8_t const **) ALLOCA_N(uint8_t *, axis->taps);
+  size_t y, k;
+
+  for (y = begin; y < end; ++y) {
+    size_t const n = axis->count[y];
+    for (k = 0; k < n; ++k)
+      rows[k] = rs->rows + (axis->start[y] + k) * rs->rows_stride;
+
+    uint8_t *out = dst->data + y * dst->row_stride;
+    int16_t const *w = axis->weights + y * axis->taps;
+    if (dst->component_size == 1)
+      imf_resize_row_v8(rows, w, n, out, length);
+    else
+      imf_resize_row_v16(rows, w, n, (uint16_t *) out, length);
+  }
+}
+
+static size_t
+imf_resize_min_rows_per_band(size_t width)
+{
+  size_t const rows = IMF_RESIZE_MIN_BAND_PIXELS / (width > 0 ? width : 1);
+  return rows > 0 ? rows : 1;
+}
+
+static void *
+imf_resize_without_gvl(void *arg)
+{
+  imf_resize_t *rs = (imf_resize_t *) arg;
+  imf_image_t const *src = rs->src;
+  imf_image_t *dst = rs->dst;
+
+  if (rs->resize_horizontally) {
+    imf_parallel_for_rows(src->height, imf_resize_min_rows_per_band(dst->width),
+                          imf_resize_horizontal_band, rs);
+  }
+
+  if (rs->resize_vertically) {
+    imf_parallel_for_rows(dst->height, imf_resize_min_rows_per_band(dst->width),
+                          imf_resize_vertical_band, rs);
+  }
+
+  return NULL;
+}
+
+static VALUE
+imf_resize_body(VALUE arg)
+{
+  imf_resize_t *rs = (imf_resize_t *) arg;
+  imf_image_t const *src = rs->src;
+  imf_image_t *dst = rs->dst;
+  imf_resize_filter_t const *filter = rs->filter;
+  size_t const width = dst->width, height = dst->height;
+
+  if (src->color_space == IMF_COLOR_SPACE_INDEXED && filter->func != NULL) {
+    rs->expanded.row_alignment = src->row_alignment;
+    imf_image_expand_palette(src, &rs->expanded);
+    rs->src = src = &rs->expanded;
+  }
+
+  *dst = *src;
+  dst->width = width;
+  dst->height = height;
+  dst->data = NULL;
+  dst->palette = NULL;
+  if (src->palette != NULL) {
+    imf_image_allocate_palette(dst, src->palette_size);
+    memcpy(dst->palette, src->palette, IMF_IMAGE_PALETTE_CAPACITY * 4);
+  }
+  imf_image_allocate_image_buffer(dst);
+
+  rs->resize_horizontally = dst->width != src->width;
+  rs->resize_vertically = dst->height != src->height;
+  if (!rs->resize_horizontally && !rs->resize_vertically) {
+    size_t y;
+    for (y = 0; y < src->height; ++y)
+      memcpy(dst->data + y * dst->row_stride, src->data + y * src->row_stride,
+             src->width * src->pixel_channels * src->component_size);
+    return Qnil;
+  }
+
+  if (rs->resize_horizontally)
+    imf_resize_axis_init(&rs->horizontal, src->width, dst->width, filter);
+  if (rs->resize_vertically)
+    imf_resize_axis_init(&rs->vertical, src->height, dst->height, filter);
+
+  if (rs->resize_horizontally && rs->resize_vertically) {
+    rs->tmp_stride = dst->width * dst->pixel_channels * dst->component_size;
+    rs->tmp = ALLOC_N(uint8_t, rs->tmp_stride * src->height);
+    rs->rows = rs->tmp;
+    rs->rows_stride = rs->tmp_stride;
+  }
+  else {
+    rs->rows = src->data;
+    rs->rows_stride = src->row_stride;
+  }
+
+  imf_call_without_gvl(imf_resize_without_gvl, rs, NULL, NULL);
+
+  return Qnil;
+}
+
+static VALUE
+imf_resize_ensure(VALUE arg)
+{
+  imf_resize_t *rs = (imf_resize_t *) arg;
+
+  imf_resize_axis_free(&rs->horizontal);
+  imf_resize_axis_free(&rs->vertical);
+  xfree(rs->tmp);
+  rs->tmp = NULL;
+  if (rs->expanded.data != NULL)
+    imf_image_release(&rs->expanded);
+
+  return Qnil;
+}
+
+/*
+ * call-seq:
+ *   image.resize(width, height, filter: :bicubic) -> new_image
+ *
+ * Returns a new image resized to width x height.  The filter is one of
+ * :nearest, :bilinear, :bicubic, and :lanczos.  Indexed images are
+ * resized as indexed images by :nearest, and expanded into RGB(A) images
+ * by the other filters.
+ */
+static VALUE
+imf_image_resize(int argc, VALUE *argv, VALUE obj)
+{
+  imf_image_t *img = imf_get_image_data(obj);
+  VALUE width_v, height_v, opts, filter_v = Qnil, new_obj;
+  imf_resize_filter_t const *filter = &resize_filters[2];
+  imf_image_t *new_img;
+  imf_resize_t rs;
+  long width, height;
+
+  imf_image_check_interleaved(img);
+  rb_scan_args(argc, argv, "2:", &width_v, &height_v, &opts);
+  if (!NIL_P(opts)) {
+    rb_get_kwargs(opts, &id_filter, 0, 1, &filter_v);
+    if (filter_v != Qundef && !NIL_P(filter_v))
+      filter = imf_resize_find_filter(filter_v);
+  }
+
+  width = NUM2LONG(width_v);
+  height = NUM2LONG(height_v);
+  if (width <= 0 || height <= 0)
+    rb_raise(rb_eArgError, "image size must be positive (%ldx%ld given)", width, height);
+
+  new_obj = rb_obj_alloc(rb_obj_class(obj));
+  new_img = imf_get_image_data(new_obj);
+
+  new_img->width = (size_t) width;
+  new_img->height = (size_t) height;
+
+  memset(&rs, 0, sizeof(rs));
+  rs.filter = filter;
+  rs.src = img;
+  rs.dst = new_img;
+  rb_ensure(imf_resize_body, (VALUE) &rs, imf_resize_ensure, (VALUE) &rs);
+
+  return new_obj;
+}
+
+void
+Init_imf_image_resize(void)
+{
+  imf_resize_filter_t *filter;
+
+  rb_define_method(imf_cIMF_Image, "resize", imf_image_resize, -1);
+
+  for (filter = resize_filters; filter->name != NULL; ++filter)
+    filter->id = rb_intern(filter->name);
+
+  id_filter = rb_intern("filter");
+}
@@ -0,0 +1,807 @@
+#include "IMF.h"
+
+#include <ruby/encoding.h>
+#include <ruby/io.h>
+
+#ifdef HAVE_SYS_TYPES_H
+# include <sys/types.h>
+#endif
+
+#ifdef HAVE_SYS_STAT_H
+# include <sys/stat.h>
+#endif
+
+#ifdef HAVE_FCNTL_H
+# include <fcntl.h>
+#endif
+
+#ifndef O_CLOEXEC
+# define O_CLOEXEC 0
+#endif
+
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP)
+# include <sys/mman.h>
+# define IMF_USE_MMAP 1
+#endif
+
+#include "internal.h"
+
+VALUE imf_cIMF_ImageSource;
+
+static ID id_read;
+
+enum imf_image_source_constants {
+  IMF_IMAGE_SOURCE_FETCH_SIZE = 8192,
+  IMF_IMAGE_SOURCE_FD_WINDOW_SIZE = 65536,
+};
+
+enum imf_image_source_kind {
+  IMF_IMAGE_SOURCE_NONE = 0,
+  IMF_IMAGE_SOURCE_MMAP,
+  IMF_IMAGE_SOURCE_MEMORY,
+  IMF_IMAGE_SOURCE_FD,
+  IMF_IMAGE_SOURCE_READABLE,
+};
+
+typedef struct imf_image_source imf_image_source_t;
+struct imf_image_source {
+  imf_byte_source_t base;
+  enum imf_image_source_kind kind;
+
+  /* MEMORY: the source String; READABLE: the readable object */
+  VALUE object;
+
+  /* MMAP, MEMORY: the whole data */
+  uint8_t const *data_ptr;
+  size_t data_length;
+
+  /* FD: a window of the file; READABLE: every byte read so far.
+   * This is allocated by malloc because the window can be refilled
+   * without the GVL. */
+  uint8_t *buffer;
+  size_t buffer_capa;
+  size_t buffer_offset;
+  size_t buffer_length;
+
+  /* FD */
+  int fd;
+  off_t fd_start;
+  size_t fd_length;
+  /* the errno of the first failed pread, which may happen without the
+   * GVL and is raised by imf_image_source_protect afterwards */
+  int read_errno;
+
+  /* READABLE */
+  bool eof;
+};
+
+#define IMF_IMAGE_SOURCE(ptr) ((imf_image_source_t *)(ptr))
+
+static void
+imf_image_source_mark(void *ptr)
+{
+  imf_image_source_t *imgsrc = IMF_IMAGE_SOURCE(ptr);
+  rb_gc_mark(imgsrc->object);
+}
+
+static void
+imf_image_source_release(imf_image_source_t *imgsrc)
+{
+  switch (imgsrc->kind) {
+    case IMF_IMAGE_SOURCE_MMAP:
+#ifdef IMF_USE_MMAP
+      if (imgsrc->data_ptr != NULL)
+        munmap((void *) imgsrc->data_ptr, imgsrc->data_length);
+#endif
+      break;
+    case IMF_IMAGE_SOURCE_FD:
+      if (imgsrc->fd >= 0)
+        close(imgsrc->fd);
+      break;
+    default:
+      break;
+  }
+
+  free(imgsrc->buffer);
+
+  imgsrc->base.iface = NULL;
+  imgsrc->base.pos = 0;
+  imgsrc->kind = IMF_IMAGE_SOURCE_NONE;
+  imgsrc->object = Qnil;
+  imgsrc->data_ptr = NULL;
+  imgsrc->data_length = 0;
+  imgsrc->buffer = NULL;
+  imgsrc->buffer_capa = 0;
+  imgsrc->buffer_offset = 0;
+  imgsrc->buffer_length = 0;
+  imgsrc->fd = -1;
+  imgsrc->fd_start = 0;
+  imgsrc->fd_length = 0;
+  imgsrc->eof = false;
+}
+
+static void
+imf_image_source_free(void *ptr)
+{
+  imf_image_source_release(IMF_IMAGE_SOURCE(ptr));
+  xfree(ptr);
+}
+
+static size_t
+imf_image_source_memsize(void const *ptr)
+{
+  return sizeof(imf_image_source_t) + IMF_IMAGE_SOURCE(ptr)->buffer_capa;
+}
+
+static rb_data_type_t const imf_image_source_data_type = {
+  "imf_image_source",
+  {
+    imf_image_source_mark,
+    imf_image_source_free,
+    imf_image_source_memsize,
+  },
+#ifdef RUBY_TYPED_FREE_IMMEDIATELY
+  0, 0,
+  RUBY_TYPED_FREE_IMMEDIATELY
+#endif
+};
+
+static inline imf_image_source_t *
+imf_get_image_source_data(VALUE obj)
+{
+  imf_image_source_t *ptr;
+  TypedData_Get_Struct(obj, imf_image_source_t, &imf_image_source_data_type, ptr);
+  return ptr;
+}
+
+static inline imf_image_source_t *
+imf_get_initialized_image_source_data(VALUE obj)
+{
+  imf_image_source_t *imgsrc = imf_get_image_source_data(obj);
+  if (imgsrc->kind == IMF_IMAGE_SOURCE_NONE)
+    rb_raise(rb_eIOError, "uninitialized image source");
+  return imgsrc;
+}
+
+static VALUE
+imf_image_source_alloc(VALUE klass)
+{
+  imf_image_source_t *imgsrc;
+  VALUE obj = TypedData_Make_Struct(klass, imf_image_source_t, &imf_image_source_data_type, imgsrc);
+  imgsrc->object = Qnil;
+  imgsrc->fd = -1;
+  return obj;
+}
+
+/* Grows the buffer to hold at least `capa` bytes.
+ * Returns false if it cannot allocate memory. */
+static bool
+imf_image_source_reserve_buffer(imf_image_source_t *imgsrc, size_t capa)
+{
+  uint8_t *new_buffer;
+
+  if (imgsrc->buffer_capa >= capa)
+    return true;
+
+  if (capa < 2 * imgsrc->buffer_capa)
+    capa = 2 * imgsrc->buffer_capa;
+  new_buffer = realloc(imgsrc->buffer, capa);
+  if (new_buffer == NULL)
+    return false;
+
+  imgsrc->buffer = new_buffer;
+  imgsrc->buffer_capa = capa;
+  return true;
+}
+
+/* ==== MMAP, MEMORY ==== */
+
+static size_t
+memory_source_peek(imf_byte_source_t *src, size_t length, uint8_t const **ptr)
+{
+  imf_image_source_t *imgsrc = IMF_IMAGE_SOURCE(src);
+  size_t const rest = imgsrc->data_length - src->pos;
+
+  if (length > rest)
+    length = rest;
+  *ptr = imgsrc->data_ptr + src->pos;
+  return length;
+}
+
+static size_t
+memory_source_read_into(imf_byte_source_t *src, void *buf, size_t length)
+{
+  uint8_t const *ptr;
+
+  length = memory_source_peek(src, length, &ptr);
+  memcpy(buf, ptr, length);
+  src->pos += length;
+  return length;
+}
+
+static size_t
+memory_source_skip(imf_byte_source_t *src, size_t length)
+{
+  imf_image_source_t *imgsrc = IMF_IMAGE_SOURCE(src);
+  size_t const rest = imgsrc->data_length - src->pos;
+
+  if (length > rest)
+    length = rest;
+  src->pos += length;
+  return length;
+}
+
+static void
+generic_source_rewind(imf_byte_source_t *src)
+{
+  src->pos = 0;
+}
+
+static imf_byte_source_interface_t const memory_source_interface = {
+  memory_source_peek,
+  memory_source_read_into,
+  memory_source_skip,
+  generic_source_rewind,
+  NULL
+};
+
+/* ==== FD ==== */
+
+static size_t
+fd_source_pread(imf_image_source_t *imgsrc, void *buf, size_t length, size_t offset)
+{
+  size_t total = 0;
+
+  while (total < length) {
+    ssize_t n = pread(imgsrc->fd, (uint8_t *) buf + total, length - total,
+                      imgsrc->fd_start + (off_t)(offset + total));
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && imgsrc->read_errno == 0)
+      imgsrc->read_errno = errno;
+    if (n <= 0)
+      break;
+    total += (size_t) n;
+  }
+
+  return total;
+}
+
+static size_t
+fd_source_peek(imf_byte_source_t *src, size_t length, uint8_t const **ptr)
+{
+  imf_image_source_t *imgsrc = IMF_IMAGE_SOURCE(src);
+  size_t const rest = imgsrc->fd_length - src->pos;
+
+  if (length > rest)
+    length = rest;
+
+  if (src->pos < imgsrc->buffer_offset ||
+      imgsrc->buffer_offset + imgsrc->buffer_length < src->pos + length) {
+    /* refill the window from the current position */
+    size_t window_size = length;
+    if (window_size < IMF_IMAGE_SOURCE_FD_WINDOW_SIZE)
+      window_size = IMF_IMAGE_SOURCE_FD_WINDOW_SIZE;
+    if (window_size > rest)
+      window_size = rest;
+    if (!imf_image_source_reserve_buffer(imgsrc, window_size))
+      return 0;
+    imgsrc->buffer_offset = src->pos;
+    imgsrc->buffer_length = fd_source_pread(imgsrc, imgsrc->buffer, window_size, src->pos);
+    if (length > imgsrc->buffer_length)
+      length = imgsrc->buffer_length;
+  }
+
+  *ptr = imgsrc->buffer + (src->pos - imgsrc->buffer_offset);
+  return length;
+}
+
+static size_t
+fd_source_read_into(imf_byte_source_t *src, void *buf, size_t length)
+{
+  imf_image_source_t *imgsrc = IMF_IMAGE_SOURCE(src);
+  size_t const rest = imgsrc->fd_length - src->pos;
+  size_t total = 0;
+
+  if (length > rest)
+    length = rest;
+
+  /* take bytes in the window first */
+  if (imgsrc->buffer_offset <= src->pos &&
+      src->pos < imgsrc->buffer_offset + imgsrc->buffer_length) {
+    size_t n = imgsrc->buffer_offset + imgsrc->buffer_length - src->pos;
+    if (n > length)
+      n = length;
+    memcpy(buf, imgsrc->buffer + (src->pos - imgsrc->buffer_offset), n);
+    total = n;
+  }
+
+  /* and read the rest directly into the caller's buffer */
+  if (total < length)
+    total += fd_source_pread(imgsrc, (uint8_t *) buf + total, length - total, src->pos + total);
+
+  src->pos += total;
+  return total;
+}
+
+static size_t
+fd_source_skip(imf_byte_source_t *src, size_t length)
+{
+  imf_image_source_t *imgsrc = IMF_IMAGE_SOURCE(src);
+  size_t const rest = imgsrc->fd_length - src->pos;
+
+  if (length > rest)
+    length = rest;
+  src->pos += length;
+  return length;
+}
+
+static imf_byte_source_interface_t const fd_source_interface = {
+  fd_source_peek,
+  fd_source_read_into,
+  fd_source_skip,
+  generic_source_rewind,
+  NULL
+};
+
+/* ==== READABLE ==== */
+
+/* Reads more bytes from the readable object into the buffer.
+ * This calls a Ruby method, so the GVL is required. */
+static void
+readable_source_fetch(imf_image_source_t *imgsrc, size_t length)
+{
+  VALUE data;
+  size_t data_length;
+
+  if (imgsrc->eof)
+    return;
+
+  if (length < IMF_IMAGE_SOURCE_FETCH_SIZE)
+    length = IMF_IMAGE_SOURCE_FETCH_SIZE;
+
+  data = rb_funcall(imgsrc->object, id_read, 1, SIZET2NUM(length));
+  if (NIL_P(data)) {
+    imgsrc->eof = true;
+    return;
+  }
+
+  StringValue(data);
+  data_length = RSTRING_LEN(data);
+  if (data_length == 0) {
+    imgsrc->eof = true;
+    return;
+  }
+
+  if (!imf_image_source_reserve_buffer(imgsrc, imgsrc->buffer_length + data_length))
+    rb_memerror();
+  memcpy(imgsrc->buffer + imgsrc->buffer_length, RSTRING_PTR(data), data_length);
+  imgsrc->buffer_length += data_length;
+}
+
+static void
+readable_source_fill(imf_image_source_t *imgsrc, size_t length)
+{
+  size_t end = imgsrc->base.pos + length;
+
+  if (end < length) /* overflow */
+    end = SIZE_MAX;
+
+  while (imgsrc->buffer_length < end && !imgsrc->eof)
+    readable_source_fetch(imgsrc, end - imgsrc->buffer_length);
+}
+
+static size_t
+readable_source_peek(imf_byte_source_t *src, size_t length, uint8_t const **ptr)
+{
+  imf_image_source_t *imgsrc = IMF_IMAGE_SOURCE(src);
+  size_t rest;
+
+  readable_source_fill(imgsrc, length);
+
+  rest = imgsrc->buffer_length - src->pos;
+  if (length > rest)
+    length = rest;
+  *ptr = imgsrc->buffer + src->pos;
+  return length;
+}
+
+static size_t
+readable_source_read_into(imf_byte_source_t *src, void *buf, size_t length)
+{
+  uint8_t const *ptr;
+
+  length = readable_source_peek(src, length, &ptr);
+  memcpy(buf, ptr, length);
+  src->pos += length;
+  return length;
+}
+
+static size_t
+readable_source_skip(imf_byte_source_t *src, size_t length)
+{
+  imf_image_source_t *imgsrc = IMF_IMAGE_SOURCE(src);
+  size_t rest;
+
+  readable_source_fill(imgsrc, length);
+
+  rest = imgsrc->buffer_length - src->pos;
+  if (length > rest)
+    length = rest;
+  src->pos += length;
+  return length;
+}
+
+static void
+readable_source_prepare_without_gvl(imf_byte_source_t *src)
+{
+  imf_image_source_t *imgsrc = IMF_IMAGE_SOURCE(src);
+
+  while (!imgsrc->eof)
+    readable_source_fetch(imgsrc, imgsrc->buffer_length);
+}
+
+static imf_byte_source_interface_t const readable_source_interface = {
+  readable_source_peek,
+  readable_source_read_into,
+  readable_source_skip,
+  generic_source_rewind,
+  readable_source_prepare_without_gvl
+};
+
+/* ==== Initializers ==== */
+
+static int
+imf_image_source_open_file(VALUE path_value, struct stat *st)
+{
+  char const *path = StringValueCStr(path_value);
+  int fd;
+
+  fd = rb_cloexec_open(path, O_RDONLY, 0);
+  if (fd < 0)
+    rb_sys_fail_str(path_value);
+
+  if (fstat(fd, st) < 0) {
+    int e = errno;
+    close(fd);
+    errno = e;
+    rb_sys_fail_str(path_value);
+  }
+
+  return fd;
+}
+
+/* Returns false if it cannot allocate the window */
+static bool
+imf_image_source_try_setup_fd(imf_image_source_t *imgsrc, int fd, off_t start, struct stat const *st)
+{
+  imgsrc->kind = IMF_IMAGE_SOURCE_FD;
+  imgsrc->base.iface = &fd_source_interface;
+  imgsrc->fd = fd;
+  imgsrc->fd_start = start;
+  imgsrc->fd_length = st->st_size > start ? (size_t)(st->st_size - start) : 0;
+  imgsrc->read_errno = 0;
+  return imf_image_source_reserve_buffer(imgsrc, IMF_IMAGE_SOURCE_FD_WINDOW_SIZE);
+}
+
+static void
+imf_image_source_setup_fd(imf_image_source_t *imgsrc, int fd, off_t start, struct stat const *st)
+{
+  if (!imf_image_source_try_setup_fd(imgsrc, fd, start, st))
+    rb_memerror();
+}
+
+/* Maps the whole file into memory, and closes the file descriptor.
+ * Returns false if memory mapping is unavailable. */
+static bool
+imf_image_source_setup_mmap(imf_image_source_t *imgsrc, int fd, struct stat const *st)
+{
+#ifdef IMF_USE_MMAP
+  void *ptr = NULL;
+
+  if ((uint64_t) st->st_size > (uint64_t) SIZE_MAX)
+    return false;
+
+  if (st->st_size > 0) {
+    ptr = mmap(NULL, (size_t) st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (ptr == MAP_FAILED)
+      return false;
+# ifdef HAVE_MADVISE
+    madvise(ptr, (size_t) st->st_size, MADV_SEQUENTIAL);
+# endif
+  }
+  close(fd);
+
+  imgsrc->kind = IMF_IMAGE_SOURCE_MMAP;
+  imgsrc->base.iface = &memory_source_interface;
+  imgsrc->data_ptr = (uint8_t const *) ptr;
+  imgsrc->data_length = (size_t) st->st_size;
+  return true;
+#else
+  return false;
+#endif
+}
+
+/* Reads bytes by calling `read` method of the given object. */
+static VALUE
+imf_image_source_attach_readable(VALUE obj, VALUE readable)
+{
+  imf_image_source_t *imgsrc = imf_get_image_source_data(obj);
+
+  imf_image_source_release(imgsrc);
+
+  imgsrc->kind = IMF_IMAGE_SOURCE_READABLE;
+  imgsrc->base.iface = &readable_source_interface;
+  imgsrc->object = readable;
+  return obj;
+}
+
+/* Maps the whole file of the given path into memory.
+ * Uses the file descriptor source when memory mapping is unavailable, and
+ * reads the files other than regular files, e.g. pipes and devices, as
+ * streams because their sizes are unknown. */
+static VALUE
+imf_image_source_attach_path(VALUE obj, VALUE path_value)
+{
+  imf_image_source_t *imgsrc = imf_get_image_source_data(obj);
+  struct stat st;
+  int fd;
+
+  FilePathValue(path_value);
+
+  imf_image_source_release(imgsrc);
+
+  fd = imf_image_source_open_file(path_value, &st);
+  if (!S_ISREG(st.st_mode)) {
+    VALUE io = rb_io_fdopen(fd, O_RDONLY, StringValueCStr(path_value));
+    return imf_image_source_attach_readable(obj, io);
+  }
+  if (!imf_image_source_setup_mmap(imgsrc, fd, &st))
+    imf_image_source_setup_fd(imgsrc, fd, 0, &st);
+  return obj;
+}
+
+/* Reads a regular file from the given offset through a duplicated file descriptor. */
+static VALUE
+imf_image_source_attach_fd(VALUE obj, VALUE fd_value, VALUE offset_value)
+{
+  imf_image_source_t *imgsrc = imf_get_image_source_data(obj);
+  struct stat st;
+  int fd;
+
+  imf_image_source_release(imgsrc);
+
+  fd = rb_cloexec_dup(NUM2INT(fd_value));
+  if (fd < 0)
+    rb_sys_fail("dup");
+
+  if (fstat(fd, &st) < 0) {
+    int e = errno;
+    close(fd);
+    errno = e;
+    rb_sys_fail("fstat");
+  }
+
+  imf_image_source_setup_fd(imgsrc, fd, NUM2OFFT(offset_value), &st);
+  return obj;
+}
+
+/* Reads the bytes of the given String from the given offset without copying. */
+static VALUE
+imf_image_source_attach_string(VALUE obj, VALUE str, VALUE offset_value)
+{
+  imf_image_source_t *imgsrc = imf_get_image_source_data(obj);
+  size_t offset = NUM2SIZET(offset_value);
+
+  StringValue(str);
+  str = rb_str_new_frozen(str);
+
+  imf_image_source_release(imgsrc);
+
+  if (offset > (size_t) RSTRING_LEN(str))
+    offset = RSTRING_LEN(str);
+
+  imgsrc->kind = IMF_IMAGE_SOURCE_MEMORY;
+  imgsrc->base.iface = &memory_source_interface;
+  imgsrc->object = str;
+  imgsrc->data_ptr = (uint8_t const *) RSTRING_PTR(str) + offset;
+  imgsrc->data_length = RSTRING_LEN(str) - offset;
+  return obj;
+}
+
+/* ==== Sources without Ruby objects ==== */
+
+/* Opens the file of the path as imf_image_source_attach_path does, but
+ * without the GVL for the native threads of IMF::Image.open_all.  Returns
+ * NULL with errno set on failure, and with ESPIPE if the file is not a
+ * regular file, which can only be read as a stream with the GVL. */
+imf_byte_source_t *
+imf_image_source_open_path(char const *path)
+{
+  imf_image_source_t *imgsrc;
+  struct stat st;
+  int fd, e;
+
+  /* a FIFO is not opened here, or its writer would see the stream closed
+   * before it is opened again to be read with the GVL */
+  if (stat(path, &st) < 0)
+    return NULL;
+  if (S_ISDIR(st.st_mode)) {
+    errno = EISDIR;
+    return NULL;
+  }
+  if (!S_ISREG(st.st_mode)) {
+    errno = ESPIPE;
+    return NULL;
+  }
+
+  fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return NULL;
+  if (fstat(fd, &st) < 0)
+    goto failed;
+  if (!S_ISREG(st.st_mode)) {
+    errno = ESPIPE;
+    goto failed;
+  }
+
+  imgsrc = calloc(1, sizeof(imf_image_source_t));
+  if (imgsrc == NULL) {
+    errno = ENOMEM;
+    goto failed;
+  }
+  imgsrc->object = Qnil;
+  imgsrc->fd = -1;
+
+  if (!imf_image_source_setup_mmap(imgsrc, fd, &st) &&
+      !imf_image_source_try_setup_fd(imgsrc, fd, 0, &st)) {
+    imf_image_source_release(imgsrc);
+    free(imgsrc);
+    errno = ENOMEM;
+    return NULL;
+  }
+  return &imgsrc->base;
+
+failed:
+  e = errno;
+  close(fd);
+  errno = e;
+  return NULL;
+}
+
+/* Closes the source opened by imf_image_source_open_path */
+void
+imf_image_source_close(imf_byte_source_t *src)
+{
+  imf_image_source_release(IMF_IMAGE_SOURCE(src));
+  free(src);
+}
+
+/* Returns the errno of the first failed read of the byte source of an
+ * image source, or 0 */
+int
+imf_image_source_get_read_errno(imf_byte_source_t const *src)
+{
+  return IMF_IMAGE_SOURCE(src)->read_errno;
+}
+
+/* ==== Ruby methods ==== */
+
+static VALUE
+imf_image_source_is_mapped(VALUE obj)
+{
+  imf_image_source_t *imgsrc = imf_get_image_source_data(obj);
+  return imgsrc->kind == IMF_IMAGE_SOURCE_MMAP ? Qtrue : Qfalse;
+}
+
+static VALUE
+imf_image_source_read(int argc, VALUE *argv, VALUE obj)
+{
+  imf_image_source_t *imgsrc = imf_get_initialized_image_source_data(obj);
+  imf_byte_source_t *src = &imgsrc->base;
+  VALUE length_value, outbuf;
+  uint8_t const *ptr;
+  size_t length;
+
+  rb_scan_args(argc, argv, "02", &length_value, &outbuf);
+
+  if (NIL_P(length_value)) {
+    imf_byte_source_prepare_without_gvl(src);
+    length = SIZE_MAX - src->pos;
+  }
+  else
+    length = NUM2SIZET(length_value);
+
+  length = imf_byte_source_peek(src, length, &ptr);
+  if (imgsrc->read_errno != 0) {
+    int const e = imgsrc->read_errno;
+    imgsrc->read_errno = 0;
+    rb_syserr_fail(e, "pread");
+  }
+
+  if (NIL_P(outbuf))
+    outbuf = rb_str_new((char const *) ptr, length);
+  else {
+    StringValue(outbuf);
+    rb_str_modify(outbuf);
+    rb_enc_associate(outbuf, rb_ascii8bit_encoding());
+    rb_str_resize(outbuf, length);
+    if (length > 0)
+      memcpy(RSTRING_PTR(outbuf), ptr, length);
+  }
+  imf_byte_source_skip(src, length);
+
+  return outbuf;
+}
+
+static VALUE
+imf_image_source_rewind(VALUE obj)
+{
+  imf_image_source_t *imgsrc = imf_get_initialized_image_source_data(obj);
+  imf_byte_source_rewind(&imgsrc->base);
+  return INT2FIX(0);
+}
+
+imf_byte_source_t *
+imf_image_source_get_byte_source(VALUE imgsrc_obj)
+{
+  imf_image_source_t *imgsrc = imf_get_initialized_image_source_data(imgsrc_obj);
+  return &imgsrc->base;
+}
+
+static VALUE
+imf_image_source_protect_body(VALUE arg)
+{
+  VALUE *args = (VALUE *) arg;
+  return ((VALUE (*)(VALUE)) args[0])(args[1]);
+}
+
+/* Calls func(arg), and raises the error of a failed read of the image
+ * source instead of the result or the exception of func, because the
+ * decoders see a failed read as the end of the data, and would report it
+ * as a truncated image. */
+VALUE
+imf_image_source_protect(VALUE imgsrc_obj, VALUE (*func)(VALUE), VALUE arg)
+{
+  VALUE args[2], result;
+  int state = 0;
+
+  args[0] = (VALUE) func;
+  args[1] = arg;
+  result = rb_protect(imf_image_source_protect_body, (VALUE) args, &state);
+
+  if (rb_typeddata_is_kind_of(imgsrc_obj, &imf_image_source_data_type)) {
+    imf_image_source_t *imgsrc = imf_get_image_source_data(imgsrc_obj);
+    if (imgsrc->read_errno != 0) {
+      int const e = imgsrc->read_errno;
+      imgsrc->read_errno = 0;
+      rb_set_errinfo(Qnil);
+      rb_syserr_fail(e, "pread");
+    }
+  }
+
+  if (state)
+    rb_jump_tag(state);
+  return result;
+}
+
+void
+Init_imf_image_source(void)
+{
+  imf_cIMF_ImageSource = rb_define_class_under(imf_mIMF, "ImageSource", rb_cObject);
+  rb_define_alloc_func(imf_cIMF_ImageSource, imf_image_source_alloc);
+
+  rb_define_private_method(imf_cIMF_ImageSource, "attach_path", imf_image_source_attach_path, 1);
+  rb_define_private_method(imf_cIMF_ImageSource, "attach_fd", imf_image_source_attach_fd, 2);
+  rb_define_private_method(imf_cIMF_ImageSource, "attach_string", imf_image_source_attach_string, 2);
+  rb_define_private_method(imf_cIMF_ImageSource, "attach_readable", imf_image_source_attach_readable, 1);
+  rb_define_method(imf_cIMF_ImageSource, "mapped?", imf_image_source_is_mapped, 0);
+  rb_define_method(imf_cIMF_ImageSource, "read", imf_image_source_read, -1);
+  rb_define_method(imf_cIMF_ImageSource, "rewind", imf_image_source_rewind, 0);
+
+  id_read = rb_intern("read");
+}
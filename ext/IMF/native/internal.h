@@ -3,21 +3,154 @@
 
 #include "IMF.h"
 
+#ifdef HAVE_PTHREAD_H
+# include <pthread.h>
+#endif
+
 #ifndef HAVE_RB_ARY_NEW_CAPA
 # define rb_ary_new_capa rb_ary_new2
 #endif
 
+/* Buffer pool */
+
+void *imf_buffer_pool_alloc(size_t size);
+void *imf_buffer_pool_try_alloc(size_t size);
+void imf_buffer_pool_free(void *ptr, size_t size);
+void imf_buffer_pool_report_unreported_memory(void);
+
+/* ByteSink */
+
+VALUE imf_byte_sink_open(VALUE dest, imf_byte_sink_t **sink_ptr);
+VALUE imf_byte_sink_close(VALUE sink_obj, bool success);
+
+/* ImageSource */
+
+imf_byte_source_t *imf_image_source_open_path(char const *path);
+void imf_image_source_close(imf_byte_source_t *src);
+int imf_image_source_get_read_errno(imf_byte_source_t const *src);
+
 /* Image */
 
-imf_image_t *imf_get_image_data(VALUE obj);
+void imf_load_options_init(imf_load_options_t *opts, VALUE hash);
+/* Loads the image from the image source as IMF::Image.open */
+VALUE imf_image_load(VALUE klass, VALUE imgsrc_obj, imf_load_options_t const *opts);
+bool imf_image_crop_to_region(imf_image_t *img, imf_load_options_t const *opts, imf_load_error_t *error);
 
 /* FileFormat */
 
 VALUE imf_file_format_detect(VALUE fmt_obj, VALUE imgsrc_obj);
-VALUE imf_file_format_load(VALUE fmt_obj, VALUE image_obj, VALUE imgsrc_obj);
+VALUE imf_file_format_load(VALUE fmt_obj, VALUE image_obj, VALUE imgsrc_obj, imf_load_options_t const *opts);
+void imf_file_format_probe(VALUE fmt_obj, VALUE imgsrc_obj, imf_image_t *img);
+
+/* An enabled entry of the magic number table */
+typedef struct imf_file_format_decoder imf_file_format_decoder_t;
+struct imf_file_format_decoder {
+  imf_file_format_magic_t const *magic;
+  /* NULL if the format can be loaded only with the GVL */
+  imf_file_format_decode_func *decode;
+};
+
+size_t imf_file_format_get_decoders(imf_file_format_decoder_t **decoders);
+imf_file_format_decoder_t const *imf_file_format_find_decoder(imf_file_format_decoder_t const *decoders, size_t length, imf_byte_source_t *src);
 
 RUBY_EXTERN VALUE imf_cIMF_FileFormat_Base;
 
+/* Parallelism */
+
+/* Processes the rows [begin, end) of an operation */
+typedef void imf_row_band_func_t(void *arg, size_t begin, size_t end);
+
+/* Splits `rows` into bands of at least `min_rows_per_band` rows, and
+ * calls `func` for each band on up to IMF.max_threads threads.  Returns
+ * after all the bands are processed.  Must be called without the GVL if
+ * it takes long, and `func` must not call any Ruby API. */
+void imf_parallel_for_rows(size_t rows, size_t min_rows_per_band, imf_row_band_func_t *func, void *arg);
+
+/* Processes the item of the index in a work queue */
+typedef void imf_work_item_func_t(void *arg, size_t index);
+
+/* A queue of `count` items taken one at a time by the threads */
+typedef struct imf_work_queue imf_work_queue_t;
+struct imf_work_queue {
+  imf_work_item_func_t *func;
+  void *arg;
+  size_t count;
+  /* the index of the next item, which is kept over the runs */
+  size_t next;
+  bool canceled;
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_t lock;
+#endif
+};
+
+void imf_work_queue_init(imf_work_queue_t *queue, size_t count, imf_work_item_func_t *func, void *arg);
+void imf_work_queue_destroy(imf_work_queue_t *queue);
+/* Calls `func` for the rest of the items on up to `num_threads` threads
+ * including the calling one, until the queue is empty or canceled.  Must
+ * be called without the GVL, and `func` must not call any Ruby API. */
+void imf_work_queue_run(imf_work_queue_t *queue, size_t num_threads);
+/* Stops handing out the items.  The items being processed are finished
+ * before imf_work_queue_run returns.  This is for unblocking functions. */
+void imf_work_queue_cancel(imf_work_queue_t *queue);
+
+enum imf_simd_level {
+  IMF_SIMD_NONE = 0,
+  IMF_SIMD_SSE2 = 1,
+  IMF_SIMD_SSSE3 = 2,
+  IMF_SIMD_AVX2 = 3,
+};
+
+extern int imf_simd_level;
+
+#if defined(__SSE2__) || defined(_M_X64)
+# define IMF_HAVE_SSE2 1
+#endif
+
+/* SSSE3 and AVX2 kernels are compiled with the target attribute, and
+ * called only if the CPU supports them */
+#if defined(IMF_HAVE_SSE2) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# define IMF_HAVE_SSSE3 1
+# define IMF_TARGET_SSSE3 __attribute__((target("ssse3")))
+# define IMF_HAVE_AVX2 1
+# define IMF_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+/* FFT */
+
+typedef struct { double re, im; } imf_complex_t;
+
+typedef struct imf_fft_plan imf_fft_plan_t;
+typedef struct imf_fft_real_plan imf_fft_real_plan_t;
+
+/* Plans are cached by size and never freed.  They must be obtained with
+ * the GVL held, and can then be used on any thread. */
+imf_fft_plan_t const *imf_fft_plan(size_t n);
+imf_fft_real_plan_t const *imf_fft_real_plan(size_t n);
+size_t imf_fft_size(imf_fft_plan_t const *plan);
+size_t imf_fft_good_size(size_t n);
+
+/* The transforms are unnormalized, and need a scratch buffer of the given
+ * number of complex numbers */
+size_t imf_fft_scratch_size(imf_fft_plan_t const *plan);
+void imf_fft_forward(imf_fft_plan_t const *plan, imf_complex_t *data, imf_complex_t *scratch);
+void imf_fft_inverse(imf_fft_plan_t const *plan, imf_complex_t *data, imf_complex_t *scratch);
+
+/* The real transforms of n samples use a buffer of the returned number of
+ * complex numbers, whose first n / 2 + 1 hold the spectrum */
+size_t imf_fft_real_buffer_size(imf_fft_real_plan_t const *rplan);
+size_t imf_fft_real_scratch_size(imf_fft_real_plan_t const *rplan);
+void imf_fft_real_forward(imf_fft_real_plan_t const *rplan, double const *in, imf_complex_t *buf, imf_complex_t *scratch);
+void imf_fft_real_inverse(imf_fft_real_plan_t const *rplan, imf_complex_t *buf, double *out, imf_complex_t *scratch);
+
+/* Transforms the samples of the size of the plans of rows and columns,
+ * whose rows are `stride` doubles apart, to and from the spectrum of
+ * columns rows of rows / 2 + 1 complex numbers, in parallel.  Returns
+ * false if out of memory. */
+bool imf_fft_2d_forward(imf_fft_real_plan_t const *rows, imf_fft_plan_t const *columns,
+                        double const *samples, size_t stride, imf_complex_t *spectrum);
+bool imf_fft_2d_inverse(imf_fft_real_plan_t const *rows, imf_fft_plan_t const *columns,
+                        imf_complex_t *spectrum, double *samples, size_t stride);
+
 /* internal utilities */
 static inline size_t
 imf_calculate_row_stride(size_t const width, size_t const component_size, size_t const pixel_channels, size_t const alignment_size)
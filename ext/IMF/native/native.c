@@ -2,6 +2,10 @@
 
 #include <ruby/encoding.h>
 
+#ifdef HAVE_RUBY_THREAD_H
+# include <ruby/thread.h>
+#endif
+
 #ifdef HAVE_SYS_TYPES_H
 # include <sys/types.h>
 #endif
@@ -43,38 +47,78 @@ imf_file_p(char const *path)
 
 VALUE imf_mIMF;
 VALUE imf_cIMF_Image;
-VALUE imf_cIMF_ImageSource;
 
-static ID id_detect;
 static ID id_detect;
 static ID id_path;
 static ID id_read;
 static ID id_rewind;
+static ID id_scale;
+static ID id_max_size;
+static ID id_row_alignment;
+static ID id_region;
+static ID id_keep_color_space;
+static ID id_planar;
+static ID id_format_name;
+static ID id_downcase;
+static ID id_Info;
 
-static void
-imf_image_mark(void *ptr)
+/* GVL */
+
+void *
+imf_call_without_gvl(imf_gvl_func_t *func, void *data1, imf_unblock_func_t *ubf, void *data2)
+{
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+  return rb_thread_call_without_gvl(func, data1, ubf, data2);
+#else
+  return func(data1);
+#endif
+}
+
+void *
+imf_call_with_gvl(imf_gvl_func_t *func, void *data1)
 {
+#ifdef HAVE_RB_THREAD_CALL_WITH_GVL
+  return rb_thread_call_with_gvl(func, data1);
+#else
+  return func(data1);
+#endif
 }
 
 static void
-imf_image_free(void *ptr)
+imf_image_mark(void *ptr)
 {
-  xfree(IMF_IMAGE(ptr)->data);
-  xfree(ptr);
+  imf_image_t const *img = IMF_IMAGE(ptr);
+  if (img->base)
+    rb_gc_mark(img->base);
 }
 
 static inline size_t
 imf_image_data_size(imf_image_t const *const img)
 {
-  size_t const data_size = img->row_stride * img->height;
+  size_t data_size = img->row_stride * img->height;
+  size_t i;
+
+  if (IMF_IMAGE_IS_PLANAR(img)) {
+    for (i = 0; i < img->pixel_channels; ++i)
+      data_size += img->planes[i].row_stride * img->planes[i].allocated_height;
+  }
   return data_size;
 }
 
+static void
+imf_image_free(void *ptr)
+{
+  imf_image_release(IMF_IMAGE(ptr));
+  xfree(ptr);
+}
+
 static size_t
 imf_image_memsize(void const *ptr)
 {
-  size_t const data_size = imf_image_data_size(IMF_IMAGE(ptr));
-  return data_size + sizeof(imf_image_t);
+  /* the pixels of a view are counted by its base */
+  size_t const data_size = IMF_IMAGE(ptr)->base ? 0 : imf_image_data_size(IMF_IMAGE(ptr));
+  size_t const palette_size = IMF_IMAGE(ptr)->palette != NULL ? IMF_IMAGE_PALETTE_CAPACITY * 4 : 0;
+  return data_size + palette_size + sizeof(imf_image_t);
 }
 
 static rb_data_type_t imf_image_data_type = {
@@ -112,69 +156,810 @@ imf_image_alloc(VALUE klass)
   return obj;
 }
 
-void
-imf_image_allocate_image_buffer(imf_image_t *img)
+/* Copies the pixels of `src` into `dst` of the same size and pixel
+ * format, row by row as their row strides may differ. */
+static void
+imf_image_copy_pixels(imf_image_t *dst, imf_image_t const *src)
+{
+  size_t const row_size = src->width * src->pixel_channels * src->component_size;
+  size_t y;
+
+  for (y = 0; y < src->height; ++y)
+    memcpy(dst->data + y * dst->row_stride, src->data + y * src->row_stride, row_size);
+}
+
+/* Copies the pixels into a new buffer, so that the copy is not affected
+ * by the images that are reused, e.g. by IMF::Image.each_frame. */
+static VALUE
+imf_image_init_copy(VALUE obj, VALUE orig)
+{
+  imf_image_t *img, *orig_img;
+
+  if (obj == orig)
+    return obj;
+  rb_obj_init_copy(obj, orig);
+
+  img = imf_get_image_data(obj);
+  orig_img = imf_get_image_data(orig);
+
+  imf_image_release(img);
+  *img = *orig_img;
+  img->data = NULL;
+  img->palette = NULL;
+  if (orig_img->data != NULL && IMF_IMAGE_IS_PLANAR(orig_img)) {
+    /* the planes are copied with the padding in the same layout */
+    size_t const data_size = imf_image_data_size(orig_img);
+    size_t i;
+    img->data = imf_buffer_pool_alloc(data_size);
+    img->base = 0;
+    memcpy(img->data, orig_img->data, data_size);
+    for (i = 0; i < img->pixel_channels; ++i)
+      img->planes[i].data = img->data + (orig_img->planes[i].data - orig_img->data);
+  }
+  else if (orig_img->data != NULL) {
+    imf_image_allocate_image_buffer(img);
+    imf_image_copy_pixels(img, orig_img);
+  }
+  if (orig_img->palette != NULL) {
+    imf_image_allocate_palette(img, orig_img->palette_size);
+    memcpy(img->palette, orig_img->palette, IMF_IMAGE_PALETTE_CAPACITY * 4);
+  }
+
+  return obj;
+}
+
+/* Row alignment */
+
+static size_t imf_default_row_alignment = IMF_IMAGE_DEFAULT_ROW_ALIGNMENT;
+
+static size_t
+imf_check_row_alignment(VALUE alignment_v)
+{
+  long const alignment = NUM2LONG(alignment_v);
+
+  if (alignment <= 0 || alignment > IMF_IMAGE_BUFFER_ALIGNMENT || (alignment & (alignment - 1)) != 0)
+    rb_raise(rb_eArgError, "row alignment must be a power of two up to %d (%ld given)",
+             IMF_IMAGE_BUFFER_ALIGNMENT, alignment);
+
+  return (size_t) alignment;
+}
+
+/*
+ * call-seq:
+ *   IMF.default_row_alignment -> integer
+ *
+ * Returns the row alignment of the images loaded without
+ * the row_alignment: option.
+ */
+static VALUE
+imf_s_get_default_row_alignment(VALUE mod)
+{
+  return SIZET2NUM(imf_default_row_alignment);
+}
+
+/*
+ * call-seq:
+ *   IMF.default_row_alignment = bytes
+ *
+ * Sets the default row alignment.  It must be a power of two up to 64.
+ */
+static VALUE
+imf_s_set_default_row_alignment(VALUE mod, VALUE alignment_v)
+{
+  imf_default_row_alignment = imf_check_row_alignment(alignment_v);
+  return alignment_v;
+}
+
+/* Sets the row stride of the image of the size and the pixel format
+ * already set.  The rows are aligned to img->row_alignment, or the
+ * default row alignment if it is 0. */
+static void
+imf_image_set_row_stride(imf_image_t *img)
 {
   assert(img->width > 0);
   assert(img->height > 0);
   assert(img->pixel_channels > 0);
   assert(img->component_size > 0);
 
-  img->row_stride = imf_calculate_row_stride(img->width, img->component_size, img->pixel_channels, 16);
-  img->data = ALLOC_N(uint8_t, imf_image_data_size(img));
+  if (img->row_alignment == 0)
+    img->row_alignment = imf_default_row_alignment;
+
+  img->row_stride = imf_calculate_row_stride(img->width, img->component_size, img->pixel_channels, img->row_alignment);
+}
+
+/* Allocates the pixel buffer for the image of the size and the pixel
+ * format already set. */
+void
+imf_image_allocate_image_buffer(imf_image_t *img)
+{
+  imf_image_set_row_stride(img);
+  img->data = imf_buffer_pool_alloc(imf_image_data_size(img));
+  img->base = 0;
+}
+
+bool
+imf_image_try_allocate_image_buffer(imf_image_t *img)
+{
+  imf_image_set_row_stride(img);
+  img->data = imf_buffer_pool_try_alloc(imf_image_data_size(img));
+  img->base = 0;
+  return img->data != NULL;
+}
+
+/* Sets the layout of the planes, and returns the size of their buffer */
+static size_t
+imf_image_set_plane_strides(imf_image_t *img, size_t const *padded_widths, size_t const *padded_heights)
+{
+  size_t data_size = 0, i;
+
+  assert(img->pixel_channels > 0 && img->pixel_channels <= IMF_IMAGE_MAX_PLANES);
+  assert(img->component_size == 1);
+
+  if (img->row_alignment == 0)
+    img->row_alignment = imf_default_row_alignment;
+
+  IMF_IMAGE_FLAG_SET(img, IMF_IMAGE_FLAG_PLANAR);
+  img->row_stride = 0;
+  for (i = 0; i < img->pixel_channels; ++i) {
+    imf_image_plane_t *plane = &img->planes[i];
+    assert(padded_widths[i] >= plane->width && padded_heights[i] >= plane->height);
+    plane->row_stride = imf_calculate_row_stride(padded_widths[i], 1, 1, img->row_alignment);
+    plane->allocated_height = padded_heights[i];
+    data_size += plane->row_stride * plane->allocated_height;
+  }
+
+  return data_size;
+}
+
+/* Points the planes into the buffer, each at a multiple of the row
+ * alignment */
+static void
+imf_image_set_plane_data(imf_image_t *img, uint8_t *ptr)
+{
+  size_t i;
+
+  img->data = ptr;
+  img->base = 0;
+  for (i = 0; i < img->pixel_channels; ++i) {
+    img->planes[i].data = ptr;
+    ptr += img->planes[i].row_stride * img->planes[i].allocated_height;
+  }
+}
+
+void
+imf_image_allocate_planes(imf_image_t *img, size_t const *padded_widths, size_t const *padded_heights)
+{
+  size_t const data_size = imf_image_set_plane_strides(img, padded_widths, padded_heights);
+  imf_image_set_plane_data(img, imf_buffer_pool_alloc(data_size));
+}
+
+bool
+imf_image_try_allocate_planes(imf_image_t *img, size_t const *padded_widths, size_t const *padded_heights)
+{
+  size_t const data_size = imf_image_set_plane_strides(img, padded_widths, padded_heights);
+  uint8_t *ptr = imf_buffer_pool_try_alloc(data_size);
+
+  if (ptr == NULL)
+    return false;
+  imf_image_set_plane_data(img, ptr);
+  return true;
+}
+
+void
+imf_image_check_interleaved(imf_image_t const *img)
+{
+  if (IMF_IMAGE_IS_PLANAR(img))
+    rb_raise(rb_eArgError, "unable to operate on the pixels of a planar image; use Image#planes");
+}
+
+void
+imf_image_release(imf_image_t *img)
+{
+  if (img->base)
+    img->base = 0;
+  else
+    imf_buffer_pool_free(img->data, imf_image_data_size(img));
+  img->data = NULL;
+  free(img->palette);
+  img->palette = NULL;
+}
+
+/* Views
+ *
+ * IMF::Image#crop makes a view that points into the pixel buffer of the
+ * image with the same row stride.  The buffer is moved to a hidden base
+ * object on the first crop, so that the image and its views are equal
+ * users of the buffer and any of them can be collected first.  Every view
+ * marks the base, and an image writing pixels into a shared buffer copies
+ * them first by imf_image_make_writable. */
+
+VALUE
+imf_image_share_buffer(imf_image_t *img)
+{
+  imf_image_t *base_img;
+
+  if (!img->base) {
+    VALUE base = TypedData_Make_Struct(0, imf_image_t, &imf_image_data_type, base_img);
+    *base_img = *img;
+    base_img->palette = NULL;
+    base_img->palette_size = 0;
+    img->base = base;
+  }
+
+  return img->base;
+}
+
+void
+imf_image_make_writable(imf_image_t *img)
+{
+  imf_image_t shared;
+
+  if (!img->base)
+    return;
+
+  shared = *img;
+  imf_image_allocate_image_buffer(img);
+  imf_image_copy_pixels(img, &shared);
+  RB_GC_GUARD(shared.base);
 }
 
+/*
+ * call-seq:
+ *   image.crop(x, y, width, height) -> new_image
+ *
+ * Returns a new image of the given region, which shares the pixels with
+ * the image until either of them is written.  The rows of the new image
+ * are not aligned to row_alignment unless the region starts at an
+ * aligned position.
+ */
 static VALUE
-imf_image_s_load_image(int argc, VALUE *argv, VALUE klass)
+imf_image_crop(VALUE obj, VALUE x_v, VALUE y_v, VALUE width_v, VALUE height_v)
 {
-  VALUE image_obj, imgsrc_obj, path_value, fmt_obj;
-  imf_image_t *img;
+  imf_image_t *img = imf_get_image_data(obj);
+  long const x = NUM2LONG(x_v), y = NUM2LONG(y_v);
+  long const width = NUM2LONG(width_v), height = NUM2LONG(height_v);
+  VALUE new_obj;
+  imf_image_t *new_img;
 
-  /* TODO: support optional loading parameters */
-  rb_scan_args(argc, argv, "10", &imgsrc_obj);
+  imf_image_check_interleaved(img);
+  if (x < 0 || y < 0 || width <= 0 || height <= 0 ||
+      (size_t) x + (size_t) width > img->width ||
+      (size_t) y + (size_t) height > img->height) {
+    rb_raise(rb_eIndexError,
+             "region (%ld, %ld, %ld, %ld) is out of the image of %"PRIuSIZE"x%"PRIuSIZE,
+             x, y, width, height, img->width, img->height);
+  }
 
-  image_obj = imf_image_alloc(klass);
-  img = imf_get_image_data(image_obj);
+  new_obj = imf_image_alloc(rb_obj_class(obj));
+  new_img = imf_get_image_data(new_obj);
+  if (img->palette != NULL) {
+    imf_image_allocate_palette(new_img, img->palette_size);
+    memcpy(new_img->palette, img->palette, IMF_IMAGE_PALETTE_CAPACITY * 4);
+  }
+
+  new_img->flags = img->flags;
+  new_img->color_space = img->color_space;
+  new_img->component_size = img->component_size;
+  new_img->pixel_channels = img->pixel_channels;
+  new_img->width = (size_t) width;
+  new_img->height = (size_t) height;
+  new_img->row_stride = img->row_stride;
+  new_img->row_alignment = img->row_alignment;
+  new_img->base = imf_image_share_buffer(img);
+  new_img->data = img->data + (size_t) y * img->row_stride
+                + (size_t) x * img->pixel_channels * img->component_size;
+
+  return new_obj;
+}
+
+/*
+ * call-seq:
+ *   image.planar? -> true or false
+ *
+ * Returns true if the components are stored in separate planes, e.g. by
+ * IMF::Image.open with planar: true.
+ */
+static VALUE
+imf_image_is_planar(VALUE obj)
+{
+  imf_image_t *img = imf_get_image_data(obj);
+  return IMF_IMAGE_IS_PLANAR(img) ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq:
+ *   image.planes -> array of images
+ *
+ * Returns the planes of a planar image as GRAY images, which share the
+ * pixels with the image like the ones made by #crop.  The planes of the
+ * subsampled components are smaller than the image.  Returns [image] for
+ * an interleaved image.
+ */
+static VALUE
+imf_image_get_planes(VALUE obj)
+{
+  imf_image_t *img = imf_get_image_data(obj);
+  VALUE ary, base;
+  size_t i;
+
+  if (!IMF_IMAGE_IS_PLANAR(img))
+    return rb_ary_new_from_args(1, obj);
+
+  base = imf_image_share_buffer(img);
+  ary = rb_ary_new_capa((long) img->pixel_channels);
+  for (i = 0; i < img->pixel_channels; ++i) {
+    VALUE plane_obj = imf_image_alloc(rb_obj_class(obj));
+    imf_image_t *plane_img = imf_get_image_data(plane_obj);
+    imf_image_plane_t const *plane = &img->planes[i];
+
+    plane_img->color_space = IMF_COLOR_SPACE_GRAY;
+    plane_img->component_size = 1;
+    plane_img->pixel_channels = 1;
+    plane_img->width = plane->width;
+    plane_img->height = plane->height;
+    plane_img->row_stride = plane->row_stride;
+    plane_img->row_alignment = img->row_alignment;
+    plane_img->data = plane->data;
+    plane_img->base = base;
+    rb_ary_push(ary, plane_obj);
+  }
+
+  return ary;
+}
+
+/* Palette
+ *
+ * The palette always has room for 256 entries, so that any index found in
+ * the pixels can be looked up without checking the range.  The unused
+ * entries are opaque black.  It is allocated by malloc, as the decoders
+ * may allocate it without the GVL. */
+
+bool
+imf_image_try_allocate_palette(imf_image_t *img, size_t size)
+{
+  size_t i;
+
+  assert(size > 0 && size <= IMF_IMAGE_PALETTE_CAPACITY);
+
+  if (img->palette == NULL) {
+    img->palette = (uint8_t (*)[4]) malloc(IMF_IMAGE_PALETTE_CAPACITY * 4);
+    if (img->palette == NULL)
+      return false;
+  }
+  for (i = 0; i < IMF_IMAGE_PALETTE_CAPACITY; ++i) {
+    img->palette[i][0] = img->palette[i][1] = img->palette[i][2] = 0;
+    img->palette[i][3] = 0xFF;
+  }
+  img->palette_size = size;
+  return true;
+}
+
+void
+imf_image_allocate_palette(imf_image_t *img, size_t size)
+{
+  if (!imf_image_try_allocate_palette(img, size))
+    rb_memerror();
+}
+
+void
+imf_image_expand_palette(imf_image_t const *src, imf_image_t *dst)
+{
+  size_t x, y;
+
+  assert(src->color_space == IMF_COLOR_SPACE_INDEXED);
+  assert(src->palette != NULL);
+
+  dst->flags = src->flags;
+  dst->color_space = IMF_COLOR_SPACE_RGB;
+  dst->component_size = 1;
+  dst->pixel_channels = IMF_IMAGE_HAS_ALPHA(src) ? 4 : 3;
+  dst->width = src->width;
+  dst->height = src->height;
+  dst->palette = NULL;
+  dst->palette_size = 0;
+  imf_image_allocate_image_buffer(dst);
+
+  uint8_t const (*const palette)[4] = (uint8_t const (*)[4]) src->palette;
+  for (y = 0; y < src->height; ++y) {
+    uint8_t const *index = src->data + y * src->row_stride;
+    uint8_t *out = dst->data + y * dst->row_stride;
+
+    if (dst->pixel_channels == 4) {
+      for (x = 0; x < src->width; ++x)
+        memcpy(out + 4 * x, palette[index[x]], 4);
+    }
+    else {
+      /* Copy whole entries, whose 4th byte is overwritten by the next
+       * pixel, except for the last pixel that may end the buffer. */
+      for (x = 0; x + 1 < src->width; ++x)
+        memcpy(out + 3 * x, palette[index[x]], 4);
+      memcpy(out + 3 * x, palette[index[x]], 3);
+    }
+  }
+}
+
+/*
+ * call-seq:
+ *   image.palette -> array or nil
+ *
+ * Returns the colors of an indexed image as an Array of [r, g, b], or
+ * [r, g, b, a] if the image has alpha.  Returns nil for other images.
+ */
+static VALUE
+imf_image_get_palette(VALUE obj)
+{
+  imf_image_t *img = imf_get_image_data(obj);
+  size_t const channels = IMF_IMAGE_HAS_ALPHA(img) ? 4 : 3;
+  size_t i, c;
+  VALUE ary;
+
+  if (img->palette == NULL)
+    return Qnil;
+
+  ary = rb_ary_new_capa((long) img->palette_size);
+  for (i = 0; i < img->palette_size; ++i) {
+    VALUE color = rb_ary_new_capa((long) channels);
+    for (c = 0; c < channels; ++c)
+      rb_ary_push(color, INT2FIX(img->palette[i][c]));
+    rb_ary_push(ary, color);
+  }
+
+  return ary;
+}
+
+/*
+ * call-seq:
+ *   image.expand_palette -> new_image
+ *
+ * Returns a new RGB image, or RGBA one if the image has alpha, of the
+ * colors of an indexed image.  Returns a copy for other images.
+ */
+static VALUE
+imf_image_m_expand_palette(VALUE obj)
+{
+  imf_image_t *img = imf_get_image_data(obj);
+  VALUE new_obj;
+  imf_image_t *new_img;
+
+  if (img->color_space != IMF_COLOR_SPACE_INDEXED)
+    return rb_obj_dup(obj);
+
+  new_obj = imf_image_alloc(rb_obj_class(obj));
+  new_img = imf_get_image_data(new_obj);
+  new_img->row_alignment = img->row_alignment;
+  imf_image_expand_palette(img, new_img);
+
+  return new_obj;
+}
+
+/* Loading errors */
+
+bool
+imf_load_error_set(imf_load_error_t *error, VALUE klass, char const *format, ...)
+{
+  va_list ap;
+
+  error->klass = klass;
+  error->errno_value = 0;
+  va_start(ap, format);
+  vsnprintf(error->message, IMF_LOAD_ERROR_MESSAGE_SIZE, format, ap);
+  va_end(ap);
+
+  return false;
+}
+
+bool
+imf_load_error_set_errno(imf_load_error_t *error, int errno_value, char const *message)
+{
+  imf_load_error_set(error, 0, "%s", message);
+  error->errno_value = errno_value;
+  return false;
+}
+
+VALUE
+imf_load_error_to_exception(imf_load_error_t const *error)
+{
+  if (error->klass == 0)
+    return rb_syserr_new(error->errno_value, error->message);
+  return rb_exc_new_cstr(error->klass, error->message);
+}
+
+void
+imf_load_error_raise(imf_load_error_t const *error)
+{
+  rb_exc_raise(imf_load_error_to_exception(error));
+}
+
+/* Loading options */
+
+static void
+imf_load_options_set_scale(imf_load_options_t *opts, VALUE scale)
+{
+  VALUE num, denom;
+
+  if (RB_FLOAT_TYPE_P(scale))
+    scale = rb_flt_rationalize(scale);
+
+  if (RB_INTEGER_TYPE_P(scale)) {
+    num = scale;
+    denom = INT2FIX(1);
+  }
+  else if (RB_TYPE_P(scale, T_RATIONAL)) {
+    num = rb_rational_num(scale);
+    denom = rb_rational_den(scale);
+  }
+  else {
+    rb_raise(rb_eTypeError, "scale must be a Rational, Integer, or Float");
+  }
+
+  if (!RB_INTEGER_TYPE_P(num) || RTEST(rb_funcall(num, '<', 1, INT2FIX(1))))
+    rb_raise(rb_eArgError, "scale must be positive");
+
+  opts->scale_num = NUM2UINT(num);
+  opts->scale_denom = NUM2UINT(denom);
+}
+
+static void
+imf_load_options_set_max_size(imf_load_options_t *opts, VALUE max_size)
+{
+  VALUE ary = rb_check_array_type(max_size);
+  long width, height;
+
+  if (NIL_P(ary) || RARRAY_LEN(ary) != 2)
+    rb_raise(rb_eTypeError, "max_size must be an Array of width and height");
+
+  width = NUM2LONG(RARRAY_AREF(ary, 0));
+  height = NUM2LONG(RARRAY_AREF(ary, 1));
+  if (width <= 0 || height <= 0)
+    rb_raise(rb_eArgError, "max_size must be positive");
+
+  opts->max_width = (size_t) width;
+  opts->max_height = (size_t) height;
+}
+
+static void
+imf_load_options_set_region(imf_load_options_t *opts, VALUE region)
+{
+  VALUE ary = rb_check_array_type(region);
+  long x, y, width, height;
+
+  if (NIL_P(ary) || RARRAY_LEN(ary) != 4)
+    rb_raise(rb_eTypeError, "region must be an Array of x, y, width, and height");
+
+  x = NUM2LONG(RARRAY_AREF(ary, 0));
+  y = NUM2LONG(RARRAY_AREF(ary, 1));
+  width = NUM2LONG(RARRAY_AREF(ary, 2));
+  height = NUM2LONG(RARRAY_AREF(ary, 3));
+  if (x < 0 || y < 0)
+    rb_raise(rb_eArgError, "region must not have negative position");
+  if (width <= 0 || height <= 0)
+    rb_raise(rb_eArgError, "region must have positive size");
+
+  opts->region_x = (size_t) x;
+  opts->region_y = (size_t) y;
+  opts->region_width = (size_t) width;
+  opts->region_height = (size_t) height;
+}
+
+bool
+imf_load_options_try_get_region(imf_load_options_t const *opts, size_t width, size_t height,
+                                size_t *x, size_t *y, size_t *region_width, size_t *region_height,
+                                imf_load_error_t *error)
+{
+  if (opts->region_width == 0) {
+    *x = *y = 0;
+    *region_width = width;
+    *region_height = height;
+    return true;
+  }
+
+  if (opts->region_x + opts->region_width > width || opts->region_y + opts->region_height > height) {
+    return imf_load_error_set(
+      error, rb_eArgError,
+      "region (%"PRIuSIZE", %"PRIuSIZE", %"PRIuSIZE", %"PRIuSIZE") is out of the image of %"PRIuSIZE"x%"PRIuSIZE,
+      opts->region_x, opts->region_y, opts->region_width, opts->region_height, width, height);
+  }
+
+  *x = opts->region_x;
+  *y = opts->region_y;
+  *region_width = opts->region_width;
+  *region_height = opts->region_height;
+  return true;
+}
+
+void
+imf_load_options_get_region(imf_load_options_t const *opts, size_t width, size_t height,
+                            size_t *x, size_t *y, size_t *region_width, size_t *region_height)
+{
+  imf_load_error_t error;
+
+  if (!imf_load_options_try_get_region(opts, width, height, x, y, region_width, region_height, &error))
+    imf_load_error_raise(&error);
+}
+
+void
+imf_load_options_init(imf_load_options_t *opts, VALUE hash)
+{
+  ID keys[6];
+  VALUE values[6];
+  imf_load_options_t const defaults = IMF_LOAD_OPTIONS_INITIALIZER;
+
+  *opts = defaults;
+  if (NIL_P(hash))
+    return;
+
+  keys[0] = id_scale;
+  keys[1] = id_max_size;
+  keys[2] = id_row_alignment;
+  keys[3] = id_region;
+  keys[4] = id_keep_color_space;
+  keys[5] = id_planar;
+  rb_get_kwargs(hash, keys, 0, 6, values);
+
+  if (values[0] != Qundef && !NIL_P(values[0]))
+    imf_load_options_set_scale(opts, values[0]);
+  if (values[1] != Qundef && !NIL_P(values[1]))
+    imf_load_options_set_max_size(opts, values[1]);
+  if (values[2] != Qundef && !NIL_P(values[2]))
+    opts->row_alignment = imf_check_row_alignment(values[2]);
+  if (values[3] != Qundef && !NIL_P(values[3]))
+    imf_load_options_set_region(opts, values[3]);
+  if (values[4] != Qundef)
+    opts->keep_color_space = RTEST(values[4]);
+  if (values[5] != Qundef)
+    opts->planar = RTEST(values[5]);
+}
+
+/* Crops the loaded image to the region for the decoders that loaded the
+ * whole image.  The decoders that handle the region by themselves have
+ * already made the image of the region size.  This can be called without
+ * the GVL. */
+bool
+imf_image_crop_to_region(imf_image_t *img, imf_load_options_t const *opts, imf_load_error_t *error)
+{
+  imf_image_t cropped;
+  size_t x, y, j;
+
+  if (opts->region_width == 0)
+    return true;
+  if (img->width == opts->region_width && img->height == opts->region_height)
+    return true;
+
+  cropped = *img;
+  if (!imf_load_options_try_get_region(opts, img->width, img->height, &x, &y, &cropped.width, &cropped.height, error))
+    return false;
+  if (!imf_image_try_allocate_image_buffer(&cropped))
+    return imf_load_error_set(error, rb_eNoMemError, "failed to allocate memory for the region");
+
+  size_t const pixel_size = img->pixel_channels * img->component_size;
+  uint8_t const *src = img->data + y * img->row_stride + x * pixel_size;
+  for (j = 0; j < cropped.height; ++j, src += img->row_stride)
+    memcpy(cropped.data + j * cropped.row_stride, src, cropped.width * pixel_size);
+
+  imf_buffer_pool_free(img->data, imf_image_data_size(img));
+  *img = cropped;
+  return true;
+}
+
+static VALUE
+imf_image_source_find_file_format_body(VALUE imgsrc_obj)
+{
+  VALUE path_value, fmt_klass, fmt_obj;
+
+  fmt_klass = imf_detect_file_format_class_by_magic(imf_image_source_get_byte_source(imgsrc_obj));
+  if (!NIL_P(fmt_klass))
+    return rb_class_new_instance(0, NULL, fmt_klass);
 
   path_value = rb_funcall(imgsrc_obj, id_path, 0);
   if (!NIL_P(path_value)) {
     FilePathStringValue(path_value);
     fmt_obj = imf_find_file_format_by_filename(path_value);
-    if (NIL_P(fmt_obj))
-      goto guess_format;
-    if (imf_is_file_format(fmt_obj)) {
-      if (imf_file_format_detect(fmt_obj, imgsrc_obj)) {
-      detected_file_format:
-        imf_file_format_load(fmt_obj, image_obj, imgsrc_obj);
-        return image_obj;
-      }
-    }
+    if (imf_is_file_format(fmt_obj) && imf_file_format_detect(fmt_obj, imgsrc_obj))
+      return fmt_obj;
   }
 
-guess_format:
   fmt_obj = imf_detect_file_format(imgsrc_obj);
   if (imf_is_file_format(fmt_obj))
-    goto detected_file_format;
+    return fmt_obj;
 
-unknown:
   rb_raise(rb_eRuntimeError, "Unknown image format");
 }
 
+/* Finds the file format of the image source by the magic number, by the
+ * extension of the path name, and then by asking every file format. */
 static VALUE
-imf_image_get_color_space(VALUE obj)
+imf_image_source_find_file_format(VALUE imgsrc_obj)
 {
-  imf_image_t *img = imf_get_image_data(obj);
+  return imf_image_source_protect(imgsrc_obj, imf_image_source_find_file_format_body, imgsrc_obj);
+}
 
-  switch (img->color_space) {
+VALUE
+imf_image_load(VALUE klass, VALUE imgsrc_obj, imf_load_options_t const *opts)
+{
+  VALUE image_obj, fmt_obj;
+  imf_image_t *img;
+  imf_load_error_t error;
+
+  image_obj = imf_image_alloc(klass);
+  img = imf_get_image_data(image_obj);
+  img->row_alignment = opts->row_alignment;
+
+  fmt_obj = imf_image_source_find_file_format(imgsrc_obj);
+  imf_file_format_load(fmt_obj, image_obj, imgsrc_obj, opts);
+  if (!imf_image_crop_to_region(img, opts, &error))
+    imf_load_error_raise(&error);
+
+  return image_obj;
+}
+
+static VALUE
+imf_image_s_load_image(int argc, VALUE *argv, VALUE klass)
+{
+  VALUE imgsrc_obj, opts_hash;
+  imf_load_options_t opts;
+
+  rb_scan_args(argc, argv, "1:", &imgsrc_obj, &opts_hash);
+  imf_load_options_init(&opts, opts_hash);
+
+  return imf_image_load(klass, imgsrc_obj, &opts);
+}
+
+static VALUE
+imf_color_space_to_symbol(enum imf_color_space color_space)
+{
+  switch (color_space) {
     case IMF_COLOR_SPACE_GRAY:
       return ID2SYM(rb_intern("GRAY"));
     case IMF_COLOR_SPACE_RGB:
       return ID2SYM(rb_intern("RGB"));
+    case IMF_COLOR_SPACE_INDEXED:
+      return ID2SYM(rb_intern("INDEXED"));
+    case IMF_COLOR_SPACE_YCBCR:
+      return ID2SYM(rb_intern("YCbCr"));
+    case IMF_COLOR_SPACE_HSV:
+      return ID2SYM(rb_intern("HSV"));
+    case IMF_COLOR_SPACE_HSL:
+      return ID2SYM(rb_intern("HSL"));
+    case IMF_COLOR_SPACE_LAB:
+      return ID2SYM(rb_intern("Lab"));
+    case IMF_COLOR_SPACE_CMYK:
+      return ID2SYM(rb_intern("CMYK"));
     default:
       return Qnil;
   }
 }
 
+static VALUE
+imf_image_s_probe_image(VALUE klass, VALUE imgsrc_obj)
+{
+  VALUE fmt_obj, format_name, cInfo;
+  imf_image_t img;
+
+  fmt_obj = imf_image_source_find_file_format(imgsrc_obj);
+
+  memset(&img, 0, sizeof(img));
+  imf_file_format_probe(fmt_obj, imgsrc_obj, &img);
+
+  format_name = rb_funcall(rb_funcall(CLASS_OF(fmt_obj), id_format_name, 0), id_downcase, 0);
+  cInfo = rb_const_get(klass, id_Info);
+
+  return rb_struct_new(cInfo,
+                       rb_str_intern(format_name),
+                       SIZET2NUM(img.width),
+                       SIZET2NUM(img.height),
+                       imf_color_space_to_symbol(img.color_space),
+                       INT2FIX(8 * img.component_size),
+                       INT2FIX(img.pixel_channels),
+                       IMF_IMAGE_HAS_ALPHA(&img) ? Qtrue : Qfalse);
+}
+
+static VALUE
+imf_image_get_color_space(VALUE obj)
+{
+  imf_image_t *img = imf_get_image_data(obj);
+  return imf_color_space_to_symbol(img->color_space);
+}
+
 static VALUE
 imf_image_has_alpha(VALUE obj)
 {
@@ -217,6 +1002,13 @@ imf_image_get_row_stride(VALUE obj)
   return UINT2NUM(img->row_stride);
 }
 
+static VALUE
+imf_image_get_row_alignment(VALUE obj)
+{
+  imf_image_t *img = imf_get_image_data(obj);
+  return SIZET2NUM(img->row_alignment);
+}
+
 static VALUE
 imf_image_get_pixel(VALUE obj, VALUE row_index_v, VALUE col_index_v)
 {
@@ -224,6 +1016,7 @@ imf_image_get_pixel(VALUE obj, VALUE row_index_v, VALUE col_index_v)
   ssize_t i, j, row_index, col_index;
   VALUE pixel;
 
+  imf_image_check_interleaved(img);
   row_index = NUM2SSIZET(row_index_v);
   col_index = NUM2SSIZET(col_index_v);
 
@@ -273,6 +1066,8 @@ Init_imf_image(void)
   rb_define_alloc_func(imf_cIMF_Image, imf_image_alloc);
 
   rb_define_singleton_method(imf_cIMF_Image, "load_image", imf_image_s_load_image, -1);
+  rb_define_singleton_method(imf_cIMF_Image, "probe_image", imf_image_s_probe_image, 1);
+  rb_define_method(imf_cIMF_Image, "initialize_copy", imf_image_init_copy, 1);
   rb_define_method(imf_cIMF_Image, "color_space", imf_image_get_color_space, 0);
   rb_define_method(imf_cIMF_Image, "has_alpha?", imf_image_has_alpha, 0);
   rb_define_method(imf_cIMF_Image, "component_size", imf_image_get_component_size, 0);
@@ -280,24 +1075,64 @@ Init_imf_image(void)
   rb_define_method(imf_cIMF_Image, "width", imf_image_get_width, 0);
   rb_define_method(imf_cIMF_Image, "height", imf_image_get_height, 0);
   rb_define_method(imf_cIMF_Image, "row_stride", imf_image_get_row_stride, 0);
+  rb_define_method(imf_cIMF_Image, "row_alignment", imf_image_get_row_alignment, 0);
+
+  rb_define_singleton_method(imf_mIMF, "default_row_alignment", imf_s_get_default_row_alignment, 0);
+  rb_define_singleton_method(imf_mIMF, "default_row_alignment=", imf_s_set_default_row_alignment, 1);
   rb_define_method(imf_cIMF_Image, "[]", imf_image_get_pixel, 2);
+  rb_define_method(imf_cIMF_Image, "palette", imf_image_get_palette, 0);
+  rb_define_method(imf_cIMF_Image, "expand_palette", imf_image_m_expand_palette, 0);
+  rb_define_method(imf_cIMF_Image, "crop", imf_image_crop, 4);
+  rb_define_method(imf_cIMF_Image, "planar?", imf_image_is_planar, 0);
+  rb_define_method(imf_cIMF_Image, "planes", imf_image_get_planes, 0);
 }
 
+void Init_imf_buffer_pool(void);
+void Init_imf_byte_sink(void);
+void Init_imf_image_export(void);
+void Init_imf_image_resize(void);
+void Init_imf_image_convert(void);
+void Init_imf_image_convolve(void);
+void Init_imf_image_fft(void);
+void Init_imf_image_open_all(void);
+void Init_imf_fft(void);
+void Init_imf_parallel(void);
 void Init_imf_file_format(void);
+void Init_imf_image_source(void);
 
 void
 Init_native(void)
 {
   imf_mIMF = rb_define_module("IMF");
 
+  Init_imf_buffer_pool();
+  Init_imf_byte_sink();
+
   Init_imf_image();
+  Init_imf_image_export();
+  Init_imf_image_resize();
+  Init_imf_image_convert();
+  Init_imf_image_convolve();
+  Init_imf_image_fft();
+  Init_imf_image_open_all();
+  Init_imf_parallel();
+  Init_imf_fft();
 
   Init_imf_file_format();
 
-  imf_cIMF_ImageSource = rb_define_class_under(imf_mIMF, "ImageSource", rb_cObject);
+  Init_imf_image_source();
 
   id_detect = rb_intern("detect");
   id_path = rb_intern("path");
   id_read = rb_intern("read");
   id_rewind = rb_intern("rewind");
+  id_scale = rb_intern("scale");
+  id_max_size = rb_intern("max_size");
+  id_row_alignment = rb_intern("row_alignment");
+  id_region = rb_intern("region");
+  id_keep_color_space = rb_intern("keep_color_space");
+  id_planar = rb_intern("planar");
+  id_format_name = rb_intern("format_name");
+  id_downcase = rb_intern("downcase");
+  id_Info = rb_intern("Info");
 }
@@ -0,0 +1,308 @@
+#include "IMF.h"
+
+#ifdef HAVE_PTHREAD_H
+# include <pthread.h>
+#endif
+
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+
+#include "internal.h"
+
+/* Data parallelism for image operations
+ *
+ * The operations on whole images split the rows into bands, and process
+ * the bands on native threads.  They are called without the GVL, and the
+ * threads never touch Ruby objects.  A work queue hands out the items of
+ * unequal costs, e.g. the images of IMF::Image.open_all, one at a time
+ * to the threads that finish their previous ones.
+ *
+ * The SIMD kernels are chosen at run time by imf_simd_level, which is the
+ * best instruction set the CPU supports unless disabled by IMF.simd=. */
+
+enum imf_parallel_constants {
+  IMF_PARALLEL_MAX_THREADS = 64,
+};
+
+static size_t imf_max_threads = 1;
+
+int imf_simd_level = IMF_SIMD_NONE;
+static int imf_detected_simd_level = IMF_SIMD_NONE;
+
+/* Threads */
+
+typedef struct imf_row_band imf_row_band_t;
+struct imf_row_band {
+  imf_row_band_func_t *func;
+  void *arg;
+  size_t begin;
+  size_t end;
+};
+
+#ifdef HAVE_PTHREAD_H
+static void *
+imf_row_band_thread(void *ptr)
+{
+  imf_row_band_t *band = (imf_row_band_t *) ptr;
+  band->func(band->arg, band->begin, band->end);
+  return NULL;
+}
+#endif
+
+void
+imf_parallel_for_rows(size_t rows, size_t min_rows_per_band, imf_row_band_func_t *func, void *arg)
+{
+  size_t num_bands, i;
+
+  if (rows == 0)
+    return;
+  if (min_rows_per_band == 0)
+    min_rows_per_band = 1;
+
+  num_bands = (rows + min_rows_per_band - 1) / min_rows_per_band;
+  if (num_bands > imf_max_threads)
+    num_bands = imf_max_threads;
+
+#ifdef HAVE_PTHREAD_H
+  if (num_bands > 1) {
+    imf_row_band_t bands[IMF_PARALLEL_MAX_THREADS];
+    pthread_t threads[IMF_PARALLEL_MAX_THREADS];
+    bool started[IMF_PARALLEL_MAX_THREADS];
+
+    for (i = 0; i < num_bands; ++i) {
+      bands[i].func = func;
+      bands[i].arg = arg;
+      bands[i].begin = rows * i / num_bands;
+      bands[i].end = rows * (i + 1) / num_bands;
+    }
+
+    /* The calling thread takes the first band.  A band whose thread
+     * cannot be started is also processed here. */
+    for (i = 1; i < num_bands; ++i)
+      started[i] = pthread_create(&threads[i], NULL, imf_row_band_thread, &bands[i]) == 0;
+    func(arg, bands[0].begin, bands[0].end);
+    for (i = 1; i < num_bands; ++i) {
+      if (started[i])
+        pthread_join(threads[i], NULL);
+      else
+        func(arg, bands[i].begin, bands[i].end);
+    }
+    return;
+  }
+#endif
+
+  func(arg, 0, rows);
+}
+
+/* Work queues */
+
+void
+imf_work_queue_init(imf_work_queue_t *queue, size_t count, imf_work_item_func_t *func, void *arg)
+{
+  queue->func = func;
+  queue->arg = arg;
+  queue->count = count;
+  queue->next = 0;
+  queue->canceled = false;
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_init(&queue->lock, NULL);
+#endif
+}
+
+void
+imf_work_queue_destroy(imf_work_queue_t *queue)
+{
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_destroy(&queue->lock);
+#endif
+}
+
+/* Takes the index of the next item, or returns false if the queue is
+ * empty or canceled */
+static bool
+imf_work_queue_take(imf_work_queue_t *queue, size_t *index)
+{
+  bool taken = false;
+
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_lock(&queue->lock);
+#endif
+  if (!queue->canceled && queue->next < queue->count) {
+    *index = queue->next++;
+    taken = true;
+  }
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_unlock(&queue->lock);
+#endif
+
+  return taken;
+}
+
+static void *
+imf_work_queue_thread(void *ptr)
+{
+  imf_work_queue_t *queue = (imf_work_queue_t *) ptr;
+  size_t index;
+
+  while (imf_work_queue_take(queue, &index))
+    queue->func(queue->arg, index);
+  return NULL;
+}
+
+void
+imf_work_queue_run(imf_work_queue_t *queue, size_t num_threads)
+{
+#ifdef HAVE_PTHREAD_H
+  pthread_t threads[IMF_PARALLEL_MAX_THREADS];
+  bool started[IMF_PARALLEL_MAX_THREADS];
+  size_t const rest = queue->count - queue->next;
+  size_t i;
+
+  if (num_threads > IMF_PARALLEL_MAX_THREADS)
+    num_threads = IMF_PARALLEL_MAX_THREADS;
+  if (num_threads > rest)
+    num_threads = rest;
+
+  /* The calling thread is one of the threads.  If no thread can be
+   * started, it takes all the items. */
+  for (i = 1; i < num_threads; ++i)
+    started[i] = pthread_create(&threads[i], NULL, imf_work_queue_thread, queue) == 0;
+  imf_work_queue_thread(queue);
+  for (i = 1; i < num_threads; ++i) {
+    if (started[i])
+      pthread_join(threads[i], NULL);
+  }
+#else
+  imf_work_queue_thread(queue);
+#endif
+}
+
+void
+imf_work_queue_cancel(imf_work_queue_t *queue)
+{
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_lock(&queue->lock);
+#endif
+  queue->canceled = true;
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_unlock(&queue->lock);
+#endif
+}
+
+static size_t
+imf_detect_num_processors(void)
+{
+#if defined(HAVE_PTHREAD_H) && defined(_SC_NPROCESSORS_ONLN)
+  long const n = sysconf(_SC_NPROCESSORS_ONLN);
+  if (n > IMF_PARALLEL_MAX_THREADS)
+    return IMF_PARALLEL_MAX_THREADS;
+  if (n > 0)
+    return (size_t) n;
+#endif
+  return 1;
+}
+
+/*
+ * call-seq:
+ *   IMF.max_threads -> integer
+ *
+ * Returns the maximum number of threads an image operation uses.
+ */
+static VALUE
+imf_s_get_max_threads(VALUE mod)
+{
+  return SIZET2NUM(imf_max_threads);
+}
+
+/*
+ * call-seq:
+ *   IMF.max_threads = n
+ *
+ * Sets the maximum number of threads an image operation uses, from 1 to
+ * 64.  It is the number of online processors by default.
+ */
+static VALUE
+imf_s_set_max_threads(VALUE mod, VALUE n_v)
+{
+  long const n = NUM2LONG(n_v);
+
+  if (n < 1 || n > IMF_PARALLEL_MAX_THREADS)
+    rb_raise(rb_eArgError, "max_threads must be from 1 to %d (%ld given)", IMF_PARALLEL_MAX_THREADS, n);
+
+  imf_max_threads = (size_t) n;
+  return n_v;
+}
+
+/* SIMD */
+
+static int
+imf_detect_simd_level(void)
+{
+#if defined(IMF_HAVE_AVX2)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    return IMF_SIMD_AVX2;
+  if (__builtin_cpu_supports("ssse3"))
+    return IMF_SIMD_SSSE3;
+#endif
+#if defined(IMF_HAVE_SSE2)
+  return IMF_SIMD_SSE2;
+#else
+  return IMF_SIMD_NONE;
+#endif
+}
+
+static VALUE
+imf_simd_level_to_symbol(int level)
+{
+  switch (level) {
+    case IMF_SIMD_SSE2:
+      return ID2SYM(rb_intern("sse2"));
+    case IMF_SIMD_SSSE3:
+      return ID2SYM(rb_intern("ssse3"));
+    case IMF_SIMD_AVX2:
+      return ID2SYM(rb_intern("avx2"));
+    default:
+      return Qnil;
+  }
+}
+
+/*
+ * call-seq:
+ *   IMF.simd -> symbol or nil
+ *
+ * Returns the best instruction set the SIMD kernels use, :sse2, :ssse3,
+ * or :avx2, or nil if the scalar kernels are used.
+ */
+static VALUE
+imf_s_get_simd(VALUE mod)
+{
+  return imf_simd_level_to_symbol(imf_simd_level);
+}
+
+/*
+ * call-seq:
+ *   IMF.simd = true or false
+ *
+ * Enables or disables the SIMD kernels.  The scalar kernels give the
+ * same results, so this is only for measuring them.
+ */
+static VALUE
+imf_s_set_simd(VALUE mod, VALUE enabled)
+{
+  imf_simd_level = RTEST(enabled) ? imf_detected_simd_level : IMF_SIMD_NONE;
+  return enabled;
+}
+
+void
+Init_imf_parallel(void)
+{
+  imf_max_threads = imf_detect_num_processors();
+  imf_detected_simd_level = imf_simd_level = imf_detect_simd_level();
+
+  rb_define_singleton_method(imf_mIMF, "max_threads", imf_s_get_max_threads, 0);
+  rb_define_singleton_method(imf_mIMF, "max_threads=", imf_s_set_max_threads, 1);
+  rb_define_singleton_method(imf_mIMF, "simd", imf_s_get_simd, 0);
+  rb_define_singleton_method(imf_mIMF, "simd=", imf_s_set_simd, 1);
+}
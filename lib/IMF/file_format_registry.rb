@@ -90,10 +90,12 @@ module IMF
 
     def register_file_format(file_format)
       global_file_format_registry.register(file_format)
+      set_file_format_magic_enabled(file_format, true)
     end
 
     def unregister_file_format(file_format)
       global_file_format_registry.unregister(file_format)
+      set_file_format_magic_enabled(file_format, false)
     end
 
     def each_file_format(extname: nil, &block)
@@ -12,16 +12,133 @@ module IMF
 
     def self.detect_format(file)
       image_source = ImageSource.new(file)
+
+      # Built-in formats are detected at once by their magic numbers
+      fmt_class = IMF.detect_file_format_class_by_magic(image_source)
+      return fmt_class.new if fmt_class
+
       IMF.each_file_format do |fmt_class|
+        next if fmt_class.magic?
         fmt = fmt_class.new
         return fmt if fmt.detect(image_source)
       end
       nil
     end
 
-    def self.open(source)
+    # The header information of an image returned by Image.probe.
+    Info = Struct.new(:format, :width, :height, :color_space, :bit_depth, :pixel_channels, :has_alpha) do
+      alias has_alpha? has_alpha
+    end
+
+    # Returns the Info of the image in the source, reading only its header.
+    # The format is the lower-cased format name, e.g. :png.
+    def self.probe(source)
+      image_source = ImageSource.new(source)
+      probe_image(image_source)
+    end
+
+    # Opens an image from the source.
+    #
+    # Options:
+    #
+    # - scale: reduces the image by the given factor, e.g. 1/8r.
+    # - max_size: [width, height] of the box into which the image is going
+    #   to be fit, e.g. for making a thumbnail.
+    # - row_alignment: the alignment of rows in bytes, a power of two up
+    #   to 64.  IMF.default_row_alignment is used by default.
+    # - region: [x, y, width, height] of the part to be loaded, in the
+    #   coordinates of the scaled image.  JPEG decodes only the rows and
+    #   columns around the region.  The other formats crop the loaded image.
+    # - keep_color_space: if true, JPEG images of YCbCr are loaded as
+    #   :YCbCr without the conversion into RGB, e.g. for computing luma or
+    #   encoding them again.  CMYK JPEG images are always loaded as :CMYK.
+    # - planar: if true, JPEG images are loaded with each component in its
+    #   own plane as stored in the file, i.e. without upsampling the chroma
+    #   or converting the color space.  Image#planes returns the planes.
+    #   It cannot be combined with scale, max_size, or region.  The other
+    #   formats ignore this option.
+    #
+    # The scale options are hints for the decoders that can produce a reduced image
+    # cheaply, and the image is never smaller than requested.  JPEG reduces
+    # by a factor of n/8, and WEBP scales to the exact size.
+    def self.open(source, **options)
+      image_source = ImageSource.new(source)
+      load_image(image_source, **options)
+    end
+
+    # Opens the images from many sources on a pool of native threads, and
+    # returns them in the order of the sources.  Each thread takes the next
+    # source when it finishes one, so that a large image doesn't hold up the
+    # others.  The paths are opened, detected, and decoded without the GVL,
+    # and the other sources are read into memory first if they are not
+    # seekable files.  The formats that cannot be decoded without the GVL
+    # are opened by Image.open after the threads finish.  If a source fails
+    # to be opened, its StandardError is returned in place of the image, and
+    # the others are still opened.
+    #
+    # threads: the number of threads, IMF.max_threads by default.
+    # The other options are the ones of Image.open.
+    def self.open_all(sources, threads: nil, **options)
+      sources = sources.to_a.map {|source| source.is_a?(Pathname) ? source.to_path : source }
+      load_images(sources, Integer(threads || IMF.max_threads), **options)
+    end
+
+    # Yields each frame of an animated image with its delay time in seconds.
+    # Every frame is composited on the canvas in turn, and the same Image
+    # object is yielded for all the frames, so that the memory does not grow
+    # with the number of frames.  Use #dup to keep a frame.  The formats
+    # without animation yield the only image with nil delay.
+    def self.each_frame(source)
+      return enum_for(__method__, source) unless block_given?
+
       image_source = ImageSource.new(source)
-      load_image(image_source)
+      fmt = detect_format(image_source)
+      if fmt.respond_to?(:each_frame)
+        fmt.each_frame(image_source) {|image, delay| yield image, delay }
+      else
+        yield load_image(image_source), nil
+      end
+      nil
+    end
+
+    # Returns all the pixels as a packed binary String.
+    # See #export_pixels for layout.
+    def pixels(layout: nil)
+      export_pixels(0, 0, width, height, layout: layout)
+    end
+
+    alias to_s pixels
+
+    # Saves the image into dest, which is a path name, an IO, or an object
+    # that responds to #write.  The format is given by a name like :png,
+    # or guessed from the extension of the path name.  The other options
+    # are specific to the format.
+    def save(dest, format: nil, **options)
+      fmt_class = find_file_format_for_saving(format, dest)
+      fmt_class.new.save(self, dest, **options)
+      self
+    end
+
+    # Returns the image encoded in the format as a binary String.
+    def encode(format:, **options)
+      fmt_class = find_file_format_for_saving(format, nil)
+      fmt_class.new.encode(self, **options)
+    end
+
+    private
+
+    def find_file_format_for_saving(format, dest)
+      if format
+        name = format.to_s
+        fmt_class = IMF.file_formats.find {|f| f.format_name.casecmp?(name) }
+        fmt_class ||= IMF.each_file_format(extname: ".#{name.downcase}").first
+        raise ArgumentError, "unknown format: #{format.inspect}" unless fmt_class
+      else
+        path = dest.respond_to?(:to_path) ? dest.to_path : dest
+        fmt_class = IMF.file_formats_for_filename(path).first if path.is_a?(String)
+        raise ArgumentError, "format is not given and cannot be guessed from #{dest.inspect}" unless fmt_class
+      end
+      fmt_class
     end
   end
 end
@@ -1,7 +1,5 @@
 module IMF
   class ImageSource
-    INITIAL_BUFFER_SIZE = 8192
-
     class InvalidSourceError < IMF::Error
     end
 
@@ -15,15 +13,15 @@ module IMF
     end
 
     def initialize(source)
-      @buffer = '\0' * INITIAL_BUFFER_SIZE
-      @read_size = 0
-      @pos = 0
-
       case source
       when String
         init_with_path(source)
+      when Pathname
+        init_with_path(source.to_path)
       when IO, File
         init_with_io(source)
+      when StringIO
+        init_with_string_io(source)
       else
         init_with_readable(source)
       end
@@ -31,37 +29,6 @@ module IMF
 
     attr_reader :path
 
-    def read(length = nil, outbuf = '')
-      init_with_io(File.open(@path, 'rb')) unless @source
-
-      if length.nil?
-        data = @source.read
-        @buffer[@read_size, data.length] = data
-        @read_size += data.length
-        beg, @pos = @pos, @read_size
-        outbuf.replace @buffer[beg..-1]
-      elsif length > 0
-        tail_length = @read_size - @pos
-        shortage_length = length - tail_length
-        if shortage_length <= 0
-          outbuf.replace @buffer[@pos, length]
-          @pos += length
-        else
-          data = @source.read(shortage_length)
-          @buffer[@read_size, data.length] = data
-          @read_size += data.length
-          beg, @pos = @pos, @read_size
-          outbuf.replace @buffer[beg, length]
-        end
-      end
-
-      outbuf
-    end
-
-    def rewind
-      @pos = 0
-    end
-
     private
 
     def init_with_path(path)
@@ -78,7 +45,10 @@ module IMF
       end
 
       @path = path
-      @source = nil
+
+      # The whole file is memory-mapped when the platform allows it,
+      # so that the decoders can read it without copying.
+      attach_path(path)
     end
 
     def init_with_io(io)
@@ -89,12 +59,24 @@ module IMF
         # ignored
       end
 
-      @source = io
+      if io.stat.file?
+        # Read the rest of the regular file by pread(2) on its own descriptor
+        attach_fd(io.fileno, io.pos)
+        io.seek(0, IO::SEEK_END)
+      else
+        attach_readable(io)
+      end
+    end
+
+    def init_with_string_io(strio)
+      # Share the underlying string instead of copying it
+      attach_string(strio.string, strio.pos)
+      strio.seek(0, IO::SEEK_END)
     end
 
     def init_with_readable(obj)
       if obj.respond_to?(:read)
-        @source = obj
+        attach_readable(obj)
       else
         raise InvalidSourceError
       end
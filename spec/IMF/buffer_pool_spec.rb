@@ -0,0 +1,51 @@
+require 'spec_helper'
+
+RSpec.describe IMF, '.buffer_pool_stats' do
+  around do |example|
+    limit = IMF.buffer_pool_limit
+    begin
+      example.run
+    ensure
+      IMF.buffer_pool_limit = limit
+    end
+  end
+
+  def open_and_discard_images(n)
+    n.times do
+      IMF::Image.open(fixture_file('vimlogo-141x141.png'))
+      GC.start
+    end
+  end
+
+  subject(:stats) do
+    IMF.buffer_pool_stats
+  end
+
+  it 'returns the statistics of the pixel buffer pool' do
+    expect(stats.keys).to eq([:hits, :misses, :hit_rate, :pooled_buffers, :pooled_bytes, :limit])
+    expect(stats[:limit]).to eq(IMF.buffer_pool_limit)
+  end
+
+  it 'counts the buffers reused for images of the same size' do
+    hits = IMF.buffer_pool_stats[:hits]
+    open_and_discard_images(10)
+    expect(IMF.buffer_pool_stats[:hits]).to be > hits
+  end
+
+  context 'when the limit is 0' do
+    it 'keeps no buffers' do
+      IMF.buffer_pool_limit = 0
+      open_and_discard_images(3)
+      expect(stats[:pooled_buffers]).to eq(0)
+      expect(stats[:pooled_bytes]).to eq(0)
+    end
+  end
+
+  context 'when the limit is negative' do
+    it 'raises ArgumentError' do
+      expect {
+        IMF.buffer_pool_limit = -1
+      }.to raise_error(ArgumentError)
+    end
+  end
+end
@@ -221,12 +221,16 @@ RSpec.describe IMF::Image do
       expect(image.height).to eq(40)
     end
 
-    specify 'the color space is RGB' do
-      expect(image.color_space).to eq(:RGB)
+    specify 'the color space is INDEXED' do
+      expect(image.color_space).to eq(:INDEXED)
     end
 
-    specify 'pixel channels is 4' do
-      expect(image.pixel_channels).to eq(3)
+    specify 'pixel channels is 1' do
+      expect(image.pixel_channels).to eq(1)
+    end
+
+    specify 'the palette has 8 colors' do
+      expect(image.palette.size).to eq(8)
     end
 
     specify 'component size is 1' do
@@ -238,6 +242,7 @@ RSpec.describe IMF::Image do
     end
 
     it 'is correctly loaded' do
+      image = self.image.expand_palette
       expect(image[ 0,   0]).to eq([255, 255, 255])
       expect(image[ 0,  15]).to eq([255, 255, 255])
       expect(image[31,   0]).to eq([255, 255, 255])
@@ -309,4 +314,31 @@ RSpec.describe IMF::Image do
       expect(image[39, 111]).to eq([255, 255, 255])
     end
   end
+
+  describe 'of "colorbar_interlaced.png"' do
+    subject(:image) do
+      IMF::Image.open(image_filename)
+    end
+
+    let(:image_filename) do
+      fixture_file('colorbar_interlaced.png')
+    end
+
+    let(:reference) do
+      IMF::Image.open(fixture_file('colorbar.png'))
+    end
+
+    specify 'the size is 112x40' do
+      expect(image.width).to eq(112)
+      expect(image.height).to eq(40)
+    end
+
+    it 'is correctly loaded' do
+      40.times do |y|
+        112.times do |x|
+          expect(image[y, x]).to eq(reference[y, x])
+        end
+      end
+    end
+  end
 end
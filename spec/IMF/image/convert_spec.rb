@@ -0,0 +1,95 @@
+require 'spec_helper'
+
+RSpec.describe IMF::Image, '#convert' do
+  let(:colorbar) { IMF::Image.open(fixture_file('colorbar.png')) }
+
+  # white, yellow, cyan, green, magenta, red, and blue bars
+  def bar(x)
+    colorbar.crop(x * 16, 20, 1, 1)
+  end
+
+  def max_error(a, b)
+    a.bytes.zip(b.bytes).map { |u, v| (u - v).abs }.max
+  end
+
+  it 'converts RGB into GRAY with the same luma as the gray8 layout' do
+    image = IMF::Image.open(fixture_file('momosan.jpg'))
+    gray = image.convert(:GRAY)
+    expect(gray.color_space).to eq(:GRAY)
+    expect(gray.pixel_channels).to eq(1)
+    expect(gray.pixels).to eq(image.export_pixels(0, 0, image.width, image.height, layout: :gray8))
+  end
+
+  it 'converts RGB into full range YCbCr' do
+    expect(bar(5).convert(:YCbCr).pixels.bytes).to eq([76, 85, 255])
+    expect(bar(0).convert(:YCbCr).pixels.bytes).to eq([255, 128, 128])
+  end
+
+  it 'converts RGB into HSV and HSL with the hue from 0 to 255' do
+    expect(bar(1).convert(:HSV).pixels.bytes).to eq([43, 255, 255])
+    expect(bar(6).convert(:HSV).pixels.bytes).to eq([171, 255, 255])
+    expect(bar(3).convert(:HSL).pixels.bytes).to eq([85, 255, 128])
+  end
+
+  it 'converts RGB into Lab with L* scaled to 255 and a* and b* offset by 128' do
+    expect(bar(5).convert(:Lab).pixels.bytes).to eq([136, 208, 195])
+    expect(bar(6).convert(:Lab).pixels.bytes).to eq([82, 207, 20])
+  end
+
+  it 'keeps the alpha channel' do
+    image = IMF::Image.open(fixture_file('vimlogo-141x141.png'))
+    hsv = image.convert(:HSV)
+    expect(hsv.pixel_channels).to eq(4)
+    expect(hsv.has_alpha?).to eq(true)
+    alpha = image.pixels.bytes.each_slice(4).map(&:last)
+    expect(hsv.pixels.bytes.each_slice(4).map(&:last)).to eq(alpha)
+  end
+
+  it 'expands the palette of an indexed image' do
+    image = IMF::Image.open(fixture_file('colorbar_with_colormap.png'))
+    expect(image.convert(:YCbCr).pixels).to eq(image.expand_palette.convert(:YCbCr).pixels)
+  end
+
+  {YCbCr: 1, HSV: 3, HSL: 3, Lab: 8}.each do |color_space, tolerance|
+    it "converts #{color_space} back into RGB" do
+      back = colorbar.convert(color_space).convert(:RGB)
+      expect(max_error(back.pixels, colorbar.pixels)).to be <= tolerance
+    end
+
+    it "converts #{color_space} into the other color spaces through RGB" do
+      image = colorbar.convert(color_space)
+      expect(image.convert(:GRAY).pixels).to eq(image.convert(:RGB).convert(:GRAY).pixels)
+    end
+  end
+
+  %w[momosan.jpg vimlogo-141x141.png momosan_gray.jpg colorbar_with_alpha.png].each do |filename|
+    it "gives the same pixels with and without SIMD for #{filename}" do
+      image = IMF::Image.open(fixture_file(filename))
+      %i[GRAY RGB YCbCr HSV HSL Lab].each do |color_space|
+        converted = with_simd(true) { image.convert(color_space) }
+        expect(with_simd(false) { image.convert(color_space) }.pixels).to eq(converted.pixels)
+        expect(with_simd(true) { converted.convert(:RGB) }.pixels).to eq(with_simd(false) { converted.convert(:RGB) }.pixels)
+      end
+    end
+  end
+
+  it 'returns a copy for the same color space' do
+    copy = colorbar.convert(:RGB)
+    expect(copy).not_to equal(colorbar)
+    expect(copy.pixels).to eq(colorbar.pixels)
+  end
+
+  it 'refuses to export the pixels of other color spaces in a layout' do
+    expect { colorbar.convert(:HSV).export_pixels(0, 0, 1, 1, layout: :rgb8) }.to raise_error(ArgumentError)
+  end
+
+  it 'raises ArgumentError for an unknown color space' do
+    expect { colorbar.convert(:XYZ) }.to raise_error(ArgumentError)
+    expect { colorbar.convert(:INDEXED) }.to raise_error(ArgumentError)
+  end
+
+  it 'raises NotImplementedError for 16-bit images' do
+    image = IMF::Image.open(fixture_file('gradient16.png'))
+    expect { image.convert(:GRAY) }.to raise_error(NotImplementedError)
+  end
+end
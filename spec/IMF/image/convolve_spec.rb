@@ -0,0 +1,133 @@
+require 'spec_helper'
+
+RSpec.describe IMF::Image, '#convolve' do
+  let(:image) { IMF::Image.open(fixture_file('vimlogo-141x141.png')) }
+
+  it 'returns a new image in the same pixel format' do
+    result = image.convolve([[0, -1, 0], [-1, 5, -1], [0, -1, 0]])
+    expect([result.width, result.height]).to eq([image.width, image.height])
+    expect(result.color_space).to eq(image.color_space)
+    expect(result.pixel_channels).to eq(image.pixel_channels)
+  end
+
+  it 'copies the pixels by the identity kernel' do
+    expect(image.convolve([[0, 0, 0], [0, 1, 0], [0, 0, 0]]).pixels).to eq(image.pixels)
+  end
+
+  it 'puts the center of the kernel on the destination pixel' do
+    shifted = image.convolve([[1, 0, 0]])
+    expect(shifted[30, 40]).to eq(image[30, 39])
+  end
+
+  it 'puts the lower right of the center of an even-size kernel on the destination pixel' do
+    %i[direct fft].each do |method|
+      shifted = image.convolve([[1, 0], [0, 0]], method: method)
+      expect(shifted[30, 40]).to eq(image[29, 39])
+      shifted = image.convolve([[0, 0], [1, 0]], method: method)
+      expect(shifted[30, 40]).to eq(image[30, 39])
+    end
+  end
+
+  it 'repeats the edge pixels by border: :clamp' do
+    shifted = image.convolve([[1, 0, 0]], border: :clamp)
+    expect(shifted[30, 0]).to eq(image[30, 0])
+  end
+
+  it 'mirrors the image at the edge pixels by border: :reflect' do
+    shifted = image.convolve([[1, 0, 0]], border: :reflect)
+    expect(shifted[30, 0]).to eq(image[30, 1])
+  end
+
+  it 'clamps the results to the range of the components' do
+    gray = IMF::Image.open(fixture_file('momosan_gray.jpg'))
+    edges = gray.convolve([[1, 0, -1], [2, 0, -2], [1, 0, -1]])
+    expect(edges.pixels.bytes.minmax).to eq([0, 255])
+  end
+
+  it 'raises ArgumentError for a malformed kernel' do
+    expect { image.convolve([]) }.to raise_error(ArgumentError)
+    expect { image.convolve([[1, 2], [3]]) }.to raise_error(ArgumentError)
+    expect { image.convolve([[1]], border: :wrap) }.to raise_error(ArgumentError)
+  end
+
+  %w[momosan_gray.jpg colorbar_with_alpha.png gradient16.png colorbar_with_colormap.png].each do |filename|
+    context "Given #{filename}" do
+      let(:image) { IMF::Image.open(fixture_file(filename)) }
+      let(:kernels) do
+        [
+          [[0, -1, 0], [-1, 5, -1], [0, -1, 0]],
+          Array.new(5) { |i| Array.new(7) { |j| (i - 2) * (j - 3) * 0.01 } },
+          Array.new(4) { |i| Array.new(4) { |j| ((i * 4 + j) % 5) * 0.05 } },
+        ]
+      end
+
+      it 'gives the same pixels with and without SIMD' do
+        kernels.each do |kernel|
+          simd = with_simd(true) { image.convolve(kernel, border: :reflect) }
+          scalar = with_simd(false) { image.convolve(kernel, border: :reflect) }
+          expect(simd.pixels).to eq(scalar.pixels)
+        end
+        [1.5, 6].each do |sigma|
+          simd = with_simd(true) { image.gaussian_blur(sigma) }
+          scalar = with_simd(false) { image.gaussian_blur(sigma) }
+          expect(simd.pixels).to eq(scalar.pixels)
+        end
+      end
+
+      it 'gives the same pixels on any number of threads' do
+        single = with_max_threads(1) { [image.convolve(kernels[2]), image.gaussian_blur(6)] }
+        multi = with_max_threads(5) { [image.convolve(kernels[2]), image.gaussian_blur(6)] }
+        expect(multi.map(&:pixels)).to eq(single.map(&:pixels))
+      end
+    end
+  end
+end
+
+RSpec.describe IMF::Image, '#gaussian_blur' do
+  let(:image) { IMF::Image.open(fixture_file('momosan.jpg')) }
+
+  def mean_error(a, b)
+    diffs = a.pixels.bytes.zip(b.pixels.bytes).map { |u, v| (u - v).abs }
+    diffs.sum / diffs.size.to_f
+  end
+
+  # The shortest of a few runs, which is the least affected by the others
+  def best_time
+    Array.new(5) {
+      start = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+      yield
+      Process.clock_gettime(Process::CLOCK_MONOTONIC) - start
+    }.min
+  end
+
+  it 'keeps a constant image constant' do
+    gray = IMF::Image.open(fixture_file('momosan_gray.jpg'), region: [0, 0, 8, 8]).resize(1, 1).resize(40, 30)
+    [0.8, 4, 50].each do |sigma|
+      %i[clamp reflect].each do |border|
+        expect(gray.gaussian_blur(sigma, border: border).pixels).to eq(gray.pixels)
+      end
+    end
+  end
+
+  it 'approximates the Gaussian kernel by the box blurs for a large sigma' do
+    radius = 12
+    weights = (-radius..radius).map { |x| Math.exp(-x * x / 32.0) }
+    total = weights.sum
+    kernel = weights.map { |u| weights.map { |v| u * v / total / total } }
+    expect(mean_error(image.gaussian_blur(4), image.convolve(kernel))).to be < 1.0
+  end
+
+  it 'takes about the same time for any sigma over the box blurs' do
+    with_max_threads(1) do
+      %i[clamp reflect].each do |border|
+        expect(best_time { image.gaussian_blur(10000, border: border) })
+          .to be < 3 * best_time { image.gaussian_blur(3, border: border) }
+      end
+    end
+  end
+
+  it 'raises ArgumentError for a sigma out of range' do
+    expect { image.gaussian_blur(0) }.to raise_error(ArgumentError)
+    expect { image.gaussian_blur(-1) }.to raise_error(ArgumentError)
+  end
+end
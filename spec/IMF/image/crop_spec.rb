@@ -0,0 +1,63 @@
+require 'spec_helper'
+require 'objspace'
+
+RSpec.describe IMF::Image, '#crop' do
+  let(:image) { IMF::Image.open(fixture_file('vimlogo-141x141.png')) }
+
+  it 'returns an image of the region' do
+    view = image.crop(13, 7, 50, 60)
+    expect([view.width, view.height]).to eq([50, 60])
+    expect(view.color_space).to eq(image.color_space)
+    expect(view.pixel_channels).to eq(image.pixel_channels)
+    expect(view.pixels).to eq(image.export_pixels(13, 7, 50, 60))
+  end
+
+  it 'shares the pixel buffer with the image' do
+    views = Array.new(100) { |i| image.crop(i % 10 * 14, i / 10 * 14, 14, 14) }
+    expect(views.map { |view| ObjectSpace.memsize_of(view) }.max).to be < 14 * 14 * 4
+    expect(views.last.pixels).to eq(image.export_pixels(126, 126, 14, 14))
+  end
+
+  it 'keeps the pixels alive after the image is collected' do
+    expected = image.export_pixels(100, 100, 41, 41)
+    view = IMF::Image.open(fixture_file('vimlogo-141x141.png')).crop(100, 100, 41, 41)
+    GC.start
+    expect(view.pixels).to eq(expected)
+  end
+
+  it 'crops a view again' do
+    view = image.crop(10, 20, 100, 100).crop(5, 6, 7, 8)
+    expect(view.pixels).to eq(image.export_pixels(15, 26, 7, 8))
+  end
+
+  it 'copies the pixels on dup' do
+    view = image.crop(10, 20, 30, 40)
+    copy = view.dup
+    expect(copy.pixels).to eq(view.pixels)
+    expect(copy.row_stride).to be < view.row_stride
+  end
+
+  it 'keeps the palette of an indexed image' do
+    indexed = IMF::Image.open(fixture_file('colorbar_with_colormap.png'))
+    view = indexed.crop(1, 2, 30, 20)
+    expect(view.color_space).to eq(:INDEXED)
+    expect(view.palette).to eq(indexed.palette)
+    expect(view.export_pixels(0, 0, 30, 20, layout: :rgb8)).to eq(indexed.export_pixels(1, 2, 30, 20, layout: :rgb8))
+  end
+
+  it 'is not affected by the frames drawn on the canvas later' do
+    views = []
+    copies = []
+    IMF::Image.each_frame(fixture_file('animation.gif')) do |canvas, _|
+      views << canvas.crop(0, 0, 32, 24)
+      copies << canvas.dup.crop(0, 0, 32, 24)
+    end
+    expect(views.map(&:pixels)).to eq(copies.map(&:pixels))
+  end
+
+  it 'raises IndexError for a region out of the image' do
+    expect { image.crop(100, 0, 42, 10) }.to raise_error(IndexError)
+    expect { image.crop(-1, 0, 10, 10) }.to raise_error(IndexError)
+    expect { image.crop(0, 0, 0, 10) }.to raise_error(IndexError)
+  end
+end
@@ -126,4 +126,22 @@ RSpec.describe IMF::Image, '.detect_format' do
 
     include_examples 'Normal conditions', IMF::FileFormat::WEBP
   end
+
+  context 'When the file format of the image is unregistered' do
+    let(:image_filename) do
+      fixture_file("vimlogo-141x141.png")
+    end
+
+    before do
+      IMF.unregister_file_format(IMF::FileFormat::PNG)
+    end
+
+    after do
+      IMF.register_file_format(IMF::FileFormat::PNG)
+    end
+
+    it 'returns nil' do
+      expect(IMF::Image.detect_format(image_filename)).to eq(nil)
+    end
+  end
 end
@@ -0,0 +1,93 @@
+require 'spec_helper'
+
+RSpec.describe IMF::Image do
+  subject(:image) do
+    IMF::Image.open(fixture_file('colorbar.png'))
+  end
+
+  describe '#export_pixels' do
+    it 'returns the pixels of the region in the layout of the image' do
+      pixels = image.export_pixels(15, 0, 2, 1)
+      expect(pixels.encoding).to eq(Encoding::ASCII_8BIT)
+      expect(pixels.bytes).to eq([255, 255, 255, 255, 255, 0])
+    end
+
+    it 'converts the pixels into the given layout' do
+      expect(image.export_pixels(16, 0, 1, 1, layout: :rgba8).bytes).to eq([255, 255, 0, 255])
+      expect(image.export_pixels(16, 0, 1, 1, layout: :bgr8).bytes).to eq([0, 255, 255])
+      expect(image.export_pixels(16, 0, 1, 1, layout: :argb8).bytes).to eq([255, 255, 255, 0])
+      expect(image.export_pixels(96, 0, 1, 1, layout: :gray8).bytes).to eq([29])
+    end
+
+    it 'packs the rows without padding' do
+      expect(image.export_pixels(0, 0, 3, 2).bytesize).to eq(3 * 2 * 3)
+    end
+
+    it 'raises IndexError for the region out of the image' do
+      expect {
+        image.export_pixels(100, 0, 13, 1)
+      }.to raise_error(IndexError)
+    end
+
+    it 'raises ArgumentError for an unknown layout' do
+      expect {
+        image.export_pixels(0, 0, 1, 1, layout: :cmyk8)
+      }.to raise_error(ArgumentError)
+    end
+  end
+
+  describe '#pixels' do
+    it 'returns all the pixels' do
+      expect(image.pixels.bytesize).to eq(112 * 40 * 3)
+      expect(image.pixels(layout: :rgba8).bytesize).to eq(112 * 40 * 4)
+      expect(image.to_s).to eq(image.pixels)
+    end
+  end
+
+  describe '#each_row' do
+    it 'yields every row as a frozen String' do
+      rows = image.each_row.to_a
+      expect(rows.size).to eq(40)
+      expect(rows.all?(&:frozen?)).to eq(true)
+      expect(rows[0].bytesize).to eq(112 * 3)
+      expect(rows[39].byteslice(0, 3).bytes).to eq([0, 0, 255])
+    end
+
+    it 'keeps the image alive while the rows are referred' do
+      rows = IMF::Image.open(fixture_file('colorbar.png')).each_row.to_a
+      GC.start
+      expect(rows[0].byteslice(16 * 3, 3).bytes).to eq([255, 255, 0])
+    end
+
+    it 'keeps the pixels of the rows when the image is written later' do
+      rows = []
+      bytes = []
+      last = nil
+      IMF::Image.each_frame(fixture_file('animation.gif')) do |canvas, _|
+        canvas.crop(0, 0, 8, 8)
+        rows << canvas.each_row.to_a
+        bytes << rows.last.map(&:bytes)
+        last = canvas
+      end
+      GC.start
+      last.convolve([[0.5]])
+      expect(rows.map { |frame_rows| frame_rows.map(&:bytes) }).to eq(bytes)
+    end
+
+    it 'yields the rows of the buffer at the start when the image gets another buffer' do
+      # the enumerator stops in the first frame, and resumes after the
+      # canvas is copied for the later frames
+      enum = nil
+      pixels = nil
+      rows = []
+      IMF::Image.each_frame(fixture_file('animation.gif')) do |canvas, _|
+        next if enum
+        pixels = canvas.pixels
+        enum = canvas.each_row
+        rows << enum.next
+      end
+      loop { rows << enum.next }
+      expect(rows.join).to eq(pixels)
+    end
+  end
+end
@@ -0,0 +1,108 @@
+require 'spec_helper'
+
+RSpec.describe IMF::Image, '#fft' do
+  def dft(image, v, u)
+    sums = Array.new(image.pixel_channels) { Complex(0, 0) }
+    image.height.times do |y|
+      image.width.times do |x|
+        phase = -2 * Math::PI * (v * y / image.height.to_f + u * x / image.width.to_f)
+        twiddle = Complex(Math.cos(phase), Math.sin(phase))
+        image[y, x].each_with_index { |c, i| sums[i] += c * twiddle }
+      end
+    end
+    sums
+  end
+
+  # 12 = 4 * 3, 25 = 5 * 5, 7 is a generic radix, and 37 needs Bluestein's
+  # algorithm
+  [[12, 25], [7, 37], [37, 8]].each do |width, height|
+    context "Given a #{width}x#{height} image" do
+      let(:image) { IMF::Image.open(fixture_file('momosan.jpg')).resize(width, height) }
+
+      it 'returns the discrete Fourier transform of every channel' do
+        spectrum = image.fft
+        expect([spectrum.width, spectrum.height, spectrum.pixel_channels]).to eq([width, height, 3])
+        [[0, 0], [1, 2], [height - 1, width - 1], [height / 2, width / 2]].each do |v, u|
+          dft(image, v, u).zip(spectrum[v, u]).each do |expected, actual|
+            expect((expected - actual).abs).to be < 1e-6
+          end
+        end
+      end
+
+      it 'returns the same pixels by IMF::Spectrum#ifft' do
+        expect(image.fft.ifft.pixels).to eq(image.pixels)
+      end
+    end
+  end
+
+  %w[momosan.jpg colorbar_with_alpha.png gradient16.png colorbar_with_colormap.png].each do |filename|
+    context "Given #{filename}" do
+      let(:image) { IMF::Image.open(fixture_file(filename)) }
+
+      it 'returns the same pixels by IMF::Spectrum#ifft' do
+        restored = image.fft.ifft
+        expected = image.color_space == :INDEXED ? image.expand_palette : image
+        expect(restored.color_space).to eq(expected.color_space)
+        expect(restored.component_size).to eq(expected.component_size)
+        expect(restored.pixels).to eq(expected.pixels)
+      end
+    end
+  end
+
+  it 'returns the conjugates of the symmetric elements for the negative frequencies' do
+    spectrum = IMF::Image.open(fixture_file('vimlogo-141x141.png')).fft
+    expect(spectrum[5, 100]).to eq(spectrum[-5, 41].map(&:conj))
+    expect(spectrum[0, -1]).to eq(spectrum[0, 1].map(&:conj))
+    expect(spectrum[141, 0]).to be_nil
+  end
+
+  it 'reuses the plans of the same size' do
+    image = IMF::Image.open(fixture_file('vimlogo-141x141.png'))
+    image.fft
+    sizes = IMF.fft_plan_sizes
+    expect(sizes).to include(141)
+    image.fft.ifft
+    expect(IMF.fft_plan_sizes).to eq(sizes)
+  end
+end
+
+RSpec.describe IMF::Image, '#convolve by FFT' do
+  def max_difference(a, b)
+    format = a.component_size == 1 ? 'C*' : 'S*'
+    a.pixels.unpack(format).zip(b.pixels.unpack(format)).map { |u, v| (u - v).abs }.max
+  end
+
+  %w[momosan_gray.jpg colorbar_with_alpha.png gradient16.png colorbar_with_colormap.png].each do |filename|
+    context "Given #{filename}" do
+      let(:image) { IMF::Image.open(fixture_file(filename)) }
+
+      it 'gives the pixels of the direct convolution within 1' do
+        kernels = [
+          [[1, 0, 0]],
+          Array.new(4) { |i| Array.new(4) { |j| ((i * 4 + j) % 5) * 0.05 } },
+          [[0, -1, 0], [-1, 5, -1], [0, -1, 0]],
+        ]
+        kernels.each do |kernel|
+          %i[clamp reflect].each do |border|
+            direct = image.convolve(kernel, border: border, method: :direct)
+            fft = image.convolve(kernel, border: border, method: :fft)
+            expect(max_difference(direct, fft)).to be <= 1
+          end
+        end
+      end
+    end
+  end
+
+  it 'is chosen for a large kernel by method: :auto' do
+    image = IMF::Image.open(fixture_file('vimlogo-141x141.png'))
+    random = Random.new(1)
+    kernel = Array.new(31) { Array.new(31) { random.rand / 480.0 } }
+    expect(image.convolve(kernel).pixels).to eq(image.convolve(kernel, method: :fft).pixels)
+  end
+
+  it 'raises ArgumentError for an unknown method' do
+    image = IMF::Image.open(fixture_file('vimlogo-141x141.png'))
+    expect { image.convolve([[1]], method: :winograd) }.to raise_error(ArgumentError)
+    expect { image.gaussian_blur(2, method: :fft) }.to raise_error(ArgumentError)
+  end
+end
@@ -0,0 +1,103 @@
+require 'spec_helper'
+
+RSpec.describe IMF::Image, 'GIF decoding' do
+  def rgba_at(image, x, y)
+    image.export_pixels(x, y, 1, 1, layout: :rgba8).bytes
+  end
+
+  # The palette and the first frame of animation.gif
+  def palette_color(i)
+    [i, 255 - i, (i * 7) & 255]
+  end
+
+  def first_frame_index(x, y)
+    (x * 7 + y * 13 + (x * y) % 11) % 256
+  end
+
+  context 'Given vimlogo-141x141.gif' do
+    subject(:image) do
+      IMF::Image.open(fixture_file('vimlogo-141x141.gif'))
+    end
+
+    it 'loads the image as RGB' do
+      expect([image.width, image.height]).to eq([141, 141])
+      expect(image.color_space).to eq(:RGB)
+      expect(image.pixel_channels).to eq(3)
+      expect(image.has_alpha?).to eq(false)
+    end
+
+    it 'has pixels close to the PNG version' do
+      png = IMF::Image.open(fixture_file('vimlogo-141x141.png'))
+      a = image.export_pixels(0, 0, 141, 141, layout: :rgb8).bytes
+      b = png.export_pixels(0, 0, 141, 141, layout: :rgb8).bytes
+      mean_error = a.zip(b).sum { |u, v| (u - v).abs } / a.size.to_f
+      expect(mean_error).to be < 2.0
+    end
+  end
+
+  context 'Given animation.gif' do
+    let(:path) { fixture_file('animation.gif') }
+
+    it 'loads the first frame' do
+      image = IMF::Image.open(path)
+      expect([image.width, image.height]).to eq([64, 48])
+      expect(image.pixel_channels).to eq(4)
+      expect(image.has_alpha?).to eq(true)
+
+      mismatches = 0
+      48.times do |y|
+        64.times do |x|
+          i = first_frame_index(x, y)
+          expected = i == 255 ? [0, 255, 0, 0] : [*palette_color(i), 255]
+          mismatches += 1 if rgba_at(image, x, y) != expected
+        end
+      end
+      expect(mismatches).to eq(0)
+    end
+
+    it 'yields every frame with its delay' do
+      delays = []
+      IMF::Image.each_frame(path) { |_, delay| delays << delay }
+      expect(delays).to eq([0.1, 0.2, 0.3, 0.0])
+    end
+
+    it 'returns an enumerator without a block' do
+      enum = IMF::Image.each_frame(path)
+      expect(enum).to be_a(Enumerator)
+      expect(enum.count).to eq(4)
+    end
+
+    it 'reuses the canvas image across frames' do
+      images = []
+      IMF::Image.each_frame(path) { |image, _| images << image }
+      expect(images.uniq(&:object_id).size).to eq(1)
+    end
+
+    it 'composes frames with transparency, disposal, and a local palette' do
+      frames = []
+      IMF::Image.each_frame(path) { |image, _| frames << image.dup }
+
+      # frame 2: an interlaced checkerboard with a local palette, where odd
+      # cells are transparent and keep the first frame
+      expect(rgba_at(frames[1], 8, 4)).to eq([255, 255, 255, 255])
+      expect(rgba_at(frames[1], 9, 4)).to eq([*palette_color(first_frame_index(9, 4)), 255])
+      expect(rgba_at(frames[1], 23, 15)).to eq([255, 255, 255, 255])
+      expect(rgba_at(frames[1], 7, 4)).to eq([*palette_color(first_frame_index(7, 4)), 255])
+
+      # frame 3: frame 2 is disposed to the transparent background
+      expect(rgba_at(frames[2], 8, 4)).to eq([0, 255, 0, 0])
+      expect(rgba_at(frames[2], 3, 3)).to eq([*palette_color(5), 255])
+
+      # frame 4: frame 3 is disposed to the previous canvas
+      expect(rgba_at(frames[3], 0, 0)).to eq([*palette_color(first_frame_index(0, 0)), 255])
+      expect(rgba_at(frames[3], 63, 47)).to eq([*palette_color(9), 255])
+      expect(rgba_at(frames[3], 8, 4)).to eq([0, 255, 0, 0])
+    end
+  end
+
+  it 'copies pixels on dup' do
+    image = IMF::Image.open(fixture_file('vimlogo-141x141.gif'))
+    copy = image.dup
+    expect(copy.pixels).to eq(image.pixels)
+  end
+end
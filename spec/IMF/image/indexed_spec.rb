@@ -0,0 +1,64 @@
+require 'spec_helper'
+require 'stringio'
+
+RSpec.describe IMF::Image, 'indexed color' do
+  subject(:image) do
+    IMF::Image.open(fixture_file('palette_with_transparency.png'))
+  end
+
+  it 'keeps 2-bit indices unpacked into bytes' do
+    expect(image.color_space).to eq(:INDEXED)
+    expect(image.component_size).to eq(1)
+    expect(image.pixel_channels).to eq(1)
+    expect(image[0, 0]).to eq([0])
+    expect(image[6, 12]).to eq([(12 + 6) % 4])
+    expect(image.export_pixels(0, 1, 13, 1).bytes).to eq((0...13).map {|x| (x + 1) % 4 })
+  end
+
+  it 'has the palette with the alpha of tRNS chunk' do
+    expect(image.has_alpha?).to eq(true)
+    expect(image.palette).to eq([
+      [255, 0, 0, 0], [0, 255, 0, 128], [0, 0, 255, 255], [255, 255, 255, 255]
+    ])
+  end
+
+  it 'exports the colors of the palette' do
+    expect(image.export_pixels(0, 0, 4, 1, layout: :rgba8).bytes).to eq([
+      255, 0, 0, 0, 0, 255, 0, 128, 0, 0, 255, 255, 255, 255, 255, 255
+    ])
+    expect(image.export_pixels(1, 0, 1, 1, layout: :bgr8).bytes).to eq([0, 255, 0])
+  end
+
+  it 'is expanded into an RGBA image' do
+    rgba = image.expand_palette
+    expect(rgba.color_space).to eq(:RGB)
+    expect(rgba.pixel_channels).to eq(4)
+    expect(rgba.palette).to be_nil
+    expect(rgba.pixels).to eq(image.export_pixels(0, 0, 13, 7, layout: :rgba8))
+  end
+
+  it 'is saved as an indexed PNG' do
+    reloaded = IMF::Image.open(StringIO.new(image.encode(format: :png)))
+    expect(reloaded.color_space).to eq(:INDEXED)
+    expect(reloaded.palette).to eq(image.palette)
+    expect(reloaded.pixels).to eq(image.pixels)
+  end
+
+  it 'is expanded to be saved as a JPEG' do
+    reloaded = IMF::Image.open(StringIO.new(image.encode(format: :jpeg)))
+    expect(reloaded.color_space).to eq(:RGB)
+    expect([reloaded.width, reloaded.height]).to eq([13, 7])
+  end
+
+  it 'keeps the palette in the copy' do
+    copy = image.dup
+    expect(copy.palette).to eq(image.palette)
+    expect(copy.pixels).to eq(image.pixels)
+  end
+
+  it 'keeps the palette in a region' do
+    region = IMF::Image.open(fixture_file('palette_with_transparency.png'), region: [3, 2, 5, 4])
+    expect(region.palette).to eq(image.palette)
+    expect(region.pixels).to eq(image.export_pixels(3, 2, 5, 4))
+  end
+end
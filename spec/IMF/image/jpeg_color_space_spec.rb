@@ -0,0 +1,75 @@
+require 'spec_helper'
+
+RSpec.describe IMF::Image, 'JPEG color spaces' do
+  def max_error(a, b)
+    a.bytes.zip(b.bytes).map { |u, v| (u - v).abs }.max
+  end
+
+  context 'Given momosan.jpg' do
+    let(:path) { fixture_file('momosan.jpg') }
+
+    it 'converts YCbCr into RGB by default' do
+      image = IMF::Image.open(path)
+      expect(image.color_space).to eq(:RGB)
+    end
+
+    it 'keeps YCbCr with keep_color_space: true' do
+      image = IMF::Image.open(path, keep_color_space: true)
+      expect(image.color_space).to eq(:YCbCr)
+      expect(image.pixel_channels).to eq(3)
+
+      rgb = IMF::Image.open(path)
+      expect(max_error(image.convert(:RGB).pixels, rgb.pixels)).to be <= 2
+    end
+
+    it 'keeps YCbCr with the scale and the region' do
+      image = IMF::Image.open(path, keep_color_space: true, scale: 1/2r, region: [10, 20, 30, 40])
+      full = IMF::Image.open(path, keep_color_space: true, scale: 1/2r)
+      expect(image.color_space).to eq(:YCbCr)
+      expect(image.pixels).to eq(full.export_pixels(10, 20, 30, 40))
+    end
+
+    it 'encodes a YCbCr image without converting it' do
+      image = IMF::Image.open(path, keep_color_space: true)
+      reloaded = IMF::Image.open(StringIO.new(image.encode(format: :jpeg, quality: 95)), keep_color_space: true)
+      expect(reloaded.color_space).to eq(:YCbCr)
+      diffs = image.pixels.bytes.zip(reloaded.pixels.bytes).map { |u, v| (u - v).abs }
+      expect(diffs.sum / diffs.size.to_f).to be < 2.0
+    end
+  end
+
+  context 'Given momosan_cmyk.jpg' do
+    let(:path) { fixture_file('momosan_cmyk.jpg') }
+
+    it 'loads the image as CMYK' do
+      image = IMF::Image.open(path)
+      expect(image.color_space).to eq(:CMYK)
+      expect(image.pixel_channels).to eq(4)
+      expect(image.has_alpha?).to eq(false)
+      expect(IMF::Image.probe(path).color_space).to eq(:CMYK)
+    end
+
+    it 'encodes a CMYK image as CMYK' do
+      image = IMF::Image.open(path)
+      reloaded = IMF::Image.open(StringIO.new(image.encode(format: :jpeg, quality: 95)))
+      expect(reloaded.color_space).to eq(:CMYK)
+      diffs = image.pixels.bytes.zip(reloaded.pixels.bytes).map { |u, v| (u - v).abs }
+      expect(diffs.sum / diffs.size.to_f).to be < 2.0
+    end
+
+    it 'cannot be saved as PNG' do
+      image = IMF::Image.open(path)
+      expect { image.encode(format: :png) }.to raise_error(ArgumentError)
+    end
+  end
+
+  it 'keeps GRAY as it is' do
+    image = IMF::Image.open(fixture_file('momosan_gray.jpg'), keep_color_space: true)
+    expect(image.color_space).to eq(:GRAY)
+  end
+
+  it 'ignores keep_color_space: for the formats without color conversion' do
+    image = IMF::Image.open(fixture_file('colorbar.png'), keep_color_space: true)
+    expect(image.color_space).to eq(:RGB)
+  end
+end
@@ -0,0 +1,73 @@
+require 'spec_helper'
+require 'objspace'
+
+RSpec.describe IMF::Image, 'planar JPEG' do
+  def plane_pixels(plane)
+    plane.export_pixels(0, 0, plane.width, plane.height)
+  end
+
+  context 'Given a 4:2:0 JPEG image' do
+    let(:data) do
+      IMF::Image.open(fixture_file('momosan.jpg')).encode(format: :jpeg, subsampling: '4:2:0')
+    end
+
+    subject(:image) { IMF::Image.open(StringIO.new(data), planar: true) }
+
+    it 'loads the components into planes' do
+      expect(image).to be_planar
+      expect(image.color_space).to eq(:YCbCr)
+      expect(image.pixel_channels).to eq(3)
+      expect([image.width, image.height]).to eq([809, 961])
+      expect(image.planes.map { |plane| [plane.width, plane.height] }).to eq([[809, 961], [405, 481], [405, 481]])
+      expect(image.planes.map(&:color_space).uniq).to eq([:GRAY])
+    end
+
+    it 'loads the same luma as keep_color_space: true' do
+      interleaved = IMF::Image.open(StringIO.new(data), keep_color_space: true)
+      luma = interleaved.export_pixels(0, 0, 809, 961).bytes.each_slice(3).map(&:first).pack('C*')
+      expect(plane_pixels(image.planes[0])).to eq(luma)
+    end
+
+    it 'stores fewer bytes than the interleaved image' do
+      interleaved = IMF::Image.open(StringIO.new(data))
+      expect(ObjectSpace.memsize_of(image)).to be < ObjectSpace.memsize_of(interleaved) * 2 / 3
+    end
+
+    it 'keeps the planes when the image is copied' do
+      copy = image.dup
+      expect(copy).to be_planar
+      expect(copy.planes.map { |plane| plane_pixels(plane) }).to eq(image.planes.map { |plane| plane_pixels(plane) })
+    end
+
+    it 'refuses the operations on interleaved pixels' do
+      expect { image.export_pixels(0, 0, 1, 1) }.to raise_error(ArgumentError, /planes/)
+      expect { image[0, 0] }.to raise_error(ArgumentError)
+      expect { image.resize(10, 10) }.to raise_error(ArgumentError)
+      expect { image.convert(:RGB) }.to raise_error(ArgumentError)
+      expect { image.encode(format: :png) }.to raise_error(ArgumentError)
+    end
+
+    it 'cannot be combined with the scale' do
+      expect {
+        IMF::Image.open(StringIO.new(data), planar: true, scale: 1/2r)
+      }.to raise_error(ArgumentError)
+    end
+  end
+
+  context 'Given momosan_gray.jpg' do
+    it 'loads a single plane' do
+      image = IMF::Image.open(fixture_file('momosan_gray.jpg'), planar: true)
+      gray = IMF::Image.open(fixture_file('momosan_gray.jpg'))
+      expect(image.planes.length).to eq(1)
+      expect(plane_pixels(image.planes[0])).to eq(gray.pixels)
+    end
+  end
+
+  context 'Given a PNG image' do
+    it 'ignores planar: true' do
+      image = IMF::Image.open(fixture_file('colorbar.png'), planar: true)
+      expect(image).not_to be_planar
+      expect(image.planes).to eq([image])
+    end
+  end
+end
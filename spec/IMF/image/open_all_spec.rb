@@ -0,0 +1,89 @@
+require 'spec_helper'
+
+RSpec.describe IMF::Image, '.open_all' do
+  def image_pixels(image)
+    images = image.planar? ? image.planes : [image]
+    images.map {|plane| plane.export_pixels(0, 0, plane.width, plane.height) }
+  end
+
+  let(:filenames) do
+    %w[momosan.jpg colorbar.png momosan.webp vimlogo-141x141.gif momosan_gray.jpg].map {|f| fixture_file(f) }
+  end
+
+  it 'returns the images in the order of the sources' do
+    images = IMF::Image.open_all(filenames, threads: 3)
+    expect(images.map {|image| [image.width, image.height] }).to eq(
+      [[809, 961], [112, 40], [809, 961], [141, 141], [809, 961]])
+    expect(images[1].pixels).to eq(IMF::Image.open(filenames[1]).pixels)
+  end
+
+  it 'returns the error of each source in place of the image' do
+    images = IMF::Image.open_all([filenames[0], fixture_file('nonexistent.png'), filenames[1]], threads: 2)
+    expect(images[0]).to be_a(IMF::Image)
+    expect(images[1]).to be_a(Errno::ENOENT)
+    expect(images[2]).to be_a(IMF::Image)
+  end
+
+  it 'returns the same images as Image.open' do
+    # the planes of YCCK JPEG raise NotImplementedError, which is not returned
+    cmyk = fixture_file('momosan_cmyk.jpg')
+    [{}, {scale: 1/4r}, {region: [10, 20, 30, 40]}, {scale: 1/2r, region: [3, 5, 17, 11]},
+     {keep_color_space: true}, {planar: true}].each do |options|
+      sources = Dir[fixture_file('*')].sort
+      sources.delete(cmyk) if options[:planar]
+      IMF::Image.open_all(sources, threads: 3, **options).zip(sources) do |image, source|
+        expected = begin
+                     IMF::Image.open(source, **options)
+                   rescue => error
+                     error
+                   end
+        if expected.is_a?(Exception)
+          expect(image).to be_a(expected.class)
+        else
+          expect([image.width, image.height, image.color_space, image_pixels(image)]).to eq(
+            [expected.width, expected.height, expected.color_space, image_pixels(expected)])
+        end
+      end
+    end
+  end
+
+  it 'raises the errors other than StandardError' do
+    expect {
+      IMF::Image.open_all([filenames[0], fixture_file('momosan_cmyk.jpg')], planar: true)
+    }.to raise_error(NotImplementedError)
+  end
+
+  it 'accepts IO, StringIO, and Pathname as the sources' do
+    File.open(filenames[1], 'rb') do |io|
+      images = IMF::Image.open_all([io, StringIO.new(File.binread(filenames[3])), Pathname(filenames[0])])
+      expect(images.map(&:width)).to eq([112, 141, 809])
+    end
+  end
+
+  it 'returns RuntimeError for the truncated data', :with_tmpdir do
+    path = File.join(tmpdir, 'truncated.png')
+    File.binwrite(path, File.binread(filenames[1], 100))
+    images = IMF::Image.open_all([path, StringIO.new(File.binread(filenames[0], 1000))], threads: 2)
+    expect(images.map(&:class)).to eq([RuntimeError, RuntimeError])
+  end
+
+  it 'returns Errno::EISDIR for a directory' do
+    expect(IMF::Image.open_all([File.dirname(filenames[0])])[0]).to be_a(Errno::EISDIR)
+  end
+
+  it 'passes the options to Image.open' do
+    images = IMF::Image.open_all(filenames.first(2), scale: 1/8r, row_alignment: 1)
+    expect(images.map(&:width)).to eq([102, 112])
+    expect(images.map(&:row_alignment)).to eq([1, 1])
+  end
+
+  it 'returns an empty Array for no sources' do
+    expect(IMF::Image.open_all([])).to eq([])
+  end
+
+  it 'raises ArgumentError for non-positive threads' do
+    expect {
+      IMF::Image.open_all(filenames, threads: 0)
+    }.to raise_error(ArgumentError)
+  end
+end
@@ -133,9 +133,120 @@ RSpec.describe IMF::Image, '.open' do
         expect(subject.row_stride).to eq(2432)
       end
     end
+
+    context 'with scale: 1/8r' do
+      subject(:image) do
+        IMF::Image.open(image_filename, scale: 1/8r)
+      end
+
+      it 'returns the image reduced by libjpeg' do
+        expect(subject.width).to eq(102)
+        expect(subject.height).to eq(121)
+      end
+    end
+
+    context 'with max_size: [200, 200]' do
+      subject(:image) do
+        IMF::Image.open(image_filename, max_size: [200, 200])
+      end
+
+      it 'returns the image reduced to the nearest size not smaller than the box' do
+        expect(subject.width).to eq(203)
+        expect(subject.height).to eq(241)
+      end
+    end
+
+    context 'with row_alignment: 64' do
+      subject(:image) do
+        IMF::Image.open(image_filename, row_alignment: 64)
+      end
+
+      it 'returns the image whose rows are aligned to 64 bytes' do
+        expect(subject.row_alignment).to eq(64)
+        expect(subject.row_stride).to eq(2432)
+      end
+    end
+
+    context 'with row_alignment: 1' do
+      subject(:image) do
+        IMF::Image.open(image_filename, row_alignment: 1)
+      end
+
+      it 'returns the image whose rows are packed' do
+        expect(subject.row_alignment).to eq(1)
+        expect(subject.row_stride).to eq(809 * 3)
+      end
+    end
+
+    context 'with row_alignment: 24' do
+      it 'raises ArgumentError' do
+        expect {
+          IMF::Image.open(image_filename, row_alignment: 24)
+        }.to raise_error(ArgumentError)
+      end
+    end
+
+    context 'with region: [13, 7, 100, 50]' do
+      subject(:image) do
+        IMF::Image.open(image_filename, region: [13, 7, 100, 50])
+      end
+
+      it 'returns the region of the image' do
+        expect(subject.width).to eq(100)
+        expect(subject.height).to eq(50)
+        full_image = IMF::Image.open(image_filename)
+        expect(subject.pixels).to eq(full_image.export_pixels(13, 7, 100, 50))
+      end
+    end
+
+    context 'with region: and scale: 1/2r' do
+      subject(:image) do
+        IMF::Image.open(image_filename, region: [300, 400, 100, 80], scale: 1/2r)
+      end
+
+      it 'returns the region of the reduced image' do
+        expect(subject.width).to eq(100)
+        expect(subject.height).to eq(80)
+        reduced_image = IMF::Image.open(image_filename, scale: 1/2r)
+        expect(subject.pixels).to eq(reduced_image.export_pixels(300, 400, 100, 80))
+      end
+    end
+
+    context 'with region: out of the image' do
+      it 'raises ArgumentError' do
+        expect {
+          IMF::Image.open(image_filename, region: [800, 0, 10, 10])
+        }.to raise_error(ArgumentError)
+      end
+    end
+
+    context 'with an unknown option' do
+      it 'raises ArgumentError' do
+        expect {
+          IMF::Image.open(image_filename, unknown: 1)
+        }.to raise_error(ArgumentError)
+      end
+    end
   end
 
   context 'Given a PNG image' do
+    context 'with region: [100, 30, 12, 10]' do
+      let(:image_filename) do
+        fixture_file("colorbar.png")
+      end
+
+      subject(:image) do
+        IMF::Image.open(image_filename, region: [100, 30, 12, 10])
+      end
+
+      it 'returns the region of the image' do
+        expect(subject.width).to eq(12)
+        expect(subject.height).to eq(10)
+        full_image = IMF::Image.open(image_filename)
+        expect(subject.pixels).to eq(full_image.export_pixels(100, 30, 12, 10))
+      end
+    end
+
     let(:image_filename) do
       fixture_file("momosan.png")
     end
@@ -166,11 +277,95 @@ RSpec.describe IMF::Image, '.open' do
     end
   end
 
-  xcontext 'Given a WEBP image' do
+  context 'Given a WEBP image' do
     let(:image_filename) do
       fixture_file("momosan.webp")
     end
 
+    it 'returns an image object' do
+      is_expected.to be_a(IMF::Image)
+      expect(subject.color_space).to eq(:RGB)
+      expect(subject.has_alpha?).to eq(false)
+      expect(subject.component_size).to eq(1)
+      expect(subject.pixel_channels).to eq(3)
+      expect(subject.width).to eq(809)
+      expect(subject.height).to eq(961)
+      expect(subject.row_stride).to eq(2432)
+    end
+
+    it 'has pixels close to the JPEG version' do
+      jpeg = IMF::Image.open(fixture_file("momosan.jpg"))
+      a = subject.pixels.bytes
+      b = jpeg.pixels.bytes
+      mean_error = a.zip(b).sum { |u, v| (u - v).abs } / a.size.to_f
+      expect(mean_error).to be < 2.0
+    end
+
+    context 'Given the image source is an IO' do
+      subject(:image) do
+        File.open(image_filename, 'rb') {|io| IMF::Image.open(io) }
+      end
+
+      it 'returns the same image as the one from the path' do
+        expect(subject.pixels).to eq(IMF::Image.open(image_filename).pixels)
+      end
+    end
+
+    context 'with scale: 1/8r' do
+      subject(:image) do
+        IMF::Image.open(image_filename, scale: 1/8r)
+      end
+
+      it 'returns the image reduced by libwebp' do
+        expect(subject.width).to eq(102)
+        expect(subject.height).to eq(121)
+      end
+    end
+
+    context 'with max_size: [200, 200]' do
+      subject(:image) do
+        IMF::Image.open(image_filename, max_size: [200, 200])
+      end
+
+      it 'returns the image fit into the box' do
+        expect(subject.width).to eq(169)
+        expect(subject.height).to eq(200)
+      end
+    end
+
+    context 'with region: [13, 7, 100, 50]' do
+      subject(:image) do
+        IMF::Image.open(image_filename, region: [13, 7, 100, 50])
+      end
+
+      it 'returns the region of the image' do
+        expect(subject.width).to eq(100)
+        expect(subject.height).to eq(50)
+        full_image = IMF::Image.open(image_filename)
+        expect(subject.pixels).to eq(full_image.export_pixels(13, 7, 100, 50))
+      end
+    end
+
+    context 'with region: and scale: 1/2r' do
+      subject(:image) do
+        IMF::Image.open(image_filename, region: [300, 400, 100, 80], scale: 1/2r)
+      end
+
+      it 'returns the region of the reduced image' do
+        reduced_image = IMF::Image.open(image_filename, scale: 1/2r)
+        expect(subject.pixels).to eq(reduced_image.export_pixels(300, 400, 100, 80))
+      end
+    end
+
+    context 'Given truncated data' do
+      it 'raises RuntimeError' do
+        data = IO.read(image_filename, mode: 'rb')[0, 5000]
+        expect {
+          IMF::Image.open(StringIO.new(data))
+        }.to raise_error(RuntimeError, /WEBP ERROR/)
+      end
+    end
+
     context 'the given filename ends with ".jpg"', :run_in_tmpdir do
       let(:original_image_filename) do
         fixture_file("momosan.webp")
@@ -186,6 +381,8 @@ RSpec.describe IMF::Image, '.open' do
 
       it 'returns a correct image object' do
         is_expected.to be_a(IMF::Image)
+        expect(subject.width).to eq(809)
+        expect(subject.height).to eq(961)
       end
     end
   end
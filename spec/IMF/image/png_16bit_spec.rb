@@ -0,0 +1,60 @@
+require 'spec_helper'
+require 'stringio'
+
+RSpec.describe IMF::Image, '16-bit PNG' do
+  # libpng's png_set_scale_16
+  def scale_16(v)
+    (v * 255 + 32895) >> 16
+  end
+
+  describe 'of "gradient16.png"' do
+    subject(:image) do
+      IMF::Image.open(fixture_file('gradient16.png'))
+    end
+
+    def expected_pixel(x, y)
+      [x * 1024 + y, 65535 - x * 1000 - y * 7, (x * y * 37) & 0xFFFF]
+    end
+
+    it 'keeps 16-bit components' do
+      expect(image.component_size).to eq(2)
+      expect(image.pixel_channels).to eq(3)
+      expect(image.row_stride).to eq(384)
+    end
+
+    it 'has the components of the file in the native byte order' do
+      pixels = image.export_pixels(0, 0, 64, 32).unpack('S*')
+      expected = (0...32).flat_map {|y| (0...64).flat_map {|x| expected_pixel(x, y) } }
+      expect(pixels).to eq(expected)
+      expect(image[3, 5]).to eq(expected_pixel(5, 3))
+    end
+
+    it 'exports 8-bit pixels with rounding' do
+      expected = expected_pixel(63, 31).map {|v| scale_16(v) }
+      expect(image.export_pixels(63, 31, 1, 1, layout: :rgb8).bytes).to eq(expected)
+    end
+
+    it 'is saved as a 16-bit PNG' do
+      data = image.encode(format: :png)
+      expect(IMF::Image.probe(StringIO.new(data)).bit_depth).to eq(16)
+      expect(IMF::Image.open(StringIO.new(data)).pixels).to eq(image.pixels)
+    end
+  end
+
+  describe 'of "gray_alpha16_interlaced.png"' do
+    subject(:image) do
+      IMF::Image.open(fixture_file('gray_alpha16_interlaced.png'))
+    end
+
+    it 'decodes every pass into 16-bit components' do
+      expect(image.color_space).to eq(:GRAY)
+      expect(image.has_alpha?).to eq(true)
+      expect(image.component_size).to eq(2)
+      pixels = image.export_pixels(0, 0, 37, 23).unpack('S*')
+      expected = (0...23).flat_map {|y|
+        (0...37).flat_map {|x| [(x * 1771 + y * 2833) & 0xFFFF, 65535 - x * y * 13] }
+      }
+      expect(pixels).to eq(expected)
+    end
+  end
+end
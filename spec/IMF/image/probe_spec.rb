@@ -0,0 +1,50 @@
+require 'spec_helper'
+require 'stringio'
+
+RSpec.describe IMF::Image, '.probe' do
+  {
+    'colorbar.png'            => [:png, 112, 40, :RGB, 8, 3, false],
+    'colorbar_with_alpha.png' => [:png, 112, 40, :RGB, 8, 4, true],
+    'gradient16.png'          => [:png, 64, 32, :RGB, 16, 3, false],
+    'palette_with_transparency.png' => [:png, 13, 7, :INDEXED, 8, 1, true],
+    'momosan.jpg'             => [:jpeg, 809, 961, :RGB, 8, 3, false],
+    'momosan_gray.jpg'        => [:jpeg, 809, 961, :GRAY, 8, 1, false],
+    'momosan.webp'            => [:webp, 809, 961, :RGB, 8, 3, false],
+    'vimlogo-141x141.gif'     => [:gif, 141, 141, :RGB, 8, 3, false],
+  }.each do |filename, expected|
+    context "Given #{filename}" do
+      subject(:info) do
+        IMF::Image.probe(fixture_file(filename))
+      end
+
+      it 'returns the header information' do
+        expect(info).to be_a(IMF::Image::Info)
+        expect(info.to_a).to eq(expected)
+      end
+    end
+  end
+
+  it 'reads the header from an IO' do
+    io = StringIO.new(IO.read(fixture_file('momosan.jpg'), mode: 'rb'))
+    info = IMF::Image.probe(io)
+    expect([info.width, info.height]).to eq([809, 961])
+    expect(info.has_alpha?).to eq(false)
+  end
+
+  it 'agrees with the loaded image' do
+    image = IMF::Image.open(fixture_file('vimlogo-141x141.png'))
+    info = IMF::Image.probe(fixture_file('vimlogo-141x141.png'))
+    expect([info.width, info.height, info.color_space, info.pixel_channels, info.has_alpha?]).to eq(
+      [image.width, image.height, image.color_space, image.pixel_channels, image.has_alpha?])
+  end
+
+  it 'does not allocate pixel buffers' do
+    stats = IMF.buffer_pool_stats
+    IMF::Image.probe(fixture_file('momosan.jpg'))
+    expect(IMF.buffer_pool_stats.values_at(:hits, :misses)).to eq(stats.values_at(:hits, :misses))
+  end
+
+  it 'raises an error for a truncated header' do
+    expect { IMF::Image.probe(StringIO.new('GIF89a')) }.to raise_error(RuntimeError)
+  end
+end
@@ -0,0 +1,108 @@
+require 'spec_helper'
+
+RSpec.describe IMF::Image, '#resize' do
+  let(:image) { IMF::Image.open(fixture_file('vimlogo-141x141.png')) }
+
+  it 'returns a new image of the given size in the same pixel format' do
+    resized = image.resize(70, 200)
+    expect([resized.width, resized.height]).to eq([70, 200])
+    expect(resized.color_space).to eq(image.color_space)
+    expect(resized.pixel_channels).to eq(image.pixel_channels)
+    expect(resized.component_size).to eq(image.component_size)
+    expect([image.width, image.height]).to eq([141, 141])
+  end
+
+  it 'copies the pixels for the same size' do
+    expect(image.resize(141, 141).pixels).to eq(image.pixels)
+  end
+
+  it 'picks the source pixel under the center of each pixel by :nearest' do
+    resized = image.resize(47, 47, filter: :nearest)
+    expect(resized.export_pixels(10, 20, 1, 1, layout: :rgba8)).to eq(
+      image.export_pixels(31, 61, 1, 1, layout: :rgba8))
+  end
+
+  it 'keeps a constant image constant' do
+    gray = IMF::Image.open(fixture_file('momosan_gray.jpg'), region: [0, 0, 8, 8]).resize(1, 1)
+    %i[bilinear bicubic lanczos].each do |filter|
+      resized = gray.resize(37, 23, filter: filter)
+      expect(resized.pixels.bytes.uniq).to eq(gray.pixels.bytes.uniq)
+    end
+  end
+
+  %w[
+    momosan_gray.jpg gray_alpha8.png colorbar.png vimlogo-141x141.png
+    gray16.png gray_alpha16_interlaced.png gradient16.png rgba16.png
+  ].each do |filename|
+    context "Given #{filename}" do
+      let(:image) { IMF::Image.open(fixture_file(filename)) }
+
+      %i[nearest bilinear bicubic lanczos].each do |filter|
+        it "gives the same pixels with and without SIMD by :#{filter}" do
+          [[image.width / 3, image.height / 2], [image.width * 2 + 1, image.height + 7]].each do |width, height|
+            simd = with_simd(true) { image.resize(width, height, filter: filter) }
+            scalar = with_simd(false) { image.resize(width, height, filter: filter) }
+            expect(simd.pixels).to eq(scalar.pixels)
+          end
+        end
+      end
+
+      it 'gives the same pixels on any number of threads' do
+        single = with_max_threads(1) { image.resize(image.width * 3, image.height * 3) }
+        multi = with_max_threads(4) { image.resize(image.width * 3, image.height * 3) }
+        expect(multi.pixels).to eq(single.pixels)
+      end
+    end
+  end
+
+  context 'Given an indexed image' do
+    let(:image) { IMF::Image.open(fixture_file('palette_with_transparency.png')) }
+
+    it 'keeps the palette by :nearest' do
+      resized = image.resize(image.width * 2, image.height * 2, filter: :nearest)
+      expect(resized.color_space).to eq(:INDEXED)
+      expect(resized.palette).to eq(image.palette)
+    end
+
+    it 'resizes the colors by the other filters' do
+      resized = image.resize(image.width * 2, image.height * 2, filter: :bilinear)
+      expected = image.expand_palette.resize(image.width * 2, image.height * 2, filter: :bilinear)
+      expect(resized.color_space).to eq(:RGB)
+      expect(resized.pixel_channels).to eq(4)
+      expect(resized.pixels).to eq(expected.pixels)
+    end
+  end
+
+  it 'raises ArgumentError for a non-positive size' do
+    expect { image.resize(0, 10) }.to raise_error(ArgumentError)
+    expect { image.resize(10, -1) }.to raise_error(ArgumentError)
+  end
+
+  it 'raises ArgumentError for an unknown filter' do
+    expect { image.resize(10, 10, filter: :unknown) }.to raise_error(ArgumentError, /unknown resize filter/)
+  end
+end
+
+RSpec.describe IMF do
+  describe '.max_threads' do
+    it 'is from 1 to 64' do
+      saved = IMF.max_threads
+      expect(saved).to be_between(1, 64)
+      IMF.max_threads = 2
+      expect(IMF.max_threads).to eq(2)
+      expect { IMF.max_threads = 0 }.to raise_error(ArgumentError)
+      expect { IMF.max_threads = 65 }.to raise_error(ArgumentError)
+    ensure
+      IMF.max_threads = saved
+    end
+  end
+
+  describe '.simd' do
+    it 'can disable the SIMD kernels' do
+      IMF.simd = false
+      expect(IMF.simd).to be_nil
+    ensure
+      IMF.simd = true
+    end
+  end
+end
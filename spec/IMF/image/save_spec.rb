@@ -0,0 +1,161 @@
+require 'spec_helper'
+require 'stringio'
+
+RSpec.describe IMF::Image, '#save' do
+  %w[colorbar.png colorbar_with_alpha.png momosan_gray.jpg].each do |filename|
+    context "Given #{filename}", :run_in_tmpdir do
+      let(:image) do
+        IMF::Image.open(fixture_file(filename))
+      end
+
+      let(:saved_filename) do
+        File.join(tmpdir, 'saved.png')
+      end
+
+      it 'saves the image as PNG by the extension of the path name' do
+        expect(image.save(saved_filename)).to equal(image)
+        expect(IMF::Image.detect_format(saved_filename)).to be_a(IMF::FileFormat::PNG)
+
+        saved = IMF::Image.open(saved_filename)
+        expect(saved.color_space).to eq(image.color_space)
+        expect(saved.has_alpha?).to eq(image.has_alpha?)
+        expect(saved.pixels).to eq(image.pixels)
+      end
+    end
+  end
+
+  context 'Given an object that responds to #write' do
+    let(:image) do
+      IMF::Image.open(fixture_file('colorbar.png'))
+    end
+
+    it 'writes the encoded bytes to the object' do
+      io = StringIO.new
+      image.save(io, format: :png, filter: :paeth)
+      expect(IMF::Image.open(StringIO.new(io.string)).pixels).to eq(image.pixels)
+    end
+
+    it 'propagates the exception raised by #write' do
+      writer = Object.new
+      def writer.write(_)
+        raise IOError, 'broken writer'
+      end
+      expect { image.save(writer, format: :png) }.to raise_error(IOError, 'broken writer')
+    end
+  end
+
+  context 'Given the write end of a pipe' do
+    let(:image) do
+      IMF::Image.open(fixture_file('momosan.jpg'))
+    end
+
+    # The encoded image is larger than the buffer of the pipe, whose write
+    # end is non-blocking, and the reader starts late so that the writes
+    # have to wait for it
+    it 'writes the encoded bytes as the pipe is read' do
+      reader, writer = IO.pipe
+      read_thread = Thread.new { sleep 0.1; reader.read }
+      image.save(writer, format: :png)
+      writer.close
+      expect(read_thread.value.bytesize).to be > 65536
+      expect(IMF::Image.open(StringIO.new(read_thread.value)).pixels).to eq(image.pixels)
+    ensure
+      reader.close
+    end
+  end
+
+  context 'Given a path name with an unknown extension', :run_in_tmpdir do
+    let(:image) do
+      IMF::Image.open(fixture_file('colorbar.png'))
+    end
+
+    it 'raises ArgumentError' do
+      expect { image.save(File.join(tmpdir, 'saved.bin')) }.to raise_error(ArgumentError)
+    end
+  end
+end
+
+RSpec.describe IMF::Image, '#encode' do
+  let(:image) do
+    IMF::Image.open(fixture_file('colorbar.png'))
+  end
+
+  it 'returns the PNG encoded image' do
+    png = image.encode(format: :png)
+    expect(png.encoding).to eq(Encoding::ASCII_8BIT)
+    expect(png[0, 8]).to eq("\x89PNG\r\n\x1A\n".b)
+    expect(IMF::Image.open(StringIO.new(png)).pixels).to eq(image.pixels)
+  end
+
+  it 'accepts compression:, filter:, and strategy: options' do
+    png = image.encode(format: :png, compression: 1, filter: :sub, strategy: :rle)
+    expect(IMF::Image.open(StringIO.new(png)).pixels).to eq(image.pixels)
+  end
+
+  it 'rejects invalid options' do
+    expect { image.encode(format: :png, compression: 10) }.to raise_error(ArgumentError)
+    expect { image.encode(format: :png, filter: :foo) }.to raise_error(ArgumentError)
+    expect { image.encode(format: :png, strategy: :foo) }.to raise_error(ArgumentError)
+  end
+end
+
+RSpec.describe IMF::Image, '#save as JPEG' do
+  let(:image) do
+    IMF::Image.open(fixture_file('momosan.jpg'))
+  end
+
+  def mean_abs_error(a, b)
+    a.pixels.bytes.zip(b.pixels.bytes).sum {|x, y| (x - y).abs }.fdiv(a.pixels.bytesize)
+  end
+
+  context 'Given a path name ending with ".jpg"', :run_in_tmpdir do
+    let(:saved_filename) do
+      File.join(tmpdir, 'saved.jpg')
+    end
+
+    it 'saves the image as JPEG' do
+      image.save(saved_filename)
+      expect(IMF::Image.detect_format(saved_filename)).to be_a(IMF::FileFormat::JPEG)
+
+      saved = IMF::Image.open(saved_filename)
+      expect(saved.width).to eq(image.width)
+      expect(saved.height).to eq(image.height)
+      expect(mean_abs_error(image, saved)).to be < 4
+    end
+  end
+
+  it 'saves the image to the write end of a pipe' do
+    reader, writer = IO.pipe
+    read_thread = Thread.new { sleep 0.1; reader.read }
+    image.save(writer, format: :jpeg, quality: 95)
+    writer.close
+    expect(read_thread.value.bytesize).to be > 65536
+    expect(mean_abs_error(image, IMF::Image.open(StringIO.new(read_thread.value)))).to be < 4
+  ensure
+    reader.close
+  end
+
+  it 'saves a grayscale image as a grayscale JPEG' do
+    gray = IMF::Image.open(fixture_file('momosan_gray.jpg'))
+    saved = IMF::Image.open(StringIO.new(gray.encode(format: :jpeg)))
+    expect(saved.color_space).to eq(:GRAY)
+    expect(saved.pixel_channels).to eq(1)
+  end
+
+  it 'accepts quality:, subsampling:, optimize_coding:, and progressive: options' do
+    low = image.encode(format: :jpeg, quality: 30)
+    high = image.encode(format: :jpeg, quality: 95, subsampling: '4:4:4')
+    expect(low.bytesize).to be < high.bytesize
+
+    optimized = image.encode(format: :jpeg, optimize_coding: true)
+    expect(optimized.bytesize).to be < image.encode(format: :jpeg).bytesize
+
+    progressive = IMF::Image.open(StringIO.new(image.encode(format: :jpeg, progressive: true)))
+    expect(mean_abs_error(image, progressive)).to be < 4
+  end
+
+  it 'rejects invalid options' do
+    expect { image.encode(format: :jpeg, quality: 0) }.to raise_error(ArgumentError)
+    expect { image.encode(format: :jpeg, subsampling: '4:1:1') }.to raise_error(ArgumentError)
+  end
+end
@@ -150,4 +150,92 @@ RSpec.describe IMF::ImageSource do
       it { is_expected.to eq(nil) }
     end
   end
+
+  describe '#mapped?' do
+    subject do
+      image_source.mapped?
+    end
+
+    context 'Given image_source is initialized with a path' do
+      include_context 'image file source'
+
+      it { is_expected.to eq(true) }
+    end
+
+    context 'Given image_source is initialized with a Zlib::GzipReader object' do
+      include_context 'gzipped io source'
+
+      it { is_expected.to eq(false) }
+    end
+  end
+
+  context 'Given image_source is initialized with the path of a FIFO', :with_tmpdir, if: File.respond_to?(:mkfifo) do
+    let(:fifo_path) do
+      File.join(tmpdir, 'image.fifo').tap { |path| File.mkfifo(path) }
+    end
+
+    # Writes the image into the FIFO on a thread, as a pipe reports no size
+    def with_fifo_writer
+      writer = Thread.new { File.binwrite(fifo_path, IO.read(image_path, mode: 'rb')) }
+      yield
+    ensure
+      writer.join
+    end
+
+    it 'reads the image as a stream' do
+      with_fifo_writer do
+        image = IMF::Image.open(fifo_path)
+        expect(image.pixels).to eq(IMF::Image.open(image_path).pixels)
+      end
+    end
+
+    it 'is not mapped' do
+      with_fifo_writer do
+        image_source = IMF::ImageSource.new(fifo_path)
+        expect(image_source).not_to be_mapped
+        expect(image_source.read(3).bytes).to eq([0xFF, 0xD8, 0xFF])
+        image_source.read
+      end
+    end
+
+    it 'is opened by IMF::Image.open_all' do
+      with_fifo_writer do
+        images = IMF::Image.open_all([fifo_path, image_path], threads: 2)
+        expect(images[0].pixels).to eq(images[1].pixels)
+      end
+    end
+  end
+
+  context 'When reading the file descriptor fails', if: File.directory?('/proc/self/fd') do
+    def file_descriptors
+      Dir.children('/proc/self/fd').map(&:to_i).select { |n|
+        (File.readlink("/proc/self/fd/#{n}") rescue nil) == File.realpath(image_path)
+      }
+    end
+
+    # Opens the image source on io, and closes the descriptor that it
+    # duplicated from io after the block, so that pread fails with EBADF
+    def open_broken_source(io)
+      before = file_descriptors
+      image_source = IMF::ImageSource.new(io)
+      yield image_source if block_given?
+      (file_descriptors - before).each { |fd| IO.for_fd(fd).close }
+      image_source
+    end
+
+    it 'raises the error of the read instead of the end of the data' do
+      File.open(image_path, 'rb') do |io|
+        image_source = open_broken_source(io)
+        expect { image_source.read(16) }.to raise_error(Errno::EBADF)
+      end
+    end
+
+    it 'raises the error of the read from the decoder' do
+      File.open(image_path, 'rb') do |io|
+        format = nil
+        image_source = open_broken_source(io) { |source| format = IMF::Image.detect_format(source) }
+        expect { format.load(IMF::Image.allocate, image_source) }.to raise_error(Errno::EBADF)
+      end
+    end
+  end
 end
@@ -0,0 +1,25 @@
+module IMF
+  module RSpec
+    module ParallelHelper
+      # Runs the block with the SIMD kernels enabled or disabled
+      def with_simd(enabled)
+        saved = IMF.simd
+        IMF.simd = enabled
+        yield
+      ensure
+        IMF.simd = saved
+      end
+
+      # Runs the block with IMF.max_threads set to n
+      def with_max_threads(n)
+        saved = IMF.max_threads
+        IMF.max_threads = n
+        yield
+      ensure
+        IMF.max_threads = saved
+      end
+    end
+  end
+end
+
+RSpec.configuration.include IMF::RSpec::ParallelHelper